@@ -0,0 +1,372 @@
+#include "aof.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <assert.h>
+#include <sys/stat.h>
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <chrono>
+
+static struct {
+    int fd = -1;
+    uint32_t policy = AOF_FSYNC_EVERYSEC;
+    std::string path;
+    std::string buf; // commands not yet written to the file
+
+    // Background fsync for AOF_FSYNC_EVERYSEC
+    std::mutex fd_lock; // held while fsyncing, and while the fd is swapped or closed
+    std::atomic<bool> dirty{false};
+    std::atomic<bool> stop{false};
+    std::thread fsync_thread;
+
+    // Log rewrite
+    int rewrite_fd = -1;
+    std::string rewrite_buf;
+    bool rewrite_failed = false; // a write failed, the temp file is incomplete
+} g_aof;
+
+const size_t k_rewrite_flush = 64 * 1024; // flush the rewrite buffer every 64k
+
+static void msg(const char *msg)
+{
+    fprintf(stderr, "%s\n", msg);
+}
+
+static int32_t write_all(int fd, const char *buf, size_t n)
+{
+    while (n > 0)
+    {
+        ssize_t rv = write(fd, buf, n);
+        if (rv < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (rv <= 0)
+        {
+            return -1; // error
+        }
+
+        assert((size_t)rv <= n);
+        n -= (size_t)rv;
+        buf += rv;
+    }
+    return 0;
+}
+
+// Frames a command the same way a client sends it
+void aof_encode(std::string &out, const std::vector<std::string> &cmd) {
+    uint32_t len = 4;
+    for(const std::string &s : cmd) {
+        len += 4 + (uint32_t)s.size();
+    }
+
+    uint32_t n = (uint32_t)cmd.size();
+    out.append((char *)&len, 4);
+    out.append((char *)&n, 4);
+
+    for(const std::string &s : cmd) {
+        uint32_t sz = (uint32_t)s.size();
+        out.append((char *)&sz, 4);
+        out.append(s);
+    }
+}
+
+// Decodes one frame. Returns bytes consumed, 0 if the frame is incomplete, -1 if it is corrupt
+static int64_t aof_decode(const uint8_t *data, size_t len, std::vector<std::string> &out) {
+    if(len < 4) {
+        return 0;
+    }
+
+    uint32_t flen = 0;
+    memcpy(&flen, &data[0], 4);
+    if(4 + (size_t)flen > len) {
+        return 0;
+    }
+
+    const uint8_t *body = &data[4];
+    if(flen < 4) {
+        return -1;
+    }
+
+    uint32_t n = 0;
+    memcpy(&n, &body[0], 4);
+
+    size_t pos = 4;
+    while(n--) {
+        if(pos + 4 > flen) {
+            return -1;
+        }
+
+        uint32_t sz = 0;
+        memcpy(&sz, &body[pos], 4);
+        if(pos + 4 + sz > flen) {
+            return -1;
+        }
+
+        out.push_back(std::string((char *)&body[pos + 4], sz));
+        pos += 4 + sz;
+    }
+
+    if(pos != flen) {
+        return -1;
+    }
+
+    return 4 + (int64_t)flen;
+}
+
+static void fsync_worker() {
+    while(!g_aof.stop.load()) {
+        std::this_thread::sleep_for(std::chrono::seconds(1));
+
+        if(g_aof.dirty.exchange(false)) {
+            std::lock_guard<std::mutex> guard(g_aof.fd_lock);
+            if(g_aof.fd >= 0 && fdatasync(g_aof.fd) != 0) {
+                msg("aof fdatasync() error");
+            }
+        }
+    }
+}
+
+bool aof_parse_policy(const char *name, uint32_t &out) {
+    if(0 == strcasecmp(name, "always")) {
+        out = AOF_FSYNC_ALWAYS;
+    } else if(0 == strcasecmp(name, "everysec")) {
+        out = AOF_FSYNC_EVERYSEC;
+    } else if(0 == strcasecmp(name, "no")) {
+        out = AOF_FSYNC_NO;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+int32_t aof_open(const char *path, uint32_t policy) {
+    assert(g_aof.fd < 0);
+
+    int fd = open(path, O_WRONLY | O_APPEND | O_CREAT, 0644);
+    if(fd < 0) {
+        return -1;
+    }
+
+    g_aof.fd = fd;
+    g_aof.policy = policy;
+    g_aof.path = path;
+    g_aof.stop = false;
+
+    if(policy == AOF_FSYNC_EVERYSEC) {
+        g_aof.fsync_thread = std::thread(fsync_worker);
+    }
+    return 0;
+}
+
+void aof_close() {
+    if(g_aof.fd < 0) {
+        return;
+    }
+
+    aof_flush();
+
+    if(g_aof.fsync_thread.joinable()) {
+        g_aof.stop = true;
+        g_aof.fsync_thread.join();
+    }
+
+    std::lock_guard<std::mutex> guard(g_aof.fd_lock);
+    (void)fdatasync(g_aof.fd);
+    close(g_aof.fd);
+    g_aof.fd = -1;
+}
+
+bool aof_enabled() {
+    return g_aof.fd >= 0;
+}
+
+// Called from the command dispatch for every write command. Only buffers.
+void aof_feed(const std::vector<std::string> &cmd) {
+    if(g_aof.fd < 0) {
+        return;
+    }
+
+    aof_encode(g_aof.buf, cmd);
+}
+
+// Group commit. Called once per event loop iteration
+void aof_flush() {
+    if(g_aof.fd < 0 || g_aof.buf.empty()) {
+        return;
+    }
+
+    size_t sent = 0;
+    while(sent < g_aof.buf.size()) {
+        ssize_t rv = write(g_aof.fd, g_aof.buf.data() + sent, g_aof.buf.size() - sent);
+        if(rv < 0 && errno == EINTR) {
+            continue;
+        }
+        if(rv <= 0) {
+            // Keep the rest for the next iteration. Replies stay blocked under AOF_FSYNC_ALWAYS
+            msg("aof write() error");
+            break;
+        }
+        sent += (size_t)rv;
+    }
+    g_aof.buf.erase(0, sent);
+
+    if(sent == 0) {
+        return;
+    }
+
+    if(g_aof.policy == AOF_FSYNC_ALWAYS) {
+        if(fdatasync(g_aof.fd) != 0) {
+            msg("aof fdatasync() error");
+        }
+    } else if(g_aof.policy == AOF_FSYNC_EVERYSEC) {
+        g_aof.dirty = true;
+    }
+}
+
+// Under AOF_FSYNC_ALWAYS a reply must not leave before the write it acknowledges is on disk
+bool aof_sync_pending() {
+    return g_aof.fd >= 0 && g_aof.policy == AOF_FSYNC_ALWAYS && !g_aof.buf.empty();
+}
+
+// Replays the log. A truncated last command (crash mid-write) is dropped and cut from the file.
+// Returns the number of commands applied or -1 on error
+int32_t aof_load(const char *path, void (*apply)(std::vector<std::string> &cmd)) {
+    int fd = open(path, O_RDWR);
+    if(fd < 0) {
+        return errno == ENOENT ? 0 : -1;
+    }
+
+    struct stat st = {};
+    if(fstat(fd, &st) != 0) {
+        close(fd);
+        return -1;
+    }
+
+    std::string data;
+    data.resize((size_t)st.st_size);
+
+    size_t got = 0;
+    while(got < data.size()) {
+        ssize_t rv = read(fd, &data[got], data.size() - got);
+        if(rv < 0 && errno == EINTR) {
+            continue;
+        }
+        if(rv <= 0) {
+            close(fd);
+            return -1;
+        }
+        got += (size_t)rv;
+    }
+
+    int32_t ncmds = 0;
+    size_t pos = 0;
+    std::vector<std::string> cmd;
+    while(pos < data.size()) {
+        cmd.clear();
+        int64_t rv = aof_decode((uint8_t *)&data[pos], data.size() - pos, cmd);
+        if(rv < 0) {
+            msg("aof is corrupt");
+            close(fd);
+            return -1;
+        }
+        if(rv == 0) {
+            break;
+        }
+
+        apply(cmd);
+        pos += (size_t)rv;
+        ncmds++;
+    }
+
+    if(pos != data.size()) {
+        msg("aof ends with a truncated command, dropping it");
+        if(ftruncate(fd, (off_t)pos) != 0) {
+            msg("ftruncate() error");
+        }
+    }
+
+    close(fd);
+    return ncmds;
+}
+
+/*
+
+Log rewrite:
+    aof_rewrite_begin() opens a temp file, the caller feeds the commands that recreate the live
+    keyspace through aof_rewrite_feed(), and aof_rewrite_end() atomically replaces the old log.
+    If any write to the temp file failed, the temp file is dropped and the old log stays.
+
+*/
+
+int32_t aof_rewrite_begin() {
+    if(g_aof.fd < 0 || g_aof.rewrite_fd >= 0) {
+        return -1;
+    }
+
+    std::string tmp = g_aof.path + ".rewrite";
+    g_aof.rewrite_fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if(g_aof.rewrite_fd < 0) {
+        return -1;
+    }
+
+    g_aof.rewrite_buf.clear();
+    g_aof.rewrite_failed = false;
+    return 0;
+}
+
+void aof_rewrite_feed(const std::vector<std::string> &cmd) {
+    if(g_aof.rewrite_failed) {
+        return;
+    }
+    aof_encode(g_aof.rewrite_buf, cmd);
+
+    if(g_aof.rewrite_buf.size() >= k_rewrite_flush) {
+        if(write_all(g_aof.rewrite_fd, g_aof.rewrite_buf.data(), g_aof.rewrite_buf.size()) != 0) {
+            msg("aof rewrite write() error");
+            g_aof.rewrite_failed = true;
+        }
+        g_aof.rewrite_buf.clear();
+    }
+}
+
+int32_t aof_rewrite_end() {
+    assert(g_aof.rewrite_fd >= 0);
+
+    int fd = g_aof.rewrite_fd;
+    g_aof.rewrite_fd = -1;
+
+    std::string tmp = g_aof.path + ".rewrite";
+    int32_t err = g_aof.rewrite_failed ? -1 : write_all(fd, g_aof.rewrite_buf.data(), g_aof.rewrite_buf.size());
+    g_aof.rewrite_buf.clear();
+    g_aof.rewrite_failed = false;
+    if(!err) {
+        err = fdatasync(fd);
+    }
+    if(!err) {
+        err = rename(tmp.c_str(), g_aof.path.c_str());
+    }
+
+    if(err) {
+        close(fd);
+        unlink(tmp.c_str());
+        return -1;
+    }
+
+    // The rewritten log already contains everything buffered so far
+    g_aof.buf.clear();
+
+    int flags = fcntl(fd, F_GETFL, 0);
+    (void)fcntl(fd, F_SETFL, flags | O_APPEND);
+
+    std::lock_guard<std::mutex> guard(g_aof.fd_lock);
+    close(g_aof.fd);
+    g_aof.fd = fd;
+    g_aof.dirty = false;
+    return 0;
+}
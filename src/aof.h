@@ -0,0 +1,39 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string>
+#include <vector>
+
+/*
+
+Append-only log:
+    Every write command is appended to the log using the same framing as a request
+    (len - nstr - (len - str)*), so replaying it is just parsing requests back out of a file.
+
+    Writes are only buffered in memory while requests are processed. The buffer is written out
+    (and maybe fsync'd) once per event loop iteration, so one fsync covers every write of the batch.
+
+*/
+
+enum {
+    AOF_FSYNC_ALWAYS = 0,   // fsync at the end of every event loop iteration
+    AOF_FSYNC_EVERYSEC = 1, // fsync once a second from a background thread
+    AOF_FSYNC_NO = 2,       // leave it to the kernel
+};
+
+bool aof_parse_policy(const char *name, uint32_t &out);
+int32_t aof_open(const char *path, uint32_t policy);
+void aof_close();
+bool aof_enabled();
+
+void aof_encode(std::string &out, const std::vector<std::string> &cmd);
+void aof_feed(const std::vector<std::string> &cmd);
+void aof_flush();
+bool aof_sync_pending();
+
+int32_t aof_load(const char *path, void (*apply)(std::vector<std::string> &cmd));
+
+int32_t aof_rewrite_begin();
+void aof_rewrite_feed(const std::vector<std::string> &cmd);
+int32_t aof_rewrite_end();
@@ -0,0 +1,400 @@
+#include "async_client.h"
+#include "protocol.h"
+#include "utils.h"
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <netinet/ip.h>
+#include <netinet/tcp.h>
+#include <memory>
+
+const size_t k_read_chunk = 16 << 10;
+const int k_pool_timeout_ms = 10000; // how long pooled connections wait for their replies
+
+static Reply error_reply(int32_t code, const char *msg) {
+    Reply r;
+    r.type = SER_ERR;
+    r.code = code;
+    r.str = msg;
+    return r;
+}
+
+// Parses one serialized value. Returns the bytes it took, or -1 if it is malformed
+int32_t reply_parse(const uint8_t *data, size_t size, Reply &out) {
+    if(size < 1) {
+        return -1;
+    }
+
+    out.type = data[0];
+    switch(data[0]) {
+        case SER_NIL:
+            return 1;
+        case SER_ERR: {
+            uint32_t len = 0;
+            if(size < 1 + 8) {
+                return -1;
+            }
+            memcpy(&out.code, &data[1], 4);
+            memcpy(&len, &data[1 + 4], 4);
+            if(size - (1 + 8) < len) {
+                return -1;
+            }
+            out.str.assign((const char *)&data[1 + 8], len);
+            return (int32_t)(1 + 8 + len);
+        }
+        case SER_STR: {
+            uint32_t len = 0;
+            if(size < 1 + 4) {
+                return -1;
+            }
+            memcpy(&len, &data[1], 4);
+            if(size - (1 + 4) < len) {
+                return -1;
+            }
+            out.str.assign((const char *)&data[1 + 4], len);
+            return (int32_t)(1 + 4 + len);
+        }
+        case SER_INT:
+            if(size < 1 + 8) {
+                return -1;
+            }
+            memcpy(&out.ival, &data[1], 8);
+            return 1 + 8;
+        case SER_DBL:
+            if(size < 1 + 8) {
+                return -1;
+            }
+            memcpy(&out.dval, &data[1], 8);
+            return 1 + 8;
+        case SER_ARR: {
+            uint32_t n = 0;
+            if(size < 1 + 4) {
+                return -1;
+            }
+            memcpy(&n, &data[1], 4);
+            if(n > size) { // every element takes at least a byte
+                return -1;
+            }
+
+            size_t used = 1 + 4;
+            out.arr.resize(n);
+            for(uint32_t i = 0; i < n; ++i) {
+                int32_t rv = reply_parse(&data[used], size - used, out.arr[i]);
+                if(rv < 0) {
+                    return -1;
+                }
+                used += (size_t)rv;
+            }
+            return (int32_t)used;
+        }
+        default:
+            return -1;
+    }
+}
+
+// Marks the connection dead and fails every command still waiting for a reply
+static int32_t ac_fail(AsyncClient *c, const char *msg) {
+    c->broken = true;
+    while(!c->pending.empty()) {
+        ReplyCb cb = std::move(c->pending.front());
+        c->pending.pop_front();
+        Reply r = error_reply(k_err_conn, msg);
+        cb(r);
+    }
+    return -1;
+}
+
+// Connects without blocking past timeout_ms. Returns NULL on failure
+AsyncClient *ac_connect(const char *ip, uint16_t port, int timeout_ms) {
+    struct sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    if(inet_pton(AF_INET, ip, &addr.sin_addr) != 1) {
+        return NULL;
+    }
+
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if(fd < 0) {
+        return NULL;
+    }
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+    int val = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &val, sizeof(val)); // batches are already coalesced
+
+    if(connect(fd, (const struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        struct pollfd pfd = {fd, POLLOUT, 0};
+        int err = 0;
+        socklen_t len = sizeof(err);
+        if(errno != EINPROGRESS || poll(&pfd, 1, timeout_ms) != 1 ||
+           getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0 || err != 0) {
+            close(fd);
+            return NULL;
+        }
+    }
+
+    AsyncClient *c = new AsyncClient();
+    c->fd = fd;
+    return c;
+}
+
+// Commands still waiting get a k_err_conn reply
+void ac_close(AsyncClient *c) {
+    ac_fail(c, "connection closed");
+    if(c->fd >= 0) {
+        close(c->fd);
+    }
+    delete c;
+}
+
+int ac_fd(const AsyncClient *c) {
+    return c->fd;
+}
+
+// Whether to poll for POLLOUT: queued commands haven't all been written yet
+bool ac_want_write(const AsyncClient *c) {
+    return c->wbuf_sent < c->wbuf.size();
+}
+
+// Queues a command. It is sent on the next ac_run() or ac_wait()
+int32_t ac_command(AsyncClient *c, const std::vector<std::string> &cmd, ReplyCb cb) {
+    if(c->broken) {
+        Reply r = error_reply(k_err_conn, "connection closed");
+        cb(r);
+        return -1;
+    }
+
+    size_t len = 4;
+    for(const std::string &s : cmd) {
+        len += 4 + s.size();
+    }
+    if(len > k_max_msg) {
+        Reply r = error_reply(k_err_2big, "command too big");
+        cb(r);
+        return -1;
+    }
+
+    size_t pos = c->wbuf.size();
+    c->wbuf.resize(pos + 4 + len);
+    uint8_t *p = &c->wbuf[pos];
+    uint32_t n = (uint32_t)len;
+    memcpy(p, &n, 4);
+    n = (uint32_t)cmd.size();
+    memcpy(p + 4, &n, 4);
+    p += 8;
+    for(const std::string &s : cmd) {
+        n = (uint32_t)s.size();
+        memcpy(p, &n, 4);
+        memcpy(p + 4, s.data(), s.size());
+        p += 4 + s.size();
+    }
+
+    c->pending.push_back(std::move(cb));
+    return 0;
+}
+
+std::future<Reply> ac_command(AsyncClient *c, const std::vector<std::string> &cmd) {
+    std::shared_ptr<std::promise<Reply>> promise = std::make_shared<std::promise<Reply>>();
+    std::future<Reply> fut = promise->get_future();
+    ac_command(c, cmd, [promise](Reply &r) { promise->set_value(std::move(r)); });
+    return fut;
+}
+
+static int32_t ac_flush(AsyncClient *c) {
+    while(c->wbuf_sent < c->wbuf.size()) {
+        ssize_t rv = write(c->fd, &c->wbuf[c->wbuf_sent], c->wbuf.size() - c->wbuf_sent);
+        if(rv < 0 && errno == EINTR) {
+            continue;
+        }
+        if(rv < 0 && errno == EAGAIN) {
+            return 0;
+        }
+        if(rv <= 0) {
+            return ac_fail(c, "write() error");
+        }
+        c->wbuf_sent += (size_t)rv;
+    }
+
+    c->wbuf.clear();
+    c->wbuf_sent = 0;
+    return 0;
+}
+
+// Hands complete replies in rbuf to their commands. Returns how many, or -1
+static int32_t ac_dispatch(AsyncClient *c) {
+    int32_t n = 0;
+    while(c->rbuf.size() - c->rbuf_used >= 4) {
+        const uint8_t *p = &c->rbuf[c->rbuf_used];
+        uint32_t len = 0;
+        memcpy(&len, p, 4);
+        if(len > k_max_msg) {
+            return ac_fail(c, "reply too long");
+        }
+        if(c->rbuf.size() - c->rbuf_used < 4 + len) {
+            break;
+        }
+
+        Reply r;
+        if(c->pending.empty() || reply_parse(p + 4, len, r) != (int32_t)len) {
+            return ac_fail(c, "bad reply");
+        }
+        c->rbuf_used += 4 + len;
+
+        ReplyCb cb = std::move(c->pending.front());
+        c->pending.pop_front();
+        cb(r);
+        n++;
+    }
+
+    c->rbuf.erase(c->rbuf.begin(), c->rbuf.begin() + c->rbuf_used);
+    c->rbuf_used = 0;
+    return n;
+}
+
+static int32_t ac_read(AsyncClient *c) {
+    int32_t n = 0;
+    while(true) {
+        size_t pos = c->rbuf.size();
+        c->rbuf.resize(pos + k_read_chunk);
+        ssize_t rv = read(c->fd, &c->rbuf[pos], k_read_chunk);
+        c->rbuf.resize(pos + (rv > 0 ? (size_t)rv : 0));
+
+        if(rv < 0 && errno == EINTR) {
+            continue;
+        }
+        if(rv < 0 && errno == EAGAIN) {
+            return n;
+        }
+        if(rv <= 0) {
+            return ac_fail(c, rv == 0 ? "EOF" : "read() error");
+        }
+
+        int32_t got = ac_dispatch(c);
+        if(got < 0) {
+            return -1;
+        }
+        n += got;
+        if((size_t)rv < k_read_chunk) {
+            return n;
+        }
+    }
+}
+
+// Does the I/O poll() reported in revents on ac_fd(), writing any queued commands.
+// Returns the number of replies delivered, or -1 if the connection failed
+int32_t ac_run(AsyncClient *c, short revents) {
+    if(c->broken) {
+        return -1;
+    }
+    if(ac_flush(c) < 0) {
+        return -1;
+    }
+    if(revents & (POLLIN | POLLERR | POLLHUP)) {
+        return ac_read(c);
+    }
+    return 0;
+}
+
+// Sends everything queued and waits for all the replies. Returns -1 if the connection failed,
+// or if nothing happened for timeout_ms (-1 waits forever)
+int32_t ac_wait(AsyncClient *c, int timeout_ms) {
+    if(ac_run(c, 0) < 0) {
+        return -1;
+    }
+
+    while(!c->pending.empty()) {
+        struct pollfd pfd = {c->fd, (short)(POLLIN | (ac_want_write(c) ? POLLOUT : 0)), 0};
+        int rv = poll(&pfd, 1, timeout_ms);
+        if(rv < 0 && errno == EINTR) {
+            continue;
+        }
+        if(rv <= 0) {
+            return -1;
+        }
+        if(ac_run(c, pfd.revents) < 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Connections are opened as threads ask for them, up to max_conns
+ClientPool *pool_new(const char *ip, uint16_t port, size_t max_conns) {
+    ClientPool *pool = new ClientPool();
+    pool->ip = ip;
+    pool->port = port;
+    pool->max_conns = max_conns ? max_conns : 1;
+    return pool;
+}
+
+// Every connection must have been put back
+void pool_destroy(ClientPool *pool) {
+    for(AsyncClient *c : pool->idle) {
+        ac_close(c);
+    }
+    delete pool;
+}
+
+// An idle connection, or a new one. Blocks while max_conns are handed out. NULL if connecting fails
+AsyncClient *pool_get(ClientPool *pool) {
+    {
+        std::unique_lock<std::mutex> lock(pool->mu);
+        pool->cv.wait(lock, [pool] { return !pool->idle.empty() || pool->nconns < pool->max_conns; });
+        if(!pool->idle.empty()) {
+            AsyncClient *c = pool->idle.back();
+            pool->idle.pop_back();
+            return c;
+        }
+        pool->nconns++;
+    }
+
+    AsyncClient *c = ac_connect(pool->ip.c_str(), pool->port, k_pool_timeout_ms);
+    if(!c) {
+        std::lock_guard<std::mutex> lock(pool->mu);
+        pool->nconns--;
+        pool->cv.notify_one();
+    }
+    return c;
+}
+
+// Waits for the connection's outstanding replies first. Broken connections are closed
+void pool_put(ClientPool *pool, AsyncClient *c) {
+    if(!c->pending.empty() || ac_want_write(c)) {
+        ac_wait(c, k_pool_timeout_ms);
+    }
+    if(c->broken || !c->pending.empty()) {
+        ac_close(c);
+        c = NULL;
+    }
+
+    std::lock_guard<std::mutex> lock(pool->mu);
+    if(c) {
+        pool->idle.push_back(c);
+    } else {
+        pool->nconns--;
+    }
+    pool->cv.notify_one();
+}
+
+// Sends cmds as one pipeline on a pooled connection. out[i] is the reply to cmds[i]
+int32_t pool_pipeline(ClientPool *pool, const std::vector<std::vector<std::string>> &cmds,
+                      std::vector<Reply> &out) {
+    out.assign(cmds.size(), Reply());
+    AsyncClient *c = pool_get(pool);
+    if(!c) {
+        for(Reply &r : out) {
+            r = error_reply(k_err_conn, "connect() error");
+        }
+        return -1;
+    }
+
+    for(size_t i = 0; i < cmds.size(); ++i) {
+        ac_command(c, cmds[i], [&out, i](Reply &r) { out[i] = std::move(r); });
+    }
+    int32_t rv = ac_wait(c, k_pool_timeout_ms);
+    pool_put(pool, c);
+    return rv;
+}
@@ -0,0 +1,85 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string>
+#include <vector>
+#include <deque>
+#include <functional>
+#include <future>
+#include <mutex>
+#include <condition_variable>
+
+/*
+
+Pipelined client over the TLV protocol:
+    Commands are encoded into the write buffer as they are queued, and go out together on the
+    next flush, so a batch of commands costs one write() and the round trips overlap. The server
+    answers in order, so replies are matched to the queued commands first in, first out.
+
+    The socket is nonblocking. A connection is driven by its owner: ac_wait() until the replies
+    are in, or ac_run() from an event loop on ac_fd(). Futures are fulfilled by whoever drives
+    the connection, so only wait on one after ac_wait() or from another thread.
+
+    An AsyncClient is used by one thread at a time. A ClientPool hands connections out to
+    threads and takes them back once their replies are in.
+
+    Pub/Sub messages aren't replies, so subscribed connections aren't supported.
+
+*/
+
+// Reply::code of errors made up by the client. Server error codes are positive
+const int32_t k_err_conn = -1; // the connection failed before the reply came
+const int32_t k_err_2big = -2; // the command is too big for a request
+
+struct Reply {
+    uint32_t type = 0; // SER_* (utils.h)
+    int32_t code = 0;  // SER_ERR
+    int64_t ival = 0;  // SER_INT
+    double dval = 0;   // SER_DBL
+    std::string str;   // SER_STR, or the SER_ERR message
+    std::vector<Reply> arr;
+};
+
+// Called exactly once per command, with the reply or with a k_err_* error
+typedef std::function<void(Reply &)> ReplyCb;
+
+struct AsyncClient {
+    int fd = -1;
+    bool broken = false;
+    std::vector<uint8_t> wbuf;
+    size_t wbuf_sent = 0;
+    std::vector<uint8_t> rbuf;
+    size_t rbuf_used = 0; // bytes of rbuf already parsed
+    std::deque<ReplyCb> pending;
+};
+
+int32_t reply_parse(const uint8_t *data, size_t size, Reply &out);
+
+AsyncClient *ac_connect(const char *ip, uint16_t port, int timeout_ms);
+void ac_close(AsyncClient *c);
+int ac_fd(const AsyncClient *c);
+bool ac_want_write(const AsyncClient *c);
+
+int32_t ac_command(AsyncClient *c, const std::vector<std::string> &cmd, ReplyCb cb);
+std::future<Reply> ac_command(AsyncClient *c, const std::vector<std::string> &cmd);
+
+int32_t ac_run(AsyncClient *c, short revents);
+int32_t ac_wait(AsyncClient *c, int timeout_ms);
+
+struct ClientPool {
+    std::string ip;
+    uint16_t port = 0;
+    size_t max_conns = 0;
+    size_t nconns = 0; // connections open, idle or handed out
+    std::vector<AsyncClient *> idle;
+    std::mutex mu;
+    std::condition_variable cv;
+};
+
+ClientPool *pool_new(const char *ip, uint16_t port, size_t max_conns);
+void pool_destroy(ClientPool *pool);
+AsyncClient *pool_get(ClientPool *pool);
+void pool_put(ClientPool *pool, AsyncClient *c);
+int32_t pool_pipeline(ClientPool *pool, const std::vector<std::vector<std::string>> &cmds,
+                      std::vector<Reply> &out);
@@ -1,5 +1,6 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include "avl.h"
 #include "zset.h"
 #include "utils.h"
@@ -90,12 +91,13 @@ struct AVLNode *insert(struct AVLNode **cur_node, struct AVLNode *new_node, int(
         return *cur_node;
     }
 
-    //Compare znodes
-    if(node_compare_func(new_node, *cur_node) == -1) {
+    //Compare znodes. Only the sign counts, so memcmp() results can be passed through
+    int cmp = node_compare_func(new_node, *cur_node);
+    if(cmp < 0) {
         (*cur_node)->left = insert(&((*cur_node)->left), new_node, node_compare_func);
-    } else if(node_compare_func(new_node, *cur_node) == 1) {
+    } else if(cmp > 0) {
         (*cur_node)->right = insert(&((*cur_node)->right), new_node, node_compare_func);
-    } else if(node_compare_func(new_node, *cur_node) == 0) {
+    } else {
         //Duplicate nodes??/?
         return *cur_node;
     }
@@ -117,67 +119,64 @@ struct AVLNode *insert(struct AVLNode **cur_node, struct AVLNode *new_node, int(
     return *cur_node;
 }
 
-//FIXME: Nodes are not getting deleted from tree
-//Things to check
-//1. Double check node compare function
-//2. Verify correct traversal of tree
-//3. Verify proper rotating of tree after deletion..bottom-up towards root
-bool del(struct AVLNode **cur_node, struct AVLNode *node_to_delete, int(node_compare_func)(AVLNode *, AVLNode *)) {
+//Unlinks the node comparing equal to node_to_delete and rebalances bottom-up towards root.
+//Returns the unlinked node, NULL if there is none. Freeing it is up to the caller.
+//A node with two children swaps contents with its inorder successor, and the successor is unlinked
+struct AVLNode *del(struct AVLNode **cur_node, struct AVLNode *node_to_delete, int(node_compare_func)(AVLNode *, AVLNode *)) {
     
     //Didn't find node to delete
     if(*cur_node == NULL) {
-        return false;
+        return NULL;
     }
 
-    if(node_compare_func(node_to_delete, *cur_node) == -1) {
-        return del(&((*cur_node)->left), node_to_delete, node_compare_func);
-    } else if(node_compare_func(node_to_delete, *cur_node) == 1) {
-        return del(&((*cur_node)->right), node_to_delete, node_compare_func);
+    //Recurse, then fall through to rebalance this node on the way back up
+    struct AVLNode *removed = NULL;
+    int cmp = node_compare_func(node_to_delete, *cur_node);
+    if(cmp < 0) {
+        removed = del(&((*cur_node)->left), node_to_delete, node_compare_func);
+        if(!removed) {
+            return NULL;
+        }
+    } else if(cmp > 0) {
+        removed = del(&((*cur_node)->right), node_to_delete, node_compare_func);
+        if(!removed) {
+            return NULL;
+        }
     } else {
         //We found node to delete
+        removed = *cur_node;
 
         //Check for 1 child or leaf
         if((*cur_node)->left == NULL || (*cur_node)->right == NULL) {
-            struct AVLNode *temp = (*cur_node)->left ? (*cur_node)->left : (*cur_node)->right;
-
-            //Leaf
-            if(!temp) {
-                //temp = (*node);
-                (*cur_node) = NULL;
-            } else {
-                //One child
-                struct AVLNode *to_delete = *cur_node;
-                *cur_node = temp;
-                free(to_delete);
-            }
+            //Leaf or one child: the child (or NULL) takes its place
+            *cur_node = (*cur_node)->left ? (*cur_node)->left : (*cur_node)->right;
         } else {
             //Multiple children. Get inorder successor
             //Inorder successor is deepest left child in right sub-tree
-            struct AVLNode **inorder_successor = &((*cur_node)->right);
+            struct AVLNode *inorder_successor = (*cur_node)->right;
 
-            while((*inorder_successor)->left != NULL) {
-                inorder_successor = &((*inorder_successor)->left);
+            while(inorder_successor->left != NULL) {
+                inorder_successor = inorder_successor->left;
             }
 
-            //copy contents of inorder successor
+            //Swap contents with inorder successor. Only pointers move, the key bytes stay put
             ZNode *cur_node_container = container_of(*cur_node, ZNode, tree_node);
-            ZNode *inorder__successor_container = container_of(*inorder_successor, ZNode, tree_node);
+            ZNode *inorder_successor_container = container_of(inorder_successor, ZNode, tree_node);
 
-            double temp_score = inorder__successor_container->score;
-            char temp_key[0];
-            memcpy(&temp_key, inorder__successor_container->key, inorder__successor_container->len);
-            size_t temp_len = inorder__successor_container->len;
+            uint32_t temp_score = cur_node_container->score;
+            char *temp_key = cur_node_container->key;
+            size_t temp_len = cur_node_container->len;
 
-            //delete inorder successor
-            del(cur_node, *inorder_successor, node_compare_func);
+            cur_node_container->score = inorder_successor_container->score;
+            cur_node_container->key = inorder_successor_container->key;
+            cur_node_container->len = inorder_successor_container->len;
 
-            //paste contents from inorder succ into current node
-            cur_node_container->score = temp_score;
-            memcpy(&(cur_node_container->key), temp_key, temp_len);
-            cur_node_container->len = temp_len;
+            inorder_successor_container->score = temp_score;
+            inorder_successor_container->key = temp_key;
+            inorder_successor_container->len = temp_len;
 
-            //delete znode
-            free(inorder__successor_container);
+            //The successor now holds the deleted contents, smaller than the rest of the right sub-tree
+            removed = del(&((*cur_node)->right), inorder_successor, node_compare_func);
         }
     }
 
@@ -187,18 +186,19 @@ bool del(struct AVLNode **cur_node, struct AVLNode *node_to_delete, int(node_com
         (*cur_node)->height = node_height((*cur_node));
 
         //Check balance factors and perform rotations
-        if(balanceFactor((*cur_node)) == 2 && balanceFactor((*cur_node)->left) == 1) {
+        //After a deletion the taller child can be balanced too: that takes a single rotation
+        if(balanceFactor((*cur_node)) == 2 && balanceFactor((*cur_node)->left) >= 0) {
             *cur_node = ll_rotation(*cur_node);
         } else if(balanceFactor((*cur_node)) == 2 && balanceFactor((*cur_node)->left) == -1) {
-            *cur_node = rl_rotation(*cur_node);
-        } else if(balanceFactor((*cur_node)) == -2 && balanceFactor((*cur_node)->right) == -1) {
+            *cur_node = lr_rotation(*cur_node);
+        } else if(balanceFactor((*cur_node)) == -2 && balanceFactor((*cur_node)->right) <= 0) {
             *cur_node = rr_rotation(*cur_node);
         } else if(balanceFactor((*cur_node)) == -2 && balanceFactor((*cur_node)->right) == 1) {
-            *cur_node = lr_rotation(*cur_node);
+            *cur_node = rl_rotation(*cur_node);
         }
     }
 
-    return true;
+    return removed;
 }
 
 void inorder_traversal(AVLNode *node) {
@@ -0,0 +1,362 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <math.h>
+#include <time.h>
+#include <poll.h>
+#include <string>
+#include <vector>
+#include <deque>
+#include <thread>
+#include <algorithm>
+#include "utils.h"
+#include "async_client.h"
+#include "histogram.h"
+
+/*
+
+Load generator:
+    Every thread drives its share of the connections from one poll() loop, keeping up to
+    --pipeline commands in flight on each. Keys are picked uniformly or Zipf distributed from
+    --keyspace keys, and a --set-ratio fraction of the commands are SETs of --value-size bytes.
+
+    Closed loop by default: a connection sends as soon as a reply frees a slot, so a stalled
+    server also stalls the sending, and the requests that would have queued up meanwhile are
+    never measured (coordinated omission). With --rate, every connection sends on a fixed
+    schedule instead and latency is counted from when the command was due, not when it went out.
+
+*/
+
+struct Options {
+    std::string ip = "127.0.0.1";
+    uint16_t port = 1234;
+    uint32_t threads = 4;
+    uint32_t conns = 16;
+    uint32_t pipeline = 1;
+    uint64_t keyspace = 100000;
+    uint32_t value_size = 64;
+    double zipf = 0;      // exponent. 0 is uniform
+    double set_ratio = 0.1;
+    double rate = 0;      // ops/sec over all connections. 0 is closed loop
+    double duration = 10; // seconds
+    bool prefill = true;
+};
+
+struct Worker;
+
+struct BenchConn {
+    Worker *worker = NULL;
+    AsyncClient *client = NULL;
+    uint64_t next_ns = 0; // when the next command is due, with --rate
+    // Commands in flight, oldest first: when it was due, and whether it is a SET
+    std::deque<std::pair<uint64_t, bool>> inflight;
+};
+
+struct Worker {
+    const Options *opts = NULL;
+    const std::vector<double> *zipf_cdf = NULL;
+    std::vector<BenchConn> conns;
+    uint64_t rng = 0;
+    uint64_t ops = 0;
+    uint64_t errors = 0;
+    bool failed = false;
+    Hist get;
+    Hist set;
+};
+
+static std::string g_value;
+
+static uint64_t now_ns() {
+    struct timespec ts = {};
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+static uint64_t xorshift(uint64_t &state) {
+    state ^= state << 13;
+    state ^= state >> 7;
+    state ^= state << 17;
+    return state;
+}
+
+// P(rank <= i) for ranks weighted 1 / (i + 1)^s
+static std::vector<double> zipf_table(uint64_t n, double s) {
+    std::vector<double> cdf(n);
+    double sum = 0;
+    for(uint64_t i = 0; i < n; ++i) {
+        sum += 1.0 / pow((double)(i + 1), s);
+        cdf[i] = sum;
+    }
+    for(double &p : cdf) {
+        p /= sum;
+    }
+    return cdf;
+}
+
+static uint64_t pick_key(Worker *w) {
+    uint64_t r = xorshift(w->rng);
+    if(!w->zipf_cdf) {
+        return r % w->opts->keyspace;
+    }
+
+    double u = (double)(r >> 11) / (double)(1ull << 53);
+    const std::vector<double> &cdf = *w->zipf_cdf;
+    return (uint64_t)(std::lower_bound(cdf.begin(), cdf.end(), u) - cdf.begin());
+}
+
+static std::string key_name(uint64_t i) {
+    char buf[32];
+    return std::string(buf, (size_t)snprintf(buf, sizeof(buf), "key:%lu", (unsigned long)i));
+}
+
+static void on_reply(BenchConn *conn, Reply &r) {
+    Worker *w = conn->worker;
+    std::pair<uint64_t, bool> sent = conn->inflight.front();
+    conn->inflight.pop_front();
+
+    uint64_t now = now_ns();
+    hist_record(sent.second ? &w->set : &w->get, now > sent.first ? now - sent.first : 0);
+    w->ops++;
+    if(r.type == SER_ERR) {
+        w->errors++;
+    }
+}
+
+static void send_one(BenchConn *conn, uint64_t due) {
+    Worker *w = conn->worker;
+    bool is_set = (double)(xorshift(w->rng) % 1000000) < w->opts->set_ratio * 1000000;
+    std::string key = key_name(pick_key(w));
+
+    conn->inflight.emplace_back(due, is_set);
+    if(is_set) {
+        ac_command(conn->client, {"set", key, g_value}, [conn](Reply &r) { on_reply(conn, r); });
+    } else {
+        ac_command(conn->client, {"get", key}, [conn](Reply &r) { on_reply(conn, r); });
+    }
+}
+
+static void worker_run(Worker *w, uint64_t start, uint64_t end) {
+    const Options &o = *w->opts;
+    uint64_t interval = 0;
+    if(o.rate > 0) {
+        interval = (uint64_t)(1e9 * o.conns / o.rate); // per connection
+    }
+    for(size_t i = 0; i < w->conns.size(); ++i) {
+        w->conns[i].next_ns = start + (interval * i) / w->conns.size(); // spread the schedules
+    }
+
+    std::vector<struct pollfd> pfds(w->conns.size());
+    for(uint64_t now = now_ns(); now < end; now = now_ns()) {
+        uint64_t wake = end;
+        for(BenchConn &conn : w->conns) {
+            while(conn.inflight.size() < o.pipeline && (!interval || conn.next_ns <= now)) {
+                send_one(&conn, interval ? conn.next_ns : now);
+                conn.next_ns += interval;
+            }
+            if(interval && conn.inflight.size() < o.pipeline) {
+                wake = std::min(wake, conn.next_ns);
+            }
+        }
+
+        for(size_t i = 0; i < w->conns.size(); ++i) {
+            AsyncClient *c = w->conns[i].client;
+            pfds[i] = {ac_fd(c), (short)(POLLIN | (ac_want_write(c) ? POLLOUT : 0)), 0};
+        }
+
+        uint64_t wait = wake > now ? wake - now : 0;
+        struct timespec ts = {(time_t)(wait / 1000000000), (long)(wait % 1000000000)};
+        if(ppoll(pfds.data(), pfds.size(), &ts, NULL) < 0) {
+            continue;
+        }
+
+        for(size_t i = 0; i < w->conns.size(); ++i) {
+            if(pfds[i].revents && ac_run(w->conns[i].client, pfds[i].revents) < 0) {
+                w->failed = true;
+                return;
+            }
+        }
+    }
+}
+
+static int32_t prefill(const Options &o) {
+    AsyncClient *c = ac_connect(o.ip.c_str(), o.port, 5000);
+    if(!c) {
+        return -1;
+    }
+
+    int32_t rv = 0;
+    for(uint64_t i = 0; i < o.keyspace && rv == 0; ++i) {
+        ac_command(c, {"set", key_name(i), g_value}, [](Reply &) {});
+        if(i % 1000 == 999 || i + 1 == o.keyspace) {
+            rv = ac_wait(c, 5000);
+        }
+    }
+    ac_close(c);
+    return rv;
+}
+
+static void print_row(const char *name, const Hist *h) {
+    printf("%-4s %10lu %10.1f %10.1f %10.1f %10.1f %10.1f\n", name, (unsigned long)h->total,
+           hist_percentile(h, 50) / 1e3, hist_percentile(h, 99) / 1e3,
+           hist_percentile(h, 99.9) / 1e3, h->max / 1e3, hist_mean(h) / 1e3);
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr,
+            "usage: %s [--host <ip>] [--port <n>] [--threads <n>] [--connections <n>]\n"
+            "       [--pipeline <n>] [--keyspace <n>] [--value-size <bytes>] [--zipf <s>]\n"
+            "       [--set-ratio <0..1>] [--rate <ops/sec>] [--duration <sec>] [--no-prefill]\n", prog);
+    exit(1);
+}
+
+int main(int argc, char **argv)
+{
+    Options o;
+    for (int i = 1; i < argc; ++i)
+    {
+        const char *arg = argv[i];
+        const char *val = i + 1 < argc ? argv[i + 1] : NULL;
+        if (0 == strcmp(arg, "--no-prefill"))
+        {
+            o.prefill = false;
+            continue;
+        }
+        if (!val)
+        {
+            usage(argv[0]);
+        }
+        i++;
+
+        if (0 == strcmp(arg, "--host"))
+        {
+            o.ip = val;
+        }
+        else if (0 == strcmp(arg, "--port"))
+        {
+            o.port = (uint16_t)atoi(val);
+        }
+        else if (0 == strcmp(arg, "--threads"))
+        {
+            o.threads = (uint32_t)atoi(val);
+        }
+        else if (0 == strcmp(arg, "--connections"))
+        {
+            o.conns = (uint32_t)atoi(val);
+        }
+        else if (0 == strcmp(arg, "--pipeline"))
+        {
+            o.pipeline = (uint32_t)atoi(val);
+        }
+        else if (0 == strcmp(arg, "--keyspace"))
+        {
+            o.keyspace = (uint64_t)atoll(val);
+        }
+        else if (0 == strcmp(arg, "--value-size"))
+        {
+            o.value_size = (uint32_t)atoi(val);
+        }
+        else if (0 == strcmp(arg, "--zipf"))
+        {
+            o.zipf = atof(val);
+        }
+        else if (0 == strcmp(arg, "--set-ratio"))
+        {
+            o.set_ratio = atof(val);
+        }
+        else if (0 == strcmp(arg, "--rate"))
+        {
+            o.rate = atof(val);
+        }
+        else if (0 == strcmp(arg, "--duration"))
+        {
+            o.duration = atof(val);
+        }
+        else
+        {
+            usage(argv[0]);
+        }
+    }
+    if (o.threads == 0 || o.conns == 0 || o.pipeline == 0 || o.keyspace == 0)
+    {
+        usage(argv[0]);
+    }
+    o.threads = std::min(o.threads, o.conns);
+    g_value.assign(o.value_size, 'x');
+
+    std::vector<double> cdf;
+    if (o.zipf > 0)
+    {
+        cdf = zipf_table(o.keyspace, o.zipf);
+    }
+
+    if (o.prefill && prefill(o) != 0)
+    {
+        fprintf(stderr, "prefill failed\n");
+        return 1;
+    }
+
+    // Connections are dealt out round robin
+    std::vector<Worker> workers(o.threads);
+    for (uint32_t i = 0; i < o.threads; ++i)
+    {
+        workers[i].opts = &o;
+        workers[i].zipf_cdf = o.zipf > 0 ? &cdf : NULL;
+        workers[i].rng = 0x9E3779B97F4A7C15ull * (i + 1);
+        workers[i].conns.resize((o.conns - i + o.threads - 1) / o.threads);
+        for (BenchConn &conn : workers[i].conns)
+        {
+            conn.worker = &workers[i];
+            conn.client = ac_connect(o.ip.c_str(), o.port, 5000);
+            if (!conn.client)
+            {
+                fprintf(stderr, "connect() error\n");
+                return 1;
+            }
+        }
+    }
+
+    uint64_t start = now_ns();
+    uint64_t end = start + (uint64_t)(o.duration * 1e9);
+    std::vector<std::thread> threads;
+    for (Worker &w : workers)
+    {
+        threads.emplace_back(worker_run, &w, start, end);
+    }
+    for (std::thread &t : threads)
+    {
+        t.join();
+    }
+    double secs = (double)(now_ns() - start) / 1e9;
+
+    Hist get, set, all;
+    uint64_t ops = 0, errors = 0;
+    bool failed = false;
+    for (Worker &w : workers)
+    {
+        hist_merge(&get, &w.get);
+        hist_merge(&set, &w.set);
+        ops += w.ops;
+        errors += w.errors;
+        failed = failed || w.failed;
+        for (BenchConn &conn : w.conns)
+        {
+            ac_close(conn.client);
+        }
+    }
+    hist_merge(&all, &get);
+    hist_merge(&all, &set);
+
+    printf("%u threads, %u connections, pipeline %u, %lu keys (%s), %u byte values, %.0f%% SET, %s\n",
+           o.threads, o.conns, o.pipeline, (unsigned long)o.keyspace, o.zipf > 0 ? "zipf" : "uniform",
+           o.value_size, o.set_ratio * 100, o.rate > 0 ? "fixed rate" : "closed loop");
+    printf("%lu ops in %.2fs: %.0f ops/sec, %lu errors%s\n", (unsigned long)ops, secs, ops / secs,
+           (unsigned long)errors, failed ? ", connection failed" : "");
+    printf("%-4s %10s %10s %10s %10s %10s %10s\n", "", "count", "p50(us)", "p99(us)", "p999(us)",
+           "max(us)", "mean(us)");
+    print_row("GET", &get);
+    print_row("SET", &set);
+    print_row("ALL", &all);
+    return failed ? 1 : 0;
+}
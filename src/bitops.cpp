@@ -0,0 +1,123 @@
+#include "bitops.h"
+#include "utils.h"
+#include <string.h>
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+/*
+
+Bitmap kernels. Each has an AVX2 version picked at runtime and a 64-bit scalar fallback.
+
+*/
+
+static uint64_t count_tail(const uint8_t *data, size_t len) {
+    uint64_t n = 0;
+    size_t i = 0;
+    for(; i + 8 <= len; i += 8) {
+        uint64_t w;
+        memcpy(&w, &data[i], 8);
+        n += (uint64_t)__builtin_popcountll(w);
+    }
+    for(; i < len; ++i) {
+        n += (uint64_t)__builtin_popcount(data[i]);
+    }
+    return n;
+}
+
+#if defined(__x86_64__)
+// Same loop as count_tail, but compiled to use the popcnt instruction
+__attribute__((target("popcnt")))
+static uint64_t count_popcnt(const uint8_t *data, size_t len) {
+    return count_tail(data, len);
+}
+
+// Nibble lookup with vpshufb, summed per 64-bit lane with vpsadbw (Mula et al.)
+__attribute__((target("avx2,popcnt")))
+static uint64_t count_avx2(const uint8_t *data, size_t len) {
+    const __m256i lut = _mm256_setr_epi8(0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4,
+                                         0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4);
+    const __m256i low = _mm256_set1_epi8(0x0F);
+
+    __m256i acc = _mm256_setzero_si256();
+    size_t i = 0;
+    for(; i + 32 <= len; i += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)&data[i]);
+        __m256i lo = _mm256_shuffle_epi8(lut, _mm256_and_si256(v, low));
+        __m256i hi = _mm256_shuffle_epi8(lut, _mm256_and_si256(_mm256_srli_epi16(v, 4), low));
+        acc = _mm256_add_epi64(acc, _mm256_sad_epu8(_mm256_add_epi8(lo, hi), _mm256_setzero_si256()));
+    }
+
+    uint64_t lanes[4];
+    _mm256_storeu_si256((__m256i *)lanes, acc);
+    return lanes[0] + lanes[1] + lanes[2] + lanes[3] + count_popcnt(&data[i], len - i);
+}
+#endif
+
+uint64_t bit_count(const uint8_t *data, size_t len) {
+#if defined(__x86_64__)
+    if(len >= 256 && cpu_has_avx2()) {
+        return count_avx2(data, len);
+    }
+    if(__builtin_cpu_supports("popcnt")) {
+        return count_popcnt(data, len);
+    }
+#endif
+    return count_tail(data, len);
+}
+
+static void op_tail(uint32_t op, uint8_t *dst, const uint8_t *src, size_t len) {
+    size_t i = 0;
+    for(; i + 8 <= len; i += 8) {
+        uint64_t d, s;
+        memcpy(&d, &dst[i], 8);
+        memcpy(&s, &src[i], 8);
+        d = op == BITOP_AND ? d & s : op == BITOP_OR ? d | s : op == BITOP_XOR ? d ^ s : ~s;
+        memcpy(&dst[i], &d, 8);
+    }
+    for(; i < len; ++i) {
+        uint8_t d = dst[i], s = src[i];
+        dst[i] = op == BITOP_AND ? d & s : op == BITOP_OR ? d | s : op == BITOP_XOR ? d ^ s : (uint8_t)~s;
+    }
+}
+
+#if defined(__x86_64__)
+// 128 bytes per iteration, one loop per op so the inner loop has no branches
+__attribute__((target("avx2")))
+static void op_avx2(uint32_t op, uint8_t *dst, const uint8_t *src, size_t len) {
+    size_t i = 0;
+
+#define BITOP_LOOP(expr)                                                           \
+    for(; i + 128 <= len; i += 128) {                                              \
+        for(size_t k = 0; k < 128; k += 32) {                                      \
+            __m256i d = _mm256_loadu_si256((const __m256i *)&dst[i + k]);         \
+            __m256i s = _mm256_loadu_si256((const __m256i *)&src[i + k]);         \
+            _mm256_storeu_si256((__m256i *)&dst[i + k], expr);                    \
+        }                                                                          \
+    }
+
+    if(op == BITOP_AND) {
+        BITOP_LOOP(_mm256_and_si256(d, s))
+    } else if(op == BITOP_OR) {
+        BITOP_LOOP(_mm256_or_si256(d, s))
+    } else if(op == BITOP_XOR) {
+        BITOP_LOOP(_mm256_xor_si256(d, s))
+    } else {
+        BITOP_LOOP(((void)d, _mm256_xor_si256(s, _mm256_set1_epi8((char)0xFF))))
+    }
+
+#undef BITOP_LOOP
+
+    op_tail(op, &dst[i], &src[i], len - i);
+}
+#endif
+
+// dst[i] = dst[i] op src[i] for the first len bytes. BITOP_NOT ignores dst: dst[i] = ~src[i]
+void bit_op(uint32_t op, uint8_t *dst, const uint8_t *src, size_t len) {
+#if defined(__x86_64__)
+    if(len >= 128 && cpu_has_avx2()) {
+        return op_avx2(op, dst, src, len);
+    }
+#endif
+    op_tail(op, dst, src, len);
+}
@@ -0,0 +1,14 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+enum {
+    BITOP_AND = 0,
+    BITOP_OR = 1,
+    BITOP_XOR = 2,
+    BITOP_NOT = 3,
+};
+
+uint64_t bit_count(const uint8_t *data, size_t len);
+void bit_op(uint32_t op, uint8_t *dst, const uint8_t *src, size_t len);
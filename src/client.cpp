@@ -2,274 +2,58 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
-#include <errno.h>
-#include <unistd.h>
-#include <arpa/inet.h>
-#include <sys/socket.h>
-#include <netinet/ip.h>
-#include <assert.h>
 #include <string>
 #include <vector>
 #include "utils.h"
+#include "async_client.h"
 
-// FUTURE UPDATES:
+// Usage: client <cmd> [args...]
+// Sends one command and prints the reply. Built on the pipelined client in async_client.h
 
-const size_t k_max_msg = 4096;
-
-static void msg(const char *msg)
-{
-    fprintf(stderr, "%s\n", msg);
-}
-
-static int32_t read_full(int fd, char *buf, size_t n)
-{
-    while (n > 0)
-    {
-        ssize_t rv = read(fd, buf, n);
-        if (rv <= 0)
-        {
-            return -1; // Error or unexpected EOF
-        }
-        assert((size_t)rv <= n);
-        n -= (size_t)rv;
-        buf += rv;
-    }
-    return 0;
-}
-
-static int32_t write_all(int fd, const char *buf, size_t n)
-{
-    while (n > 0)
-    {
-        ssize_t rv = write(fd, buf, n);
-        if (rv <= 0)
-        {
-            return -1; // error
-        }
-
-        assert((ssize_t)rv <= n);
-        n -= (ssize_t)rv;
-        buf += rv;
-    }
-    return 0;
-}
-
-static void die(const char *msg)
-{
-    int err = errno;
-    fprintf(stderr, "[%d] %s\n", err, msg);
-    abort();
-}
-
-static int32_t send_req(int fd, const std::vector<std::string> &cmd)
-{
-    uint32_t len = 4;
-
-    for (const std::string &s : cmd)
-    {
-        len += 4 + s.size();
-    }
-
-    if (len > k_max_msg)
-    {
-        return -1;
-    }
-
-    char wBuf[4 + k_max_msg];
-    memcpy(&wBuf[0], &len, 4);
-    uint32_t n = cmd.size();
-    memcpy(&wBuf[4], &n, len);
-    size_t cur = 8;
-
-    for (const std::string &s : cmd)
-    {
-        uint32_t p = (uint32_t)s.size();
-        memcpy(&wBuf[cur], &p, 4);
-        memcpy(&wBuf[cur + 4], s.data(), s.size());
-        cur += 4 + s.size();
-    }
-
-    return write_all(fd, wBuf, 4 + len);
-}
-
-static int32_t on_response(const uint8_t *data, size_t size) {
-    if(size < 1) {
-        msg("bad response. Response size less than 1 byte.");
-        return -1;
-    }
-
-    switch(data[0]) {
+static void print_reply(const Reply &r) {
+    switch(r.type) {
         case SER_NIL:
             printf("(nil)\n");
-            return 1;
+            break;
         case SER_ERR:
-            if(size < 1 + 8) {
-                msg("bad response in SER_ERR.");
-                return -1;
-            }
-
-            {
-                int32_t code = 0;
-                uint32_t len = 0;
-                memcpy(&code, &data[1], 4);
-                memcpy(&len, &data[1 + 4], 4);
-
-                if(size < 1 + 8 + len) {
-                    msg("bad response");
-                    return -1;
-                }
-
-                printf("(err) %d %.*s\n", code, len, &data[1 + 8]);
-                return 1 + 8 + len;
-            }
+            printf("(err) %d %s\n", r.code, r.str.c_str());
+            break;
         case SER_STR:
-            if(size < 1 + 4) {
-                msg("bad response");
-                return -1;
-            }
-            {
-                uint32_t len = 0;
-                memcpy(&len, &data[1], 4);
-
-                if(size < 1 + 4 + len) {
-                    msg("bad response");
-                    return -1;
-                }
-
-                printf("(str) %.*s\n", len, &data[1 + 4]);
-                return 1 + 4 + len;
-            }
+            printf("(str) %.*s\n", (int)r.str.size(), r.str.data());
+            break;
         case SER_INT:
-            if(size < 1 + 8) {
-                msg("bad response");
-                return -1;
-            }
-            {
-                int64_t val = 0;
-                memcpy(&val, &data[1], 8);
-
-                printf("(int) %ld\n", val);
-                return 1 + 8;
-            }
+            printf("(int) %ld\n", r.ival);
+            break;
         case SER_DBL:
-            if(size < 1 + 8) {
-                msg("bad response");
-                return -1;
-            }
-            {
-                double val = 0;
-                memcpy(&val, &data[1], 8);
-                printf("(dbl) %g\n", val);
-                return 1 + 8;
-            }
+            printf("(dbl) %g\n", r.dval);
+            break;
         case SER_ARR:
-            if(size < 1 + 4) {
-                msg("bad response");
-                return -1;
-            } 
-            {
-                uint32_t len = 0;
-                memcpy(&len, &data[1], 4);
-                printf("(arr) len=%u\n", len);
-                size_t array_bytes = 1 + 4;
-
-                for(uint32_t i = 0; i < len; ++i) {
-                    int32_t rv = on_response(&data[array_bytes], size - array_bytes);
-
-                    if(rv < 0) {
-                        return rv;
-                    }
-
-                    array_bytes += (size_t)rv;
-                }
-
-                printf("(arr) end\n");
-                return (int32_t)array_bytes;
+            printf("(arr) len=%u\n", (uint32_t)r.arr.size());
+            for(const Reply &elem : r.arr) {
+                print_reply(elem);
             }
-        default:
-            msg("bad response");
-            return -1;
-    }
-}
-
-static int32_t read_res(int fd)
-{
-    uint32_t len = 0;
-    char rBuf[4 + k_max_msg + 1];
-    errno = 0;
-    int32_t err = read_full(fd, rBuf, 4);
-    if (err)
-    {
-        if (errno == 0)
-        {
-            msg("EOF");
-        }
-        else
-        {
-            msg("read() error");
-        }
-    }
-
-    memcpy(&len, rBuf, 4);
-    if (len > k_max_msg)
-    {
-        msg("msg too long");
-        return -1;
-    }
-
-    err = read_full(fd, &rBuf[4], len);
-
-    if (err)
-    {
-        msg("read() error for body");
-        return err;
-    }
-
-    // Read rescode and print result
-    int32_t rv = on_response((uint8_t *)&rBuf[4], len);
-    if(rv > 0 && (uint32_t)rv != len) {
-        msg("bad response.");
-        rv = -1;
+            printf("(arr) end\n");
+            break;
     }
-
-    return rv;
 }
 
 int main(int argc, char **argv)
 {
-    int fd = socket(AF_INET, SOCK_STREAM, 0);
-
-    if (fd < 0)
+    AsyncClient *c = ac_connect("127.0.0.1", 1234, 5000);
+    if (!c)
     {
-        die("socket()");
+        fprintf(stderr, "connect() error\n");
+        return 1;
     }
 
-    struct sockaddr_in addr = {};
-    addr.sin_family = AF_INET;
-    addr.sin_port = ntohs(1234);
-    addr.sin_addr.s_addr = ntohl(INADDR_LOOPBACK); // 127.0.0.1
-    int rv = connect(fd, (const struct sockaddr *)&addr, sizeof(addr));
-
     std::vector<std::string> cmd;
-
     for (int i = 1; i < argc; ++i)
     {
         cmd.push_back(argv[i]);
     }
 
-    int32_t err = send_req(fd, cmd);
-    if (err)
-    {
-        goto L_DONE;
-    }
-
-    err = read_res(fd);
-    if (err)
-    {
-        goto L_DONE;
-    }
-
-L_DONE:
-    close(fd);
-    return 0;
-}
\ No newline at end of file
+    ac_command(c, cmd, [](Reply &r) { print_reply(r); });
+    int32_t err = ac_wait(c, -1);
+    ac_close(c);
+    return err ? 1 : 0;
+}
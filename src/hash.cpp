@@ -0,0 +1,291 @@
+#include "hash.h"
+#include "utils.h"
+#include "memusage.h"
+#include "slab.h"
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <new>
+
+const size_t k_hash_packed_max_len = 128; // fields
+const size_t k_hash_packed_max_size = 64; // bytes per field or value
+
+static SlabClass g_fields = {"hash fields", slab_stride(sizeof(HashField))};
+
+static HashField *field_new() {
+    return new (slab_alloc(&g_fields)) HashField();
+}
+
+static void field_del(HashField *hf) {
+    hf->~HashField();
+    slab_free(hf);
+}
+
+static size_t field_mem(const HashField *hf) {
+    return g_fields.size + mem_str(hf->field) + mem_str(hf->val);
+}
+
+static bool field_eq(HNode *lhs, HNode *rhs) {
+    HashField *le = container_of(lhs, HashField, node);
+    HashField *re = container_of(rhs, HashField, node);
+    return le->field == re->field;
+}
+
+// Returns the offset of the pair holding field in the packed buffer, or -1
+static int64_t packed_find(Hash *hash, const std::string &field) {
+    uint32_t pos = 0;
+    while(pos < hash->packed_size) {
+        const uint8_t *p = &hash->packed[pos];
+        uint32_t flen = p[0];
+        uint32_t vlen = p[1 + flen];
+
+        if(flen == field.size() && 0 == memcmp(p + 1, field.data(), flen)) {
+            return pos;
+        }
+        pos += 1 + flen + 1 + vlen;
+    }
+    return -1;
+}
+
+static uint32_t packed_pair_size(const uint8_t *p) {
+    uint32_t flen = p[0];
+    return 1 + flen + 1 + p[1 + flen];
+}
+
+// Replaces the bytes [pos, pos + old_size) with new_size bytes. Returns where they start
+static uint8_t *packed_splice(Hash *hash, uint32_t pos, uint32_t old_size, uint32_t new_size) {
+    uint32_t tail = hash->packed_size - pos - old_size;
+    uint32_t size = hash->packed_size - old_size + new_size;
+
+    if(new_size < old_size) {
+        memmove(&hash->packed[pos + new_size], &hash->packed[pos + old_size], tail);
+    }
+
+    // Exact sized. Small hashes are about memory, not append speed
+    hash->packed = (uint8_t *)realloc(hash->packed, size ? size : 1);
+    if(!hash->packed) {
+        abort();
+    }
+
+    if(new_size > old_size) {
+        memmove(&hash->packed[pos + new_size], &hash->packed[pos + old_size], tail);
+    }
+
+    hash->packed_size = size;
+    return &hash->packed[pos];
+}
+
+static void hmap_insert(Hash *hash, const uint8_t *field, uint32_t flen, const uint8_t *val, uint32_t vlen) {
+    HashField *hf = field_new();
+    hf->field.assign((const char *)field, flen);
+    hf->val.assign((const char *)val, vlen);
+    hf->node.hcode = str_hash(field, flen);
+    hm_insert(&hash->map, &hf->node);
+    hash->bytes += field_mem(hf);
+}
+
+// Moves every pair into the HMap. Incremental resizing takes over from here
+static void hash_convert(Hash *hash) {
+    assert(hash->enc == HASH_PACKED);
+
+    uint32_t pos = 0;
+    while(pos < hash->packed_size) {
+        const uint8_t *p = &hash->packed[pos];
+        uint32_t flen = p[0];
+        uint32_t vlen = p[1 + flen];
+        hmap_insert(hash, p + 1, flen, p + 1 + flen + 1, vlen);
+        pos += 1 + flen + 1 + vlen;
+    }
+
+    free(hash->packed);
+    hash->packed = NULL;
+    hash->packed_size = 0;
+    hash->enc = HASH_HMAP;
+}
+
+static HashField *hmap_find(Hash *hash, const std::string &field) {
+    HashField probe;
+    probe.field = field;
+    probe.node.hcode = str_hash((const uint8_t *)field.data(), field.size());
+    HNode *node = hm_lookup(&hash->map, &probe.node, &field_eq);
+    return node ? container_of(node, HashField, node) : NULL;
+}
+
+// Returns true if the field was added, false if an existing one was updated
+bool hash_set(Hash *hash, const std::string &field, const std::string &val) {
+    if(hash->enc == HASH_PACKED
+        && (field.size() > k_hash_packed_max_size || val.size() > k_hash_packed_max_size)) {
+        hash_convert(hash);
+    }
+
+    if(hash->enc == HASH_PACKED) {
+        int64_t pos = packed_find(hash, field);
+        if(pos < 0 && hash->len + 1 > k_hash_packed_max_len) {
+            hash_convert(hash);
+            return hash_set(hash, field, val);
+        }
+
+        uint32_t old_size = pos < 0 ? 0 : packed_pair_size(&hash->packed[pos]);
+        uint32_t new_size = 1 + (uint32_t)field.size() + 1 + (uint32_t)val.size();
+        uint8_t *p = packed_splice(hash, pos < 0 ? hash->packed_size : (uint32_t)pos, old_size, new_size);
+
+        p[0] = (uint8_t)field.size();
+        memcpy(p + 1, field.data(), field.size());
+        p[1 + field.size()] = (uint8_t)val.size();
+        memcpy(p + 1 + field.size() + 1, val.data(), val.size());
+
+        if(pos < 0) {
+            hash->len++;
+        }
+        return pos < 0;
+    }
+
+    if(HashField *hf = hmap_find(hash, field)) {
+        hash->bytes -= mem_str(hf->val);
+        hf->val = val;
+        hash->bytes += mem_str(hf->val);
+        return false;
+    }
+
+    hmap_insert(hash, (const uint8_t *)field.data(), (uint32_t)field.size(),
+                (const uint8_t *)val.data(), (uint32_t)val.size());
+    hash->len++;
+    return true;
+}
+
+bool hash_get(Hash *hash, const std::string &field, const uint8_t **val, uint32_t *len) {
+    if(hash->enc == HASH_PACKED) {
+        int64_t pos = packed_find(hash, field);
+        if(pos < 0) {
+            return false;
+        }
+
+        const uint8_t *p = &hash->packed[pos];
+        *len = p[1 + p[0]];
+        *val = p + 1 + p[0] + 1;
+        return true;
+    }
+
+    HashField *hf = hmap_find(hash, field);
+    if(!hf) {
+        return false;
+    }
+
+    *val = (const uint8_t *)hf->val.data();
+    *len = (uint32_t)hf->val.size();
+    return true;
+}
+
+bool hash_del(Hash *hash, const std::string &field) {
+    if(hash->enc == HASH_PACKED) {
+        int64_t pos = packed_find(hash, field);
+        if(pos < 0) {
+            return false;
+        }
+
+        packed_splice(hash, (uint32_t)pos, packed_pair_size(&hash->packed[pos]), 0);
+        hash->len--;
+        return true;
+    }
+
+    HashField probe;
+    probe.field = field;
+    probe.node.hcode = str_hash((const uint8_t *)field.data(), field.size());
+    HNode *node = hm_pop(&hash->map, &probe.node, &field_eq);
+    if(!node) {
+        return false;
+    }
+
+    HashField *hf = container_of(node, HashField, node);
+    hash->bytes -= field_mem(hf);
+    field_del(hf);
+    hash->len--;
+    return true;
+}
+
+static void scan_tab(HTab *tab, void (*f)(const uint8_t *, uint32_t, const uint8_t *, uint32_t, void *), void *arg) {
+    if(tab->size == 0) {
+        return;
+    }
+
+    for(size_t i = 0; i < tab->mask + 1; ++i) {
+        for(HNode *node = tab->tab[i]; node; node = node->next) {
+            HashField *hf = container_of(node, HashField, node);
+            f((const uint8_t *)hf->field.data(), (uint32_t)hf->field.size(),
+              (const uint8_t *)hf->val.data(), (uint32_t)hf->val.size(), arg);
+        }
+    }
+}
+
+// Calls f on every field/value pair
+void hash_scan(Hash *hash, void (*f)(const uint8_t *field, uint32_t flen, const uint8_t *val, uint32_t vlen, void *arg), void *arg) {
+    if(hash->enc == HASH_PACKED) {
+        uint32_t pos = 0;
+        while(pos < hash->packed_size) {
+            const uint8_t *p = &hash->packed[pos];
+            uint32_t flen = p[0];
+            uint32_t vlen = p[1 + flen];
+            f(p + 1, flen, p + 1 + flen + 1, vlen, arg);
+            pos += 1 + flen + 1 + vlen;
+        }
+        return;
+    }
+
+    scan_tab(&hash->map.h1, f, arg);
+    scan_tab(&hash->map.h2, f, arg);
+}
+
+static void destroy_tab(HTab *tab) {
+    if(tab->size == 0) {
+        return;
+    }
+
+    for(size_t i = 0; i < tab->mask + 1; ++i) {
+        HNode *node = tab->tab[i];
+        while(node) {
+            HNode *next = node->next;
+            field_del(container_of(node, HashField, node));
+            node = next;
+        }
+    }
+}
+
+void hash_destroy(Hash *hash) {
+    free(hash->packed);
+    destroy_tab(&hash->map.h1);
+    destroy_tab(&hash->map.h2);
+    hm_destroy(&hash->map);
+    *hash = Hash();
+}
+
+// Moves a field off a sparse slab, see slab_should_move()
+static HNode *field_relocate(HNode *node, void *arg) {
+    HashField *hf = container_of(node, HashField, node);
+    void *dst = slab_should_move(hf) ? slab_alloc_dense(hf) : NULL;
+    if(!dst) {
+        return node;
+    }
+
+    HashField *moved = new (dst) HashField(std::move(*hf));
+    field_del(hf);
+    (*(size_t *)arg)++;
+    return &moved->node;
+}
+
+// Packs the fields into fuller slabs. Returns the number moved
+size_t hash_defrag(Hash *hash) {
+    size_t moved = 0;
+    if(hash->enc == HASH_HMAP) {
+        size_t cursor = 0;
+        do {
+            cursor = hm_relocate(&hash->map, cursor, &field_relocate, &moved);
+        } while(cursor);
+    }
+    return moved;
+}
+
+// Bytes held by the pairs and the bucket arrays, not counting the Hash itself
+size_t hash_mem(const Hash *hash) {
+    return mem_alloc(hash->packed ? (hash->packed_size ? hash->packed_size : 1) : 0)
+        + hash->bytes + mem_hmap(&hash->map);
+}
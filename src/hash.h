@@ -0,0 +1,46 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string>
+#include "hashtable.h"
+
+/*
+
+Hash (field -> value map stored under one key):
+    Small hashes are one malloc'd buffer of packed pairs, scanned linearly:
+
+        flen u8 - field - vlen u8 - val
+
+    Once a hash has more than k_hash_packed_max_len fields, or a field or value longer than
+    k_hash_packed_max_size, it is converted to an HMap of HashFields for good.
+
+*/
+
+enum {
+    HASH_PACKED = 0,
+    HASH_HMAP = 1,
+};
+
+struct HashField {
+    HNode node;
+    std::string field;
+    std::string val;
+};
+
+struct Hash {
+    uint32_t enc = HASH_PACKED;
+    uint32_t packed_size = 0; // bytes used in packed
+    uint8_t *packed = NULL;
+    HMap map;
+    size_t len = 0;
+    size_t bytes = 0; // HashFields in map and their strings, see mem_alloc()
+};
+
+bool hash_set(Hash *hash, const std::string &field, const std::string &val);
+bool hash_get(Hash *hash, const std::string &field, const uint8_t **val, uint32_t *len);
+bool hash_del(Hash *hash, const std::string &field);
+void hash_scan(Hash *hash, void (*f)(const uint8_t *field, uint32_t flen, const uint8_t *val, uint32_t vlen, void *arg), void *arg);
+void hash_destroy(Hash *hash);
+size_t hash_mem(const Hash *hash);
+size_t hash_defrag(Hash *hash);
@@ -5,6 +5,7 @@
 
 const size_t k_max_load_factor = 8;
 const size_t k_resizing_work = 128; // constant work
+const size_t k_prefetch_batch = 16; // lookups in flight at once, roughly the number of line fill buffers
 
 //Initalizes a hashtable that is a power of 2
 static void h_init(HTab *htab, size_t n)
@@ -72,12 +73,12 @@ static void hm_start_resizing(HMap *hmap)
     hmap->resizing_pos = 0;
 }
 
-//Moves some keys to the new table. Triggered from lookups and updates
-static void hm_help_resizing(HMap *hmap)
+//Moves up to max_work keys to the new table
+static void hm_move_keys(HMap *hmap, size_t max_work)
 {
     size_t nwork = 0;
 
-    while (nwork < k_resizing_work && hmap->h2.size > 0)
+    while (nwork < max_work && hmap->h2.size > 0)
     {
         // Scan for nodes in ht2 and move them to ht1
         HNode **from = &hmap->h2.tab[hmap->resizing_pos];
@@ -102,6 +103,19 @@ static void hm_help_resizing(HMap *hmap)
     }
 }
 
+//Moves some keys to the new table. Triggered from lookups and updates
+static void hm_help_resizing(HMap *hmap)
+{
+    hm_move_keys(hmap, k_resizing_work);
+}
+
+//Moves a resize along without waiting for traffic on the table. Returns true while one is running
+bool hm_rehash(HMap *hmap, size_t max_work)
+{
+    hm_move_keys(hmap, max_work);
+    return hmap->h2.tab != NULL;
+}
+
 //Inserts a node into the hashmap
 void hm_insert(HMap *hmap, HNode *node)
 {
@@ -138,6 +152,55 @@ HNode *hm_lookup(HMap *hmap, HNode *key, bool (*eq)(HNode *, HNode *))
     return from ? *from : NULL;
 }
 
+//Looks up n keys at once. The slots of every key are prefetched in both tables first, then the
+//chain heads, so the cache misses of the whole group overlap instead of happening one after another
+void hm_lookup_batch(HMap *hmap, HNode **keys, size_t n, bool (*eq)(HNode *, HNode *), HNode **out)
+{
+    hm_help_resizing(hmap);
+
+    HTab *tabs[2] = {&hmap->h1, &hmap->h2};
+
+    for (size_t base = 0; base < n; base += k_prefetch_batch)
+    {
+        size_t end = base + k_prefetch_batch < n ? base + k_prefetch_batch : n;
+
+        // Bucket slots
+        for (size_t i = base; i < end; ++i)
+        {
+            for (HTab *htab : tabs)
+            {
+                if (htab->tab)
+                {
+                    __builtin_prefetch(&htab->tab[keys[i]->hcode & htab->mask]);
+                }
+            }
+        }
+
+        // First node of each chain
+        for (size_t i = base; i < end; ++i)
+        {
+            for (HTab *htab : tabs)
+            {
+                if (htab->tab)
+                {
+                    HNode *head = htab->tab[keys[i]->hcode & htab->mask];
+                    if (head)
+                    {
+                        __builtin_prefetch(head);
+                    }
+                }
+            }
+        }
+
+        for (size_t i = base; i < end; ++i)
+        {
+            HNode **from = h_lookup(&hmap->h1, keys[i], eq);
+            from = from ? from : h_lookup(&hmap->h2, keys[i], eq);
+            out[i] = from ? *from : NULL;
+        }
+    }
+}
+
 //Deletes node from hashtable
 HNode *hm_pop(HMap *hmap, HNode *key, bool (*eq)(HNode *, HNode *))
 {
@@ -156,6 +219,61 @@ HNode *hm_pop(HMap *hmap, HNode *key, bool (*eq)(HNode *, HNode *))
     return NULL;
 }
 
+//Finds the incoming pointer to node itself in its chain. Compares pointers, not keys
+static HNode **h_find_node(HTab *htab, HNode *node)
+{
+    if (!htab->tab)
+    {
+        return NULL;
+    }
+
+    for (HNode **from = &htab->tab[node->hcode & htab->mask]; *from; from = &(*from)->next)
+    {
+        if (*from == node)
+        {
+            return from;
+        }
+    }
+    return NULL;
+}
+
+//Deletes a node that is in the hashmap, like one found by hm_lookup_batch, without comparing keys again
+void hm_unlink(HMap *hmap, HNode *node)
+{
+    hm_help_resizing(hmap);
+
+    if (HNode **from = h_find_node(&hmap->h1, node))
+    {
+        h_detach(&hmap->h1, from);
+        return;
+    }
+
+    HNode **from = h_find_node(&hmap->h2, node);
+    assert(from);
+    h_detach(&hmap->h2, from);
+}
+
+//Visits one bucket: cursor counts the buckets of h1, then those of h2. f may move each node
+//(copying its next) and returns where it lives now, which is relinked in place.
+//Returns the next cursor, 0 after the last bucket. A resize between calls may make it skip
+//or revisit buckets
+size_t hm_relocate(HMap *hmap, size_t cursor, HNode *(*f)(HNode *, void *), void *arg)
+{
+    size_t n1 = hmap->h1.tab ? hmap->h1.mask + 1 : 0;
+    size_t n2 = hmap->h2.tab ? hmap->h2.mask + 1 : 0;
+    if (cursor >= n1 + n2)
+    {
+        return 0;
+    }
+
+    HNode **from = cursor < n1 ? &hmap->h1.tab[cursor] : &hmap->h2.tab[cursor - n1];
+    for (; *from; from = &(*from)->next)
+    {
+        *from = f(*from, arg);
+    }
+    return cursor + 1 < n1 + n2 ? cursor + 1 : 0;
+}
+
 //Returns size of the two hashtables
 size_t hm_size(HMap *hmap)
 {
@@ -168,4 +286,19 @@ void hm_destroy(HMap *hmap)
     free(hmap->h1.tab);
     free(hmap->h2.tab);
     *hmap = HMap();
+}
+
+//Sizes an empty hashmap for n keys up front, so bulk loading never triggers a resize
+void hm_reserve(HMap *hmap, size_t n)
+{
+    assert(hm_size(hmap) == 0);
+    hm_destroy(hmap);
+
+    size_t cap = 4;
+    while (n / cap >= k_max_load_factor)
+    {
+        cap *= 2;
+    }
+
+    h_init(&hmap->h1, cap);
 }
\ No newline at end of file
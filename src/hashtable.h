@@ -2,6 +2,7 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
 
 struct HNode
 {
@@ -25,6 +26,11 @@ struct HMap
 
 void hm_insert(HMap *hmap, HNode *node);
 HNode *hm_pop(HMap *hmap, HNode *key, bool (*eq)(HNode *, HNode *));
+void hm_unlink(HMap *hmap, HNode *node);
 HNode *hm_lookup(HMap *hmap, HNode *key, bool (*eq)(HNode *, HNode *));
+void hm_lookup_batch(HMap *hmap, HNode **keys, size_t n, bool (*eq)(HNode *, HNode *), HNode **out);
 void hm_destroy(HMap *hmap);
-size_t hm_size(HMap *hmap);
\ No newline at end of file
+size_t hm_size(HMap *hmap);
+void hm_reserve(HMap *hmap, size_t n);
+bool hm_rehash(HMap *hmap, size_t max_work);
+size_t hm_relocate(HMap *hmap, size_t cursor, HNode *(*f)(HNode *, void *), void *arg);
\ No newline at end of file
@@ -0,0 +1,107 @@
+#include "histogram.h"
+#include <string.h>
+
+static size_t hist_index(uint64_t v) {
+    const uint64_t limit = ((uint64_t)1 << k_hist_max_bits) - 1;
+    if(v > limit) {
+        v = limit;
+    }
+    if(v < ((uint64_t)1 << k_hist_sub_bits)) {
+        return (size_t)v;
+    }
+
+    uint32_t e = 63 - (uint32_t)__builtin_clzll(v); // >= k_hist_sub_bits
+    uint64_t sub = (v >> (e - k_hist_sub_bits + 1)) - k_hist_half;
+    return ((size_t)1 << k_hist_sub_bits) + (e - k_hist_sub_bits) * k_hist_half + (size_t)sub;
+}
+
+// The largest value that lands in bucket idx
+static uint64_t hist_bucket_max(size_t idx) {
+    if(idx < ((size_t)1 << k_hist_sub_bits)) {
+        return idx;
+    }
+
+    size_t j = idx - ((size_t)1 << k_hist_sub_bits);
+    uint32_t shift = (uint32_t)(j / k_hist_half) + 1;
+    uint64_t low = (uint64_t)(k_hist_half + j % k_hist_half) << shift;
+    return low + ((uint64_t)1 << shift) - 1;
+}
+
+void hist_record_n(Hist *h, uint64_t v, uint64_t n) {
+    h->counts[hist_index(v)] += n;
+    h->total += n;
+    h->sum += v * n;
+    if(v > h->max) {
+        h->max = v;
+    }
+}
+
+void hist_record(Hist *h, uint64_t v) {
+    hist_record_n(h, v, 1);
+}
+
+void hist_merge(Hist *dst, const Hist *src) {
+    for(size_t i = 0; i < k_hist_buckets; ++i) {
+        dst->counts[i] += src->counts[i];
+    }
+    dst->total += src->total;
+    dst->sum += src->sum;
+    if(src->max > dst->max) {
+        dst->max = src->max;
+    }
+}
+
+void hist_reset(Hist *h) {
+    memset(h->counts, 0, sizeof(h->counts));
+    h->total = 0;
+    h->sum = 0;
+    h->max = 0;
+}
+
+// The value p percent of the recorded values are at or below, rounded up to its bucket
+uint64_t hist_percentile(const Hist *h, double p) {
+    if(h->total == 0) {
+        return 0;
+    }
+
+    uint64_t rank = (uint64_t)(p / 100.0 * (double)h->total + 0.5);
+    if(rank < 1) {
+        rank = 1;
+    }
+
+    uint64_t seen = 0;
+    for(size_t i = 0; i < k_hist_buckets; ++i) {
+        seen += h->counts[i];
+        if(seen >= rank) {
+            uint64_t v = hist_bucket_max(i);
+            return v < h->max ? v : h->max;
+        }
+    }
+    return h->max;
+}
+
+double hist_mean(const Hist *h) {
+    return h->total ? (double)h->sum / (double)h->total : 0.0;
+}
+
+// Collapses the buckets into powers of two of unit: counts[k] gets the values in
+// (2^(k-1), 2^k] units, counts[0] those up to 1 unit. Returns the number of counts used
+size_t hist_log2(const Hist *h, uint64_t unit, uint64_t *counts, size_t n) {
+    size_t used = 0;
+    for(size_t k = 0; k < n; ++k) {
+        counts[k] = 0;
+    }
+
+    for(size_t i = 0; i < k_hist_buckets && n; ++i) {
+        if(!h->counts[i]) {
+            continue;
+        }
+
+        uint64_t units = (hist_bucket_max(i) + unit - 1) / unit;
+        size_t k = units <= 1 ? 0 : 64 - (size_t)__builtin_clzll(units - 1);
+        k = k < n ? k : n - 1;
+        counts[k] += h->counts[i];
+        used = k + 1 > used ? k + 1 : used;
+    }
+    return used;
+}
@@ -0,0 +1,35 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+
+Latency histogram, HDR style:
+    Values below 2^k_hist_sub_bits get a bucket each. Above that, every power of two range is
+    split into 2^(k_hist_sub_bits - 1) linear buckets, so a value is off by less than 1/64 of
+    itself, at any magnitude. Recording is an index computation and an increment.
+
+    Values are clamped to 2^k_hist_max_bits - 1 (18 minutes in ns).
+
+*/
+
+const uint32_t k_hist_sub_bits = 7;
+const uint32_t k_hist_max_bits = 40;
+const size_t k_hist_half = (size_t)1 << (k_hist_sub_bits - 1);
+const size_t k_hist_buckets = ((size_t)1 << k_hist_sub_bits) + k_hist_half * (k_hist_max_bits - k_hist_sub_bits);
+
+struct Hist {
+    uint64_t counts[k_hist_buckets] = {};
+    uint64_t total = 0;
+    uint64_t sum = 0;
+    uint64_t max = 0;
+};
+
+void hist_record(Hist *h, uint64_t v);
+void hist_record_n(Hist *h, uint64_t v, uint64_t n);
+void hist_merge(Hist *dst, const Hist *src);
+void hist_reset(Hist *h);
+uint64_t hist_percentile(const Hist *h, double p);
+double hist_mean(const Hist *h);
+size_t hist_log2(const Hist *h, uint64_t unit, uint64_t *counts, size_t n);
@@ -0,0 +1,345 @@
+#include "hll.h"
+#include "utils.h"
+#include <string.h>
+#include <math.h>
+#include <assert.h>
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+const uint32_t k_hll_p = 14;                     // log2 of the register count
+const uint32_t k_hll_q = 64 - k_hll_p;           // hash bits left for the run of zeros
+const size_t k_hll_hdr = 16;
+const size_t k_hll_dense = k_hll_registers * 6 / 8;
+const size_t k_hll_sparse_max = 3000;            // sparse bytes before going dense
+const uint8_t k_hll_sparse_val_max = 32;
+const uint64_t k_hll_seed = 0xadc83b19ull;
+
+enum {
+    HLL_DENSE = 0,
+    HLL_SPARSE = 1,
+};
+
+static void hll_invalidate(std::string &s) {
+    s[15] = (char)((uint8_t)s[15] | 0x80);
+}
+
+static uint8_t dense_get(const uint8_t *r, size_t i) {
+    size_t bit = i * 6;
+    size_t byte = bit >> 3;
+    uint32_t shift = bit & 7;
+
+    uint32_t v = r[byte] >> shift;
+    if(shift > 2) {
+        v |= (uint32_t)r[byte + 1] << (8 - shift);
+    }
+    return (uint8_t)(v & 63);
+}
+
+static void dense_set(uint8_t *r, size_t i, uint8_t val) {
+    size_t bit = i * 6;
+    size_t byte = bit >> 3;
+    uint32_t shift = bit & 7;
+
+    r[byte] = (uint8_t)((r[byte] & ~(63u << shift)) | ((uint32_t)val << shift));
+    if(shift > 2) {
+        uint32_t rest = 8 - shift;
+        r[byte + 1] = (uint8_t)((r[byte + 1] & ~(63u >> rest)) | ((uint32_t)val >> rest));
+    }
+}
+
+// Register index and the position of the first 1 bit of the rest of the hash
+static void hll_hash(const uint8_t *data, size_t len, uint32_t &idx, uint8_t &count) {
+    uint64_t h = hash64(data, len, k_hll_seed);
+    idx = (uint32_t)(h & (k_hll_registers - 1));
+    h >>= k_hll_p;
+    h |= 1ull << k_hll_q;
+    count = (uint8_t)(__builtin_ctzll(h) + 1);
+}
+
+// Walks the sparse opcodes, calling f(first register, run, value, offset, opcode length) for
+// every run until f returns false. Returns false if the opcodes don't cover exactly 16384 registers
+template <typename F>
+static bool sparse_walk(const std::string &s, F f) {
+    const uint8_t *p = (const uint8_t *)s.data();
+    size_t pos = k_hll_hdr, first = 0;
+
+    while(pos < s.size()) {
+        uint8_t op = p[pos];
+        size_t run = 0, oplen = 1;
+        uint8_t val = 0;
+
+        if((op & 0xC0) == 0x00) {
+            run = (op & 0x3F) + 1;
+        } else if((op & 0xC0) == 0x40) {
+            if(pos + 1 >= s.size()) {
+                return false;
+            }
+            run = (((size_t)(op & 0x3F) << 8) | p[pos + 1]) + 1;
+            oplen = 2;
+        } else {
+            val = (uint8_t)(((op >> 2) & 0x1F) + 1);
+            run = (op & 0x3) + 1;
+        }
+
+        if(first + run > k_hll_registers) {
+            return false;
+        }
+        if(!f(first, run, val, pos, oplen)) {
+            return true;
+        }
+
+        first += run;
+        pos += oplen;
+    }
+
+    return first == k_hll_registers;
+}
+
+static void emit_run(std::string &out, uint8_t val, size_t n) {
+    while(n > 0) {
+        if(val == 0 && n > 64) {
+            size_t run = n > k_hll_registers ? k_hll_registers : n;
+            out.push_back((char)(0x40 | ((run - 1) >> 8)));
+            out.push_back((char)((run - 1) & 0xFF));
+            n -= run;
+        } else if(val == 0) {
+            out.push_back((char)(n - 1));
+            n = 0;
+        } else {
+            size_t run = n > 4 ? 4 : n;
+            out.push_back((char)(0x80 | ((val - 1) << 2) | (run - 1)));
+            n -= run;
+        }
+    }
+}
+
+bool hll_valid(const std::string &s) {
+    if(s.size() < k_hll_hdr || 0 != memcmp(s.data(), "HYLL", 4)) {
+        return false;
+    }
+
+    uint8_t enc = (uint8_t)s[4];
+    if(enc == HLL_DENSE) {
+        return s.size() == k_hll_hdr + k_hll_dense;
+    }
+    if(enc == HLL_SPARSE) {
+        return sparse_walk(s, [](size_t, size_t, uint8_t, size_t, size_t) { return true; });
+    }
+    return false;
+}
+
+// An empty HLL: sparse, all registers zero
+void hll_init(std::string &s) {
+    s.assign(k_hll_hdr, '\0');
+    memcpy(&s[0], "HYLL", 4);
+    s[4] = (char)HLL_SPARSE;
+    emit_run(s, 0, k_hll_registers);
+}
+
+#if defined(__x86_64__)
+__attribute__((target("avx2")))
+static void regs_max_avx2(uint8_t *dst, const uint8_t *src) {
+    for(size_t i = 0; i < k_hll_registers; i += 32) {
+        __m256i a = _mm256_loadu_si256((const __m256i *)&dst[i]);
+        __m256i b = _mm256_loadu_si256((const __m256i *)&src[i]);
+        _mm256_storeu_si256((__m256i *)&dst[i], _mm256_max_epu8(a, b));
+    }
+}
+#endif
+
+static void regs_max_scalar(uint8_t *dst, const uint8_t *src) {
+    for(size_t i = 0; i < k_hll_registers; ++i) {
+        dst[i] = dst[i] > src[i] ? dst[i] : src[i];
+    }
+}
+
+static void regs_max(uint8_t *dst, const uint8_t *src) {
+#if defined(__x86_64__)
+    if(cpu_has_avx2()) {
+        return regs_max_avx2(dst, src);
+    }
+#endif
+    regs_max_scalar(dst, src);
+}
+
+// Unpacks 4 registers from every 3 bytes
+static void dense_unpack(const uint8_t *r, uint8_t *regs) {
+    for(size_t i = 0, j = 0; i < k_hll_registers; i += 4, j += 3) {
+        uint32_t b0 = r[j], b1 = r[j + 1], b2 = r[j + 2];
+        regs[i] = (uint8_t)(b0 & 63);
+        regs[i + 1] = (uint8_t)(((b0 >> 6) | (b1 << 2)) & 63);
+        regs[i + 2] = (uint8_t)(((b1 >> 4) | (b2 << 4)) & 63);
+        regs[i + 3] = (uint8_t)(b2 >> 2);
+    }
+}
+
+// regs[i] = max(regs[i], register i of s). s must be valid
+void hll_merge(uint8_t *regs, const std::string &s) {
+    if((uint8_t)s[4] == HLL_DENSE) {
+        uint8_t tmp[k_hll_registers];
+        dense_unpack((const uint8_t *)s.data() + k_hll_hdr, tmp);
+        regs_max(regs, tmp);
+        return;
+    }
+
+    sparse_walk(s, [&](size_t first, size_t run, uint8_t val, size_t, size_t) {
+        for(size_t i = first; val && i < first + run; ++i) {
+            regs[i] = regs[i] > val ? regs[i] : val;
+        }
+        return true;
+    });
+}
+
+// Writes regs out as a dense HLL, with the cardinality left stale
+static void dense_pack(std::string &s, const uint8_t *regs) {
+    s.assign(k_hll_hdr + k_hll_dense, '\0');
+    memcpy(&s[0], "HYLL", 4);
+    s[4] = (char)HLL_DENSE;
+    hll_invalidate(s);
+
+    uint8_t *r = (uint8_t *)&s[k_hll_hdr];
+    for(size_t i = 0, j = 0; i < k_hll_registers; i += 4, j += 3) {
+        r[j] = (uint8_t)(regs[i] | (regs[i + 1] << 6));
+        r[j + 1] = (uint8_t)((regs[i + 1] >> 2) | (regs[i + 2] << 4));
+        r[j + 2] = (uint8_t)((regs[i + 2] >> 4) | (regs[i + 3] << 2));
+    }
+}
+
+// Writes regs out as a dense HLL, with its cardinality cached
+void hll_from_regs(std::string &s, const uint8_t *regs) {
+    dense_pack(s, regs);
+    uint64_t n = hll_count_regs(regs);
+    memcpy(&s[8], &n, 8);
+}
+
+static void hll_to_dense(std::string &s) {
+    uint8_t regs[k_hll_registers] = {};
+    hll_merge(regs, s);
+    dense_pack(s, regs);
+}
+
+// Returns true if a register changed. s must be valid
+bool hll_add(std::string &s, const uint8_t *data, size_t len) {
+    uint32_t idx = 0;
+    uint8_t count = 0;
+    hll_hash(data, len, idx, count);
+
+    if((uint8_t)s[4] == HLL_SPARSE && count > k_hll_sparse_val_max) {
+        hll_to_dense(s);
+    }
+
+    if((uint8_t)s[4] == HLL_DENSE) {
+        uint8_t *r = (uint8_t *)&s[k_hll_hdr];
+        if(dense_get(r, idx) >= count) {
+            return false;
+        }
+        dense_set(r, idx, count);
+        hll_invalidate(s);
+        return true;
+    }
+
+    // Find the opcode covering idx and split it around the new value
+    size_t op_pos = 0, op_len = 0, op_first = 0, op_run = 0;
+    uint8_t op_val = 0;
+    sparse_walk(s, [&](size_t first, size_t run, uint8_t val, size_t pos, size_t oplen) {
+        if(idx >= first + run) {
+            return true;
+        }
+        op_pos = pos, op_len = oplen, op_first = first, op_run = run, op_val = val;
+        return false;
+    });
+    assert(op_len > 0);
+
+    if(op_val >= count) {
+        return false;
+    }
+
+    std::string seq;
+    emit_run(seq, op_val, idx - op_first);
+    emit_run(seq, count, 1);
+    emit_run(seq, op_val, op_first + op_run - 1 - idx);
+    s.replace(op_pos, op_len, seq);
+
+    if(s.size() > k_hll_hdr + k_hll_sparse_max) {
+        hll_to_dense(s);
+    }
+    hll_invalidate(s);
+    return true;
+}
+
+#if defined(__x86_64__)
+// 2^-r is built straight from the float exponent bits: (127 - r) << 23
+__attribute__((target("avx2,popcnt")))
+static double regs_sum_avx2(const uint8_t *regs, size_t &zeros) {
+    __m256d acc_lo = _mm256_setzero_pd(), acc_hi = _mm256_setzero_pd();
+    const __m256i bias = _mm256_set1_epi32(127);
+    size_t nzero = 0;
+
+    for(size_t i = 0; i < k_hll_registers; i += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)&regs[i]);
+        nzero += (size_t)__builtin_popcount((uint32_t)_mm256_movemask_epi8(
+            _mm256_cmpeq_epi8(v, _mm256_setzero_si256())));
+
+        for(size_t k = 0; k < 32; k += 8) {
+            __m256i r = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *)&regs[i + k]));
+            __m256 pow = _mm256_castsi256_ps(_mm256_slli_epi32(_mm256_sub_epi32(bias, r), 23));
+            acc_lo = _mm256_add_pd(acc_lo, _mm256_cvtps_pd(_mm256_castps256_ps128(pow)));
+            acc_hi = _mm256_add_pd(acc_hi, _mm256_cvtps_pd(_mm256_extractf128_ps(pow, 1)));
+        }
+    }
+
+    double lanes[4];
+    _mm256_storeu_pd(lanes, _mm256_add_pd(acc_lo, acc_hi));
+    zeros = nzero;
+    return lanes[0] + lanes[1] + lanes[2] + lanes[3];
+}
+#endif
+
+static double regs_sum_scalar(const uint8_t *regs, size_t &zeros) {
+    double sum = 0;
+    zeros = 0;
+    for(size_t i = 0; i < k_hll_registers; ++i) {
+        sum += ldexp(1.0, -(int)regs[i]);
+        zeros += regs[i] == 0;
+    }
+    return sum;
+}
+
+static double regs_sum(const uint8_t *regs, size_t &zeros) {
+#if defined(__x86_64__)
+    if(cpu_has_avx2()) {
+        return regs_sum_avx2(regs, zeros);
+    }
+#endif
+    return regs_sum_scalar(regs, zeros);
+}
+
+// Raw HLL estimate, with linear counting while registers are still mostly empty
+uint64_t hll_count_regs(const uint8_t *regs) {
+    const double m = (double)k_hll_registers;
+    const double alpha = 0.7213 / (1 + 1.079 / m);
+
+    size_t zeros = 0;
+    double sum = regs_sum(regs, zeros);
+    double est = alpha * m * m / sum;
+
+    if(est <= 2.5 * m && zeros > 0) {
+        est = m * log(m / (double)zeros);
+    }
+    return (uint64_t)llround(est);
+}
+
+// Cardinality of a valid HLL: the cached one unless it is stale. Never writes to s
+uint64_t hll_count(const std::string &s) {
+    const uint8_t *card = (const uint8_t *)&s[8];
+    if(!(card[7] & 0x80)) {
+        uint64_t cached = 0;
+        memcpy(&cached, card, 8);
+        return cached;
+    }
+
+    uint8_t regs[k_hll_registers] = {};
+    hll_merge(regs, s);
+    return hll_count_regs(regs);
+}
@@ -0,0 +1,34 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string>
+
+/*
+
+HyperLogLog, stored in a plain string value:
+    header   "HYLL" - encoding u8 - 3 unused - cached cardinality u64 (top bit set = stale)
+    dense    16384 registers of 6 bits, packed starting from the low bits of each byte
+    sparse   run length opcodes, converted to dense once they pass k_hll_sparse_max bytes
+             ZERO  00xxxxxx           xxxxxx + 1 zero registers
+             XZERO 01xxxxxx yyyyyyyy  xxxxxxyyyyyyyy + 1 zero registers
+             VAL   1vvvvvxx           xx + 1 registers of value vvvvv + 1
+
+    The cached cardinality is written along with the registers by hll_from_regs() (PFMERGE),
+    and marked stale by every change hll_add() makes. Counting only reads it, so PFCOUNT never
+    writes to the value.
+
+    Merges and multi-key counts unpack every HLL into one byte per register, so the max and
+    harmonic sum loops are plain byte arrays the compiler and AVX2 can chew through.
+
+*/
+
+const size_t k_hll_registers = 1 << 14;
+
+bool hll_valid(const std::string &s);
+void hll_init(std::string &s);
+bool hll_add(std::string &s, const uint8_t *data, size_t len);
+uint64_t hll_count(const std::string &s);
+void hll_merge(uint8_t *regs, const std::string &s);
+uint64_t hll_count_regs(const uint8_t *regs);
+void hll_from_regs(std::string &s, const uint8_t *regs);
@@ -0,0 +1,77 @@
+#include "intern.h"
+#include "utils.h"
+#include "memusage.h"
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <mutex>
+#include <vector>
+
+static struct {
+    std::mutex mu;
+    HMap pool;
+    size_t refs = 0;
+    size_t bytes = 0; // the Interned blocks
+} g_intern;
+
+static bool interned_eq(HNode *lhs, HNode *rhs) {
+    Interned *le = container_of(lhs, Interned, node);
+    Interned *re = container_of(rhs, Interned, node);
+    return le->len == re->len && 0 == memcmp(le->data, re->data, le->len);
+}
+
+// Returns the shared copy of data with a reference taken, creating it if needed
+Interned *intern_get(const char *data, size_t len) {
+    assert(len <= UINT32_MAX);
+    // The probe only needs its header and the bytes to compare
+    static thread_local std::vector<uint64_t> scratch;
+    scratch.resize((sizeof(Interned) + len + 7) / 8);
+    Interned *probe = (Interned *)scratch.data();
+    probe->node.next = NULL;
+    probe->node.hcode = str_hash((const uint8_t *)data, len);
+    probe->len = (uint32_t)len;
+    memcpy(probe->data, data, len);
+
+    std::lock_guard<std::mutex> lock(g_intern.mu);
+    g_intern.refs++;
+    if(HNode *node = hm_lookup(&g_intern.pool, &probe->node, &interned_eq)) {
+        Interned *iv = container_of(node, Interned, node);
+        iv->refs++;
+        return iv;
+    }
+
+    Interned *iv = (Interned *)malloc(sizeof(Interned) + len);
+    if(!iv) {
+        abort();
+    }
+    iv->node.next = NULL;
+    iv->node.hcode = probe->node.hcode;
+    iv->refs = 1;
+    iv->len = (uint32_t)len;
+    memcpy(iv->data, data, len);
+    hm_insert(&g_intern.pool, &iv->node);
+    g_intern.bytes += mem_alloc(sizeof(Interned) + len);
+    return iv;
+}
+
+// Drops a reference. The last one takes the value out of the pool and frees it
+void intern_put(Interned *iv) {
+    std::lock_guard<std::mutex> lock(g_intern.mu);
+    g_intern.refs--;
+    if(--iv->refs > 0) {
+        return;
+    }
+
+    HNode *node = hm_pop(&g_intern.pool, &iv->node, &interned_eq);
+    assert(node == &iv->node);
+    (void)node;
+    g_intern.bytes -= mem_alloc(sizeof(Interned) + iv->len);
+    free(iv);
+}
+
+void intern_stats(InternStats *out) {
+    std::lock_guard<std::mutex> lock(g_intern.mu);
+    out->values = hm_size(&g_intern.pool);
+    out->refs = g_intern.refs;
+    out->bytes = g_intern.bytes + mem_hmap(&g_intern.pool);
+}
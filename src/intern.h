@@ -0,0 +1,39 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include "hashtable.h"
+
+/*
+
+Interned values:
+    Medium length string values are stored once and shared by every key holding the same bytes:
+    the entry points at a refcounted Interned instead of owning a copy. Commands that edit a value
+    in place copy it out first (copy on write), and the last reference frees it.
+
+    Shorter values fit in a std::string's inline buffer and ints are stored natively, so both
+    already cost nothing past the entry, and interning them would only add a lookup.
+
+    The pool is an HMap keyed by content, behind a mutex: the snapshot loader threads intern
+    values concurrently.
+
+*/
+
+const size_t k_default_intern_max = 64; // longer values are never interned
+
+struct Interned {
+    HNode node;
+    uint32_t refs;
+    uint32_t len;
+    char data[];
+};
+
+struct InternStats {
+    size_t values = 0;
+    size_t refs = 0;
+    size_t bytes = 0; // the values and the pool's buckets, see mem_alloc()
+};
+
+Interned *intern_get(const char *data, size_t len);
+void intern_put(Interned *iv);
+void intern_stats(InternStats *out);
@@ -0,0 +1,97 @@
+#include "latency.h"
+#include "stats.h"
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+
+static const char *const k_phase_names[PHASE_COUNT] = {"poll", "io", "command", "accept", "aof", "timers"};
+
+const char *lat_phase_name(uint32_t phase) {
+    return phase < PHASE_COUNT ? k_phase_names[phase] : "?";
+}
+
+// -1 if there's no such phase
+int32_t lat_phase_parse(const char *name) {
+    for(uint32_t i = 0; i < PHASE_COUNT; ++i) {
+        if(0 == strcasecmp(name, k_phase_names[i])) {
+            return (int32_t)i;
+        }
+    }
+    return -1;
+}
+
+void lat_loop_start(LatencyMonitor *lat) {
+    memset(lat->cur_ns, 0, sizeof(lat->cur_ns));
+    lat->mark = stats_ticks();
+}
+
+// Ends the phase that has been running since the last mark
+void lat_phase(LatencyMonitor *lat, uint32_t phase) {
+    uint64_t now = stats_ticks();
+    lat->cur_ns[phase] += stats_ticks_to_ns(now - lat->mark);
+    lat->mark = now;
+}
+
+void lat_command(LatencyMonitor *lat, uint64_t ns) {
+    lat->cur_ns[PHASE_CMD] += ns;
+}
+
+void lat_loop_end(LatencyMonitor *lat, bool rehashing) {
+    uint64_t *cur = lat->cur_ns;
+    cur[PHASE_IO] = cur[PHASE_IO] > cur[PHASE_CMD] ? cur[PHASE_IO] - cur[PHASE_CMD] : 0;
+
+    uint64_t busy = 0;
+    uint32_t worst = PHASE_IO;
+    for(uint32_t i = 0; i < PHASE_COUNT; ++i) {
+        if(cur[i]) {
+            hist_record(&lat->phases[i], cur[i]);
+        }
+        if(i != PHASE_POLL) {
+            busy += cur[i];
+            worst = cur[i] > cur[worst] ? i : worst;
+        }
+    }
+    hist_record(&lat->busy, busy);
+
+    if(!lat->threshold_ns || busy < lat->threshold_ns) {
+        return;
+    }
+
+    LatSpike &spike = lat->spikes[lat->head];
+    spike.time = (uint64_t)time(NULL);
+    spike.busy_ns = busy;
+    spike.phase = worst;
+    spike.rehashing = rehashing;
+    memcpy(spike.phase_ns, cur, sizeof(spike.phase_ns));
+    lat->head = (lat->head + 1) % k_lat_spikes;
+    if(lat->nspikes < k_lat_spikes) {
+        lat->nspikes++;
+    }
+
+    lat->last_time[worst] = spike.time;
+    lat->last_ns[worst] = busy;
+    if(busy > lat->max_ns[worst]) {
+        lat->max_ns[worst] = busy;
+    }
+}
+
+// The i-th newest spike, NULL past the end
+const LatSpike *lat_spike(const LatencyMonitor *lat, size_t i) {
+    if(i >= lat->nspikes) {
+        return NULL;
+    }
+    return &lat->spikes[(lat->head + k_lat_spikes - 1 - i) % k_lat_spikes];
+}
+
+// Keeps the threshold
+void lat_reset(LatencyMonitor *lat) {
+    for(Hist &h : lat->phases) {
+        hist_reset(&h);
+    }
+    hist_reset(&lat->busy);
+    lat->head = 0;
+    lat->nspikes = 0;
+    memset(lat->last_time, 0, sizeof(lat->last_time));
+    memset(lat->last_ns, 0, sizeof(lat->last_ns));
+    memset(lat->max_ns, 0, sizeof(lat->max_ns));
+}
@@ -0,0 +1,64 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include "histogram.h"
+
+/*
+
+Event loop latency monitor:
+    Every iteration of the event loop is split into phases, timed by moving a mark along with
+    lat_phase(). Command execution happens inside connection I/O, so it is added separately
+    with lat_command() and taken out of the I/O time at the end of the iteration.
+
+    Each phase has a histogram of its time per iteration (iterations where it did nothing are
+    left out). An iteration whose busy time (everything but waiting in poll) reaches the
+    threshold is a spike: it is kept in a ring with its phase breakdown, and blamed on its
+    longest phase.
+
+*/
+
+enum {
+    PHASE_POLL = 0,   // waiting in poll()
+    PHASE_IO = 1,     // reading requests and writing replies, outside of commands
+    PHASE_CMD = 2,    // running commands
+    PHASE_ACCEPT = 3, // accepting connections
+    PHASE_AOF = 4,    // group commit of the log
+    PHASE_TIMERS = 5, // once-in-a-while work: stats, active rehashing
+    PHASE_COUNT = 6,
+};
+
+const size_t k_lat_spikes = 64;
+
+struct LatSpike {
+    uint64_t time = 0; // unix seconds
+    uint64_t busy_ns = 0;
+    uint32_t phase = 0; // the longest one
+    bool rehashing = false;
+    uint64_t phase_ns[PHASE_COUNT] = {};
+};
+
+struct LatencyMonitor {
+    uint64_t threshold_ns = 0; // 0 records no spikes
+    Hist phases[PHASE_COUNT];
+    Hist busy;
+    // The current iteration
+    uint64_t mark = 0; // stats_ticks() when the current phase started
+    uint64_t cur_ns[PHASE_COUNT] = {};
+    // Spikes, newest at head - 1
+    LatSpike spikes[k_lat_spikes];
+    size_t head = 0;
+    size_t nspikes = 0;
+    uint64_t last_time[PHASE_COUNT] = {}; // latest spike blamed on the phase, unix seconds
+    uint64_t last_ns[PHASE_COUNT] = {};
+    uint64_t max_ns[PHASE_COUNT] = {};
+};
+
+const char *lat_phase_name(uint32_t phase);
+int32_t lat_phase_parse(const char *name);
+void lat_loop_start(LatencyMonitor *lat);
+void lat_phase(LatencyMonitor *lat, uint32_t phase);
+void lat_command(LatencyMonitor *lat, uint64_t ns);
+void lat_loop_end(LatencyMonitor *lat, bool rehashing);
+const LatSpike *lat_spike(const LatencyMonitor *lat, size_t i);
+void lat_reset(LatencyMonitor *lat);
@@ -0,0 +1,245 @@
+#include "list.h"
+#include "memusage.h"
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+const uint32_t k_list_chunk_size = 512; // payload bytes per chunk
+const uint8_t k_list_len_big = 0xFF;    // marks a u32 length
+
+static uint32_t len_size(uint32_t len) {
+    return len < k_list_len_big ? 1 : 1 + 4;
+}
+
+static uint32_t elem_size(uint32_t len) {
+    return 2 * len_size(len) + len;
+}
+
+static LChunk *chunk_new(uint32_t cap, bool front) {
+    LChunk *chunk = (LChunk *)malloc(sizeof(LChunk) + cap);
+    if(!chunk) {
+        abort();
+    }
+
+    chunk->prev = chunk->next = NULL;
+    chunk->count = 0;
+    chunk->cap = cap;
+    // A chunk made for pushes at the front fills from the back, and vice versa
+    chunk->begin = chunk->end = front ? cap : 0;
+    return chunk;
+}
+
+// Reads the element starting at pos
+static void elem_read(const LChunk *chunk, uint32_t pos, const uint8_t **data, uint32_t *len) {
+    const uint8_t *p = &chunk->data[pos];
+    if(p[0] != k_list_len_big) {
+        *len = p[0];
+        *data = p + 1;
+    } else {
+        memcpy(len, p + 1, 4);
+        *data = p + 1 + 4;
+    }
+}
+
+// Returns the start of the element that ends at end
+static uint32_t elem_start_before(const LChunk *chunk, uint32_t end) {
+    const uint8_t *p = &chunk->data[end];
+    uint32_t len = p[-1];
+    if(len == k_list_len_big) {
+        memcpy(&len, p - 1 - 4, 4);
+    }
+    return end - elem_size(len);
+}
+
+static void elem_write(uint8_t *p, const uint8_t *data, uint32_t len) {
+    if(len < k_list_len_big) {
+        *p++ = (uint8_t)len;
+        memcpy(p, data, len);
+        p += len;
+        *p = (uint8_t)len;
+    } else {
+        *p++ = k_list_len_big;
+        memcpy(p, &len, 4);
+        p += 4;
+        memcpy(p, data, len);
+        p += len;
+        memcpy(p, &len, 4);
+        p[4] = k_list_len_big;
+    }
+}
+
+// Makes room for n bytes on one side of the chunk. Moves at most a chunk's worth of bytes.
+static bool chunk_reserve(LChunk *chunk, bool front, uint32_t n) {
+    uint32_t used = chunk->end - chunk->begin;
+    if(chunk->cap - used < n) {
+        return false;
+    }
+
+    if(front && chunk->begin < n) {
+        uint32_t begin = chunk->cap - used;
+        memmove(&chunk->data[begin], &chunk->data[chunk->begin], used);
+        chunk->begin = begin;
+        chunk->end = chunk->cap;
+    } else if(!front && chunk->cap - chunk->end < n) {
+        memmove(&chunk->data[0], &chunk->data[chunk->begin], used);
+        chunk->begin = 0;
+        chunk->end = used;
+    }
+    return true;
+}
+
+void list_push(List *list, bool front, const uint8_t *data, uint32_t len) {
+    uint32_t n = elem_size(len);
+    LChunk *chunk = front ? list->head : list->tail;
+
+    if(!chunk || !chunk_reserve(chunk, front, n)) {
+        // Elements bigger than a chunk get a chunk of their own
+        chunk = chunk_new(n > k_list_chunk_size ? n : k_list_chunk_size, front);
+
+        if(front) {
+            chunk->next = list->head;
+            if(list->head) {
+                list->head->prev = chunk;
+            } else {
+                list->tail = chunk;
+            }
+            list->head = chunk;
+        } else {
+            chunk->prev = list->tail;
+            if(list->tail) {
+                list->tail->next = chunk;
+            } else {
+                list->head = chunk;
+            }
+            list->tail = chunk;
+        }
+        list->nchunks++;
+        list->bytes += mem_alloc(sizeof(LChunk) + chunk->cap);
+    }
+
+    if(front) {
+        chunk->begin -= n;
+        elem_write(&chunk->data[chunk->begin], data, len);
+    } else {
+        elem_write(&chunk->data[chunk->end], data, len);
+        chunk->end += n;
+    }
+
+    chunk->count++;
+    list->len++;
+}
+
+static void chunk_unlink(List *list, LChunk *chunk) {
+    if(chunk->prev) {
+        chunk->prev->next = chunk->next;
+    } else {
+        list->head = chunk->next;
+    }
+
+    if(chunk->next) {
+        chunk->next->prev = chunk->prev;
+    } else {
+        list->tail = chunk->prev;
+    }
+
+    list->nchunks--;
+    list->bytes -= mem_alloc(sizeof(LChunk) + chunk->cap);
+    free(chunk);
+}
+
+bool list_pop(List *list, bool front, std::string &out) {
+    LChunk *chunk = front ? list->head : list->tail;
+    if(!chunk) {
+        return false;
+    }
+
+    uint32_t pos = front ? chunk->begin : elem_start_before(chunk, chunk->end);
+    const uint8_t *data = NULL;
+    uint32_t len = 0;
+    elem_read(chunk, pos, &data, &len);
+    out.assign((const char *)data, len);
+
+    if(front) {
+        chunk->begin += elem_size(len);
+    } else {
+        chunk->end = pos;
+    }
+
+    chunk->count--;
+    list->len--;
+
+    if(chunk->count == 0) {
+        chunk_unlink(list, chunk);
+    }
+    return true;
+}
+
+// Positions the iterator at element idx (0 is the head). Whole chunks are skipped by their count,
+// starting from whichever end of the list is closer.
+bool list_seek(List *list, int64_t idx, ListIter *iter) {
+    if(idx < 0 || (size_t)idx >= list->len) {
+        return false;
+    }
+
+    LChunk *chunk = NULL;
+    size_t first = 0; // index of the first element in chunk
+
+    if((size_t)idx < list->len / 2) {
+        chunk = list->head;
+        while((size_t)idx >= first + chunk->count) {
+            first += chunk->count;
+            chunk = chunk->next;
+        }
+    } else {
+        chunk = list->tail;
+        first = list->len - chunk->count;
+        while((size_t)idx < first) {
+            chunk = chunk->prev;
+            first -= chunk->count;
+        }
+    }
+
+    uint32_t pos = chunk->begin;
+    for(size_t i = first; i < (size_t)idx; ++i) {
+        const uint8_t *data = NULL;
+        uint32_t len = 0;
+        elem_read(chunk, pos, &data, &len);
+        pos += elem_size(len);
+    }
+
+    iter->chunk = chunk;
+    iter->pos = pos;
+    return true;
+}
+
+// Returns the current element and advances towards the tail
+bool list_next(ListIter *iter, const uint8_t **data, uint32_t *len) {
+    while(iter->chunk && iter->pos >= iter->chunk->end) {
+        iter->chunk = iter->chunk->next;
+        iter->pos = iter->chunk ? iter->chunk->begin : 0;
+    }
+
+    if(!iter->chunk) {
+        return false;
+    }
+
+    elem_read(iter->chunk, iter->pos, data, len);
+    iter->pos += elem_size(*len);
+    return true;
+}
+
+void list_destroy(List *list) {
+    LChunk *chunk = list->head;
+    while(chunk) {
+        LChunk *next = chunk->next;
+        free(chunk);
+        chunk = next;
+    }
+
+    *list = List();
+}
+
+// Bytes held by the chunks, not counting the List itself
+size_t list_mem(const List *list) {
+    return list->bytes;
+}
@@ -0,0 +1,48 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string>
+
+/*
+
+List:
+    A doubly linked list of chunks. Each chunk packs its elements back to back:
+
+        len - bytes - backlen
+
+    len and backlen are 1 byte for elements shorter than 255 bytes (0xFF + u32 otherwise), so an
+    element costs 2 bytes on top of its payload, and backlen lets a chunk be walked from the tail.
+    Elements sit in [begin, end) of the chunk's buffer, leaving room on both sides for pushes.
+
+*/
+
+struct LChunk {
+    LChunk *prev;
+    LChunk *next;
+    uint32_t count; // number of elements
+    uint32_t begin; // used bytes are [begin, end)
+    uint32_t end;
+    uint32_t cap;
+    uint8_t data[];
+};
+
+struct List {
+    LChunk *head = NULL;
+    LChunk *tail = NULL;
+    size_t len = 0;
+    size_t nchunks = 0;
+    size_t bytes = 0; // chunk blocks, see mem_alloc()
+};
+
+struct ListIter {
+    LChunk *chunk = NULL;
+    uint32_t pos = 0; // offset of the current element in chunk->data
+};
+
+void list_push(List *list, bool front, const uint8_t *data, uint32_t len);
+bool list_pop(List *list, bool front, std::string &out);
+bool list_seek(List *list, int64_t idx, ListIter *iter);
+bool list_next(ListIter *iter, const uint8_t **data, uint32_t *len);
+void list_destroy(List *list);
+size_t list_mem(const List *list);
@@ -0,0 +1,125 @@
+#include "lzf.h"
+#include <string.h>
+
+const uint32_t k_lzf_hash_bits = 14;
+const size_t k_lzf_max_lit = 32;
+const size_t k_lzf_max_off = 1 << 13;
+const size_t k_lzf_max_ref = 264; // 7 + 255 + 2
+
+static uint32_t lzf_hash(const uint8_t *p) {
+    uint32_t v = (uint32_t)p[0] << 16 | (uint32_t)p[1] << 8 | p[2];
+    return (v * 2654435761u) >> (32 - k_lzf_hash_bits);
+}
+
+// Emits in[start:end] as literal runs. Returns false if out is full
+static bool emit_literals(const uint8_t *in, size_t start, size_t end, uint8_t *out, size_t cap, size_t &op) {
+    while(start < end) {
+        size_t run = end - start < k_lzf_max_lit ? end - start : k_lzf_max_lit;
+        if(op + 1 + run > cap) {
+            return false;
+        }
+        out[op++] = (uint8_t)(run - 1);
+        memcpy(&out[op], &in[start], run);
+        op += run;
+        start += run;
+    }
+    return true;
+}
+
+// Returns the compressed size, or 0 if it doesn't fit in cap bytes
+size_t lzf_compress(const uint8_t *in, size_t len, uint8_t *out, size_t cap) {
+    // Position + 1, 0 is empty. Never cleared: zeroing 64KB costs more than compressing a short
+    // value, and an entry left by an earlier call is only a hint, checked like any other
+    static thread_local uint32_t htab[1 << k_lzf_hash_bits];
+    size_t ip = 0, op = 0, lit = 0;
+
+    while(ip + 3 <= len) {
+        uint32_t h = lzf_hash(&in[ip]);
+        size_t ref = htab[h];
+        htab[h] = (uint32_t)(ip + 1);
+
+        if(ref == 0 || ref - 1 >= ip || ip - (ref - 1) > k_lzf_max_off || memcmp(&in[ref - 1], &in[ip], 3) != 0) {
+            ip++;
+            continue;
+        }
+        ref--;
+
+        size_t max = len - ip < k_lzf_max_ref ? len - ip : k_lzf_max_ref;
+        size_t mlen = 3;
+        while(mlen < max && in[ref + mlen] == in[ip + mlen]) {
+            mlen++;
+        }
+
+        if(!emit_literals(in, lit, ip, out, cap, op) || op + 3 > cap) {
+            return 0;
+        }
+
+        size_t off = ip - ref - 1;
+        size_t l = mlen - 2;
+        if(l < 7) {
+            out[op++] = (uint8_t)((l << 5) | (off >> 8));
+        } else {
+            out[op++] = (uint8_t)((7 << 5) | (off >> 8));
+            out[op++] = (uint8_t)(l - 7);
+        }
+        out[op++] = (uint8_t)(off & 0xFF);
+
+        // Hash the tail of the match so the next repeat can find it
+        ip += mlen;
+        for(size_t p = ip - 2; p < ip && p + 3 <= len; ++p) {
+            htab[lzf_hash(&in[p])] = (uint32_t)(p + 1);
+        }
+        lit = ip;
+    }
+
+    if(!emit_literals(in, lit, len, out, cap, op)) {
+        return 0;
+    }
+    return op;
+}
+
+// Returns the decompressed size, or 0 if the input is corrupt or doesn't fit in cap bytes
+size_t lzf_decompress(const uint8_t *in, size_t len, uint8_t *out, size_t cap) {
+    size_t ip = 0, op = 0;
+
+    while(ip < len) {
+        size_t ctrl = in[ip++];
+
+        if(ctrl < k_lzf_max_lit) {
+            size_t run = ctrl + 1;
+            if(ip + run > len || op + run > cap) {
+                return 0;
+            }
+            memcpy(&out[op], &in[ip], run);
+            ip += run;
+            op += run;
+            continue;
+        }
+
+        size_t l = ctrl >> 5;
+        if(l == 7) {
+            if(ip >= len) {
+                return 0;
+            }
+            l += in[ip++];
+        }
+        if(ip >= len) {
+            return 0;
+        }
+
+        size_t dist = ((ctrl & 0x1F) << 8) + in[ip++] + 1;
+        size_t mlen = l + 2;
+        if(dist > op || op + mlen > cap) {
+            return 0;
+        }
+
+        // Byte by byte: the reference may overlap what it produces
+        const uint8_t *ref = &out[op - dist];
+        for(size_t i = 0; i < mlen; ++i) {
+            out[op + i] = ref[i];
+        }
+        op += mlen;
+    }
+
+    return op;
+}
@@ -0,0 +1,19 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+
+LZF compression (the format of Marc Lehmann's liblzf), written for this tree:
+    000LLLLL <L + 1 literal bytes>       literal run of 1 to 32 bytes
+    LLLooooo oooooooo                    back reference, length L + 2 (L < 7), offset o + 1
+    111ooooo LLLLLLLL oooooooo           back reference, length L + 9
+
+    Offsets reach 8KB back. Fast rather than tight: one hash probe per position, in a per thread
+    table that is reused across calls.
+
+*/
+
+size_t lzf_compress(const uint8_t *in, size_t len, uint8_t *out, size_t cap);
+size_t lzf_decompress(const uint8_t *in, size_t len, uint8_t *out, size_t cap);
@@ -0,0 +1,41 @@
+#include "memusage.h"
+
+const size_t k_malloc_header = 8;
+const size_t k_malloc_align = 16;
+const size_t k_malloc_min = 32;
+const size_t k_mmap_threshold = 128 << 10; // glibc's default, before it adapts
+const size_t k_page_size = 4096;
+
+// Bytes malloc takes for an n byte block. 0 for no block
+size_t mem_alloc(size_t n) {
+    if(n == 0) {
+        return 0;
+    }
+    if(n >= k_mmap_threshold) {
+        return (n + 2 * k_malloc_header + k_page_size - 1) & ~(k_page_size - 1);
+    }
+
+    size_t size = (n + k_malloc_header + k_malloc_align - 1) & ~(k_malloc_align - 1);
+    return size < k_malloc_min ? k_malloc_min : size;
+}
+
+// The heap block of a string, 0 while it fits in the string itself
+size_t mem_str(const std::string &s) {
+    const char *p = s.data();
+    if(p >= (const char *)&s && p < (const char *)(&s + 1)) {
+        return 0;
+    }
+    return mem_alloc(s.capacity() + 1);
+}
+
+// The bucket arrays. Both tables exist while resizing
+size_t mem_hmap(const HMap *hmap) {
+    size_t bytes = 0;
+    if(hmap->h1.tab) {
+        bytes += mem_alloc((hmap->h1.mask + 1) * sizeof(HNode *));
+    }
+    if(hmap->h2.tab) {
+        bytes += mem_alloc((hmap->h2.mask + 1) * sizeof(HNode *));
+    }
+    return bytes;
+}
@@ -0,0 +1,23 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string>
+#include "hashtable.h"
+
+/*
+
+Memory accounting:
+    Sizes are what the allocator takes for a block, not what was asked for: glibc malloc adds an
+    8 byte header, rounds up to 16 bytes with a 32 byte minimum, and hands out whole pages once a
+    block is big enough to be mmap'd. Objects from a slab class cost the class's size. A
+    std::string only costs a block when it outgrows its inline buffer.
+
+    Containers keep a running total of their element blocks as they change, so what a key costs
+    is known without walking it.
+
+*/
+
+size_t mem_alloc(size_t n);
+size_t mem_str(const std::string &s);
+size_t mem_hmap(const HMap *hmap);
@@ -0,0 +1,465 @@
+#include "protocol.h"
+#include "utils.h"
+#include <string.h>
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+static bool is_alpha(uint8_t c) {
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z');
+}
+
+uint32_t proto_detect(const uint8_t *data, size_t len) {
+    if(len == 0) {
+        return PROTO_UNKNOWN;
+    }
+    if(data[0] != '*' && !is_alpha(data[0])) {
+        return PROTO_TLV;
+    }
+    if(len >= 4) {
+        return (data[2] == 0 && data[3] == 0) ? PROTO_TLV : PROTO_RESP2;
+    }
+
+    // A short inline command like "a\r\n"
+    return memchr(data, '\n', len) ? PROTO_RESP2 : PROTO_UNKNOWN;
+}
+
+int32_t parse_req(const uint8_t *data, size_t len, std::vector<std::string> &out)
+{
+    if (len < 4)
+    {
+        return -1;
+    }
+
+    uint32_t n = 0;
+    memcpy(&n, &data[0], 4);
+    if (n > k_max_msg)
+    {
+        return -1;
+    }
+
+    size_t pos = 4;
+    while (n--)
+    {
+        if (pos + 4 > len)
+        {
+            return -1;
+        }
+        uint32_t sz = 0;
+        memcpy(&sz, &data[pos], 4);
+        if (pos + 4 + sz > len)
+        {
+            return -1;
+        }
+
+        out.push_back(std::string((char *)&data[pos + 4], sz));
+        pos += 4 + sz;
+    }
+
+    if (pos != len)
+    {
+        return -1; // There is misc trailing garbage
+    }
+    return 0;
+}
+
+// First '\n' in [p, end), 16 bytes at a time
+static const uint8_t *find_lf(const uint8_t *p, const uint8_t *end) {
+#if defined(__x86_64__)
+    const __m128i lf = _mm_set1_epi8('\n');
+    for(; end - p >= 16; p += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)p);
+        uint32_t mask = (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(v, lf));
+        if(mask) {
+            return p + __builtin_ctz(mask);
+        }
+    }
+#endif
+    return (const uint8_t *)memchr(p, '\n', (size_t)(end - p));
+}
+
+// Parses 1 to 8 decimal digits at once in a 64-bit word: left padded with '0', checked, then
+// combined pairwise into 2, 4 and 8 digit numbers
+static bool parse_len(const uint8_t *p, size_t n, int64_t &out) {
+    if(n == 0 || n > 8) {
+        return false;
+    }
+
+    const uint64_t zeros = 0x3030303030303030ull;
+    const uint64_t high = 0xF0F0F0F0F0F0F0F0ull;
+    uint64_t v = zeros;
+    memcpy((uint8_t *)&v + (8 - n), p, n);
+
+    // Every byte is 0x30..0x3F, and stays under 0x40 after adding 6
+    if((v & high) != zeros || ((v + 0x0606060606060606ull) & high) != zeros) {
+        return false;
+    }
+
+    v -= zeros;
+    v = (v * 10) + (v >> 8);
+    v = (((v & 0x000000FF000000FFull) * (100 + (1000000ull << 32))) +
+         (((v >> 16) & 0x000000FF000000FFull) * (1 + (10000ull << 32)))) >> 32;
+    out = (int64_t)v;
+    return true;
+}
+
+// Reads "<digits>\r\n" at p. Returns 1 and moves p past it, 0 if the line is incomplete
+static int32_t read_num_line(const uint8_t *&p, const uint8_t *end, int64_t &out) {
+    const uint8_t *lf = find_lf(p, end);
+    if(!lf) {
+        return 0;
+    }
+    if(lf == p || lf[-1] != '\r' || !parse_len(p, (size_t)(lf - 1 - p), out)) {
+        return -1;
+    }
+    p = lf + 1;
+    return 1;
+}
+
+static int32_t inline_parse(const uint8_t *data, size_t len, std::vector<std::string> &out, size_t *used) {
+    const uint8_t *lf = find_lf(data, data + len);
+    if(!lf) {
+        return 0;
+    }
+
+    const uint8_t *end = (lf > data && lf[-1] == '\r') ? lf - 1 : lf;
+    const uint8_t *p = data;
+    while(p < end) {
+        while(p < end && (*p == ' ' || *p == '\t')) {
+            p++;
+        }
+        const uint8_t *word = p;
+        while(p < end && *p != ' ' && *p != '\t') {
+            p++;
+        }
+        if(p > word) {
+            out.push_back(std::string((const char *)word, (size_t)(p - word)));
+        }
+    }
+
+    *used = (size_t)(lf + 1 - data);
+    return 1;
+}
+
+// Returns 1 with a command in out, 0 if more bytes are needed, -1 on bad input. An empty
+// inline line gives an empty command
+int32_t resp_parse(const uint8_t *data, size_t len, std::vector<std::string> &out, size_t *used) {
+    out.clear();
+    if(len == 0) {
+        return 0;
+    }
+    if(data[0] != '*') {
+        return inline_parse(data, len, out, used);
+    }
+
+    const uint8_t *p = data + 1, *end = data + len;
+    int64_t n = 0;
+    int32_t rv = read_num_line(p, end, n);
+    if(rv <= 0) {
+        return rv;
+    }
+    if((size_t)n > k_max_msg) {
+        return -1;
+    }
+
+    for(int64_t i = 0; i < n; ++i) {
+        if(p >= end) {
+            return 0;
+        }
+        if(*p++ != '$') {
+            return -1;
+        }
+
+        int64_t blen = 0;
+        rv = read_num_line(p, end, blen);
+        if(rv <= 0) {
+            return rv;
+        }
+        if((size_t)blen > k_max_msg) {
+            return -1;
+        }
+        if(end - p < blen + 2) {
+            return 0;
+        }
+        if(p[blen] != '\r' || p[blen + 1] != '\n') {
+            return -1;
+        }
+
+        out.push_back(std::string((const char *)p, (size_t)blen));
+        p += blen + 2;
+    }
+
+    *used = (size_t)(p - data);
+    return 1;
+}
+
+// Starts a reply at the beginning of buf
+void out_begin(Writer &w, uint32_t proto, uint8_t *buf, size_t cap) {
+    w.proto = proto;
+    w.buf = buf;
+    w.cap = cap;
+    w.len = w.total = 0;
+    w.overflow = false;
+    w.nrefs = 0;
+
+    if(proto == PROTO_TLV) {
+        w.len = w.total = 4;
+    }
+}
+
+// Finishes the reply. Returns false if it didn't fit, leaving the buffer in an undefined state
+bool out_end(Writer &w) {
+    if(w.overflow) {
+        return false;
+    }
+
+    if(w.proto == PROTO_TLV) {
+        uint32_t len = (uint32_t)(w.total - 4);
+        memcpy(w.buf, &len, 4);
+    }
+    return true;
+}
+
+// Copies the referenced values into buf, from the last one back so every move is done once
+void out_materialize(Writer &w) {
+    size_t end = w.total;
+    size_t src_end = w.len;
+    for(size_t i = w.nrefs; i-- > 0;) {
+        const WriterRef &ref = w.refs[i];
+        size_t tail = src_end - ref.pos;
+        memmove(w.buf + end - tail, w.buf + ref.pos, tail);
+        end -= tail;
+        memcpy(w.buf + end - ref.len, ref.data, ref.len);
+        end -= ref.len;
+        src_end = ref.pos;
+    }
+
+    w.len = w.total;
+    w.nrefs = 0;
+}
+
+// Fills iov with the reply minus its first skip bytes. Returns the number of entries used
+size_t out_iov(const Writer &w, size_t skip, struct iovec *iov, size_t max) {
+    size_t n = 0, pos = 0;
+    for(size_t i = 0; i <= w.nrefs && n < max; ++i) {
+        // Bytes of buf before the next reference (or up to the end), then the reference
+        size_t upto = i < w.nrefs ? w.refs[i].pos : w.len;
+        const uint8_t *parts[2] = {w.buf + pos, i < w.nrefs ? w.refs[i].data : NULL};
+        size_t lens[2] = {upto - pos, i < w.nrefs ? w.refs[i].len : 0};
+        pos = upto;
+
+        for(size_t k = 0; k < 2 && n < max; ++k) {
+            if(skip >= lens[k]) {
+                skip -= lens[k];
+                continue;
+            }
+            iov[n].iov_base = (void *)(parts[k] + skip);
+            iov[n].iov_len = lens[k] - skip;
+            skip = 0;
+            n++;
+        }
+    }
+    return n;
+}
+
+static void out_put(Writer &w, const void *data, size_t len) {
+    if(w.overflow || w.total + len > w.cap) {
+        w.overflow = true;
+        return;
+    }
+    memcpy(w.buf + w.len, data, len);
+    w.len += len;
+    w.total += len;
+}
+
+// type, decimal v, CRLF
+static void resp_num(Writer &w, char type, int64_t v) {
+    char buf[1 + k_int_digits + 2];
+    buf[0] = type;
+    uint32_t len = 1 + int_format(v, buf + 1);
+    buf[len++] = '\r';
+    buf[len++] = '\n';
+    out_put(w, buf, len);
+}
+
+void out_nil(Writer &w) {
+    if(w.proto == PROTO_TLV) {
+        uint8_t type = SER_NIL;
+        return out_put(w, &type, 1);
+    }
+    if(w.proto == PROTO_RESP3) {
+        return out_put(w, "_\r\n", 3);
+    }
+    out_put(w, "$-1\r\n", 5);
+}
+
+// The header of a string: tag and length, or "$<len>\r\n"
+static void str_head(Writer &w, uint32_t len) {
+    if(w.proto != PROTO_TLV) {
+        return resp_num(w, '$', len);
+    }
+
+    uint8_t head[5];
+    head[0] = SER_STR;
+    memcpy(&head[1], &len, 4);
+    out_put(w, head, 5);
+}
+
+static void str_tail(Writer &w) {
+    if(w.proto != PROTO_TLV) {
+        out_put(w, "\r\n", 2);
+    }
+}
+
+void out_str(Writer &w, const uint8_t *data, uint32_t len) {
+    str_head(w, len);
+    out_put(w, data, len);
+    str_tail(w);
+}
+
+void out_str(Writer &w, const std::string &val) {
+    out_str(w, (const uint8_t *)val.data(), (uint32_t)val.size());
+}
+
+// Like out_str, but long values are sent from data itself. data must stay unchanged until the
+// reply is sent or materialized
+void out_str_ref(Writer &w, const uint8_t *data, uint32_t len) {
+    if(len < k_ref_min || w.nrefs == k_max_refs) {
+        return out_str(w, data, len);
+    }
+
+    str_head(w, len);
+    if(w.overflow || w.total + len > w.cap) {
+        w.overflow = true;
+        return;
+    }
+    w.refs[w.nrefs++] = WriterRef{w.len, data, len};
+    w.total += len;
+    str_tail(w);
+}
+
+// Writes a string of len bytes and returns where they go, for the caller to fill in (NULL on overflow)
+uint8_t *out_str_space(Writer &w, uint32_t len) {
+    str_head(w, len);
+    if(w.overflow || w.total + len > w.cap) {
+        w.overflow = true;
+        return NULL;
+    }
+    uint8_t *space = w.buf + w.len;
+    w.len += len;
+    w.total += len;
+    str_tail(w);
+    return w.overflow ? NULL : space;
+}
+
+void out_int(Writer &w, int64_t val) {
+    if(w.proto != PROTO_TLV) {
+        return resp_num(w, ':', val);
+    }
+
+    uint8_t buf[9];
+    buf[0] = SER_INT;
+    memcpy(&buf[1], &val, 8);
+    out_put(w, buf, 9);
+}
+
+void out_dbl(Writer &w, double val) {
+    if(w.proto == PROTO_TLV) {
+        uint8_t buf[9];
+        buf[0] = SER_DBL;
+        memcpy(&buf[1], &val, 8);
+        return out_put(w, buf, 9);
+    }
+
+    char buf[k_dbl_digits];
+    uint32_t len = dbl_format(val, buf);
+    if(w.proto == PROTO_RESP2) {
+        return out_str(w, (const uint8_t *)buf, len);
+    }
+    out_put(w, ",", 1);
+    out_put(w, buf, len);
+    out_put(w, "\r\n", 2);
+}
+
+// The first word of a RESP error, which clients switch on
+static const char *err_word(int32_t code) {
+    switch(code) {
+        case ERR_TYPE:
+            return "WRONGTYPE";
+        case ERR_READONLY:
+            return "READONLY";
+        case ERR_NOPROTO:
+            return "NOPROTO";
+        default:
+            return "ERR";
+    }
+}
+
+void out_err(Writer &w, int32_t code, const std::string &msg) {
+    if(w.proto != PROTO_TLV) {
+        const char *word = err_word(code);
+        out_put(w, "-", 1);
+        out_put(w, word, strlen(word));
+        out_put(w, " ", 1);
+        out_put(w, msg.data(), msg.size());
+        return out_put(w, "\r\n", 2);
+    }
+
+    uint8_t head[9];
+    uint32_t len = (uint32_t)msg.size();
+    head[0] = SER_ERR;
+    memcpy(&head[1], &code, 4);
+    memcpy(&head[5], &len, 4);
+    out_put(w, head, 9);
+    out_put(w, msg.data(), msg.size());
+}
+
+void out_arr(Writer &w, uint32_t n) {
+    if(w.proto != PROTO_TLV) {
+        return resp_num(w, '*', n);
+    }
+
+    uint8_t head[5];
+    head[0] = SER_ARR;
+    memcpy(&head[1], &n, 4);
+    out_put(w, head, 5);
+}
+
+// An array that is out of band data (Pub/Sub) in RESP3
+void out_push(Writer &w, uint32_t n) {
+    if(w.proto == PROTO_RESP3) {
+        return resp_num(w, '>', n);
+    }
+    out_arr(w, n);
+}
+
+// n replies for one request, like (UN)SUBSCRIBE's. TLV has one reply per request, so they
+// go in an array
+void out_split(Writer &w, uint32_t n) {
+    if(w.proto == PROTO_TLV) {
+        out_arr(w, n);
+    }
+}
+
+// The number of items, out of n, that still fit in the reply behind an array header. put(w, i, arg)
+// writes item i. They are written into a scratch reply to measure them
+size_t out_fit(const Writer &w, size_t n, void (*put)(Writer &, size_t, void *), void *arg) {
+    const size_t k_arr_head = 16; // "*4294967295\r\n"
+    if(w.overflow || w.total + k_arr_head >= w.cap) {
+        return 0;
+    }
+
+    std::vector<uint8_t> scratch(w.cap - w.total - k_arr_head);
+    Writer probe;
+    out_begin(probe, w.proto, scratch.data(), scratch.size());
+    probe.len = probe.total = 0;
+
+    size_t fit = 0;
+    for(; fit < n; ++fit) {
+        put(probe, fit, arg);
+        if(probe.overflow) {
+            break;
+        }
+    }
+    return fit;
+}
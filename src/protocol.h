@@ -0,0 +1,90 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string>
+#include <vector>
+#include <sys/uio.h>
+
+/*
+
+Wire protocols, picked per connection from its first bytes:
+    TLV    len u32 - nstr u32 - (len u32 - bytes)*, replies tagged with SER_* (utils.h)
+    RESP   "*2\r\n$3\r\nGET\r\n$1\r\nk\r\n" multibulk, or inline "GET k\r\n"
+
+    A TLV header is a length <= k_max_msg, so its 3rd and 4th bytes are zero. RESP is text.
+    Connections start as RESP2 and switch to RESP3 with HELLO 3.
+
+    Replies are written by a Writer straight into the connection's write buffer, in the
+    connection's protocol. A TLV reply starts with its 4 byte length, patched in by out_end().
+    Long values that stay put until the reply is sent (entry values) are referenced instead of
+    copied and go out with writev(). If the reply can't be sent right away, out_materialize()
+    copies them into the buffer, which always has room: references count against its size.
+
+    A reply has to fit in one message. Commands that list a variable number of records use
+    out_fit() to send as many as fit, instead of failing with "Response is too big".
+
+    Errors carry an ERR_* code. TLV sends the number, RESP the Redis word for it
+    ("-WRONGTYPE ...", "-READONLY ..."), or ERR when there is none.
+
+*/
+
+const size_t k_max_msg = 4096;
+
+enum {
+    ERR_UNKNOWN = 1,
+    ERR_2BIG = 2,
+    ERR_TYPE = 3,
+    ERR_ARG = 4,
+    ERR_READONLY = 5, // write to a replica
+    ERR_NOPROTO = 6,  // HELLO with a version that isn't spoken
+};
+
+enum {
+    PROTO_UNKNOWN = 0, // not enough bytes yet
+    PROTO_TLV = 1,
+    PROTO_RESP2 = 2,
+    PROTO_RESP3 = 3,
+};
+
+uint32_t proto_detect(const uint8_t *data, size_t len);
+int32_t parse_req(const uint8_t *data, size_t len, std::vector<std::string> &out);
+int32_t resp_parse(const uint8_t *data, size_t len, std::vector<std::string> &out, size_t *used);
+
+const size_t k_max_refs = 8;  // referenced values per reply. Past that they are copied
+const size_t k_ref_min = 256; // shorter values are always copied
+
+struct WriterRef {
+    size_t pos; // offset in buf the value goes in front of
+    const uint8_t *data;
+    size_t len;
+};
+
+struct Writer {
+    uint32_t proto = PROTO_TLV;
+    uint8_t *buf = NULL;
+    size_t cap = 0;
+    size_t len = 0;   // bytes in buf
+    size_t total = 0; // bytes of the reply, counting the references
+    bool overflow = false;
+    size_t nrefs = 0;
+    WriterRef refs[k_max_refs];
+};
+
+void out_begin(Writer &w, uint32_t proto, uint8_t *buf, size_t cap);
+bool out_end(Writer &w);
+void out_materialize(Writer &w);
+size_t out_iov(const Writer &w, size_t skip, struct iovec *iov, size_t max);
+
+void out_nil(Writer &w);
+void out_str(Writer &w, const std::string &val);
+void out_str(Writer &w, const uint8_t *data, uint32_t len);
+void out_str_ref(Writer &w, const uint8_t *data, uint32_t len);
+uint8_t *out_str_space(Writer &w, uint32_t len);
+void out_int(Writer &w, int64_t val);
+void out_dbl(Writer &w, double val);
+void out_err(Writer &w, int32_t code, const std::string &msg);
+void out_arr(Writer &w, uint32_t n);
+void out_push(Writer &w, uint32_t n);
+void out_split(Writer &w, uint32_t n);
+size_t out_fit(const Writer &w, size_t n, void (*put)(Writer &, size_t, void *), void *arg);
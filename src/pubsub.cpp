@@ -0,0 +1,210 @@
+#include "pubsub.h"
+#include "utils.h"
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+
+MsgBuf *msgbuf_new(const uint8_t *data, size_t len) {
+    MsgBuf *buf = (MsgBuf *)malloc(sizeof(MsgBuf) + len);
+    if(!buf) {
+        abort();
+    }
+
+    buf->refs = 1;
+    buf->len = (uint32_t)len;
+    memcpy(buf->data, data, len);
+    return buf;
+}
+
+void msgbuf_ref(MsgBuf *buf) {
+    buf->refs++;
+}
+
+void msgbuf_unref(MsgBuf *buf) {
+    if(--buf->refs == 0) {
+        free(buf);
+    }
+}
+
+static bool channel_eq(HNode *lhs, HNode *rhs) {
+    Channel *lc = container_of(lhs, Channel, node);
+    Channel *rc = container_of(rhs, Channel, node);
+    return lc->name == rc->name;
+}
+
+static HNode *channel_find(PubSub *ps, const std::string &name, bool pop) {
+    Channel probe;
+    probe.name = name;
+    probe.node.hcode = str_hash((const uint8_t *)name.data(), name.size());
+    return pop ? hm_pop(&ps->channels, &probe.node, &channel_eq) : hm_lookup(&ps->channels, &probe.node, &channel_eq);
+}
+
+// Swap-removes sub. Delivery order between subscribers doesn't matter
+static bool subs_remove(std::vector<void *> &subs, void *sub) {
+    auto it = std::find(subs.begin(), subs.end(), sub);
+    if(it == subs.end()) {
+        return false;
+    }
+    *it = subs.back();
+    subs.pop_back();
+    return true;
+}
+
+// Returns true if sub wasn't subscribed to channel yet
+bool ps_subscribe(PubSub *ps, const std::string &channel, void *sub) {
+    HNode *node = channel_find(ps, channel, false);
+    Channel *ch = NULL;
+    if(node) {
+        ch = container_of(node, Channel, node);
+        if(std::find(ch->subs.begin(), ch->subs.end(), sub) != ch->subs.end()) {
+            return false;
+        }
+    } else {
+        ch = new Channel();
+        ch->name = channel;
+        ch->node.hcode = str_hash((const uint8_t *)channel.data(), channel.size());
+        hm_insert(&ps->channels, &ch->node);
+    }
+
+    ch->subs.push_back(sub);
+    return true;
+}
+
+// Channels without subscribers are dropped
+bool ps_unsubscribe(PubSub *ps, const std::string &channel, void *sub) {
+    HNode *node = channel_find(ps, channel, false);
+    if(!node) {
+        return false;
+    }
+
+    Channel *ch = container_of(node, Channel, node);
+    if(!subs_remove(ch->subs, sub)) {
+        return false;
+    }
+    if(ch->subs.empty()) {
+        channel_find(ps, channel, true);
+        delete ch;
+    }
+    return true;
+}
+
+bool ps_psubscribe(PubSub *ps, const std::string &pattern, void *sub) {
+    for(Pattern &p : ps->patterns) {
+        if(p.pattern != pattern) {
+            continue;
+        }
+        if(std::find(p.subs.begin(), p.subs.end(), sub) != p.subs.end()) {
+            return false;
+        }
+        p.subs.push_back(sub);
+        return true;
+    }
+
+    ps->patterns.push_back(Pattern{pattern, {sub}});
+    return true;
+}
+
+bool ps_punsubscribe(PubSub *ps, const std::string &pattern, void *sub) {
+    for(size_t i = 0; i < ps->patterns.size(); ++i) {
+        Pattern &p = ps->patterns[i];
+        if(p.pattern != pattern) {
+            continue;
+        }
+        if(!subs_remove(p.subs, sub)) {
+            return false;
+        }
+        if(p.subs.empty()) {
+            ps->patterns.erase(ps->patterns.begin() + i);
+        }
+        return true;
+    }
+    return false;
+}
+
+// Calls f with the channel's subscribers (pattern NULL), then once for every matching pattern
+void ps_publish(PubSub *ps, const std::string &channel,
+                void (*f)(const std::string *pattern, const std::vector<void *> &subs, void *arg), void *arg) {
+    HNode *node = channel_find(ps, channel, false);
+    if(node) {
+        f(NULL, container_of(node, Channel, node)->subs, arg);
+    }
+
+    for(const Pattern &p : ps->patterns) {
+        if(glob_match(p.pattern.data(), p.pattern.size(), channel.data(), channel.size())) {
+            f(&p.pattern, p.subs, arg);
+        }
+    }
+}
+
+// Matches a [...] class at pat[0] == '['. Sets *plen to the length of the class
+static bool class_match(const char *pat, size_t avail, size_t *plen, char c) {
+    size_t i = 1;
+    bool negate = i < avail && pat[i] == '^';
+    i += negate;
+
+    bool found = false;
+    for(; i < avail && pat[i] != ']'; ++i) {
+        if(pat[i] == '\\' && i + 1 < avail) {
+            found = found || pat[++i] == c;
+        } else if(i + 2 < avail && pat[i + 1] == '-' && pat[i + 2] != ']') {
+            char lo = pat[i], hi = pat[i + 2];
+            if(lo > hi) {
+                std::swap(lo, hi);
+            }
+            found = found || (c >= lo && c <= hi);
+            i += 2;
+        } else {
+            found = found || pat[i] == c;
+        }
+    }
+
+    *plen = i < avail ? i + 1 : avail;
+    return found != negate;
+}
+
+// Glob style matching: * ? [abc] [^a-z] and \ escapes. Backtracks to the last * only
+bool glob_match(const char *pat, size_t plen, const char *str, size_t slen) {
+    size_t p = 0, s = 0;
+    size_t star_p = (size_t)-1, star_s = 0;
+
+    while(s < slen) {
+        if(p < plen && pat[p] == '*') {
+            star_p = p++;
+            star_s = s;
+            continue;
+        }
+
+        if(p < plen) {
+            size_t step = 1;
+            bool ok = false;
+            if(pat[p] == '?') {
+                ok = true;
+            } else if(pat[p] == '[') {
+                ok = class_match(pat + p, plen - p, &step, str[s]);
+            } else if(pat[p] == '\\' && p + 1 < plen) {
+                ok = pat[p + 1] == str[s];
+                step = 2;
+            } else {
+                ok = pat[p] == str[s];
+            }
+
+            if(ok) {
+                p += step;
+                s++;
+                continue;
+            }
+        }
+
+        // Mismatch: let the last * swallow one more byte
+        if(star_p == (size_t)-1) {
+            return false;
+        }
+        p = star_p + 1;
+        s = ++star_s;
+    }
+
+    while(p < plen && pat[p] == '*') {
+        p++;
+    }
+    return p == plen;
+}
@@ -0,0 +1,54 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string>
+#include <vector>
+#include "hashtable.h"
+
+/*
+
+Pub/Sub registry:
+    channel name -> subscribers, in an HMap
+    pattern      -> subscribers, in a list matched against every published channel
+
+    Subscribers are opaque pointers (the server's connections). A published message is
+    serialized once per channel and once per matching pattern into a MsgBuf, and the same
+    MsgBuf is queued on every receiving connection.
+
+*/
+
+// A complete reply frame, as it goes on the wire, shared by every output queue holding it
+struct MsgBuf {
+    uint32_t refs;
+    uint32_t len;
+    uint8_t data[];
+};
+
+MsgBuf *msgbuf_new(const uint8_t *data, size_t len);
+void msgbuf_ref(MsgBuf *buf);
+void msgbuf_unref(MsgBuf *buf);
+
+struct Channel {
+    HNode node;
+    std::string name;
+    std::vector<void *> subs;
+};
+
+struct Pattern {
+    std::string pattern;
+    std::vector<void *> subs;
+};
+
+struct PubSub {
+    HMap channels;
+    std::vector<Pattern> patterns;
+};
+
+bool ps_subscribe(PubSub *ps, const std::string &channel, void *sub);
+bool ps_unsubscribe(PubSub *ps, const std::string &channel, void *sub);
+bool ps_psubscribe(PubSub *ps, const std::string &pattern, void *sub);
+bool ps_punsubscribe(PubSub *ps, const std::string &pattern, void *sub);
+void ps_publish(PubSub *ps, const std::string &channel,
+                void (*f)(const std::string *pattern, const std::vector<void *> &subs, void *arg), void *arg);
+bool glob_match(const char *pat, size_t plen, const char *str, size_t slen);
@@ -0,0 +1,83 @@
+#include "reclaim.h"
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <pthread.h>
+#include <sched.h>
+
+struct ReclaimJob {
+    ReclaimFn fn;
+    void *arg;
+};
+
+static struct {
+    ReclaimJob ring[k_reclaim_queue];
+    std::atomic<size_t> head{0}; // next job to run. Only the reclaim thread moves it
+    std::atomic<size_t> tail{0}; // next free slot. Only the producer moves it
+    std::atomic<bool> sleeping{false};
+    std::atomic<uint64_t> done{0};
+    std::mutex mu;
+    std::condition_variable cv;
+    bool started = false;
+} g_reclaim;
+
+static void reclaim_main() {
+#if defined(SCHED_BATCH)
+    // Not woken ahead of the event loop: on a busy core, a push shouldn't cost the producer the
+    // rest of its time slice
+    struct sched_param param = {};
+    pthread_setschedparam(pthread_self(), SCHED_BATCH, &param);
+#endif
+
+    while(true) {
+        size_t head = g_reclaim.head.load(std::memory_order_relaxed);
+        if(head == g_reclaim.tail.load()) {
+            // sleeping is set before tail is checked again, and a push stores tail before it
+            // checks sleeping, so one of the two sees the other
+            std::unique_lock<std::mutex> lock(g_reclaim.mu);
+            g_reclaim.sleeping.store(true);
+            g_reclaim.cv.wait(lock, [head] { return head != g_reclaim.tail.load(); });
+            g_reclaim.sleeping.store(false);
+            continue;
+        }
+
+        ReclaimJob job = g_reclaim.ring[head % k_reclaim_queue];
+        job.fn(job.arg);
+        g_reclaim.head.store(head + 1, std::memory_order_release);
+        g_reclaim.done.fetch_add(1, std::memory_order_relaxed);
+    }
+}
+
+void reclaim_start() {
+    if(g_reclaim.started) {
+        return;
+    }
+    std::thread(reclaim_main).detach();
+    g_reclaim.started = true;
+}
+
+// Queues fn(arg) for the reclaim thread. Only call it from one thread. false if it can't be
+// queued: the caller runs it
+bool reclaim_push(ReclaimFn fn, void *arg) {
+    size_t tail = g_reclaim.tail.load(std::memory_order_relaxed);
+    if(!g_reclaim.started || tail - g_reclaim.head.load(std::memory_order_acquire) == k_reclaim_queue) {
+        return false;
+    }
+
+    g_reclaim.ring[tail % k_reclaim_queue] = ReclaimJob{fn, arg};
+    g_reclaim.tail.store(tail + 1);
+    if(g_reclaim.sleeping.load()) {
+        std::lock_guard<std::mutex> lock(g_reclaim.mu);
+        g_reclaim.cv.notify_one();
+    }
+    return true;
+}
+
+size_t reclaim_pending() {
+    return g_reclaim.tail.load(std::memory_order_relaxed) - g_reclaim.head.load(std::memory_order_relaxed);
+}
+
+uint64_t reclaim_done() {
+    return g_reclaim.done.load(std::memory_order_relaxed);
+}
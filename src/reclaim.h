@@ -0,0 +1,30 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+
+Background reclamation:
+    Tearing down a big value (a list of many chunks, a hash or set of many nodes, a whole
+    keyspace) is handed to one reclaim thread, so the event loop doesn't stall on it. The value
+    must already be unreachable from the keyspace.
+
+    Jobs go through a lock-free single producer, single consumer ring: the event loop pushes,
+    the reclaim thread pops. The reclaim thread only takes a mutex to sleep when the ring is
+    empty, and a push only takes it to wake the thread up. When the thread isn't running or
+    the ring is full, reclaim_push() fails and the caller frees inline.
+
+    Whatever a job frees must be safe to free off the event loop thread: the allocators and
+    the memory counters it touches are thread-safe for the snapshot loader already.
+
+*/
+
+const size_t k_reclaim_queue = 1 << 16; // jobs in flight
+
+typedef void (*ReclaimFn)(void *arg);
+
+void reclaim_start();
+bool reclaim_push(ReclaimFn fn, void *arg);
+size_t reclaim_pending();
+uint64_t reclaim_done();
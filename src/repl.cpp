@@ -0,0 +1,191 @@
+#include "repl.h"
+#include "aof.h"
+#include "utils.h"
+#include "protocol.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <random>
+
+const int k_repl_timeout_sec = 60; // per connect, read and write of the handshake
+
+void backlog_init(ReplBacklog *bl, size_t size, uint64_t offset) {
+    bl->buf.assign(size, 0);
+    bl->start = bl->end = offset;
+}
+
+bool backlog_enabled(const ReplBacklog *bl) {
+    return !bl->buf.empty();
+}
+
+void backlog_append(ReplBacklog *bl, const uint8_t *data, size_t len) {
+    size_t size = bl->buf.size();
+    if(len > size) {
+        // Only the tail fits
+        bl->end += len - size;
+        data += len - size;
+        len = size;
+    }
+
+    size_t pos = bl->end % size;
+    size_t first = len < size - pos ? len : size - pos;
+    memcpy(&bl->buf[pos], data, first);
+    memcpy(&bl->buf[0], data + first, len - first);
+    bl->end += len;
+    if(bl->end - bl->start > size) {
+        bl->start = bl->end - size;
+    }
+}
+
+// Copies the stream from offset from up to the newest byte. false if it isn't held anymore
+bool backlog_read(const ReplBacklog *bl, uint64_t from, std::string &out) {
+    if(!backlog_enabled(bl) || from < bl->start || from > bl->end) {
+        return false;
+    }
+
+    size_t size = bl->buf.size();
+    size_t len = (size_t)(bl->end - from);
+    size_t pos = from % size;
+    size_t first = len < size - pos ? len : size - pos;
+    out.assign((const char *)&bl->buf[pos], first);
+    out.append((const char *)&bl->buf[0], len - first);
+    return true;
+}
+
+// 40 random hex digits
+std::string repl_new_id() {
+    static const char k_hex[] = "0123456789abcdef";
+    std::random_device rd;
+    std::string id(40, '0');
+    for(char &c : id) {
+        c = k_hex[rd() & 15];
+    }
+    return id;
+}
+
+// Connects with blocking I/O and timeouts. Returns the fd, -1 on error
+int repl_connect(const char *host, uint16_t port) {
+    struct addrinfo hints = {};
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    struct addrinfo *res = NULL;
+    char service[8];
+    snprintf(service, sizeof(service), "%u", (unsigned)port);
+    if(0 != getaddrinfo(host, service, &hints, &res)) {
+        return -1;
+    }
+
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if(fd >= 0) {
+        struct timeval tv = {k_repl_timeout_sec, 0};
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+        if(0 != connect(fd, res->ai_addr, res->ai_addrlen)) {
+            close(fd);
+            fd = -1;
+        }
+    }
+    freeaddrinfo(res);
+    return fd;
+}
+
+static int32_t read_full(int fd, uint8_t *buf, size_t n) {
+    while(n > 0) {
+        ssize_t rv = read(fd, buf, n);
+        if(rv < 0 && errno == EINTR) {
+            continue;
+        }
+        if(rv <= 0) {
+            return -1;
+        }
+        n -= (size_t)rv;
+        buf += rv;
+    }
+    return 0;
+}
+
+static int32_t write_full(int fd, const uint8_t *buf, size_t n) {
+    while(n > 0) {
+        ssize_t rv = write(fd, buf, n);
+        if(rv < 0 && errno == EINTR) {
+            continue;
+        }
+        if(rv <= 0) {
+            return -1;
+        }
+        n -= (size_t)rv;
+        buf += rv;
+    }
+    return 0;
+}
+
+// Sends PSYNC and parses the reply. Nothing after the reply is read
+int32_t repl_handshake(int fd, const std::string &replid, int64_t offset, ReplSync *out) {
+    std::string req;
+    aof_encode(req, {"psync", replid, std::to_string(offset)});
+    if(0 != write_full(fd, (const uint8_t *)req.data(), req.size())) {
+        return -1;
+    }
+
+    uint32_t len = 0;
+    uint8_t body[k_max_msg];
+    if(0 != read_full(fd, (uint8_t *)&len, 4) || len > k_max_msg || len < 1 || 0 != read_full(fd, body, len)) {
+        return -1;
+    }
+
+    uint32_t slen = 0;
+    if(len >= 9 && body[0] == SER_ERR) {
+        memcpy(&slen, &body[5], 4);
+        fprintf(stderr, "PSYNC refused: %.*s\n", (int)min(slen, len - 9), (const char *)&body[9]);
+        return -1;
+    }
+    if(len < 5 || body[0] != SER_STR) {
+        return -1;
+    }
+    memcpy(&slen, &body[1], 4);
+    if(slen > len - 5) {
+        return -1;
+    }
+
+    std::string reply((const char *)&body[5], slen);
+    char kind[16], id[48];
+    unsigned long long off = 0, bytes = 0;
+    int n = sscanf(reply.c_str(), "%15s %47s %llu %llu", kind, id, &off, &bytes);
+    out->full = n == 4 && 0 == strcmp(kind, "FULLRESYNC");
+    if(!out->full && !(n >= 3 && 0 == strcmp(kind, "CONTINUE"))) {
+        return -1;
+    }
+    out->replid = id;
+    out->offset = off;
+    out->snap_bytes = out->full ? bytes : 0;
+    return 0;
+}
+
+// Copies len bytes of the snapshot that follows a FULLRESYNC into a file
+int32_t repl_recv_file(int fd, const char *path, uint64_t len) {
+    int file = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if(file < 0) {
+        return -1;
+    }
+
+    uint8_t buf[64 << 10];
+    int32_t err = 0;
+    while(len > 0 && !err) {
+        size_t n = len < sizeof(buf) ? (size_t)len : sizeof(buf);
+        err = read_full(fd, buf, n);
+        if(!err) {
+            err = write_full(file, buf, n);
+        }
+        len -= n;
+    }
+    if(0 != close(file)) {
+        err = -1;
+    }
+    return err;
+}
@@ -0,0 +1,61 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string>
+#include <vector>
+
+/*
+
+Replication:
+    A replica connects to its primary like a client and sends PSYNC <replid> <offset>: the ID of
+    the stream it follows and how many bytes of it it has ("?" and -1 when it has none). The
+    stream is every write command, in the log's framing (see aof.h), and an offset counts its
+    bytes from the start of the replication ID.
+
+    The primary keeps the newest bytes of the stream in a circular backlog. If the replica's
+    replid is the primary's and its offset is still in the backlog, the reply is
+
+        CONTINUE <replid> <offset>
+
+    and the stream picks up from there. Otherwise the primary saves a snapshot and replies
+
+        FULLRESYNC <replid> <offset> <bytes>
+
+    followed by that many bytes of snapshot file, then the stream from <offset>.
+
+    A replica applies the stream like requests without replies, and feeds the commands into its
+    own backlog the way a primary does. Its offsets match its primary's, so it can serve
+    replicas of its own and resume with CONTINUE after losing the link. Clients can only read.
+
+    The backlog only exists once a replica has synced, so a server that never has one doesn't
+    pay for encoding the stream.
+
+*/
+
+const size_t k_default_backlog = 1 << 20;
+
+struct ReplBacklog {
+    std::vector<uint8_t> buf; // circular, offset o is at buf[o % size]
+    uint64_t start = 0;       // oldest offset held
+    uint64_t end = 0;         // offset of the next byte of the stream
+};
+
+void backlog_init(ReplBacklog *bl, size_t size, uint64_t offset);
+bool backlog_enabled(const ReplBacklog *bl);
+void backlog_append(ReplBacklog *bl, const uint8_t *data, size_t len);
+bool backlog_read(const ReplBacklog *bl, uint64_t from, std::string &out);
+
+std::string repl_new_id();
+
+// The primary's reply to PSYNC
+struct ReplSync {
+    bool full = false;
+    std::string replid;
+    uint64_t offset = 0;
+    uint64_t snap_bytes = 0; // snapshot bytes that follow a full resync
+};
+
+int repl_connect(const char *host, uint16_t port);
+int32_t repl_handshake(int fd, const std::string &replid, int64_t offset, ReplSync *out);
+int32_t repl_recv_file(int fd, const char *path, uint64_t len);
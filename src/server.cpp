@@ -17,14 +17,43 @@ Serialization Protocol:
 #include <sys/socket.h>
 #include <netinet/ip.h>
 #include <assert.h>
+#include <stdarg.h>
+#include <signal.h>
 #include <fcntl.h>
+#include <time.h>
+#include <math.h>
 #include <vector>
 #include <stdbool.h>
 #include <poll.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
 #include <map>
+#include <deque>
+#include <algorithm>
 #include <string>
+#include <atomic>
+#include <new>
 #include "hashtable.h"
 #include "utils.h"
+#include "aof.h"
+#include "snapshot.h"
+#include "list.h"
+#include "hash.h"
+#include "set.h"
+#include "bitops.h"
+#include "hll.h"
+#include "pubsub.h"
+#include "protocol.h"
+#include "lzf.h"
+#include "stats.h"
+#include "histogram.h"
+#include "slowlog.h"
+#include "latency.h"
+#include "memusage.h"
+#include "slab.h"
+#include "intern.h"
+#include "reclaim.h"
+#include "repl.h"
 
 #define container_of(ptr, type, member) ({ \
     const typeof( ((type *)0)->member ) *__mptr = (ptr); \
@@ -36,7 +65,6 @@ Serialization Protocol:
 // 2. Perform memove only before a read
 // 3. Buffer multiple response and flush with a single write call (buffer limit may get full, flush then)
 
-const size_t k_max_msg = 4096;
 enum
 {
     STATE_REQ = 0, // Reading requests
@@ -51,59 +79,60 @@ enum
     RES_NX = 2,
 };
 
+// Value types
 enum {
-    ERR_UNKNOWN = 1,
-    ERR_2BIG = 2,
+    T_STR = 0,
+    T_LIST = 1,
+    T_HASH = 2,
+    T_SET = 3,
+    T_COUNT = 4,
+};
+
+// Encodings of T_STR
+enum {
+    ENC_RAW = 0, // val
+    ENC_INT = 1, // ival. val is empty
+    ENC_LZF = 2, // val is the raw length u32, then the LZF compressed bytes
+    ENC_SHARED = 3, // shared. val is empty
 };
 
 struct Entry {
     struct HNode node;
     std::string key;
     std::string val;
+    uint32_t type = T_STR;
+    uint32_t enc = ENC_RAW;
+    union {
+        int64_t ival = 0;
+        Interned *shared;
+    };
+    List *list = NULL;
+    Hash *hash = NULL;
+    Set *set = NULL;
+    size_t mem = 0; // bytes counted in g_data.mem_bytes, 0 while not counted
 };
 
 static std::map<std::string, std::string> g_map;
 
+static SlabClass g_entries = {"entries", slab_stride(sizeof(Entry))};
+
+static Entry *entry_alloc() {
+    return new (slab_alloc(&g_entries)) Entry();
+}
+
 static bool entry_eq(HNode *lhs, HNode *rhs) {
     struct Entry *le = container_of(lhs, struct Entry, node);
     struct Entry *re = container_of(rhs, struct Entry, node);
     return le->key == re->key;
 }
 
-static void out_nil(std::string &out) {
-    out.push_back(SER_NIL);
-}
-
-static void out_str(std::string &out, const std::string &val) {
-    out.push_back(SER_STR);
-    uint32_t len = (uint32_t)val.size();
-    out.append((char *)&len, 4);
-    out.append(val);
-}
-
-static void out_int(std::string &out, int64_t val) {
-    out.push_back(SER_INT);
-    out.append((char *)&val, 8);
-}
-
-static void out_err(std::string &out, int32_t code, const std::string &msg) {
-    out.push_back(SER_ERR);
-    out.append((char *)&code, 4);
-    uint32_t len = (uint32_t)msg.size();
-    out.append((char *) &len, 4);
-    out.append(msg);
-}
-
-static void out_arr(std::string &out, uint32_t n) {
-    out.push_back(SER_ARR);
-    out.append((char *)&n, 4);
-}
-
 struct Connection
 {
     int fd = -1;
     // State of connection
     uint32_t state = 0;
+    // Wire protocol, detected from the first bytes
+    uint32_t proto = PROTO_UNKNOWN;
     // Buffer for readin
     size_t read_buffer_size = 0;
     uint8_t read_buffer[4 + k_max_msg];
@@ -111,10 +140,89 @@ struct Connection
     size_t write_buffer_size = 0;
     size_t write_buffer_sent = 0;
     uint8_t write_buffer[4 + k_max_msg];
+    // Writes the reply into write_buffer. Also holds the values it references
+    Writer out;
+    // Pub/Sub messages, shared with the other subscribers. Once it is not empty, replies are
+    // queued behind the messages too so they stay in order
+    std::deque<MsgBuf *> out_queue;
+    size_t out_queue_bytes = 0;
+    size_t out_queue_sent = 0; // bytes of the front buffer already written
+    std::vector<std::string> channels;
+    std::vector<std::string> patterns;
+    // A replica of this server, see repl.h. It gets the stream once it is online
+    bool replica = false;
+    bool repl_online = false;
+    uint64_t repl_offset = 0; // where its stream starts
+    int snap_fd = -1;         // snapshot still to send for a full resync
+    uint64_t snap_left = 0;
+    // The link to this server's primary
+    bool primary = false;
 };
 
+const uint16_t k_default_port = 1234;
+const size_t k_default_out_limit = 32 << 20; // queued bytes before a subscriber is dropped
+const size_t k_default_compress_min = 1024;   // shorter string values are never compressed
+const size_t k_lazyfree_min_effort = 64;     // smaller values are freed inline even by UNLINK
+const uint64_t k_default_latency_ms = 10;     // event loop iterations this long are spikes
+const uint64_t k_cron_interval_ms = 100;
+const size_t k_cron_rehash_work = 128;        // keys moved per step of active rehashing
+const uint64_t k_cron_rehash_ns = 1000000;    // time spent on active rehashing per run
+const double k_default_defrag_threshold = 1.25; // slab bytes over live object bytes that start defrag
+const size_t k_defrag_min_waste = 4 << 20;      // free slab bytes below which defrag never starts
+const uint64_t k_defrag_cycle_ns = 2000000;     // time spent on defrag per run of server_cron()
+const size_t k_defrag_max_elems = 1024;         // bigger hashes and sets keep their nodes in place
+const uint64_t k_repl_retry_ms = 1000;          // between attempts to reach the primary
+const size_t k_repl_chunk = 64 << 10;           // snapshot bytes per message to a replica
+const size_t k_repl_queued = 4 * k_repl_chunk;  // snapshot bytes in a replica's queue at once
+
 static struct {
     HMap db;
+    std::string snapshot_path = "dump.snap";
+    PubSub pubsub;
+    size_t out_limit = k_default_out_limit;
+    size_t compress_min = k_default_compress_min; // 0 turns compression off
+    size_t intern_max = k_default_intern_max;     // 0 turns interning off
+    size_t loader_threads = 1;
+    // ENC_LZF values: count, bytes before and after compression. The loader threads add to them
+    std::atomic<uint64_t> lzf_keys{0};
+    std::atomic<uint64_t> lzf_raw_bytes{0};
+    std::atomic<uint64_t> lzf_bytes{0};
+    // Keys and their bytes by value type, see entry_mem(). The loader threads add to them
+    std::atomic<uint64_t> mem_keys[T_COUNT];
+    std::atomic<uint64_t> mem_bytes[T_COUNT];
+    // Connection whose request is running. NULL while replaying the log
+    Connection *client = NULL;
+    SlowLog slowlog;
+    LatencyMonitor latency;
+    uint64_t cron_ms = 0; // when server_cron() last ran
+    // Active defrag, see active_defrag()
+    double defrag_threshold = k_default_defrag_threshold; // 0 turns it off
+    bool defrag_running = false;
+    size_t defrag_cursor = 0;
+    uint64_t defrag_pass_hits = 0;
+    size_t defrag_stuck_waste = 0; // waste left by a pass that moved nothing
+    // Replication, see repl.h
+    std::string replid;
+    ReplBacklog backlog;
+    size_t backlog_size = k_default_backlog;
+    std::string repl_pending; // stream written in this event loop iteration
+    std::vector<Connection *> replicas;
+    std::string primary_host; // empty unless this is a replica
+    uint16_t primary_port = 0;
+    Connection *primary = NULL; // the link, while it is up
+    uint64_t primary_retry_ms = 0;
+    // For INFO
+    uint64_t start_ms = 0;
+    uint64_t stat_clients = 0;
+    uint64_t stat_conns_total = 0;
+    uint64_t stat_cmds = 0;
+    uint64_t stat_net_in = 0;
+    uint64_t stat_net_out = 0;
+    uint64_t ops_per_sec = 0;
+    uint64_t ops_sample_ms = 0;   // when ops_per_sec was last worked out
+    uint64_t ops_sample_cmds = 0; // stat_cmds back then
+    uint64_t stat_defrag_hits = 0;   // objects moved
+    uint64_t stat_defrag_misses = 0; // keys looked at with nothing to move
 } g_data;
 
 static void state_res(Connection *conn);
@@ -182,230 +290,2839 @@ static int32_t accept_new_conn(std::vector<Connection *> &fd_to_connection, int
         return -1;
     }
 
-    // Set new connection fd to nonblocking mode
-    set_fd_nb(connfd);
+    // Set new connection fd to nonblocking mode
+    set_fd_nb(connfd);
+
+    // Create the Connection struct
+    struct Connection *conn = new Connection();
+    conn->fd = connfd;
+    conn->state = STATE_REQ;
+    conn_put(fd_to_connection, conn);
+    g_data.stat_clients++;
+    g_data.stat_conns_total++;
+
+    return 0;
+}
+
+static void conn_destroy(std::vector<Connection *> &fd_to_connection, Connection *conn)
+{
+    for (const std::string &channel : conn->channels)
+    {
+        ps_unsubscribe(&g_data.pubsub, channel, conn);
+    }
+    for (const std::string &pattern : conn->patterns)
+    {
+        ps_punsubscribe(&g_data.pubsub, pattern, conn);
+    }
+    for (MsgBuf *buf : conn->out_queue)
+    {
+        msgbuf_unref(buf);
+    }
+    if (conn->replica)
+    {
+        g_data.replicas.erase(std::find(g_data.replicas.begin(), g_data.replicas.end(), conn));
+        if (conn->snap_fd >= 0)
+        {
+            (void)close(conn->snap_fd);
+        }
+    }
+    if (conn == g_data.primary)
+    {
+        msg("lost the link to the primary");
+        g_data.primary = NULL;
+    }
+
+    fd_to_connection[conn->fd] = NULL;
+    (void)close(conn->fd);
+    delete conn;
+    g_data.stat_clients--;
+}
+
+// Takes a reference to buf. A subscriber that can't keep up gets disconnected
+static bool conn_queue(Connection *conn, MsgBuf *buf)
+{
+    if (conn->state == STATE_END)
+    {
+        return false;
+    }
+
+    msgbuf_ref(buf);
+    conn->out_queue.push_back(buf);
+    conn->out_queue_bytes += buf->len;
+    if (conn->out_queue_bytes > g_data.out_limit)
+    {
+        msg("output queue over limit");
+        conn->state = STATE_END;
+    }
+    return true;
+}
+
+static bool cmd_is(const std::string &word, const char *cmd)
+{
+    return 0 == strcasecmp(word.c_str(), cmd);
+}
+
+static void h_scan(HTab *tab, void (*f)(HNode *, void *), void *arg) {
+    if(tab->size == 0) {
+        return;
+    }
+
+    for(size_t i = 0; i < tab->mask + 1; ++i) {
+        HNode *node = tab->tab[i];
+        while(node) {
+            f(node, arg);
+            node = node->next;
+        }
+    }
+}
+
+static void cb_scan(HNode *node, void *arg) {
+    Writer &out = *(Writer *)arg;
+    out_str(out, container_of(node, Entry, node)->key);
+}
+
+static uint32_t lzf_raw_len(const Entry *entry) {
+    uint32_t len = 0;
+    memcpy(&len, entry->val.data(), 4);
+    return len;
+}
+
+static void lzf_unpack(const Entry *entry, uint8_t *dst) {
+    const uint8_t *src = (const uint8_t *)entry->val.data() + 4;
+    size_t n = lzf_decompress(src, entry->val.size() - 4, dst, lzf_raw_len(entry));
+    assert(n == lzf_raw_len(entry));
+    (void)n;
+}
+
+// Takes an ENC_LZF value out of the stats, before it is replaced or decompressed
+static void lzf_forget(Entry *entry) {
+    if(entry->enc != ENC_LZF) {
+        return;
+    }
+    g_data.lzf_keys.fetch_sub(1, std::memory_order_relaxed);
+    g_data.lzf_raw_bytes.fetch_sub(lzf_raw_len(entry), std::memory_order_relaxed);
+    g_data.lzf_bytes.fetch_sub(entry->val.size(), std::memory_order_relaxed);
+}
+
+// What an entry costs: its own block (the HNode is part of it), the key and value strings, and
+// the container of a list, hash or set. The keyspace buckets pointing at it are not included,
+// and a shared value is counted once, with the intern pool
+static size_t entry_mem(const Entry *entry) {
+    size_t bytes = g_entries.size + mem_str(entry->key) + mem_str(entry->val);
+    if(entry->type == T_LIST) {
+        bytes += mem_alloc(sizeof(List)) + list_mem(entry->list);
+    } else if(entry->type == T_HASH) {
+        bytes += mem_alloc(sizeof(Hash)) + hash_mem(entry->hash);
+    } else if(entry->type == T_SET) {
+        bytes += mem_alloc(sizeof(Set)) + set_mem(entry->set);
+    }
+    return bytes;
+}
+
+// Brings the memory stats up to date after the entry changed. Cheap: entry_mem() doesn't walk
+// the value
+static void mem_track(Entry *entry) {
+    size_t bytes = entry_mem(entry);
+    if(!entry->mem) {
+        g_data.mem_keys[entry->type].fetch_add(1, std::memory_order_relaxed);
+    }
+    g_data.mem_bytes[entry->type].fetch_add(bytes - entry->mem, std::memory_order_relaxed);
+    entry->mem = bytes;
+}
+
+// Takes the entry out of the memory stats, before its type changes or it is freed
+static void mem_forget(Entry *entry) {
+    if(!entry->mem) {
+        return;
+    }
+    g_data.mem_keys[entry->type].fetch_sub(1, std::memory_order_relaxed);
+    g_data.mem_bytes[entry->type].fetch_sub(entry->mem, std::memory_order_relaxed);
+    entry->mem = 0;
+}
+
+// Compresses a long ENC_RAW value in place. Left alone if that saves less than 1/8
+static void entry_compress(Entry *entry) {
+    size_t len = entry->val.size();
+    if(g_data.compress_min == 0 || len < g_data.compress_min || len > UINT32_MAX) {
+        return;
+    }
+
+    static thread_local std::vector<uint8_t> scratch;
+    size_t cap = len - len / 8;
+    scratch.resize(4 + cap);
+    size_t clen = lzf_compress((const uint8_t *)entry->val.data(), len, scratch.data() + 4, cap);
+    if(clen == 0) {
+        return;
+    }
+
+    uint32_t raw_len = (uint32_t)len;
+    memcpy(scratch.data(), &raw_len, 4);
+    std::string((char *)scratch.data(), 4 + clen).swap(entry->val); // a fresh string, sized to fit
+    entry->enc = ENC_LZF;
+
+    g_data.lzf_keys.fetch_add(1, std::memory_order_relaxed);
+    g_data.lzf_raw_bytes.fetch_add(len, std::memory_order_relaxed);
+    g_data.lzf_bytes.fetch_add(4 + clen, std::memory_order_relaxed);
+}
+
+// Drops the entry's reference to an ENC_SHARED value. The encoding is left to the caller
+static void entry_unshare(Entry *entry) {
+    if(entry->enc != ENC_SHARED) {
+        return;
+    }
+    intern_put(entry->shared);
+    entry->ival = 0;
+}
+
+// Stores val as a string value: natively if it is an int in canonical form, shared if it is too
+// long for the string's inline buffer but short enough to intern, compressed if it is long and
+// compresses well. Takes the string
+static void entry_set_str(Entry *entry, std::string &val) {
+    lzf_forget(entry);
+    entry_unshare(entry);
+
+    int64_t ival = 0;
+    if(str2int_canonical(val, ival)) {
+        entry->enc = ENC_INT;
+        entry->ival = ival;
+        std::string().swap(entry->val);
+    } else if(val.size() > std::string().capacity() && val.size() <= g_data.intern_max) {
+        entry->enc = ENC_SHARED;
+        entry->shared = intern_get(val.data(), val.size());
+        std::string().swap(entry->val);
+    } else {
+        entry->enc = ENC_RAW;
+        entry->val.swap(val);
+        entry_compress(entry);
+    }
+    mem_track(entry);
+}
+
+// The string form of a T_STR value. Values in any other encoding are copied or decoded into buf
+static const std::string &entry_strval(Entry *entry, std::string &buf) {
+    if(entry->enc == ENC_RAW) {
+        return entry->val;
+    }
+
+    if(entry->enc == ENC_SHARED) {
+        buf.assign(entry->shared->data, entry->shared->len);
+        return buf;
+    }
+
+    if(entry->enc == ENC_LZF) {
+        buf.resize(lzf_raw_len(entry));
+        lzf_unpack(entry, (uint8_t *)&buf[0]);
+        return buf;
+    }
+
+    char tmp[k_int_digits];
+    buf.assign(tmp, int_format(entry->ival, tmp));
+    return buf;
+}
+
+// Replies with a T_STR value. Long values are referenced, not copied, and compressed ones are
+// decompressed straight into the reply
+static void out_strval(Writer &out, Entry *entry) {
+    if(entry->enc == ENC_INT) {
+        char buf[k_int_digits];
+        return out_str(out, (uint8_t *)buf, int_format(entry->ival, buf));
+    }
+
+    if(entry->enc == ENC_SHARED) {
+        return out_str(out, (const uint8_t *)entry->shared->data, entry->shared->len);
+    }
+
+    if(entry->enc == ENC_LZF) {
+        uint8_t *dst = out_str_space(out, lzf_raw_len(entry));
+        if(dst) {
+            lzf_unpack(entry, dst);
+        }
+        return;
+    }
+
+    out_str_ref(out, (const uint8_t *)entry->val.data(), (uint32_t)entry->val.size());
+}
+
+static void do_get(std::vector<std::string> &cmd, Writer &out) {
+    Entry key;
+    key.key.swap(cmd[1]);
+    key.node.hcode = str_hash((uint8_t *)key.key.data(), key.key.size());
+
+    HNode *node = hm_lookup(&g_data.db, &key.node, &entry_eq);
+
+    if(!node) {
+        return out_nil(out);
+    }
+
+    Entry *entry = container_of(node, Entry, node);
+    if(entry->type != T_STR) {
+        return out_err(out, ERR_TYPE, "Expect string type");
+    }
+
+    out_strval(out, entry);
+}
+
+// Turns an int encoded, shared or compressed value back into plain bytes of its own, for
+// commands that edit or parse them. It stays that way until the next write of the whole value
+static void entry_to_raw(Entry *entry) {
+    if(entry->enc == ENC_SHARED) {
+        entry->val.assign(entry->shared->data, entry->shared->len);
+        entry_unshare(entry);
+        entry->enc = ENC_RAW;
+    } else if(entry->enc == ENC_INT) {
+        char buf[k_int_digits];
+        entry->val.assign(buf, int_format(entry->ival, buf));
+        entry->enc = ENC_RAW;
+    } else if(entry->enc == ENC_LZF) {
+        std::string raw(lzf_raw_len(entry), '\0');
+        lzf_unpack(entry, (uint8_t *)&raw[0]);
+        lzf_forget(entry);
+        entry->val.swap(raw);
+        entry->enc = ENC_RAW;
+    }
+    mem_track(entry);
+}
+
+// Frees whatever the entry holds besides the string value
+static void entry_clear_value(Entry *entry) {
+    mem_forget(entry);
+    if(entry->type == T_LIST) {
+        list_destroy(entry->list);
+        delete entry->list;
+        entry->list = NULL;
+    } else if(entry->type == T_HASH) {
+        hash_destroy(entry->hash);
+        delete entry->hash;
+        entry->hash = NULL;
+    } else if(entry->type == T_SET) {
+        set_destroy(entry->set);
+        delete entry->set;
+        entry->set = NULL;
+    }
+    lzf_forget(entry);
+    entry_unshare(entry);
+    entry->type = T_STR;
+    entry->enc = ENC_RAW;
+}
+
+static void entry_del(Entry *entry) {
+    entry_clear_value(entry);
+    entry->~Entry();
+    slab_free(entry);
+}
+
+// Finds the entry for key. The key string is borrowed for the lookup and handed back
+static Entry *entry_find(std::string &key) {
+    Entry probe;
+    probe.key.swap(key);
+    probe.node.hcode = str_hash((uint8_t *)probe.key.data(), probe.key.size());
+
+    HNode *node = hm_lookup(&g_data.db, &probe.node, &entry_eq);
+    key.swap(probe.key);
+    return node ? container_of(node, Entry, node) : NULL;
+}
+
+// Creates an empty entry of the given type. Takes the key string
+static Entry *entry_new(std::string &key, uint32_t type) {
+    Entry *entry = entry_alloc();
+    entry->key.swap(key);
+    entry->node.hcode = str_hash((uint8_t *)entry->key.data(), entry->key.size());
+    entry->type = type;
+    if(type == T_LIST) {
+        entry->list = new List();
+    } else if(type == T_HASH) {
+        entry->hash = new Hash();
+    } else if(type == T_SET) {
+        entry->set = new Set();
+    }
+    mem_track(entry);
+
+    hm_insert(&g_data.db, &entry->node);
+    return entry;
+}
+
+// Roughly how many blocks freeing the entry takes
+static size_t entry_free_effort(const Entry *entry) {
+    if(entry->type == T_LIST) {
+        return entry->list->nchunks;
+    } else if(entry->type == T_HASH) {
+        return entry->hash->enc == HASH_HMAP ? entry->hash->len : 1;
+    } else if(entry->type == T_SET) {
+        return entry->set->enc == SET_HMAP ? entry->set->len : 1;
+    }
+    return 1;
+}
+
+static void reclaim_entry(void *arg) {
+    entry_del((Entry *)arg);
+}
+
+// Frees an entry already out of the keyspace, on the reclaim thread if it is big. It leaves
+// the memory stats right away
+static void entry_del_async(Entry *entry) {
+    mem_forget(entry);
+    if(entry_free_effort(entry) < k_lazyfree_min_effort || !reclaim_push(&reclaim_entry, entry)) {
+        entry_del(entry);
+    }
+}
+
+// Removes an entry from the keyspace and frees it
+static void entry_remove(Entry *entry) {
+    hm_unlink(&g_data.db, &entry->node);
+    entry_del(entry);
+}
+
+static void do_set(std::vector<std::string> &cmd, Writer &out) {  
+    //Create key
+    Entry key;
+    key.key.swap(cmd[1]);
+    key.node.hcode = str_hash((uint8_t *) key.key.data(), key.key.size());
+
+    //Find node
+    HNode *node = hm_lookup(&g_data.db, &key.node, &entry_eq);
+
+    if(node) {
+        //We found the node. Swap it's current val to new one passed in args. SET overwrites any type
+        Entry *entry = container_of(node, Entry, node);
+        entry_clear_value(entry);
+        entry_set_str(entry, cmd[2]);
+    } else {
+        //Create new entry into hashtable.
+        Entry *entry = entry_alloc();
+        entry->key.swap(key.key);
+        entry->node.hcode = key.node.hcode;
+        entry_set_str(entry, cmd[2]);
+        hm_insert(&g_data.db, &entry->node);
+    }
+
+    return out_nil(out);
+}
+
+// Looks up cmd[first], cmd[first + step], ... with one batched hashtable lookup.
+// The probes take the key strings
+static void entry_find_batch(std::vector<std::string> &cmd, size_t first, size_t step,
+                             std::vector<Entry> &probes, std::vector<HNode *> &found) {
+    size_t n = (cmd.size() - first + step - 1) / step;
+    probes.resize(n);
+    found.resize(n);
+
+    std::vector<HNode *> keys(n);
+    for(size_t i = 0; i < n; ++i) {
+        Entry &probe = probes[i];
+        probe.key.swap(cmd[first + i * step]);
+        probe.node.hcode = str_hash((uint8_t *)probe.key.data(), probe.key.size());
+        keys[i] = &probe.node;
+    }
+
+    hm_lookup_batch(&g_data.db, keys.data(), n, &entry_eq, found.data());
+}
+
+// DEL and UNLINK. UNLINK frees big values in the background
+static void del_keys(std::vector<std::string> &cmd, Writer &out, bool async)
+{
+    void (*del)(Entry *) = async ? &entry_del_async : &entry_del;
+    if(cmd.size() > 2) {
+        // The batched lookup pulls every chain into cache, and its nodes are unlinked without
+        // comparing keys again. A key given twice finds the same node, which goes once
+        std::vector<Entry> probes;
+        std::vector<HNode *> found;
+        entry_find_batch(cmd, 1, 1, probes, found);
+        std::sort(found.begin(), found.end());
+        found.erase(std::unique(found.begin(), found.end()), found.end());
+
+        int64_t deleted = 0;
+        for(HNode *node : found) {
+            if(node) {
+                hm_unlink(&g_data.db, node);
+                del(container_of(node, Entry, node));
+                deleted++;
+            }
+        }
+        return out_int(out, deleted);
+    }
+
+    Entry key;
+    key.key.swap(cmd[1]);
+    key.node.hcode = str_hash((uint8_t *)key.key.data(), key.key.size());
+
+    HNode *node = hm_pop(&g_data.db, &key.node, &entry_eq);
+
+    if(node) {
+        del(container_of(node, Entry, node));
+    }
+
+    //Returns whether or not deletion took place
+    return out_int(out, node ? 1 : 0);
+}
+
+static void do_del(std::vector<std::string> &cmd, Writer &out) {
+    del_keys(cmd, out, false);
+}
+
+static void do_unlink(std::vector<std::string> &cmd, Writer &out) {
+    del_keys(cmd, out, true);
+}
+
+static void free_tab(HTab *tab) {
+    for(size_t i = 0; tab->tab && i < tab->mask + 1; ++i) {
+        HNode *node = tab->tab[i];
+        while(node) {
+            HNode *next = node->next;
+            Entry *entry = container_of(node, Entry, node);
+            entry->mem = 0; // taken out of the stats in bulk
+            entry_del(entry);
+            node = next;
+        }
+    }
+}
+
+// Frees a detached keyspace
+static void reclaim_db(void *arg) {
+    HMap *db = (HMap *)arg;
+    free_tab(&db->h1);
+    free_tab(&db->h2);
+    hm_destroy(db);
+    delete db;
+}
+
+// Swaps in an empty keyspace. async frees the old one in the background
+static void flush_db(bool async) {
+    HMap *db = new HMap(g_data.db);
+    g_data.db = HMap();
+    for(uint32_t t = 0; t < T_COUNT; ++t) {
+        g_data.mem_keys[t].store(0);
+        g_data.mem_bytes[t].store(0);
+    }
+
+    if(!async || !reclaim_push(&reclaim_db, db)) {
+        reclaim_db(db);
+    }
+}
+
+// FLUSHALL [ASYNC | SYNC]
+static void do_flushall(std::vector<std::string> &cmd, Writer &out) {
+    bool async = cmd.size() == 2 && cmd_is(cmd[1], "async");
+    if(cmd.size() > 2 || (cmd.size() == 2 && !async && !cmd_is(cmd[1], "sync"))) {
+        return out_err(out, ERR_ARG, "Expect FLUSHALL [ASYNC | SYNC]");
+    }
+
+    flush_db(async);
+    return out_nil(out);
+}
+
+static void do_mget(std::vector<std::string> &cmd, Writer &out) {
+    std::vector<Entry> probes;
+    std::vector<HNode *> found;
+    entry_find_batch(cmd, 1, 1, probes, found);
+
+    out_arr(out, (uint32_t)found.size());
+    for(HNode *node : found) {
+        Entry *entry = node ? container_of(node, Entry, node) : NULL;
+        if(!entry || entry->type != T_STR) {
+            out_nil(out);
+        } else {
+            out_strval(out, entry);
+        }
+    }
+}
+
+static void do_mset(std::vector<std::string> &cmd, Writer &out) {
+    if(cmd.size() % 2 != 1) {
+        return out_err(out, ERR_ARG, "Expect key value pairs");
+    }
+
+    std::vector<Entry> probes;
+    std::vector<HNode *> found;
+    entry_find_batch(cmd, 1, 2, probes, found);
+
+    // A key the batch didn't find may come again later in this MSET, and has to reuse the entry
+    // its first occurrence adds. Sorting the new keys puts repeats next to each other
+    std::vector<size_t> added;
+    for(size_t i = 0; i < probes.size(); ++i) {
+        if(!found[i]) {
+            added.push_back(i);
+        }
+    }
+    std::stable_sort(added.begin(), added.end(), [&](size_t a, size_t b) {
+        const Entry &pa = probes[a], &pb = probes[b];
+        return pa.node.hcode != pb.node.hcode ? pa.node.hcode < pb.node.hcode : pa.key < pb.key;
+    });
+    std::vector<size_t> first(probes.size());
+    for(size_t k = 0; k < added.size(); ++k) {
+        size_t i = added[k], prev = k ? added[k - 1] : i;
+        first[i] = k && probes[i].key == probes[prev].key ? first[prev] : i;
+    }
+
+    std::vector<Entry *> entries(probes.size());
+    for(size_t i = 0; i < probes.size(); ++i) {
+        Entry *entry = NULL;
+        if(found[i]) {
+            entry = container_of(found[i], Entry, node);
+            entry_clear_value(entry);
+        } else if(first[i] != i) {
+            entry = entries[first[i]];
+            entry_clear_value(entry);
+        } else {
+            entry = entry_new(probes[i].key, T_STR);
+        }
+
+        entries[i] = entry;
+        entry_set_str(entry, cmd[2 + 2 * i]);
+    }
+
+    return out_nil(out);
+}
+
+static void do_keys(std::vector<std::string> &cmd, Writer &out) {
+    (void)cmd;
+    out_arr(out, (uint32_t)hm_size(&g_data.db));
+    h_scan(&g_data.db.h1, &cb_scan, &out);
+    h_scan(&g_data.db.h2, &cb_scan, &out);
+}
+
+static void do_incr_by(std::vector<std::string> &cmd, Writer &out, int64_t incr) {
+    Entry *entry = entry_find(cmd[1]);
+    if(entry && entry->type != T_STR) {
+        return out_err(out, ERR_TYPE, "Expect string type");
+    }
+    if(entry && entry->enc != ENC_INT) {
+        return out_err(out, ERR_ARG, "Value is not an int");
+    }
+
+    int64_t val = entry ? entry->ival : 0;
+    if((incr > 0 && val > INT64_MAX - incr) || (incr < 0 && val < INT64_MIN - incr)) {
+        return out_err(out, ERR_ARG, "Increment would overflow");
+    }
+
+    if(!entry) {
+        entry = entry_new(cmd[1], T_STR);
+        entry->enc = ENC_INT;
+    }
+
+    entry->ival = val + incr;
+    return out_int(out, entry->ival);
+}
+
+static void do_incr(std::vector<std::string> &cmd, Writer &out) {
+    do_incr_by(cmd, out, 1);
+}
+
+static void do_decr(std::vector<std::string> &cmd, Writer &out) {
+    do_incr_by(cmd, out, -1);
+}
+
+static void do_incrby(std::vector<std::string> &cmd, Writer &out) {
+    int64_t incr = 0;
+    if(!str2int(cmd[2], incr)) {
+        return out_err(out, ERR_ARG, "Expect int");
+    }
+    do_incr_by(cmd, out, incr);
+}
+
+static void do_decrby(std::vector<std::string> &cmd, Writer &out) {
+    int64_t decr = 0;
+    if(!str2int(cmd[2], decr) || decr == INT64_MIN) {
+        return out_err(out, ERR_ARG, "Expect int");
+    }
+    do_incr_by(cmd, out, -decr);
+}
+
+static void do_incrbyfloat(std::vector<std::string> &cmd, Writer &out) {
+    double incr = 0;
+    if(!str2dbl(cmd[2], incr)) {
+        return out_err(out, ERR_ARG, "Expect float");
+    }
+
+    Entry *entry = entry_find(cmd[1]);
+    if(entry && entry->type != T_STR) {
+        return out_err(out, ERR_TYPE, "Expect string type");
+    }
+
+    double val = 0;
+    std::string strval;
+    if(entry && entry->enc == ENC_INT) {
+        val = (double)entry->ival;
+    } else if(entry && !str2dbl(entry_strval(entry, strval), val)) {
+        return out_err(out, ERR_ARG, "Value is not a float");
+    }
+
+    val += incr;
+    if(isinf(val)) {
+        return out_err(out, ERR_ARG, "Increment would overflow");
+    }
+
+    if(!entry) {
+        entry = entry_new(cmd[1], T_STR);
+    }
+
+    // Stored as text. An integral result becomes an int again
+    char buf[k_dbl_digits];
+    std::string text(buf, dbl_format(val, buf));
+    entry_set_str(entry, text);
+    return out_dbl(out, val);
+}
+
+// Resolves a possibly negative list index. Returns false if it is out of range
+static bool list_index(const List *list, int64_t &idx) {
+    if(idx < 0) {
+        idx += (int64_t)list->len;
+    }
+    return idx >= 0 && (size_t)idx < list->len;
+}
+
+static void do_push(std::vector<std::string> &cmd, Writer &out, bool front) {
+    Entry *entry = entry_find(cmd[1]);
+    if(entry && entry->type != T_LIST) {
+        return out_err(out, ERR_TYPE, "Expect list type");
+    }
+    if(!entry) {
+        entry = entry_new(cmd[1], T_LIST);
+    }
+
+    for(size_t i = 2; i < cmd.size(); ++i) {
+        list_push(entry->list, front, (uint8_t *)cmd[i].data(), (uint32_t)cmd[i].size());
+    }
+    mem_track(entry);
+
+    return out_int(out, (int64_t)entry->list->len);
+}
+
+static void do_lpush(std::vector<std::string> &cmd, Writer &out) {
+    do_push(cmd, out, true);
+}
+
+static void do_rpush(std::vector<std::string> &cmd, Writer &out) {
+    do_push(cmd, out, false);
+}
+
+static void do_pop(std::vector<std::string> &cmd, Writer &out, bool front) {
+    Entry *entry = entry_find(cmd[1]);
+    if(!entry) {
+        return out_nil(out);
+    }
+    if(entry->type != T_LIST) {
+        return out_err(out, ERR_TYPE, "Expect list type");
+    }
+
+    std::string val;
+    bool ok = list_pop(entry->list, front, val);
+    assert(ok);
+    (void)ok;
+
+    // Empty lists don't exist
+    if(entry->list->len == 0) {
+        entry_remove(entry);
+    } else {
+        mem_track(entry);
+    }
+
+    return out_str(out, val);
+}
+
+static void do_lpop(std::vector<std::string> &cmd, Writer &out) {
+    do_pop(cmd, out, true);
+}
+
+static void do_rpop(std::vector<std::string> &cmd, Writer &out) {
+    do_pop(cmd, out, false);
+}
+
+static void do_lindex(std::vector<std::string> &cmd, Writer &out) {
+    int64_t idx = 0;
+    if(!str2int(cmd[2], idx)) {
+        return out_err(out, ERR_ARG, "Expect int");
+    }
+
+    Entry *entry = entry_find(cmd[1]);
+    if(!entry) {
+        return out_nil(out);
+    }
+    if(entry->type != T_LIST) {
+        return out_err(out, ERR_TYPE, "Expect list type");
+    }
+
+    ListIter iter;
+    const uint8_t *data = NULL;
+    uint32_t len = 0;
+    if(!list_index(entry->list, idx) || !list_seek(entry->list, idx, &iter) || !list_next(&iter, &data, &len)) {
+        return out_nil(out);
+    }
+
+    return out_str(out, data, len);
+}
+
+static void do_lrange(std::vector<std::string> &cmd, Writer &out) {
+    int64_t start = 0, stop = 0;
+    if(!str2int(cmd[2], start) || !str2int(cmd[3], stop)) {
+        return out_err(out, ERR_ARG, "Expect int");
+    }
+
+    Entry *entry = entry_find(cmd[1]);
+    if(!entry) {
+        return out_arr(out, 0);
+    }
+    if(entry->type != T_LIST) {
+        return out_err(out, ERR_TYPE, "Expect list type");
+    }
+
+    // Clamp the range like redis does
+    int64_t len = (int64_t)entry->list->len;
+    start = start < 0 ? start + len : start;
+    stop = stop < 0 ? stop + len : stop;
+    start = start < 0 ? 0 : start;
+    stop = stop >= len ? len - 1 : stop;
+    if(start > stop) {
+        return out_arr(out, 0);
+    }
+
+    out_arr(out, (uint32_t)(stop - start + 1));
+
+    ListIter iter;
+    list_seek(entry->list, start, &iter);
+    for(int64_t i = start; i <= stop; ++i) {
+        const uint8_t *data = NULL;
+        uint32_t dlen = 0;
+        list_next(&iter, &data, &dlen);
+        out_str(out, data, dlen);
+    }
+}
+
+static void do_hset(std::vector<std::string> &cmd, Writer &out) {
+    if(cmd.size() % 2 != 0) {
+        return out_err(out, ERR_ARG, "Expect field value pairs");
+    }
+
+    Entry *entry = entry_find(cmd[1]);
+    if(entry && entry->type != T_HASH) {
+        return out_err(out, ERR_TYPE, "Expect hash type");
+    }
+    if(!entry) {
+        entry = entry_new(cmd[1], T_HASH);
+    }
+
+    int64_t added = 0;
+    for(size_t i = 2; i < cmd.size(); i += 2) {
+        added += hash_set(entry->hash, cmd[i], cmd[i + 1]) ? 1 : 0;
+    }
+    mem_track(entry);
+
+    return out_int(out, added);
+}
+
+static void do_hget(std::vector<std::string> &cmd, Writer &out) {
+    Entry *entry = entry_find(cmd[1]);
+    if(!entry) {
+        return out_nil(out);
+    }
+    if(entry->type != T_HASH) {
+        return out_err(out, ERR_TYPE, "Expect hash type");
+    }
+
+    const uint8_t *val = NULL;
+    uint32_t len = 0;
+    if(!hash_get(entry->hash, cmd[2], &val, &len)) {
+        return out_nil(out);
+    }
+
+    return out_str(out, val, len);
+}
+
+static void do_hdel(std::vector<std::string> &cmd, Writer &out) {
+    Entry *entry = entry_find(cmd[1]);
+    if(!entry) {
+        return out_int(out, 0);
+    }
+    if(entry->type != T_HASH) {
+        return out_err(out, ERR_TYPE, "Expect hash type");
+    }
+
+    int64_t removed = 0;
+    for(size_t i = 2; i < cmd.size(); ++i) {
+        removed += hash_del(entry->hash, cmd[i]) ? 1 : 0;
+    }
+
+    if(entry->hash->len == 0) {
+        entry_remove(entry);
+    } else {
+        mem_track(entry);
+    }
+
+    return out_int(out, removed);
+}
+
+static void cb_hgetall(const uint8_t *field, uint32_t flen, const uint8_t *val, uint32_t vlen, void *arg) {
+    Writer &out = *(Writer *)arg;
+    out_str(out, field, flen);
+    out_str(out, val, vlen);
+}
+
+static void do_hgetall(std::vector<std::string> &cmd, Writer &out) {
+    Entry *entry = entry_find(cmd[1]);
+    if(!entry) {
+        return out_arr(out, 0);
+    }
+    if(entry->type != T_HASH) {
+        return out_err(out, ERR_TYPE, "Expect hash type");
+    }
+
+    out_arr(out, (uint32_t)(2 * entry->hash->len));
+    hash_scan(entry->hash, &cb_hgetall, &out);
+}
+
+static void do_hincrby(std::vector<std::string> &cmd, Writer &out) {
+    int64_t incr = 0;
+    if(!str2int(cmd[3], incr)) {
+        return out_err(out, ERR_ARG, "Expect int");
+    }
+
+    Entry *entry = entry_find(cmd[1]);
+    if(entry && entry->type != T_HASH) {
+        return out_err(out, ERR_TYPE, "Expect hash type");
+    }
+    if(!entry) {
+        entry = entry_new(cmd[1], T_HASH);
+    }
+
+    int64_t val = 0;
+    const uint8_t *data = NULL;
+    uint32_t len = 0;
+    if(hash_get(entry->hash, cmd[2], &data, &len)
+        && !str2int(std::string((const char *)data, len), val)) {
+        return out_err(out, ERR_ARG, "Hash value is not an int");
+    }
+
+    if((incr > 0 && val > INT64_MAX - incr) || (incr < 0 && val < INT64_MIN - incr)) {
+        return out_err(out, ERR_ARG, "Increment would overflow");
+    }
+
+    val += incr;
+    hash_set(entry->hash, cmd[2], std::to_string(val));
+    mem_track(entry);
+    return out_int(out, val);
+}
+
+static void do_sadd(std::vector<std::string> &cmd, Writer &out) {
+    Entry *entry = entry_find(cmd[1]);
+    if(entry && entry->type != T_SET) {
+        return out_err(out, ERR_TYPE, "Expect set type");
+    }
+    if(!entry) {
+        entry = entry_new(cmd[1], T_SET);
+    }
+
+    int64_t added = 0;
+    for(size_t i = 2; i < cmd.size(); ++i) {
+        added += set_add(entry->set, cmd[i]) ? 1 : 0;
+    }
+    mem_track(entry);
+
+    return out_int(out, added);
+}
+
+static void do_srem(std::vector<std::string> &cmd, Writer &out) {
+    Entry *entry = entry_find(cmd[1]);
+    if(!entry) {
+        return out_int(out, 0);
+    }
+    if(entry->type != T_SET) {
+        return out_err(out, ERR_TYPE, "Expect set type");
+    }
+
+    int64_t removed = 0;
+    for(size_t i = 2; i < cmd.size(); ++i) {
+        removed += set_rem(entry->set, cmd[i]) ? 1 : 0;
+    }
+
+    if(entry->set->len == 0) {
+        entry_remove(entry);
+    } else {
+        mem_track(entry);
+    }
+
+    return out_int(out, removed);
+}
+
+static void do_sismember(std::vector<std::string> &cmd, Writer &out) {
+    Entry *entry = entry_find(cmd[1]);
+    if(entry && entry->type != T_SET) {
+        return out_err(out, ERR_TYPE, "Expect set type");
+    }
+
+    return out_int(out, entry && set_contains(entry->set, cmd[2]) ? 1 : 0);
+}
+
+static void do_scard(std::vector<std::string> &cmd, Writer &out) {
+    Entry *entry = entry_find(cmd[1]);
+    if(entry && entry->type != T_SET) {
+        return out_err(out, ERR_TYPE, "Expect set type");
+    }
+
+    return out_int(out, entry ? (int64_t)entry->set->len : 0);
+}
+
+static void cb_smembers(const char *data, uint32_t len, void *arg) {
+    out_str(*(Writer *)arg, (const uint8_t *)data, len);
+}
+
+static void do_smembers(std::vector<std::string> &cmd, Writer &out) {
+    Entry *entry = entry_find(cmd[1]);
+    if(!entry) {
+        return out_arr(out, 0);
+    }
+    if(entry->type != T_SET) {
+        return out_err(out, ERR_TYPE, "Expect set type");
+    }
+
+    out_arr(out, (uint32_t)entry->set->len);
+    set_scan(entry->set, &cb_smembers, &out);
+}
+
+// Collects the sets named by cmd[1..]. A missing key is an empty set, reported through missing
+static bool find_sets(std::vector<std::string> &cmd, std::vector<Set *> &sets, bool &missing, Writer &out) {
+    missing = false;
+    for(size_t i = 1; i < cmd.size(); ++i) {
+        Entry *entry = entry_find(cmd[i]);
+        if(!entry) {
+            missing = true;
+            continue;
+        }
+        if(entry->type != T_SET) {
+            out_err(out, ERR_TYPE, "Expect set type");
+            return false;
+        }
+        sets.push_back(entry->set);
+    }
+    return true;
+}
+
+static void do_sinter(std::vector<std::string> &cmd, Writer &out) {
+    std::vector<Set *> sets;
+    bool missing = false;
+    if(!find_sets(cmd, sets, missing, out)) {
+        return;
+    }
+    if(missing) {
+        return out_arr(out, 0);
+    }
+
+    std::vector<std::string> members;
+    set_inter(sets.data(), sets.size(), members);
+
+    out_arr(out, (uint32_t)members.size());
+    for(const std::string &m : members) {
+        out_str(out, m);
+    }
+}
+
+static void cb_sunion(const char *data, uint32_t len, void *arg) {
+    set_add((Set *)arg, std::string(data, len));
+}
+
+static void do_sunion(std::vector<std::string> &cmd, Writer &out) {
+    std::vector<Set *> sets;
+    bool missing = false;
+    if(!find_sets(cmd, sets, missing, out)) {
+        return;
+    }
+
+    Set result;
+    for(Set *set : sets) {
+        set_scan(set, &cb_sunion, &result);
+    }
+
+    out_arr(out, (uint32_t)result.len);
+    set_scan(&result, &cb_smembers, &out);
+    set_destroy(&result);
+}
+
+const uint64_t k_max_bit_offset = (1ull << 32) - 1; // bitmaps stop at 512MB
+
+static bool parse_bit_offset(const std::string &s, uint64_t &out) {
+    int64_t v = 0;
+    if(!str2int(s, v) || v < 0 || (uint64_t)v > k_max_bit_offset) {
+        return false;
+    }
+    out = (uint64_t)v;
+    return true;
+}
+
+// Bits are numbered from the most significant bit of the first byte, like redis
+static void do_setbit(std::vector<std::string> &cmd, Writer &out) {
+    uint64_t offset = 0;
+    if(!parse_bit_offset(cmd[2], offset)) {
+        return out_err(out, ERR_ARG, "Bit offset is not an int or out of range");
+    }
+    if(cmd[3] != "0" && cmd[3] != "1") {
+        return out_err(out, ERR_ARG, "Bit is not 0 or 1");
+    }
+
+    Entry *entry = entry_find(cmd[1]);
+    if(entry && entry->type != T_STR) {
+        return out_err(out, ERR_TYPE, "Expect string type");
+    }
+    if(!entry) {
+        entry = entry_new(cmd[1], T_STR);
+    }
+    entry_to_raw(entry);
+
+    // Grow with zero bytes as needed
+    size_t byte = (size_t)(offset >> 3);
+    if(entry->val.size() <= byte) {
+        entry->val.resize(byte + 1, '\0');
+        mem_track(entry);
+    }
+
+    uint8_t mask = (uint8_t)(0x80 >> (offset & 7));
+    uint8_t &b = (uint8_t &)entry->val[byte];
+    int64_t old = (b & mask) ? 1 : 0;
+    b = cmd[3][0] == '1' ? (b | mask) : (b & ~mask);
+
+    return out_int(out, old);
+}
+
+static void do_getbit(std::vector<std::string> &cmd, Writer &out) {
+    uint64_t offset = 0;
+    if(!parse_bit_offset(cmd[2], offset)) {
+        return out_err(out, ERR_ARG, "Bit offset is not an int or out of range");
+    }
+
+    Entry *entry = entry_find(cmd[1]);
+    if(!entry) {
+        return out_int(out, 0);
+    }
+    if(entry->type != T_STR) {
+        return out_err(out, ERR_TYPE, "Expect string type");
+    }
+
+    std::string buf;
+    const std::string &val = entry_strval(entry, buf);
+    size_t byte = (size_t)(offset >> 3);
+    if(byte >= val.size()) {
+        return out_int(out, 0);
+    }
+
+    return out_int(out, ((uint8_t)val[byte] & (0x80 >> (offset & 7))) ? 1 : 0);
+}
+
+// BITCOUNT key [start end], with a byte range
+static void do_bitcount(std::vector<std::string> &cmd, Writer &out) {
+    if(cmd.size() != 2 && cmd.size() != 4) {
+        return out_err(out, ERR_ARG, "Expect a start and an end");
+    }
+
+    int64_t start = 0, end = -1;
+    if(cmd.size() == 4 && (!str2int(cmd[2], start) || !str2int(cmd[3], end))) {
+        return out_err(out, ERR_ARG, "Expect int");
+    }
+
+    Entry *entry = entry_find(cmd[1]);
+    if(!entry) {
+        return out_int(out, 0);
+    }
+    if(entry->type != T_STR) {
+        return out_err(out, ERR_TYPE, "Expect string type");
+    }
+
+    std::string buf;
+    const std::string &val = entry_strval(entry, buf);
+    int64_t len = (int64_t)val.size();
+    start = start < 0 ? start + len : start;
+    end = end < 0 ? end + len : end;
+    start = start < 0 ? 0 : start;
+    end = end >= len ? len - 1 : end;
+    if(start > end) {
+        return out_int(out, 0);
+    }
+
+    return out_int(out, (int64_t)bit_count((const uint8_t *)val.data() + start, (size_t)(end - start + 1)));
+}
+
+// BITOP AND|OR|XOR|NOT destkey key [key ...]. Shorter inputs count as zero padded
+static void do_bitop(std::vector<std::string> &cmd, Writer &out) {
+    uint32_t op = 0;
+    if(cmd_is(cmd[1], "and")) {
+        op = BITOP_AND;
+    } else if(cmd_is(cmd[1], "or")) {
+        op = BITOP_OR;
+    } else if(cmd_is(cmd[1], "xor")) {
+        op = BITOP_XOR;
+    } else if(cmd_is(cmd[1], "not") && cmd.size() == 4) {
+        op = BITOP_NOT;
+    } else {
+        return out_err(out, ERR_ARG, "Expect AND, OR, XOR or NOT with one key");
+    }
+
+    // Raw values of the source keys. Missing keys are empty
+    std::vector<std::string> bufs(cmd.size() - 3);
+    std::vector<const std::string *> srcs;
+    size_t maxlen = 0;
+    for(size_t i = 3; i < cmd.size(); ++i) {
+        Entry *entry = entry_find(cmd[i]);
+        if(entry && entry->type != T_STR) {
+            return out_err(out, ERR_TYPE, "Expect string type");
+        }
+
+        const std::string *val = entry ? &entry_strval(entry, bufs[i - 3]) : &bufs[i - 3];
+        srcs.push_back(val);
+        maxlen = val->size() > maxlen ? val->size() : maxlen;
+    }
+
+    std::string result(maxlen, '\0');
+    uint8_t *dst = (uint8_t *)&result[0];
+    const std::string &first = *srcs[0];
+
+    if(op == BITOP_NOT) {
+        bit_op(BITOP_NOT, dst, (const uint8_t *)first.data(), first.size());
+    } else {
+        memcpy(dst, first.data(), first.size());
+        for(size_t i = 1; i < srcs.size(); ++i) {
+            const std::string &src = *srcs[i];
+            bit_op(op, dst, (const uint8_t *)src.data(), src.size());
+            if(op == BITOP_AND && src.size() < maxlen) {
+                memset(dst + src.size(), 0, maxlen - src.size());
+            }
+        }
+    }
+
+    // The destination takes the result whatever it held before. An empty result deletes it
+    Entry *entry = entry_find(cmd[2]);
+    if(maxlen == 0) {
+        if(entry) {
+            entry_remove(entry);
+        }
+        return out_int(out, 0);
+    }
+
+    if(entry) {
+        entry_clear_value(entry);
+    } else {
+        entry = entry_new(cmd[2], T_STR);
+    }
+    entry_set_str(entry, result);
+
+    return out_int(out, (int64_t)maxlen);
+}
+
+// The HLL held by entry, NULL if it doesn't hold one. A shared or compressed value is decoded into
+// buf, so reading leaves the entry as it is
+static const std::string *entry_hll(Entry *entry, std::string &buf) {
+    if(entry->type != T_STR) {
+        return NULL;
+    }
+    const std::string &hll = entry_strval(entry, buf);
+    return hll_valid(hll) ? &hll : NULL;
+}
+
+// Replaces the value with hll as plain bytes of its own. Takes the string
+static void entry_set_hll(Entry *entry, std::string &hll) {
+    lzf_forget(entry);
+    entry_unshare(entry);
+    entry->enc = ENC_RAW;
+    entry->val.swap(hll);
+    mem_track(entry);
+}
+
+// PFADD key [element ...]. Replies 1 if the estimate may have changed. A shared or compressed
+// HLL is edited in its decoded copy, which only replaces the value if a register changed
+static void do_pfadd(std::vector<std::string> &cmd, Writer &out) {
+    Entry *entry = entry_find(cmd[1]);
+    bool created = false;
+    if(!entry) {
+        entry = entry_new(cmd[1], T_STR);
+        hll_init(entry->val);
+        created = true;
+    }
+
+    std::string buf;
+    const std::string *view = entry_hll(entry, buf);
+    if(!view) {
+        return out_err(out, ERR_TYPE, "Key is not a valid HyperLogLog string");
+    }
+
+    std::string &hll = view == &entry->val ? entry->val : buf;
+    bool changed = false;
+    for(size_t i = 2; i < cmd.size(); ++i) {
+        changed = hll_add(hll, (const uint8_t *)cmd[i].data(), cmd[i].size()) || changed;
+    }
+    if(changed && &hll == &buf) {
+        entry_set_hll(entry, buf);
+    } else if(changed || created) {
+        mem_track(entry);
+    }
+
+    return out_int(out, changed || created ? 1 : 0);
+}
+
+// Merges the HLLs of cmd[first:] into regs. Missing keys count as empty
+static bool pf_merge_keys(std::vector<std::string> &cmd, size_t first, uint8_t *regs, Writer &out) {
+    std::string buf;
+    for(size_t i = first; i < cmd.size(); ++i) {
+        Entry *entry = entry_find(cmd[i]);
+        if(!entry) {
+            continue;
+        }
+
+        const std::string *hll = entry_hll(entry, buf);
+        if(!hll) {
+            out_err(out, ERR_TYPE, "Key is not a valid HyperLogLog string");
+            return false;
+        }
+        hll_merge(regs, *hll);
+    }
+    return true;
+}
+
+// PFCOUNT key [key ...]. A single key uses the cached estimate, several are counted as their union.
+// Only reads: a stale estimate is recomputed without being stored
+static void do_pfcount(std::vector<std::string> &cmd, Writer &out) {
+    if(cmd.size() == 2) {
+        Entry *entry = entry_find(cmd[1]);
+        if(!entry) {
+            return out_int(out, 0);
+        }
+
+        std::string buf;
+        const std::string *hll = entry_hll(entry, buf);
+        if(!hll) {
+            return out_err(out, ERR_TYPE, "Key is not a valid HyperLogLog string");
+        }
+        return out_int(out, (int64_t)hll_count(*hll));
+    }
+
+    std::vector<uint8_t> regs(k_hll_registers, 0);
+    if(!pf_merge_keys(cmd, 1, regs.data(), out)) {
+        return;
+    }
+    return out_int(out, (int64_t)hll_count_regs(regs.data()));
+}
+
+// PFMERGE destkey [sourcekey ...]. The destination is part of the union, and is stored dense with
+// its estimate cached
+static void do_pfmerge(std::vector<std::string> &cmd, Writer &out) {
+    std::vector<uint8_t> regs(k_hll_registers, 0);
+    if(!pf_merge_keys(cmd, 1, regs.data(), out)) {
+        return;
+    }
+
+    Entry *entry = entry_find(cmd[1]);
+    if(!entry) {
+        entry = entry_new(cmd[1], T_STR);
+    }
+    std::string hll;
+    hll_from_regs(hll, regs.data());
+    entry_set_hll(entry, hll);
+
+    return out_nil(out);
+}
+
+static bool conn_subscribed(Connection *conn) {
+    return !conn->channels.empty() || !conn->patterns.empty();
+}
+
+static void out_sub_reply(Writer &out, const char *kind, const std::string *name, Connection *conn) {
+    out_push(out, 3);
+    out_str(out, std::string(kind));
+    if(name) {
+        out_str(out, *name);
+    } else {
+        out_nil(out);
+    }
+    out_int(out, (int64_t)(conn->channels.size() + conn->patterns.size()));
+}
+
+static bool names_remove(std::vector<std::string> &names, const std::string &name) {
+    for(size_t i = 0; i < names.size(); ++i) {
+        if(names[i] == name) {
+            names[i].swap(names.back());
+            names.pop_back();
+            return true;
+        }
+    }
+    return false;
+}
+
+// (P)SUBSCRIBE name [name ...]. One [kind, name, subscription count] triple per name
+static void subscribe(std::vector<std::string> &cmd, Writer &out, bool pattern) {
+    Connection *conn = g_data.client;
+    if(!conn) {
+        return out_err(out, ERR_UNKNOWN, "No connection");
+    }
+
+    out_split(out, (uint32_t)(cmd.size() - 1));
+    for(size_t i = 1; i < cmd.size(); ++i) {
+        if(pattern && ps_psubscribe(&g_data.pubsub, cmd[i], conn)) {
+            conn->patterns.push_back(cmd[i]);
+        } else if(!pattern && ps_subscribe(&g_data.pubsub, cmd[i], conn)) {
+            conn->channels.push_back(cmd[i]);
+        }
+        out_sub_reply(out, pattern ? "psubscribe" : "subscribe", &cmd[i], conn);
+    }
+}
+
+// (P)UNSUBSCRIBE [name ...]. Without names, drops every subscription of that kind
+static void unsubscribe(std::vector<std::string> &cmd, Writer &out, bool pattern) {
+    Connection *conn = g_data.client;
+    if(!conn) {
+        return out_err(out, ERR_UNKNOWN, "No connection");
+    }
+
+    const char *kind = pattern ? "punsubscribe" : "unsubscribe";
+    std::vector<std::string> &names = pattern ? conn->patterns : conn->channels;
+    std::vector<std::string> targets(cmd.begin() + 1, cmd.end());
+    if(targets.empty()) {
+        targets = names;
+    }
+    if(targets.empty()) {
+        out_split(out, 1);
+        return out_sub_reply(out, kind, NULL, conn);
+    }
+
+    out_split(out, (uint32_t)targets.size());
+    for(const std::string &name : targets) {
+        if(names_remove(names, name)) {
+            if(pattern) {
+                ps_punsubscribe(&g_data.pubsub, name, conn);
+            } else {
+                ps_unsubscribe(&g_data.pubsub, name, conn);
+            }
+        }
+        out_sub_reply(out, kind, &name, conn);
+    }
+}
+
+// PING [message]
+// PING [message]. A subscribed RESP2 or TLV connection gets ["pong", message] instead, like
+// its other replies in subscribed mode
+static void do_ping(std::vector<std::string> &cmd, Writer &out) {
+    Connection *conn = g_data.client;
+    if(conn && conn_subscribed(conn) && conn->proto != PROTO_RESP3) {
+        out_arr(out, 2);
+        out_str(out, std::string("pong"));
+        return out_str(out, cmd.size() > 1 ? cmd[1] : std::string());
+    }
+    return out_str(out, cmd.size() > 1 ? cmd[1] : std::string("PONG"));
+}
+
+// HELLO [2|3]. Switches a RESP connection between RESP2 and RESP3
+static void do_hello(std::vector<std::string> &cmd, Writer &out) {
+    Connection *conn = g_data.client;
+    if(!conn) {
+        return out_err(out, ERR_UNKNOWN, "No connection");
+    }
+
+    if(cmd.size() > 1) {
+        int64_t ver = 0;
+        if(!str2int(cmd[1], ver) || (ver != 2 && ver != 3)) {
+            return out_err(out, ERR_NOPROTO, "unsupported protocol version");
+        }
+        if(conn->proto != PROTO_TLV) {
+            conn->proto = ver == 3 ? PROTO_RESP3 : PROTO_RESP2;
+        }
+    }
+
+    out_arr(out, 6);
+    out_str(out, std::string("server"));
+    out_str(out, std::string("redis-c"));
+    out_str(out, std::string("proto"));
+    out_int(out, conn->proto == PROTO_RESP3 ? 3 : 2);
+    out_str(out, std::string("mode"));
+    out_str(out, std::string("standalone"));
+}
+
+static void do_subscribe(std::vector<std::string> &cmd, Writer &out) {
+    subscribe(cmd, out, false);
+}
+
+static void do_psubscribe(std::vector<std::string> &cmd, Writer &out) {
+    subscribe(cmd, out, true);
+}
+
+static void do_unsubscribe(std::vector<std::string> &cmd, Writer &out) {
+    unsubscribe(cmd, out, false);
+}
+
+static void do_punsubscribe(std::vector<std::string> &cmd, Writer &out) {
+    unsubscribe(cmd, out, true);
+}
+
+struct Publish {
+    const std::string *channel;
+    const std::string *message;
+    int64_t receivers;
+};
+
+// One serialization per channel or pattern and protocol, shared by all of its subscribers
+static void cb_publish(const std::string *pattern, const std::vector<void *> &subs, void *arg) {
+    Publish &pub = *(Publish *)arg;
+
+    MsgBuf *bufs[PROTO_RESP3 + 1] = {};
+    uint8_t frame[4 + k_max_msg];
+    for(void *sub : subs) {
+        Connection *conn = (Connection *)sub;
+        MsgBuf *&buf = bufs[conn->proto];
+        if(!buf) {
+            Writer w;
+            out_begin(w, conn->proto, frame, sizeof(frame));
+            out_push(w, pattern ? 4 : 3);
+            out_str(w, std::string(pattern ? "pmessage" : "message"));
+            if(pattern) {
+                out_str(w, *pattern);
+            }
+            out_str(w, *pub.channel);
+            out_str(w, *pub.message);
+            if(!out_end(w)) {
+                break; // Clients can't read it. Only a long pattern gets here
+            }
+            buf = msgbuf_new(frame, w.len);
+        }
+        pub.receivers += conn_queue(conn, buf) ? 1 : 0;
+    }
+
+    for(MsgBuf *buf : bufs) {
+        if(buf) {
+            msgbuf_unref(buf);
+        }
+    }
+}
+
+// PUBLISH channel message. Replies with the number of receivers
+static void do_publish(std::vector<std::string> &cmd, Writer &out) {
+    Publish pub = {&cmd[1], &cmd[2], 0};
+    ps_publish(&g_data.pubsub, cmd[1], &cb_publish, &pub);
+    return out_int(out, pub.receivers);
+}
+
+const size_t k_rewrite_batch = 64; // elements per command when rewriting collections
+
+// Collects HSET args. cmd already holds "hset" and the key
+static void cb_rewrite_field(const uint8_t *field, uint32_t flen, const uint8_t *val, uint32_t vlen, void *arg) {
+    std::vector<std::string> &cmd = *(std::vector<std::string> *)arg;
+    cmd.push_back(std::string((const char *)field, flen));
+    cmd.push_back(std::string((const char *)val, vlen));
+
+    if(cmd.size() - 2 == 2 * k_rewrite_batch) {
+        aof_rewrite_feed(cmd);
+        cmd.resize(2);
+    }
+}
+
+// Collects SADD args. cmd already holds "sadd" and the key
+static void cb_rewrite_member(const char *data, uint32_t len, void *arg) {
+    std::vector<std::string> &cmd = *(std::vector<std::string> *)arg;
+    cmd.push_back(std::string(data, len));
+
+    if(cmd.size() - 2 == k_rewrite_batch) {
+        aof_rewrite_feed(cmd);
+        cmd.resize(2);
+    }
+}
+
+static void cb_rewrite(HNode *node, void *arg) {
+    (void)arg;
+    Entry *entry = container_of(node, Entry, node);
+
+    if(entry->type == T_STR) {
+        std::string buf;
+        aof_rewrite_feed({"set", entry->key, entry_strval(entry, buf)});
+    } else if(entry->type == T_LIST) {
+        std::vector<std::string> cmd;
+        ListIter iter;
+        const uint8_t *data = NULL;
+        uint32_t len = 0;
+
+        list_seek(entry->list, 0, &iter);
+        while(list_next(&iter, &data, &len)) {
+            if(cmd.empty()) {
+                cmd.push_back("rpush");
+                cmd.push_back(entry->key);
+            }
+            cmd.push_back(std::string((const char *)data, len));
+
+            if(cmd.size() - 2 == k_rewrite_batch) {
+                aof_rewrite_feed(cmd);
+                cmd.clear();
+            }
+        }
+
+        if(!cmd.empty()) {
+            aof_rewrite_feed(cmd);
+        }
+    } else if(entry->type == T_SET) {
+        std::vector<std::string> cmd = {"sadd", entry->key};
+        set_scan(entry->set, &cb_rewrite_member, &cmd);
+        if(cmd.size() > 2) {
+            aof_rewrite_feed(cmd);
+        }
+    } else if(entry->type == T_HASH) {
+        std::vector<std::string> cmd = {"hset", entry->key};
+        hash_scan(entry->hash, &cb_rewrite_field, &cmd);
+        if(cmd.size() > 2) {
+            aof_rewrite_feed(cmd);
+        }
+    }
+}
+
+// Compacts the append-only log down to one command per live key. Returns an error message,
+// NULL on success
+static const char *rewrite_aof() {
+    if(0 != aof_rewrite_begin()) {
+        return "Can't start log rewrite";
+    }
+
+    h_scan(&g_data.db.h1, &cb_rewrite, NULL);
+    h_scan(&g_data.db.h2, &cb_rewrite, NULL);
+
+    if(0 != aof_rewrite_end()) {
+        return "Log rewrite failed";
+    }
+    return NULL;
+}
+
+static void do_rewriteaof(std::vector<std::string> &cmd, Writer &out) {
+    (void)cmd;
+    if(!aof_enabled()) {
+        return out_err(out, ERR_UNKNOWN, "Append-only log is disabled");
+    }
+
+    if(const char *err = rewrite_aof()) {
+        return out_err(out, ERR_UNKNOWN, err);
+    }
+    return out_nil(out);
+}
+
+enum {
+    SNAP_T_STR = 0,
+    SNAP_T_LIST = 1, // elements as (len u32 - bytes)*
+    SNAP_T_HASH = 2, // pairs as (len u32 - field - len u32 - val)*
+    SNAP_T_SET = 3,  // members as (len u32 - bytes)*
+};
+
+static void cb_save_member(const char *data, uint32_t len, void *arg) {
+    std::string &out = *(std::string *)arg;
+    out.append((char *)&len, 4);
+    out.append(data, len);
+}
+
+static void cb_save_field(const uint8_t *field, uint32_t flen, const uint8_t *val, uint32_t vlen, void *arg) {
+    std::string &out = *(std::string *)arg;
+    out.append((char *)&flen, 4);
+    out.append((const char *)field, flen);
+    out.append((char *)&vlen, 4);
+    out.append((const char *)val, vlen);
+}
+
+static void cb_save(HNode *node, void *arg) {
+    SnapWriter &w = *(SnapWriter *)arg;
+    Entry *entry = container_of(node, Entry, node);
+
+    if(entry->type == T_STR) {
+        std::string buf;
+        snap_write_record(w, SNAP_T_STR, entry->key, entry_strval(entry, buf));
+    } else if(entry->type == T_LIST) {
+        std::string val;
+        ListIter iter;
+        const uint8_t *data = NULL;
+        uint32_t len = 0;
+
+        list_seek(entry->list, 0, &iter);
+        while(list_next(&iter, &data, &len)) {
+            val.append((char *)&len, 4);
+            val.append((const char *)data, len);
+        }
+        snap_write_record(w, SNAP_T_LIST, entry->key, val);
+    } else if(entry->type == T_HASH) {
+        std::string val;
+        hash_scan(entry->hash, &cb_save_field, &val);
+        snap_write_record(w, SNAP_T_HASH, entry->key, val);
+    } else if(entry->type == T_SET) {
+        std::string val;
+        set_scan(entry->set, &cb_save_member, &val);
+        snap_write_record(w, SNAP_T_SET, entry->key, val);
+    }
+}
+
+// Returns an error message, NULL on success
+static const char *save_snapshot(const char *path) {
+    SnapWriter w;
+    if(0 != snap_write_begin(w, path, hm_size(&g_data.db))) {
+        return "Can't open snapshot file";
+    }
+
+    h_scan(&g_data.db.h1, &cb_save, &w);
+    h_scan(&g_data.db.h2, &cb_save, &w);
+
+    if(0 != snap_write_end(w)) {
+        return "Snapshot write failed";
+    }
+    return NULL;
+}
+
+static void do_save(std::vector<std::string> &cmd, Writer &out) {
+    (void)cmd;
+    if(const char *err = save_snapshot(g_data.snapshot_path.c_str())) {
+        return out_err(out, ERR_UNKNOWN, err);
+    }
+    return out_nil(out);
+}
+
+// Runs on the snapshot loader threads. Builds the entry without touching the keyspace
+static HNode *snap_decode_entry(const SnapRecord &rec) {
+    Entry *entry = entry_alloc();
+    entry->key.assign((char *)rec.key, rec.klen);
+    entry->node.hcode = str_hash(rec.key, rec.klen);
+
+    if(rec.type == SNAP_T_STR) {
+        std::string val((char *)rec.val, rec.vlen);
+        entry_set_str(entry, val);
+    } else if(rec.type == SNAP_T_LIST) {
+        entry->type = T_LIST;
+        entry->list = new List();
+
+        size_t pos = 0;
+        while(pos + 4 <= rec.vlen) {
+            uint32_t len = 0;
+            memcpy(&len, &rec.val[pos], 4);
+            if(pos + 4 + len > rec.vlen) {
+                break;
+            }
+            list_push(entry->list, false, &rec.val[pos + 4], len);
+            pos += 4 + len;
+        }
+
+        if(pos != rec.vlen || entry->list->len == 0) {
+            entry_del(entry);
+            return NULL;
+        }
+    } else if(rec.type == SNAP_T_HASH) {
+        entry->type = T_HASH;
+        entry->hash = new Hash();
+
+        size_t pos = 0;
+        std::string field, val;
+        while(pos + 4 <= rec.vlen) {
+            uint32_t flen = 0, vlen = 0;
+            memcpy(&flen, &rec.val[pos], 4);
+            if(pos + 4 + flen + 4 > rec.vlen) {
+                break;
+            }
+            memcpy(&vlen, &rec.val[pos + 4 + flen], 4);
+            if(pos + 4 + flen + 4 + vlen > rec.vlen) {
+                break;
+            }
+
+            field.assign((const char *)&rec.val[pos + 4], flen);
+            val.assign((const char *)&rec.val[pos + 4 + flen + 4], vlen);
+            hash_set(entry->hash, field, val);
+            pos += 4 + flen + 4 + vlen;
+        }
+
+        if(pos != rec.vlen || entry->hash->len == 0) {
+            entry_del(entry);
+            return NULL;
+        }
+    } else if(rec.type == SNAP_T_SET) {
+        entry->type = T_SET;
+        entry->set = new Set();
+
+        size_t pos = 0;
+        while(pos + 4 <= rec.vlen) {
+            uint32_t len = 0;
+            memcpy(&len, &rec.val[pos], 4);
+            if(pos + 4 + len > rec.vlen) {
+                break;
+            }
+            set_add(entry->set, std::string((const char *)&rec.val[pos + 4], len));
+            pos += 4 + len;
+        }
+
+        if(pos != rec.vlen || entry->set->len == 0) {
+            entry_del(entry);
+            return NULL;
+        }
+    } else {
+        entry_del(entry);
+        return NULL;
+    }
+    mem_track(entry);
+
+    return &entry->node;
+}
+
+static void snap_destroy_entry(HNode *node) {
+    entry_del(container_of(node, Entry, node));
+}
+
+// Adds a write to the replication stream, once there is a backlog
+static void repl_feed(const std::vector<std::string> &cmd) {
+    if(!backlog_enabled(&g_data.backlog)) {
+        return;
+    }
+
+    size_t pos = g_data.repl_pending.size();
+    aof_encode(g_data.repl_pending, cmd);
+    backlog_append(&g_data.backlog, (const uint8_t *)&g_data.repl_pending[pos], g_data.repl_pending.size() - pos);
+}
+
+// Queues the next snapshot chunks for a replica in a full resync. Once the snapshot is out,
+// the stream from its offset follows out of the backlog and it goes online
+static void repl_serve(Connection *conn) {
+    while(conn->snap_fd >= 0 && conn->out_queue_bytes < k_repl_queued && conn->state != STATE_END) {
+        uint8_t buf[k_repl_chunk];
+        size_t n = conn->snap_left < k_repl_chunk ? (size_t)conn->snap_left : k_repl_chunk;
+        ssize_t rv = 0;
+        do {
+            rv = read(conn->snap_fd, buf, n);
+        } while(rv < 0 && errno == EINTR);
+        if(rv <= 0) {
+            msg("snapshot read() error");
+            conn->state = STATE_END;
+            return;
+        }
+
+        MsgBuf *mb = msgbuf_new(buf, (size_t)rv);
+        conn_queue(conn, mb);
+        msgbuf_unref(mb);
+        conn->snap_left -= (uint64_t)rv;
+        if(conn->snap_left == 0) {
+            (void)close(conn->snap_fd);
+            conn->snap_fd = -1;
+        }
+    }
+    if(conn->snap_fd >= 0 || conn->state == STATE_END) {
+        return;
+    }
+
+    std::string stream;
+    if(!backlog_read(&g_data.backlog, conn->repl_offset, stream)) {
+        msg("replica fell behind the backlog");
+        conn->state = STATE_END;
+        return;
+    }
+    if(!stream.empty()) {
+        MsgBuf *mb = msgbuf_new((const uint8_t *)stream.data(), stream.size());
+        conn_queue(conn, mb);
+        msgbuf_unref(mb);
+    }
+    conn->repl_online = true;
+}
+
+// Sends the writes of this event loop iteration to the online replicas, and moves the others
+// along. Runs once per iteration, like aof_flush()
+static void repl_flush() {
+    MsgBuf *mb = NULL;
+    for(Connection *conn : g_data.replicas) {
+        if(!conn->repl_online) {
+            repl_serve(conn);
+        } else if(!g_data.repl_pending.empty()) {
+            if(!mb) {
+                mb = msgbuf_new((const uint8_t *)g_data.repl_pending.data(), g_data.repl_pending.size());
+            }
+            conn_queue(conn, mb);
+        }
+    }
+    if(mb) {
+        msgbuf_unref(mb);
+    }
+    g_data.repl_pending.clear();
+}
+
+// PSYNC replid offset, from a replica. Replies CONTINUE or FULLRESYNC, see repl.h. Whatever
+// follows is queued by repl_serve(), behind the reply
+static void do_psync(std::vector<std::string> &cmd, Writer &out) {
+    Connection *conn = g_data.client;
+    int64_t offset = 0;
+    if(!conn || conn->primary) {
+        return out_err(out, ERR_ARG, "PSYNC is only for replicas");
+    }
+    if(!str2int(cmd[2], offset)) {
+        return out_err(out, ERR_ARG, "Expect int offset");
+    }
+
+    ReplBacklog &bl = g_data.backlog;
+    if(!backlog_enabled(&bl)) {
+        backlog_init(&bl, g_data.backlog_size, 0);
+    }
+
+    char reply[128];
+    if(cmd[1] == g_data.replid && offset >= 0 && (uint64_t)offset >= bl.start && (uint64_t)offset <= bl.end) {
+        conn->repl_offset = (uint64_t)offset;
+        snprintf(reply, sizeof(reply), "CONTINUE %s %lu", g_data.replid.c_str(), (unsigned long)offset);
+    } else {
+        // The file is gone once the fd is closed
+        std::string path = g_data.snapshot_path + ".repl";
+        if(const char *err = save_snapshot(path.c_str())) {
+            return out_err(out, ERR_UNKNOWN, err);
+        }
+        int fd = open(path.c_str(), O_RDONLY);
+        struct stat st = {};
+        (void)unlink(path.c_str());
+        if(fd < 0 || 0 != fstat(fd, &st)) {
+            if(fd >= 0) {
+                (void)close(fd);
+            }
+            return out_err(out, ERR_UNKNOWN, "Can't read the snapshot");
+        }
+
+        conn->snap_fd = st.st_size > 0 ? fd : -1;
+        conn->snap_left = (uint64_t)st.st_size;
+        if(conn->snap_fd < 0) {
+            (void)close(fd);
+        }
+        conn->repl_offset = bl.end;
+        snprintf(reply, sizeof(reply), "FULLRESYNC %s %lu %lu", g_data.replid.c_str(),
+                 (unsigned long)bl.end, (unsigned long)st.st_size);
+    }
+
+    conn->replica = true;
+    g_data.replicas.push_back(conn);
+    return out_str(out, std::string(reply));
+}
+
+// Replaces the data set with the snapshot that follows a FULLRESYNC
+static int32_t replica_load(int fd, const ReplSync &sync) {
+    std::string path = g_data.snapshot_path + ".sync";
+    if(0 != repl_recv_file(fd, path.c_str(), sync.snap_bytes)) {
+        (void)unlink(path.c_str());
+        return -1;
+    }
+
+    flush_db(true);
+    int64_t nkeys = snap_load(path.c_str(), &g_data.db, g_data.loader_threads, &snap_decode_entry, &snap_destroy_entry);
+    (void)unlink(path.c_str());
+    if(nkeys < 0) {
+        return -1;
+    }
+    fprintf(stderr, "loaded %ld keys from the primary\n", (long)nkeys);
+
+    g_data.replid = sync.replid;
+    backlog_init(&g_data.backlog, g_data.backlog_size, sync.offset);
+    // They followed the old data set
+    for(Connection *conn : g_data.replicas) {
+        conn->state = STATE_END;
+    }
+    if(aof_enabled()) {
+        if(const char *err = rewrite_aof()) {
+            msg(err);
+        }
+    }
+    return 0;
+}
+
+// Brings the link to the primary back up, at most every k_repl_retry_ms. The handshake and a
+// full resync block the event loop, like loading a snapshot at startup
+static void replica_cron(std::vector<Connection *> &fd_to_connections) {
+    uint64_t now = stats_now_ms();
+    if(g_data.primary_host.empty() || g_data.primary || now - g_data.primary_retry_ms < k_repl_retry_ms) {
+        return;
+    }
+    g_data.primary_retry_ms = now;
+
+    int fd = repl_connect(g_data.primary_host.c_str(), g_data.primary_port);
+    if(fd < 0) {
+        msg("can't connect to the primary");
+        return;
+    }
+
+    ReplSync sync;
+    bool have = backlog_enabled(&g_data.backlog);
+    if(0 != repl_handshake(fd, have ? g_data.replid : "?", have ? (int64_t)g_data.backlog.end : -1, &sync) ||
+       (sync.full && 0 != replica_load(fd, sync))) {
+        msg("sync with the primary failed");
+        (void)close(fd);
+        return;
+    }
+    fprintf(stderr, "%s with the primary at offset %lu\n", sync.full ? "full resync" : "continuing",
+            (unsigned long)sync.offset);
+
+    set_fd_nb(fd);
+    Connection *conn = new Connection();
+    conn->fd = fd;
+    conn->state = STATE_REQ;
+    conn->proto = PROTO_TLV;
+    conn->primary = true;
+    conn_put(fd_to_connections, conn);
+    g_data.primary = conn;
+    g_data.stat_clients++;
+}
+
+// REPLICAOF host port | REPLICAOF NO ONE
+static void do_replicaof(std::vector<std::string> &cmd, Writer &out) {
+    int64_t port = 0;
+    bool none = cmd_is(cmd[1], "no") && cmd_is(cmd[2], "one");
+    if(!none && (!str2int(cmd[2], port) || port <= 0 || port > 65535)) {
+        return out_err(out, ERR_ARG, "Expect REPLICAOF host port | REPLICAOF NO ONE");
+    }
+
+    if(g_data.primary) {
+        g_data.primary->state = STATE_END;
+    }
+    if(none) {
+        // Writes from here on are a history of its own
+        if(!g_data.primary_host.empty()) {
+            g_data.replid = repl_new_id();
+        }
+        g_data.primary_host.clear();
+        g_data.primary_port = 0;
+    } else {
+        g_data.primary_host = cmd[1];
+        g_data.primary_port = (uint16_t)port;
+        g_data.primary_retry_ms = 0;
+    }
+    return out_nil(out);
+}
+
+enum {
+    INFO_SERVER = 1 << 0,
+    INFO_CLIENTS = 1 << 1,
+    INFO_MEMORY = 1 << 2,
+    INFO_STATS = 1 << 3,
+    INFO_KEYSPACE = 1 << 4,
+    INFO_COMMANDS = 1 << 5,
+    INFO_LATENCY = 1 << 6,
+    INFO_REPLICATION = 1 << 7,
+    INFO_HISTOGRAM = 1 << 8,
+    INFO_DEFAULT = INFO_SERVER | INFO_CLIENTS | INFO_MEMORY | INFO_STATS | INFO_KEYSPACE | INFO_REPLICATION,
+    INFO_ALL = INFO_DEFAULT | INFO_COMMANDS | INFO_LATENCY | INFO_HISTOGRAM,
+};
+
+// The reply is one string in one message. Room is left for its header in any protocol
+const size_t k_info_max = k_max_msg - 16;
+const char k_info_cut[] = "# Truncated\r\n";
+
+static void info_add(std::string &s, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+
+static void info_add(std::string &s, const char *fmt, ...) {
+    char buf[512];
+    va_list ap;
+    va_start(ap, fmt);
+    int n = vsnprintf(buf, sizeof(buf), fmt, ap);
+    va_end(ap);
+    if(n > 0) {
+        s.append(buf, (size_t)n < sizeof(buf) ? (size_t)n : sizeof(buf) - 1);
+    }
+}
+
+static void info_commands(std::string &s, uint32_t sections);
+
+// Drops the lines that don't fit, and says so in a last line
+static void info_fit(std::string &s) {
+    if(s.size() <= k_info_max) {
+        return;
+    }
+    size_t room = k_info_max - (sizeof(k_info_cut) - 1);
+    size_t cut = s.rfind("\r\n", room - 2);
+    s.resize(cut == std::string::npos ? 0 : cut + 2);
+    s += k_info_cut;
+}
+
+static uint32_t info_section(const std::string &name) {
+    static const struct {
+        const char *name;
+        uint32_t bits;
+    } k_sections[] = {
+        {"server", INFO_SERVER},        {"clients", INFO_CLIENTS},   {"memory", INFO_MEMORY},
+        {"stats", INFO_STATS},          {"keyspace", INFO_KEYSPACE}, {"commandstats", INFO_COMMANDS},
+        {"latencystats", INFO_LATENCY}, {"latencyhistogram", INFO_HISTOGRAM},
+        {"replication", INFO_REPLICATION},
+        {"default", INFO_DEFAULT},      {"all", INFO_ALL},
+    };
+    for(const auto &sec : k_sections) {
+        if(cmd_is(name, sec.name)) {
+            return sec.bits;
+        }
+    }
+    return 0;
+}
+
+// INFO [section ...]. Text of "key:value" lines under "# Section" headers. The per-command
+// sections grow with every command used, so they are only in "all" or when asked for by name.
+// Whatever doesn't fit in one message is cut off at a line and ends with "# Truncated"
+static void do_info(std::vector<std::string> &cmd, Writer &out) {
+    uint32_t sections = cmd.size() > 1 ? 0 : INFO_DEFAULT;
+    for(size_t i = 1; i < cmd.size(); ++i) {
+        uint32_t bits = info_section(cmd[i]);
+        if(!bits) {
+            return out_err(out, ERR_ARG, "Unknown INFO section");
+        }
+        sections |= bits;
+    }
+
+    std::string s;
+    if(sections & INFO_SERVER) {
+        info_add(s, "# Server\r\n");
+        info_add(s, "process_id:%ld\r\n", (long)getpid());
+        info_add(s, "uptime_in_seconds:%lu\r\n", (unsigned long)((stats_now_ms() - g_data.start_ms) / 1000));
+        info_add(s, "aof_enabled:%d\r\n", aof_enabled() ? 1 : 0);
+    }
+    if(sections & INFO_CLIENTS) {
+        info_add(s, "# Clients\r\n");
+        info_add(s, "connected_clients:%lu\r\n", (unsigned long)g_data.stat_clients);
+        info_add(s, "pubsub_channels:%lu\r\n", (unsigned long)hm_size(&g_data.pubsub.channels));
+        info_add(s, "pubsub_patterns:%lu\r\n", (unsigned long)g_data.pubsub.patterns.size());
+    }
+    if(sections & INFO_MEMORY) {
+        AllocStats as;
+        bool have_alloc = stats_alloc(&as);
+        size_t rss = stats_rss();
+        uint64_t lzf_raw = g_data.lzf_raw_bytes.load(), lzf = g_data.lzf_bytes.load();
+        // Slabs are mmapped outside malloc, so they are added to what it reports, as in MEMORY STATS
+        SlabStats ss;
+        slab_stats(&ss);
+        size_t slab_bytes = ss.slabs * k_slab_size;
+        size_t used = as.allocated + slab_bytes;
+        info_add(s, "# Memory\r\n");
+        if(have_alloc) {
+            info_add(s, "used_memory:%lu\r\n", (unsigned long)used);
+            info_add(s, "allocator_allocated:%lu\r\n", (unsigned long)as.allocated);
+            info_add(s, "allocator_free:%lu\r\n", (unsigned long)as.free);
+            info_add(s, "allocator_mapped:%lu\r\n", (unsigned long)as.mapped);
+        }
+        info_add(s, "used_memory_slab:%lu\r\n", (unsigned long)slab_bytes);
+        info_add(s, "used_memory_rss:%lu\r\n", (unsigned long)rss);
+        InternStats is;
+        intern_stats(&is);
+        uint64_t dataset = mem_hmap(&g_data.db) + is.bytes;
+        for(const std::atomic<uint64_t> &bytes : g_data.mem_bytes) {
+            dataset += bytes.load(std::memory_order_relaxed);
+        }
+        info_add(s, "used_memory_dataset:%lu\r\n", (unsigned long)dataset);
+        info_add(s, "interned_values:%lu\r\n", (unsigned long)is.values);
+        info_add(s, "interned_refs:%lu\r\n", (unsigned long)is.refs);
+        if(have_alloc && used) {
+            info_add(s, "mem_fragmentation_ratio:%.2f\r\n", (double)rss / (double)used);
+        }
+        info_add(s, "compressed_keys:%lu\r\n", (unsigned long)g_data.lzf_keys.load());
+        info_add(s, "compressed_raw_bytes:%lu\r\n", (unsigned long)lzf_raw);
+        info_add(s, "compressed_bytes:%lu\r\n", (unsigned long)lzf);
+        info_add(s, "compression_ratio:%.2f\r\n", lzf ? (double)lzf_raw / (double)lzf : 1.0);
+        info_add(s, "lazyfree_pending_objects:%lu\r\n", (unsigned long)reclaim_pending());
+        info_add(s, "lazyfreed_objects:%lu\r\n", (unsigned long)reclaim_done());
+        info_add(s, "slab_fragmentation_ratio:%.2f\r\n",
+                 ss.used_bytes ? (double)(ss.slabs * k_slab_size) / (double)ss.used_bytes : 1.0);
+        info_add(s, "active_defrag_running:%d\r\n", g_data.defrag_running ? 1 : 0);
+    }
+    if(sections & INFO_STATS) {
+        info_add(s, "# Stats\r\n");
+        info_add(s, "total_connections_received:%lu\r\n", (unsigned long)g_data.stat_conns_total);
+        info_add(s, "total_commands_processed:%lu\r\n", (unsigned long)g_data.stat_cmds);
+        info_add(s, "instantaneous_ops_per_sec:%lu\r\n", (unsigned long)g_data.ops_per_sec);
+        info_add(s, "total_net_input_bytes:%lu\r\n", (unsigned long)g_data.stat_net_in);
+        info_add(s, "total_net_output_bytes:%lu\r\n", (unsigned long)g_data.stat_net_out);
+        info_add(s, "active_defrag_hits:%lu\r\n", (unsigned long)g_data.stat_defrag_hits);
+        info_add(s, "active_defrag_misses:%lu\r\n", (unsigned long)g_data.stat_defrag_misses);
+    }
+    if(sections & INFO_REPLICATION) {
+        const ReplBacklog &bl = g_data.backlog;
+        bool replica = !g_data.primary_host.empty();
+        info_add(s, "# Replication\r\n");
+        info_add(s, "role:%s\r\n", replica ? "replica" : "primary");
+        if(replica) {
+            info_add(s, "primary_host:%s\r\n", g_data.primary_host.c_str());
+            info_add(s, "primary_port:%u\r\n", (unsigned)g_data.primary_port);
+            info_add(s, "primary_link_status:%s\r\n", g_data.primary ? "up" : "down");
+        }
+        info_add(s, "connected_replicas:%lu\r\n", (unsigned long)g_data.replicas.size());
+        for(size_t i = 0; i < g_data.replicas.size(); ++i) {
+            const Connection *conn = g_data.replicas[i];
+            info_add(s, "replica%lu:fd=%d,state=%s,queued_bytes=%lu\r\n", (unsigned long)i, conn->fd,
+                     conn->repl_online ? "online" : "sync", (unsigned long)conn->out_queue_bytes);
+        }
+        info_add(s, "replid:%s\r\n", g_data.replid.c_str());
+        info_add(s, "repl_offset:%lu\r\n", (unsigned long)bl.end);
+        info_add(s, "repl_backlog_active:%d\r\n", backlog_enabled(&bl) ? 1 : 0);
+        info_add(s, "repl_backlog_size:%lu\r\n", (unsigned long)bl.buf.size());
+        info_add(s, "repl_backlog_first_byte_offset:%lu\r\n", (unsigned long)bl.start);
+    }
+    if(sections & INFO_KEYSPACE) {
+        HMap &db = g_data.db;
+        info_add(s, "# Keyspace\r\n");
+        info_add(s, "keys:%lu\r\n", (unsigned long)hm_size(&db));
+        info_add(s, "ht_buckets:%lu\r\n", (unsigned long)(db.h1.tab ? db.h1.mask + 1 : 0));
+        info_add(s, "rehashing:%d\r\n", db.h2.tab ? 1 : 0);
+        if(db.h2.tab) {
+            info_add(s, "rehash_old_buckets:%lu\r\n", (unsigned long)(db.h2.mask + 1));
+            info_add(s, "rehash_old_keys:%lu\r\n", (unsigned long)db.h2.size);
+            info_add(s, "resizing_pos:%lu\r\n", (unsigned long)db.resizing_pos);
+        }
+    }
+    info_commands(s, sections);
+    info_fit(s);
+
+    out_str(out, s);
+}
+
+static void out_slow_entry(Writer &out, size_t i, void *arg) {
+    const SlowEntry *e = slowlog_get((const SlowLog *)arg, i);
+    out_arr(out, 5);
+    out_int(out, (int64_t)e->id);
+    out_int(out, (int64_t)e->time);
+    out_int(out, (int64_t)e->duration_us);
+    out_arr(out, (uint32_t)e->args.size());
+    for(const std::string &arg : e->args) {
+        out_str(out, arg);
+    }
+    out_int(out, e->fd);
+}
+
+// SLOWLOG GET [count] | LEN | RESET. GET replies with the newest entries first, each as
+// [id, unix time, microseconds, [args...], client fd]. It stops at as many as fit in one
+// reply, so fewer than count can come back even when the log holds more
+static void do_slowlog(std::vector<std::string> &cmd, Writer &out) {
+    SlowLog &log = g_data.slowlog;
+    if(cmd_is(cmd[1], "len") && cmd.size() == 2) {
+        return out_int(out, (int64_t)log.len);
+    }
+    if(cmd_is(cmd[1], "reset") && cmd.size() == 2) {
+        slowlog_reset(&log);
+        return out_nil(out);
+    }
+    if(!cmd_is(cmd[1], "get") || cmd.size() > 3) {
+        return out_err(out, ERR_ARG, "Expect SLOWLOG GET [count] | LEN | RESET");
+    }
+
+    int64_t count = 10;
+    if(cmd.size() == 3 && (!str2int(cmd[2], count) || count < 0)) {
+        return out_err(out, ERR_ARG, "Expect int");
+    }
+
+    size_t n = out_fit(out, std::min((size_t)count, log.len), &out_slow_entry, &log);
+    out_arr(out, (uint32_t)n);
+    for(size_t i = 0; i < n; ++i) {
+        out_slow_entry(out, i, &log);
+    }
+}
+
+// Works out instantaneous_ops_per_sec about once a second, from the event loop
+static void stats_sample_ops() {
+    uint64_t now = stats_now_ms();
+    if(now - g_data.ops_sample_ms < 1000) {
+        return;
+    }
+    g_data.ops_per_sec = (g_data.stat_cmds - g_data.ops_sample_cmds) * 1000 / (now - g_data.ops_sample_ms);
+    g_data.ops_sample_ms = now;
+    g_data.ops_sample_cmds = g_data.stat_cmds;
+}
+
+// Moves the entry, and the nodes of a small hash or set, off sparse slabs. The entry is
+// moved with its HNode, so next is carried over and hm_relocate() relinks it
+static HNode *defrag_entry(HNode *node, void *) {
+    Entry *entry = container_of(node, Entry, node);
+    size_t moved = 0;
+    if(entry->type == T_HASH && entry->hash && entry->hash->len <= k_defrag_max_elems) {
+        moved += hash_defrag(entry->hash);
+    } else if(entry->type == T_SET && entry->set && entry->set->len <= k_defrag_max_elems) {
+        moved += set_defrag(entry->set);
+    }
+
+    void *dst = slab_should_move(entry) ? slab_alloc_dense(entry) : NULL;
+    if(dst) {
+        Entry *copy = new (dst) Entry(std::move(*entry));
+        entry->~Entry();
+        slab_free(entry);
+        node = &copy->node;
+        moved++;
+    }
+
+    g_data.defrag_pass_hits += moved;
+    g_data.stat_defrag_hits += moved;
+    g_data.stat_defrag_misses += moved ? 0 : 1;
+    return node;
+}
+
+// Free slab bytes, and whether they are over the threshold
+static bool defrag_needed(size_t *waste) {
+    SlabStats ss;
+    slab_stats(&ss);
+    size_t bytes = ss.slabs * k_slab_size;
+    *waste = bytes > ss.used_bytes ? bytes - ss.used_bytes : 0;
+    return *waste >= k_defrag_min_waste && (double)bytes >= g_data.defrag_threshold * (double)ss.used_bytes;
+}
+
+// Once the slabs hold too much free space, walks the keyspace a bucket at a time, for
+// k_defrag_cycle_ns per run, packing entries into fuller slabs until a pass is done. A pass
+// that moves nothing (every slab about as full as the others) isn't repeated until more
+// space has been freed
+static void active_defrag() {
+    size_t waste = 0;
+    if(!g_data.defrag_running) {
+        if(g_data.defrag_threshold <= 0 || !defrag_needed(&waste)) {
+            return;
+        }
+        if(g_data.defrag_stuck_waste && waste < g_data.defrag_stuck_waste + g_data.defrag_stuck_waste / 8) {
+            return;
+        }
+        g_data.defrag_running = true;
+        g_data.defrag_cursor = 0;
+        g_data.defrag_pass_hits = 0;
+    }
+
+    uint64_t start = stats_ticks();
+    size_t n = 0;
+    do {
+        g_data.defrag_cursor = hm_relocate(&g_data.db, g_data.defrag_cursor, &defrag_entry, NULL);
+    } while(g_data.defrag_cursor && (++n % 16 || stats_ticks_to_ns(stats_ticks() - start) < k_defrag_cycle_ns));
+
+    if(g_data.defrag_cursor == 0) {
+        g_data.defrag_running = false;
+        defrag_needed(&waste);
+        g_data.defrag_stuck_waste = g_data.defrag_pass_hits ? 0 : waste;
+    }
+}
+
+// Background work of the event loop, every k_cron_interval_ms. A resize otherwise only moves
+// keys when the keyspace is used, so it also finishes rehashing a bit at a time. Then it
+// takes a step of active defrag
+static void server_cron() {
+    uint64_t now = stats_now_ms();
+    if(now - g_data.cron_ms < k_cron_interval_ms) {
+        return;
+    }
+    g_data.cron_ms = now;
+
+    stats_sample_ops();
+
+    uint64_t start = stats_ticks();
+    while(hm_rehash(&g_data.db, k_cron_rehash_work)) {
+        if(stats_ticks_to_ns(stats_ticks() - start) >= k_cron_rehash_ns) {
+            break;
+        }
+    }
+
+    active_defrag();
+}
+
+static void out_hist_us(Writer &out, const char *name, const Hist *h) {
+    uint64_t counts[32];
+    size_t n = hist_log2(h, 1000, counts, 32);
+    uint32_t nonzero = 0;
+    for(size_t k = 0; k < n; ++k) {
+        nonzero += counts[k] ? 1 : 0;
+    }
+
+    out_arr(out, 7);
+    out_str(out, name);
+    out_int(out, (int64_t)h->total);
+    out_int(out, (int64_t)(hist_percentile(h, 50.0) / 1000));
+    out_int(out, (int64_t)(hist_percentile(h, 99.0) / 1000));
+    out_int(out, (int64_t)(hist_percentile(h, 99.9) / 1000));
+    out_int(out, (int64_t)(h->max / 1000));
+    out_arr(out, nonzero * 2);
+    for(size_t k = 0; k < n; ++k) {
+        if(counts[k]) {
+            out_int(out, (int64_t)1 << k);
+            out_int(out, (int64_t)counts[k]);
+        }
+    }
+}
+
+static void out_spike(Writer &out, size_t i, void *arg) {
+    const LatSpike *sp = lat_spike((const LatencyMonitor *)arg, i);
+    out_arr(out, 5);
+    out_int(out, (int64_t)sp->time);
+    out_int(out, (int64_t)(sp->busy_ns / 1000));
+    out_str(out, lat_phase_name(sp->phase));
+    out_int(out, sp->rehashing ? 1 : 0);
+    out_arr(out, PHASE_COUNT * 2);
+    for(uint32_t k = 0; k < PHASE_COUNT; ++k) {
+        out_str(out, lat_phase_name(k));
+        out_int(out, (int64_t)(sp->phase_ns[k] / 1000));
+    }
+}
+
+// LATENCY LATEST | SPIKES [count] | HISTOGRAM [phase...] | RESET
+//  LATEST: per phase blamed for a spike, [phase, unix time, latest ms, max ms]
+//  SPIKES: newest first, [unix time, busy usec, phase, rehashing, [phase, usec]...], as many
+//      as fit in one reply
+//  HISTOGRAM: per phase, and "busy" for whole iterations,
+//      [phase, count, p50, p99, p99.9, max, [bucket, count]...] in usec. Bucket b is (b/2, b]
+static void do_latency(std::vector<std::string> &cmd, Writer &out) {
+    LatencyMonitor &lat = g_data.latency;
+    if(cmd_is(cmd[1], "reset") && cmd.size() == 2) {
+        lat_reset(&lat);
+        return out_nil(out);
+    }
+    if(cmd_is(cmd[1], "latest") && cmd.size() == 2) {
+        uint32_t n = 0;
+        for(uint32_t i = 0; i < PHASE_COUNT; ++i) {
+            n += lat.last_time[i] ? 1 : 0;
+        }
+        out_arr(out, n);
+        for(uint32_t i = 0; i < PHASE_COUNT; ++i) {
+            if(lat.last_time[i]) {
+                out_arr(out, 4);
+                out_str(out, lat_phase_name(i));
+                out_int(out, (int64_t)lat.last_time[i]);
+                out_int(out, (int64_t)(lat.last_ns[i] / 1000000));
+                out_int(out, (int64_t)(lat.max_ns[i] / 1000000));
+            }
+        }
+        return;
+    }
+    if(cmd_is(cmd[1], "spikes") && cmd.size() <= 3) {
+        int64_t count = 10;
+        if(cmd.size() == 3 && (!str2int(cmd[2], count) || count < 0)) {
+            return out_err(out, ERR_ARG, "Expect int");
+        }
+
+        size_t n = out_fit(out, std::min((size_t)count, lat.nspikes), &out_spike, &lat);
+        out_arr(out, (uint32_t)n);
+        for(size_t i = 0; i < n; ++i) {
+            out_spike(out, i, &lat);
+        }
+        return;
+    }
+    if(cmd_is(cmd[1], "histogram")) {
+        std::vector<int32_t> phases;
+        for(size_t i = 2; i < cmd.size(); ++i) {
+            int32_t phase = cmd_is(cmd[i], "busy") ? PHASE_COUNT : lat_phase_parse(cmd[i].c_str());
+            if(phase < 0) {
+                return out_err(out, ERR_ARG, "Unknown phase");
+            }
+            phases.push_back(phase);
+        }
+        if(phases.empty()) {
+            for(int32_t i = 0; i <= PHASE_COUNT; ++i) {
+                phases.push_back(i);
+            }
+        }
+
+        out_arr(out, (uint32_t)phases.size());
+        for(int32_t phase : phases) {
+            if(phase == PHASE_COUNT) {
+                out_hist_us(out, "busy", &lat.busy);
+            } else {
+                out_hist_us(out, lat_phase_name((uint32_t)phase), &lat.phases[phase]);
+            }
+        }
+        return;
+    }
+    out_err(out, ERR_ARG, "Expect LATENCY LATEST | SPIKES [count] | HISTOGRAM [phase...] | RESET");
+}
+
+static void out_stat(Writer &out, const char *name, uint64_t val) {
+    out_str(out, name);
+    out_int(out, (int64_t)val);
+}
+
+// MEMORY USAGE key | STATS
+//  USAGE: bytes taken by the key, see entry_mem(). nil if it doesn't exist
+//  STATS: name, value pairs. Nothing is walked: the per type totals are kept as keys change
+static void do_memory(std::vector<std::string> &cmd, Writer &out) {
+    if(cmd_is(cmd[1], "usage") && cmd.size() == 3) {
+        Entry *entry = entry_find(cmd[2]);
+        return entry ? out_int(out, (int64_t)entry_mem(entry)) : out_nil(out);
+    }
+    if(!cmd_is(cmd[1], "stats") || cmd.size() != 2) {
+        return out_err(out, ERR_ARG, "Expect MEMORY USAGE key | STATS");
+    }
+
+    static const char *const k_type_names[T_COUNT][2] = {
+        {"strings.keys", "strings.bytes"},
+        {"lists.keys", "lists.bytes"},
+        {"hashes.keys", "hashes.bytes"},
+        {"sets.keys", "sets.bytes"},
+    };
+    uint64_t keys = 0, dataset = 0;
+    for(uint32_t t = 0; t < T_COUNT; ++t) {
+        keys += g_data.mem_keys[t].load(std::memory_order_relaxed);
+        dataset += g_data.mem_bytes[t].load(std::memory_order_relaxed);
+    }
+    uint64_t buckets = mem_hmap(&g_data.db);
+    AllocStats as;
+    bool have_alloc = stats_alloc(&as);
+    SlabStats ss;
+    slab_stats(&ss);
+    InternStats is;
+    intern_stats(&is);
+    dataset += is.bytes;
+
+    out_arr(out, 2 * (13 + 2 * T_COUNT + (have_alloc ? 2 : 0)));
+    out_stat(out, "keys.count", keys);
+    out_stat(out, "dataset.bytes", dataset + buckets);
+    out_stat(out, "keyspace.buckets", buckets);
+    out_stat(out, "keyspace.entries", keys * g_entries.size);
+    out_stat(out, "keyspace.hnodes", keys * sizeof(HNode));
+    out_stat(out, "keys.bytes-per-key", keys ? (dataset + buckets) / keys : 0);
+    for(uint32_t t = 0; t < T_COUNT; ++t) {
+        out_stat(out, k_type_names[t][0], g_data.mem_keys[t].load(std::memory_order_relaxed));
+        out_stat(out, k_type_names[t][1], g_data.mem_bytes[t].load(std::memory_order_relaxed));
+    }
+    out_stat(out, "interned.values", is.values);
+    out_stat(out, "interned.refs", is.refs);
+    out_stat(out, "interned.bytes", is.bytes);
+    out_stat(out, "slab.bytes", ss.slabs * k_slab_size);
+    out_stat(out, "slab.released", ss.empty_slabs * k_slab_size);
+    out_stat(out, "slab.huge-regions", ss.huge_regions);
+    out_stat(out, "rss.bytes", stats_rss());
+    if(have_alloc) {
+        out_stat(out, "allocator.allocated", as.allocated);
+        size_t heap = as.allocated + ss.slabs * k_slab_size;
+        out_stat(out, "allocator.other", heap > dataset + buckets ? heap - dataset - buckets : 0);
+    }
+}
+
+enum {
+    CMD_WRITE = 1,  // Changes the keyspace. Gets appended to the log
+    CMD_PUBSUB = 2, // Allowed while the connection is subscribed
+};
+
+struct Command {
+    const char *name;
+    int32_t arity; // Number of args including the name. Negative means at least -arity
+    uint32_t flags;
+    void (*proc)(std::vector<std::string> &cmd, Writer &out);
+};
+
+static const Command g_commands[] = {
+    {"keys", 1, 0, do_keys},
+    {"get", 2, 0, do_get},
+    {"set", 3, CMD_WRITE, do_set},
+    {"del", -2, CMD_WRITE, do_del},
+    {"mdel", -2, CMD_WRITE, do_del},
+    {"unlink", -2, CMD_WRITE, do_unlink},
+    {"flushall", -1, CMD_WRITE, do_flushall},
+    {"mget", -2, 0, do_mget},
+    {"mset", -3, CMD_WRITE, do_mset},
+    {"incr", 2, CMD_WRITE, do_incr},
+    {"decr", 2, CMD_WRITE, do_decr},
+    {"incrby", 3, CMD_WRITE, do_incrby},
+    {"decrby", 3, CMD_WRITE, do_decrby},
+    {"incrbyfloat", 3, CMD_WRITE, do_incrbyfloat},
+    {"lpush", -3, CMD_WRITE, do_lpush},
+    {"rpush", -3, CMD_WRITE, do_rpush},
+    {"lpop", 2, CMD_WRITE, do_lpop},
+    {"rpop", 2, CMD_WRITE, do_rpop},
+    {"lindex", 3, 0, do_lindex},
+    {"lrange", 4, 0, do_lrange},
+    {"hset", -4, CMD_WRITE, do_hset},
+    {"hget", 3, 0, do_hget},
+    {"hdel", -3, CMD_WRITE, do_hdel},
+    {"hgetall", 2, 0, do_hgetall},
+    {"hincrby", 4, CMD_WRITE, do_hincrby},
+    {"sadd", -3, CMD_WRITE, do_sadd},
+    {"srem", -3, CMD_WRITE, do_srem},
+    {"sismember", 3, 0, do_sismember},
+    {"scard", 2, 0, do_scard},
+    {"smembers", 2, 0, do_smembers},
+    {"sinter", -2, 0, do_sinter},
+    {"sunion", -2, 0, do_sunion},
+    {"setbit", 4, CMD_WRITE, do_setbit},
+    {"getbit", 3, 0, do_getbit},
+    {"bitcount", -2, 0, do_bitcount},
+    {"bitop", -4, CMD_WRITE, do_bitop},
+    {"pfadd", -2, CMD_WRITE, do_pfadd},
+    {"pfcount", -2, 0, do_pfcount},
+    {"pfmerge", -2, CMD_WRITE, do_pfmerge},
+    {"ping", -1, CMD_PUBSUB, do_ping},
+    {"hello", -1, CMD_PUBSUB, do_hello},
+    {"subscribe", -2, CMD_PUBSUB, do_subscribe},
+    {"unsubscribe", -1, CMD_PUBSUB, do_unsubscribe},
+    {"psubscribe", -2, CMD_PUBSUB, do_psubscribe},
+    {"punsubscribe", -1, CMD_PUBSUB, do_punsubscribe},
+    {"publish", 3, 0, do_publish},
+    {"rewriteaof", 1, 0, do_rewriteaof},
+    {"save", 1, 0, do_save},
+    {"info", -1, 0, do_info},
+    {"slowlog", -2, 0, do_slowlog},
+    {"latency", -2, 0, do_latency},
+    {"memory", -2, 0, do_memory},
+    {"psync", 3, 0, do_psync},
+    {"replicaof", 3, 0, do_replicaof},
+};
 
-    // Create the Connection struct
-    struct Connection *conn = (struct Connection *)malloc(sizeof(struct Connection));
+const size_t k_ncommands = sizeof(g_commands) / sizeof(g_commands[0]);
 
-    if (!conn)
-    {
-        close(connfd);
-        return -1;
-    }
+// Per command, for INFO. The histogram is allocated on the first call
+struct CmdStats {
+    uint64_t calls = 0;
+    uint64_t ns = 0;
+    Hist *latency = NULL;
+};
 
-    conn->fd = connfd;
-    conn->state = STATE_REQ;
-    conn->read_buffer_size = 0;
-    conn->write_buffer_size = 0;
-    conn->write_buffer_sent = 0;
-    conn_put(fd_to_connection, conn);
+static CmdStats g_cmd_stats[k_ncommands];
 
-    return 0;
+static void cmd_record(const Command *c, uint64_t ns) {
+    CmdStats &st = g_cmd_stats[c - g_commands];
+    if(!st.latency) {
+        st.latency = new Hist();
+    }
+    st.calls++;
+    st.ns += ns;
+    hist_record(st.latency, ns);
+    g_data.stat_cmds++;
 }
 
-static void h_scan(HTab *tab, void (*f)(HNode *, void *), void *arg) {
-    if(tab->size == 0) {
-        return;
+static void info_commands(std::string &s, uint32_t sections) {
+    if(sections & INFO_COMMANDS) {
+        info_add(s, "# Commandstats\r\n");
+        for(size_t i = 0; i < k_ncommands; ++i) {
+            const CmdStats &st = g_cmd_stats[i];
+            if(st.calls) {
+                info_add(s, "cmdstat_%s:calls=%lu,usec=%lu,usec_per_call=%.2f\r\n", g_commands[i].name,
+                         (unsigned long)st.calls, (unsigned long)(st.ns / 1000), st.ns / 1e3 / st.calls);
+            }
+        }
     }
 
-    for(size_t i = 0; i < tab->mask + 1; ++i) {
-        HNode *node = tab->tab[i];
-        while(node) {
-            f(node, arg);
-            node = node->next;
+    if(sections & INFO_LATENCY) {
+        info_add(s, "# Latencystats\r\n");
+        for(size_t i = 0; i < k_ncommands; ++i) {
+            const Hist *h = g_cmd_stats[i].latency;
+            if(h && h->total) {
+                info_add(s, "latency_percentiles_usec_%s:p50=%.3f,p99=%.3f,p99.9=%.3f,max=%.3f\r\n",
+                         g_commands[i].name, hist_percentile(h, 50) / 1e3, hist_percentile(h, 99) / 1e3,
+                         hist_percentile(h, 99.9) / 1e3, h->max / 1e3);
+            }
         }
     }
-}
-
-static void cb_scan(HNode *node, void *arg) {
-    std::string &out = *(std::string *)arg;
-    out_str(out, container_of(node, Entry, node)->key);
-}
-
-static void do_get(std::vector<std::string> &cmd, std::string &out) {
-    Entry key;
-    key.key.swap(cmd[1]);
-    key.node.hcode = str_hash((uint8_t *)key.key.data(), key.key.size());
 
-    HNode *node = hm_lookup(&g_data.db, &key.node, &entry_eq);
+    // Log2 buckets: <n>=<calls that took up to n usec and more than n/2>
+    if(sections & INFO_HISTOGRAM) {
+        info_add(s, "# Latencyhistogram\r\n");
+        for(size_t i = 0; i < k_ncommands; ++i) {
+            const Hist *h = g_cmd_stats[i].latency;
+            if(!h || !h->total) {
+                continue;
+            }
 
-    if(!node) {
-        return out_nil(out);
+            uint64_t counts[32];
+            size_t n = hist_log2(h, 1000, counts, 32);
+            info_add(s, "latency_histogram_usec_%s:", g_commands[i].name);
+            bool first = true;
+            for(size_t k = 0; k < n; ++k) {
+                if(counts[k]) {
+                    info_add(s, "%s%lu=%lu", first ? "" : ",", 1ul << k, (unsigned long)counts[k]);
+                    first = false;
+                }
+            }
+            info_add(s, "\r\n");
+        }
     }
-
-    const std::string &val = container_of(node, Entry, node)->val;
-    out_str(out, val);
 }
 
-static void do_set(std::vector<std::string> &cmd, std::string &out) {  
-    //Create key
-    Entry key;
-    key.key.swap(cmd[1]);
-    key.node.hcode = str_hash((uint8_t *) key.key.data(), key.key.size());
+static const Command *lookup_cmd(std::vector<std::string> &cmd) {
+    if(cmd.empty()) {
+        return NULL;
+    }
 
-    //Find node
-    HNode *node = hm_lookup(&g_data.db, &key.node, &entry_eq);
+    for(const Command &c : g_commands) {
+        if(!cmd_is(cmd[0], c.name)) {
+            continue;
+        }
 
-    if(node) {
-        //We found the node. Swap it's current val to new one passed in args
-        container_of(node, Entry, node)->val.swap(cmd[2]);
-    } else {
-        //Create new entry into hashtable.
-        Entry *entry = new Entry();
-        entry->key.swap(key.key);
-        entry->node.hcode = key.node.hcode;
-        entry->val.swap(cmd[2]);
-        hm_insert(&g_data.db, &entry->node);
+        bool arity_ok = c.arity >= 0 ? cmd.size() == (size_t)c.arity : cmd.size() >= (size_t)-c.arity;
+        return arity_ok ? &c : NULL;
     }
 
-    return out_nil(out);
+    return NULL;
 }
 
-static void do_del(std::vector<std::string> &cmd, std::string &out)
-{    
-    Entry key;
-    key.key.swap(cmd[1]);
-    key.node.hcode = str_hash((uint8_t *)key.key.data(), key.key.size());
+// Returns the command that ran, NULL if there wasn't one
+static const Command *do_request(std::vector<std::string> &cmd, Writer &out) {
+    const Command *c = lookup_cmd(cmd);
+    if(!c) {
+        //cmd isn't recognized
+        out_err(out, ERR_UNKNOWN, "Unknown cmd");
+        return NULL;
+    }
 
-    HNode *node = hm_pop(&g_data.db, &key.node, &entry_eq);
+    // RESP3 tells pushes from replies, so only the other protocols are limited while subscribed
+    Connection *client = g_data.client;
+    if(client && client->proto != PROTO_RESP3 && conn_subscribed(client) && !(c->flags & CMD_PUBSUB)) {
+        out_err(out, ERR_ARG, "Only (P)SUBSCRIBE and (P)UNSUBSCRIBE are allowed while subscribed");
+        return NULL;
+    }
 
-    if(node) {
-        delete container_of(node, Entry, node);
+    // A replica only takes writes from its primary. Replaying the log is fine
+    if((c->flags & CMD_WRITE) && !g_data.primary_host.empty() && g_data.client && !g_data.client->primary) {
+        out_err(out, ERR_READONLY, "Can't write to a replica");
+        return NULL;
     }
 
-    //Returns whether or not deletion took place
-    return out_int(out, node ? 1 : 0);
+    //Log before running. The handlers consume their args
+    if(c->flags & CMD_WRITE) {
+        aof_feed(cmd);
+        repl_feed(cmd);
+    }
+
+    c->proc(cmd, out);
+    return c;
 }
 
-static void do_keys(std::vector<std::string> &cmd, std::string &out) {
-    (void)cmd;
-    out_arr(out, (uint32_t)hm_size(&g_data.db));
-    h_scan(&g_data.db.h1, &cb_scan, &out);
-    h_scan(&g_data.db.h2, &cb_scan, &out);
+// Applies a command from the log at startup
+static void replay_request(std::vector<std::string> &cmd) {
+    static uint8_t scratch[4 + k_max_msg];
+    Writer out;
+    out_begin(out, PROTO_TLV, scratch, sizeof(scratch));
+    do_request(cmd, out);
 }
 
-static int32_t parse_req(const uint8_t *data, size_t len, std::vector<std::string> &out)
-{
-    if (len < 4)
+// Parses a TLV request. Returns 1 with the command, 0 if it isn't complete yet, -1 on error
+static int32_t tlv_request(Connection *conn, std::vector<std::string> &cmd, size_t *used) {
+    // Try to parse a request from buffer
+    if (conn->read_buffer_size < 4)
     {
-        return -1;
+        // Not enough data in buffer. Retry in next iteration
+        return 0;
     }
 
-    uint32_t n = 0;
-    memcpy(&n, &data[0], 4);
-    if (n > k_max_msg)
+    uint32_t len = 0;
+
+    memcpy(&len, &conn->read_buffer[0], 4);
+
+    if (len > k_max_msg)
     {
+        msg("too long");
         return -1;
     }
 
-    size_t pos = 4;
-    while (n--)
+    if (4 + len > conn->read_buffer_size)
     {
-        if (pos + 4 > len)
-        {
-            return -1;
-        }
-        uint32_t sz = 0;
-        memcpy(&sz, &data[pos], 4);
-        if (pos + 4 + sz > len)
-        {
-            return -1;
-        }
+        // Not enough data in buffer. Retry in next iteration
+        return 0;
+    }
 
-        out.push_back(std::string((char *)&data[pos + 4], sz));
-        pos += 4 + sz;
+    //Parse request
+    if(0 != parse_req(&conn->read_buffer[4], len, cmd)) {
+        msg("bad request");
+        return -1;
     }
 
-    if (pos != len)
+    *used = 4 + len;
+    return 1;
+}
+
+static int32_t resp_request(Connection *conn, std::vector<std::string> &cmd, size_t *used) {
+    int32_t rv = resp_parse(conn->read_buffer, conn->read_buffer_size, cmd, used);
+    if (rv < 0)
     {
-        return -1; // There is misc trailing garbage
+        msg("bad request");
     }
-    return 0;
+    else if (rv == 0 && conn->read_buffer_size == sizeof(conn->read_buffer))
+    {
+        msg("too long");
+        rv = -1;
+    }
+    return rv;
 }
 
-static bool cmd_is(const std::string &word, const char *cmd)
+// Removes the request from the buffer. Only once it has run: the handlers consume their args,
+// so the slow log parses them again from here
+static void consume_request(Connection *conn, size_t used)
 {
-    return 0 == strcasecmp(word.c_str(), cmd);
+    // FIXME: memmove in prod isn't efficient
+    size_t remain = conn->read_buffer_size - used;
+    if (remain)
+    {
+        memmove(conn->read_buffer, &conn->read_buffer[used], remain);
+    }
+
+    conn->read_buffer_size = remain;
 }
 
-static void do_request(std::vector<std::string> &cmd, std::string &out) {
-    if(cmd.size() == 1 && cmd_is(cmd[0], "keys")) {
-        //do keys
-        do_keys(cmd, out);
-    } else if(cmd.size() == 2 && cmd_is(cmd[0], "get")) {
-        do_get(cmd, out);
-    } else if(cmd.size() == 3 && cmd_is(cmd[0], "set")) {
-        do_set(cmd, out);
-    } else if(cmd.size() == 2 && cmd_is(cmd[0], "del")) {
-        do_del(cmd, out);
-    } else {
-        //cmd isn't recognized
-        out_err(out, ERR_UNKNOWN, "Unknown cmd");
+static void slowlog_request(Connection *conn, size_t used, uint64_t ns)
+{
+    std::vector<std::string> args;
+    size_t n = 0;
+    if (conn->proto == PROTO_TLV)
+    {
+        parse_req(&conn->read_buffer[4], used - 4, args);
     }
+    else
+    {
+        resp_parse(conn->read_buffer, used, args, &n);
+    }
+    slowlog_push(&g_data.slowlog, args, ns, conn->fd);
 }
 
 static bool try_one_request(Connection *conn) {
-    // Try to parse a request from buffer
-    if (conn->read_buffer_size < 4)
+    if (conn->proto == PROTO_UNKNOWN)
     {
-        // Not enough data in buffer. Retry in next iteration
-        return false;
+        conn->proto = proto_detect(conn->read_buffer, conn->read_buffer_size);
+        if (conn->proto == PROTO_UNKNOWN)
+        {
+            return false;
+        }
     }
 
-    uint32_t len = 0;
-
-    memcpy(&len, &conn->read_buffer[0], 4);
-
-    if (len > k_max_msg)
+    std::vector<std::string> cmd;
+    size_t used = 0;
+    int32_t rv = conn->proto == PROTO_TLV ? tlv_request(conn, cmd, &used) : resp_request(conn, cmd, &used);
+    if (rv < 0)
     {
-        msg("too long");
         conn->state = STATE_END;
         return false;
     }
-
-    if (4 + len > conn->read_buffer_size)
+    if (rv == 0)
     {
         // Not enough data in buffer. Retry in next iteration
         return false;
     }
 
-    //Parse request
-    std::vector<std::string> cmd;
-    if(0 != parse_req(&conn->read_buffer[4], len, cmd)) {
-        msg("bad request");
-        conn->state = STATE_END;
-        return false;
+    // Empty inline lines get no reply
+    if (cmd.empty() && conn->proto != PROTO_TLV)
+    {
+        consume_request(conn, used);
+        return true;
     }
 
-    // 1 request, generate response
-    std::string out;
-    do_request(cmd, out);
+    // The primary's stream gets no replies, and neither does anything a replica sends after PSYNC
+    bool quiet = conn->primary || conn->replica;
+
+    // 1 request, the response is written straight into the write buffer
+    Writer &out = conn->out;
+    out_begin(out, conn->proto, conn->write_buffer, sizeof(conn->write_buffer));
+    g_data.client = conn;
+    uint64_t start = stats_ticks();
+    const Command *c = do_request(cmd, out);
+    uint64_t ns = stats_ticks_to_ns(stats_ticks() - start);
+    g_data.client = NULL;
+    if (c)
+    {
+        cmd_record(c, ns);
+    }
+    lat_command(&g_data.latency, ns);
+    if (slowlog_wants(&g_data.slowlog, ns))
+    {
+        slowlog_request(conn, used, ns);
+    }
+    consume_request(conn, used);
+    if (quiet)
+    {
+        return true;
+    }
 
-    //But response into the buffer
-    if(4 + out.size() > k_max_msg) {
-        out.clear();
+    if (!out_end(out))
+    {
+        out_begin(out, conn->proto, conn->write_buffer, sizeof(conn->write_buffer));
         out_err(out, ERR_2BIG, "Response is too big");
+        out_end(out);
     }
-    
-    uint32_t wlen = (uint32_t)out.size();
-    memcpy(&conn->write_buffer[0], &wlen, 4);
-    memcpy(&conn->write_buffer[4], out.data(), out.size());
-    conn->write_buffer_size = 4 + wlen;
 
-    // Remove the request from the buffer
-    // FIXME: memmove in prod isn't efficient
-    size_t remain = conn->read_buffer_size - 4 - len;
-    if (remain)
+    // Messages are waiting to go out, so the reply goes behind them
+    if (!conn->out_queue.empty())
     {
-        memmove(conn->read_buffer, &conn->read_buffer[4 + len], remain);
+        out_materialize(out);
+        MsgBuf *buf = msgbuf_new(conn->write_buffer, out.len);
+        conn_queue(conn, buf);
+        msgbuf_unref(buf);
+        return (conn->state == STATE_REQ);
     }
 
-    conn->read_buffer_size = remain;
+    conn->write_buffer_size = out.total;
 
-    // Change state
+    // Change state. If the write still has to be fsync'd, the reply goes out after the group
+    // commit at the end of this event loop iteration
     conn->state = STATE_RES;
-    state_res(conn);
+    if(!aof_sync_pending()) {
+        state_res(conn);
+    }
+
+    // Values referenced by the reply can change once the next request runs
+    if (conn->state == STATE_RES && out.nrefs)
+    {
+        out_materialize(out);
+    }
 
     // Continue outer loop if the request was fully processed
     return (conn->state == STATE_REQ);
@@ -456,6 +3173,7 @@ static bool try_fill_buffer(Connection *conn)
     }
 
     conn->read_buffer_size += (size_t)rv;
+    g_data.stat_net_in += (size_t)rv;
     assert(conn->read_buffer_size <= sizeof(conn->read_buffer));
 
     // Process req one by one, pipelining
@@ -483,11 +3201,13 @@ static bool try_flush_buffer(Connection *conn)
 {
     ssize_t rv = 0;
 
+    // The reply may reference values outside of the write buffer
+    struct iovec iov[2 * k_max_refs + 1];
+    size_t n = out_iov(conn->out, conn->write_buffer_sent, iov, 2 * k_max_refs + 1);
     do
     {
-        ssize_t remain = conn->write_buffer_size - conn->write_buffer_sent;
-        rv = write(conn->fd, &conn->write_buffer[conn->write_buffer_sent], remain);
-    } while (rv < 0 && errno == EAGAIN);
+        rv = writev(conn->fd, iov, (int)n);
+    } while (rv < 0 && errno == EINTR);
 
     if (rv < 0 && errno == EAGAIN)
     {
@@ -503,6 +3223,7 @@ static bool try_flush_buffer(Connection *conn)
     }
 
     conn->write_buffer_sent += (size_t)rv;
+    g_data.stat_net_out += (size_t)rv;
     assert(conn->write_buffer_sent <= conn->write_buffer_size);
     if (conn->write_buffer_sent == conn->write_buffer_size)
     {
@@ -510,6 +3231,7 @@ static bool try_flush_buffer(Connection *conn)
         conn->state = STATE_REQ;
         conn->write_buffer_sent = 0;
         conn->write_buffer_size = 0;
+        conn->out.nrefs = 0;
         return false;
     }
 
@@ -517,6 +3239,60 @@ static bool try_flush_buffer(Connection *conn)
     return true;
 }
 
+const size_t k_max_iov = 64;
+
+// Writes queued messages straight out of the shared buffers
+static void flush_queue(Connection *conn)
+{
+    while (!conn->out_queue.empty())
+    {
+        struct iovec iov[k_max_iov];
+        size_t n = 0;
+        for (MsgBuf *buf : conn->out_queue)
+        {
+            size_t skip = n == 0 ? conn->out_queue_sent : 0;
+            iov[n].iov_base = buf->data + skip;
+            iov[n].iov_len = buf->len - skip;
+            if (++n == k_max_iov)
+            {
+                break;
+            }
+        }
+
+        ssize_t rv = 0;
+        do
+        {
+            rv = writev(conn->fd, iov, (int)n);
+        } while (rv < 0 && errno == EINTR);
+
+        if (rv < 0 && errno == EAGAIN)
+        {
+            return;
+        }
+
+        if (rv < 0)
+        {
+            msg("writev() error");
+            conn->state = STATE_END;
+            return;
+        }
+
+        g_data.stat_net_out += (size_t)rv;
+
+        // Drop the buffers that went out completely
+        size_t written = conn->out_queue_sent + (size_t)rv;
+        while (!conn->out_queue.empty() && written >= conn->out_queue.front()->len)
+        {
+            MsgBuf *buf = conn->out_queue.front();
+            written -= buf->len;
+            conn->out_queue_bytes -= buf->len;
+            conn->out_queue.pop_front();
+            msgbuf_unref(buf);
+        }
+        conn->out_queue_sent = written;
+    }
+}
+
 static void connection_io(Connection *conn)
 {
     if (conn->state == STATE_REQ)
@@ -531,6 +3307,12 @@ static void connection_io(Connection *conn)
     {
         assert(0);
     }
+
+    // Queued messages go after the reply in the write buffer, and not before the log is synced
+    if (conn->state == STATE_REQ && !aof_sync_pending())
+    {
+        flush_queue(conn);
+    }
 }
 
 static int32_t read_full(int fd, char *buf, size_t n)
@@ -625,8 +3407,143 @@ static int32_t one_request(int connfd)
 }
 
 
-int main()
+static void usage(const char *prog)
+{
+    fprintf(stderr,
+            "usage: %s [--appendonly <file>] [--appendfsync always|everysec|no]\n"
+            "       [--dbfilename <file>] [--loader-threads <n>]\n"
+            "       [--client-output-limit <bytes>] [--compress-min <bytes>] [--intern-max <bytes>]\n"
+            "       [--slowlog-log-slower-than <usec>] [--slowlog-max-len <n>]\n"
+            "       [--latency-monitor-threshold <msec>] [--active-defrag-threshold <ratio>]\n"
+            "       [--port <port>] [--replicaof <host> <port>] [--repl-backlog-size <bytes>]\n", prog);
+    exit(1);
+}
+
+int main(int argc, char **argv)
 {
+    const char *aof_path = NULL;
+    uint32_t aof_policy = AOF_FSYNC_EVERYSEC;
+    long loader_threads = sysconf(_SC_NPROCESSORS_ONLN);
+    int64_t slow_us = k_slowlog_default_us;
+    size_t slow_len = k_slowlog_default_len;
+    uint64_t latency_ms = k_default_latency_ms;
+    uint16_t port = k_default_port;
+    stats_clock_init();
+    reclaim_start();
+    g_data.start_ms = stats_now_ms();
+    // A client that goes away with replies in flight makes write() fail with EPIPE instead
+    signal(SIGPIPE, SIG_IGN);
+    g_data.ops_sample_ms = g_data.start_ms;
+
+    for (int i = 1; i < argc; ++i)
+    {
+        if (0 == strcmp(argv[i], "--appendonly") && i + 1 < argc)
+        {
+            aof_path = argv[++i];
+        }
+        else if (0 == strcmp(argv[i], "--appendfsync") && i + 1 < argc)
+        {
+            if (!aof_parse_policy(argv[++i], aof_policy))
+            {
+                usage(argv[0]);
+            }
+        }
+        else if (0 == strcmp(argv[i], "--dbfilename") && i + 1 < argc)
+        {
+            g_data.snapshot_path = argv[++i];
+        }
+        else if (0 == strcmp(argv[i], "--loader-threads") && i + 1 < argc)
+        {
+            loader_threads = atol(argv[++i]);
+        }
+        else if (0 == strcmp(argv[i], "--client-output-limit") && i + 1 < argc)
+        {
+            g_data.out_limit = (size_t)atoll(argv[++i]);
+        }
+        else if (0 == strcmp(argv[i], "--compress-min") && i + 1 < argc)
+        {
+            g_data.compress_min = (size_t)atoll(argv[++i]);
+        }
+        else if (0 == strcmp(argv[i], "--intern-max") && i + 1 < argc)
+        {
+            g_data.intern_max = (size_t)atoll(argv[++i]);
+        }
+        else if (0 == strcmp(argv[i], "--slowlog-log-slower-than") && i + 1 < argc)
+        {
+            slow_us = atoll(argv[++i]);
+        }
+        else if (0 == strcmp(argv[i], "--slowlog-max-len") && i + 1 < argc)
+        {
+            slow_len = (size_t)atoll(argv[++i]);
+        }
+        else if (0 == strcmp(argv[i], "--latency-monitor-threshold") && i + 1 < argc)
+        {
+            latency_ms = (uint64_t)atoll(argv[++i]);
+        }
+        else if (0 == strcmp(argv[i], "--active-defrag-threshold") && i + 1 < argc)
+        {
+            g_data.defrag_threshold = atof(argv[++i]);
+        }
+        else if (0 == strcmp(argv[i], "--port") && i + 1 < argc)
+        {
+            port = (uint16_t)atoi(argv[++i]);
+        }
+        else if (0 == strcmp(argv[i], "--replicaof") && i + 2 < argc)
+        {
+            g_data.primary_host = argv[++i];
+            g_data.primary_port = (uint16_t)atoi(argv[++i]);
+        }
+        else if (0 == strcmp(argv[i], "--repl-backlog-size") && i + 1 < argc)
+        {
+            g_data.backlog_size = (size_t)atoll(argv[++i]);
+        }
+        else
+        {
+            usage(argv[0]);
+        }
+    }
+
+    slowlog_init(&g_data.slowlog, slow_us, slow_len);
+    g_data.latency.threshold_ns = latency_ms * 1000000;
+    g_data.loader_threads = loader_threads > 0 ? (size_t)loader_threads : 1;
+    g_data.replid = repl_new_id();
+    if (port == 0 || g_data.backlog_size == 0 || (!g_data.primary_host.empty() && g_data.primary_port == 0))
+    {
+        usage(argv[0]);
+    }
+
+    // Rebuild the keyspace from the log before it is reopened for appending
+    if (aof_path)
+    {
+        int32_t ncmds = aof_load(aof_path, &replay_request);
+        if (ncmds < 0)
+        {
+            die("aof_load()");
+        }
+        fprintf(stderr, "replayed %d commands from %s\n", ncmds, aof_path);
+
+        if (aof_open(aof_path, aof_policy))
+        {
+            die("aof_open()");
+        }
+    }
+    else
+    {
+        // Without a log, the last snapshot is the most recent state
+        struct timespec start = {}, end = {};
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        int64_t nkeys = snap_load(g_data.snapshot_path.c_str(), &g_data.db, g_data.loader_threads,
+                                  &snap_decode_entry, &snap_destroy_entry);
+        if (nkeys < 0)
+        {
+            die("snap_load()");
+        }
+        clock_gettime(CLOCK_MONOTONIC, &end);
+
+        double secs = (double)(end.tv_sec - start.tv_sec) + (double)(end.tv_nsec - start.tv_nsec) / 1e9;
+        fprintf(stderr, "loaded %ld keys from %s in %.3fs\n", (long)nkeys, g_data.snapshot_path.c_str(), secs);
+    }
+
     // Creates a socket and returns file descriptor
     int fd = socket(AF_INET, SOCK_STREAM, 0);
 
@@ -639,7 +3556,7 @@ int main()
     // Bind. Handles IPv4 addresses
     struct sockaddr_in addr = {};
     addr.sin_family = AF_INET;
-    addr.sin_port = ntohs(1234);
+    addr.sin_port = ntohs(port);
     addr.sin_addr.s_addr = ntohl(0); // wildcard address 0.0.0.0
     int rv = bind(fd, (const sockaddr *)&addr, sizeof(addr));
     if (rv)
@@ -662,8 +3579,11 @@ int main()
 
     // Event loop
     std::vector<struct pollfd> poll_args;
+    LatencyMonitor &lat = g_data.latency;
     while (true)
     {
+        lat_loop_start(&lat);
+
         // Prepare the args of the poll()
         poll_args.clear();
 
@@ -679,20 +3599,34 @@ int main()
                 continue;
             }
 
+            // Dropped outside of its own I/O, like a slow subscriber
+            if (conn->state == STATE_END)
+            {
+                conn_destroy(fd_to_connections, conn);
+                continue;
+            }
+
             struct pollfd pfd = {};
             pfd.fd = conn->fd;
             pfd.events = (conn->state == STATE_REQ) ? POLLIN : POLLOUT;
+            if (!conn->out_queue.empty())
+            {
+                pfd.events |= POLLOUT;
+            }
             pfd.events = pfd.events | POLLERR;
             poll_args.push_back(pfd);
         }
 
+        lat_phase(&lat, PHASE_IO);
+
         // Poll for active fds
-        // The timeout arg doesn't matter here
-        int rv = poll(poll_args.data(), (nfds_t)poll_args.size(), 1000);
+        // Wakes up at least once per k_cron_interval_ms for server_cron()
+        int rv = poll(poll_args.data(), (nfds_t)poll_args.size(), (int)k_cron_interval_ms);
         if (rv < 0)
         {
             die("poll");
         }
+        lat_phase(&lat, PHASE_POLL);
 
         // Process active connections
         for (size_t i = 1; i < poll_args.size(); ++i)
@@ -700,22 +3634,36 @@ int main()
             if (poll_args[i].revents)
             {
                 Connection *conn = fd_to_connections[poll_args[i].fd];
-                connection_io(conn);
+                if (conn->state != STATE_END)
+                {
+                    connection_io(conn);
+                }
                 if (conn->state == STATE_END)
                 {
                     // Client closed normall or bad thing happened
-                    fd_to_connections[conn->fd] = NULL;
-                    (void)close(conn->fd);
-                    free(conn);
+                    conn_destroy(fd_to_connections, conn);
                 }
             }
         }
+        lat_phase(&lat, PHASE_IO);
 
         // Try to accept a new connection if the listening fd is active
         if (poll_args[0].revents)
         {
             (void)accept_new_conn(fd_to_connections, fd);
         }
+        lat_phase(&lat, PHASE_ACCEPT);
+
+        // Group commit of every write made in this iteration. Replicas get them in one message
+        aof_flush();
+        repl_flush();
+        lat_phase(&lat, PHASE_AOF);
+
+        bool rehashing = g_data.db.h2.tab != NULL;
+        server_cron();
+        replica_cron(fd_to_connections);
+        lat_phase(&lat, PHASE_TIMERS);
+        lat_loop_end(&lat, rehashing);
     }
 
     return 0;
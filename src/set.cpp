@@ -0,0 +1,378 @@
+#include "set.h"
+#include "utils.h"
+#include "memusage.h"
+#include "slab.h"
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <algorithm>
+#include <new>
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+const size_t k_set_ints_max = 512; // members of an int set
+const size_t k_gallop_ratio = 32;  // size ratio past which intersection gallops instead of merging
+
+static SlabClass g_members = {"set members", slab_stride(sizeof(SetMember))};
+
+static SetMember *member_new() {
+    return new (slab_alloc(&g_members)) SetMember();
+}
+
+static void member_del(SetMember *sm) {
+    sm->~SetMember();
+    slab_free(sm);
+}
+
+static size_t member_mem(const SetMember *sm) {
+    return g_members.size + mem_str(sm->member);
+}
+
+static bool member_eq(HNode *lhs, HNode *rhs) {
+    SetMember *le = container_of(lhs, SetMember, node);
+    SetMember *re = container_of(rhs, SetMember, node);
+    return le->member == re->member;
+}
+
+// Index of the first element >= v
+static size_t ints_search(const Set *set, int64_t v) {
+    return std::lower_bound(set->ints, set->ints + set->len, v) - set->ints;
+}
+
+static void hmap_insert(Set *set, const char *data, size_t len) {
+    SetMember *sm = member_new();
+    sm->member.assign(data, len);
+    sm->node.hcode = str_hash((const uint8_t *)data, len);
+    hm_insert(&set->map, &sm->node);
+    set->bytes += member_mem(sm);
+}
+
+static void set_convert(Set *set) {
+    assert(set->enc == SET_INTS);
+
+    char buf[k_int_digits];
+    for(size_t i = 0; i < set->len; ++i) {
+        hmap_insert(set, buf, int_format(set->ints[i], buf));
+    }
+
+    free(set->ints);
+    set->ints = NULL;
+    set->cap = 0;
+    set->enc = SET_HMAP;
+}
+
+static HNode *hmap_find(Set *set, const std::string &member, bool pop) {
+    SetMember probe;
+    probe.member = member;
+    probe.node.hcode = str_hash((const uint8_t *)member.data(), member.size());
+    return pop ? hm_pop(&set->map, &probe.node, &member_eq) : hm_lookup(&set->map, &probe.node, &member_eq);
+}
+
+// Returns true if member was added
+bool set_add(Set *set, const std::string &member) {
+    int64_t v = 0;
+    if(set->enc == SET_INTS && !str2int_canonical(member, v)) {
+        set_convert(set);
+    }
+
+    if(set->enc == SET_INTS) {
+        size_t pos = ints_search(set, v);
+        if(pos < set->len && set->ints[pos] == v) {
+            return false;
+        }
+
+        if(set->len + 1 > k_set_ints_max) {
+            set_convert(set);
+            return set_add(set, member);
+        }
+
+        if(set->len == set->cap) {
+            set->cap = set->cap ? set->cap * 2 : 4;
+            set->ints = (int64_t *)realloc(set->ints, set->cap * sizeof(int64_t));
+            if(!set->ints) {
+                abort();
+            }
+        }
+
+        memmove(&set->ints[pos + 1], &set->ints[pos], (set->len - pos) * sizeof(int64_t));
+        set->ints[pos] = v;
+        set->len++;
+        return true;
+    }
+
+    if(hmap_find(set, member, false)) {
+        return false;
+    }
+
+    hmap_insert(set, member.data(), member.size());
+    set->len++;
+    return true;
+}
+
+bool set_rem(Set *set, const std::string &member) {
+    if(set->enc == SET_INTS) {
+        int64_t v = 0;
+        if(!str2int_canonical(member, v)) {
+            return false;
+        }
+
+        size_t pos = ints_search(set, v);
+        if(pos == set->len || set->ints[pos] != v) {
+            return false;
+        }
+
+        memmove(&set->ints[pos], &set->ints[pos + 1], (set->len - pos - 1) * sizeof(int64_t));
+        set->len--;
+        return true;
+    }
+
+    HNode *node = hmap_find(set, member, true);
+    if(!node) {
+        return false;
+    }
+
+    SetMember *sm = container_of(node, SetMember, node);
+    set->bytes -= member_mem(sm);
+    member_del(sm);
+    set->len--;
+    return true;
+}
+
+bool set_contains(Set *set, const std::string &member) {
+    if(set->enc == SET_INTS) {
+        int64_t v = 0;
+        if(!str2int_canonical(member, v)) {
+            return false;
+        }
+
+        size_t pos = ints_search(set, v);
+        return pos < set->len && set->ints[pos] == v;
+    }
+
+    return hmap_find(set, member, false) != NULL;
+}
+
+static void scan_tab(HTab *tab, void (*f)(const char *, uint32_t, void *), void *arg) {
+    if(tab->size == 0) {
+        return;
+    }
+
+    for(size_t i = 0; i < tab->mask + 1; ++i) {
+        for(HNode *node = tab->tab[i]; node; node = node->next) {
+            SetMember *sm = container_of(node, SetMember, node);
+            f(sm->member.data(), (uint32_t)sm->member.size(), arg);
+        }
+    }
+}
+
+// Calls f on every member. Int members are formatted first
+void set_scan(Set *set, void (*f)(const char *data, uint32_t len, void *arg), void *arg) {
+    if(set->enc == SET_INTS) {
+        char buf[k_int_digits];
+        for(size_t i = 0; i < set->len; ++i) {
+            f(buf, int_format(set->ints[i], buf), arg);
+        }
+        return;
+    }
+
+    scan_tab(&set->map.h1, f, arg);
+    scan_tab(&set->map.h2, f, arg);
+}
+
+static void destroy_tab(HTab *tab) {
+    if(tab->size == 0) {
+        return;
+    }
+
+    for(size_t i = 0; i < tab->mask + 1; ++i) {
+        HNode *node = tab->tab[i];
+        while(node) {
+            HNode *next = node->next;
+            member_del(container_of(node, SetMember, node));
+            node = next;
+        }
+    }
+}
+
+void set_destroy(Set *set) {
+    free(set->ints);
+    destroy_tab(&set->map.h1);
+    destroy_tab(&set->map.h2);
+    hm_destroy(&set->map);
+    *set = Set();
+}
+
+// Moves a member off a sparse slab, see slab_should_move()
+static HNode *member_relocate(HNode *node, void *arg) {
+    SetMember *sm = container_of(node, SetMember, node);
+    void *dst = slab_should_move(sm) ? slab_alloc_dense(sm) : NULL;
+    if(!dst) {
+        return node;
+    }
+
+    SetMember *moved = new (dst) SetMember(std::move(*sm));
+    member_del(sm);
+    (*(size_t *)arg)++;
+    return &moved->node;
+}
+
+// Packs the members into fuller slabs. Returns the number moved
+size_t set_defrag(Set *set) {
+    size_t moved = 0;
+    if(set->enc == SET_HMAP) {
+        size_t cursor = 0;
+        do {
+            cursor = hm_relocate(&set->map, cursor, &member_relocate, &moved);
+        } while(cursor);
+    }
+    return moved;
+}
+
+// Bytes held by the members and the bucket arrays, not counting the Set itself
+size_t set_mem(const Set *set) {
+    return mem_alloc(set->cap * sizeof(int64_t)) + set->bytes + mem_hmap(&set->map);
+}
+
+/*
+
+Intersection kernels for sorted arrays of distinct ints. out may not alias the inputs and
+must hold min(na, nb) elements. Each returns the number of elements written.
+
+*/
+
+static size_t intersect_merge(const int64_t *a, size_t na, const int64_t *b, size_t nb, int64_t *out) {
+    size_t i = 0, j = 0, n = 0;
+    while(i < na && j < nb) {
+        int64_t x = a[i], y = b[j];
+        if(x == y) {
+            out[n++] = x;
+        }
+        i += x <= y;
+        j += y <= x;
+    }
+    return n;
+}
+
+// For a much smaller than b: exponential then binary search in b for every element of a
+static size_t intersect_gallop(const int64_t *a, size_t na, const int64_t *b, size_t nb, int64_t *out) {
+    size_t j = 0, n = 0;
+    for(size_t i = 0; i < na && j < nb; ++i) {
+        int64_t x = a[i];
+
+        size_t step = 1, hi = j;
+        while(hi < nb && b[hi] < x) {
+            j = hi + 1;
+            hi += step;
+            step *= 2;
+        }
+        hi = hi < nb ? hi + 1 : nb;
+
+        j = std::lower_bound(b + j, b + hi, x) - b;
+        if(j < nb && b[j] == x) {
+            out[n++] = x;
+            j++;
+        }
+    }
+    return n;
+}
+
+#if defined(__x86_64__)
+// Compares blocks of 4 against 4: a's block against every rotation of b's block, then the block
+// with the smaller max moves on
+__attribute__((target("avx2")))
+static size_t intersect_avx2(const int64_t *a, size_t na, const int64_t *b, size_t nb, int64_t *out) {
+    size_t i = 0, j = 0, n = 0;
+    while(i + 4 <= na && j + 4 <= nb) {
+        __m256i va = _mm256_loadu_si256((const __m256i *)&a[i]);
+        __m256i vb = _mm256_loadu_si256((const __m256i *)&b[j]);
+
+        __m256i eq = _mm256_cmpeq_epi64(va, vb);
+        eq = _mm256_or_si256(eq, _mm256_cmpeq_epi64(va, _mm256_permute4x64_epi64(vb, 0x39)));
+        eq = _mm256_or_si256(eq, _mm256_cmpeq_epi64(va, _mm256_permute4x64_epi64(vb, 0x4E)));
+        eq = _mm256_or_si256(eq, _mm256_cmpeq_epi64(va, _mm256_permute4x64_epi64(vb, 0x93)));
+
+        uint32_t mask = (uint32_t)_mm256_movemask_pd(_mm256_castsi256_pd(eq));
+        while(mask) {
+            out[n++] = a[i + __builtin_ctz(mask)];
+            mask &= mask - 1;
+        }
+
+        int64_t amax = a[i + 3], bmax = b[j + 3];
+        i += amax <= bmax ? 4 : 0;
+        j += bmax <= amax ? 4 : 0;
+    }
+
+    return n + intersect_merge(a + i, na - i, b + j, nb - j, out + n);
+}
+#endif
+
+size_t intersect_ints(const int64_t *a, size_t na, const int64_t *b, size_t nb, int64_t *out) {
+    if(na > nb) {
+        std::swap(a, b);
+        std::swap(na, nb);
+    }
+
+    if(na * k_gallop_ratio < nb) {
+        return intersect_gallop(a, na, b, nb, out);
+    }
+
+#if defined(__x86_64__)
+    if(cpu_has_avx2()) {
+        return intersect_avx2(a, na, b, nb, out);
+    }
+#endif
+    return intersect_merge(a, na, b, nb, out);
+}
+
+struct InterScan {
+    Set **sets;
+    size_t n;
+    std::vector<std::string> *out;
+};
+
+static void cb_inter(const char *data, uint32_t len, void *arg) {
+    InterScan &scan = *(InterScan *)arg;
+    std::string member(data, len);
+    for(size_t i = 1; i < scan.n; ++i) {
+        if(!set_contains(scan.sets[i], member)) {
+            return;
+        }
+    }
+    scan.out->push_back(member);
+}
+
+// Intersects n sets. sets gets reordered smallest first
+void set_inter(Set **sets, size_t n, std::vector<std::string> &out) {
+    std::sort(sets, sets + n, [](Set *l, Set *r) { return l->len < r->len; });
+    if(n == 0 || sets[0]->len == 0) {
+        return;
+    }
+
+    bool all_ints = true;
+    for(size_t i = 0; i < n; ++i) {
+        all_ints = all_ints && sets[i]->enc == SET_INTS;
+    }
+
+    if(!all_ints) {
+        // Walk the smallest set and probe the rest
+        InterScan scan = {sets, n, &out};
+        set_scan(sets[0], &cb_inter, &scan);
+        return;
+    }
+
+    std::vector<int64_t> acc(sets[0]->ints, sets[0]->ints + sets[0]->len);
+    std::vector<int64_t> tmp(acc.size());
+    for(size_t i = 1; i < n && !acc.empty(); ++i) {
+        size_t len = intersect_ints(acc.data(), acc.size(), sets[i]->ints, sets[i]->len, tmp.data());
+        tmp.resize(len);
+        acc.swap(tmp);
+        tmp.resize(acc.size());
+    }
+
+    char buf[k_int_digits];
+    out.reserve(acc.size());
+    for(int64_t v : acc) {
+        out.push_back(std::string(buf, int_format(v, buf)));
+    }
+}
@@ -0,0 +1,48 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string>
+#include <vector>
+#include "hashtable.h"
+
+/*
+
+Set:
+    While every member is an int (in canonical form) and there are at most k_set_ints_max of
+    them, a set is a sorted array of int64. Otherwise it is an HMap of SetMembers.
+
+    Intersections of int sets run on the sorted arrays: a merge (AVX2 block compare when the CPU
+    has it) for sets of similar size, galloping search when one side is much bigger.
+
+*/
+
+enum {
+    SET_INTS = 0,
+    SET_HMAP = 1,
+};
+
+struct SetMember {
+    HNode node;
+    std::string member;
+};
+
+struct Set {
+    uint32_t enc = SET_INTS;
+    uint32_t cap = 0; // capacity of ints
+    int64_t *ints = NULL;
+    HMap map;
+    size_t len = 0;
+    size_t bytes = 0; // SetMembers in map and their strings, see mem_alloc()
+};
+
+bool set_add(Set *set, const std::string &member);
+bool set_rem(Set *set, const std::string &member);
+bool set_contains(Set *set, const std::string &member);
+void set_scan(Set *set, void (*f)(const char *data, uint32_t len, void *arg), void *arg);
+void set_destroy(Set *set);
+size_t set_mem(const Set *set);
+size_t set_defrag(Set *set);
+
+size_t intersect_ints(const int64_t *a, size_t na, const int64_t *b, size_t nb, int64_t *out);
+void set_inter(Set **sets, size_t n, std::vector<std::string> &out);
@@ -0,0 +1,249 @@
+#include "slab.h"
+#include <stdlib.h>
+#include <assert.h>
+#include <sys/mman.h>
+#include <vector>
+#include <algorithm>
+
+const size_t k_slab_header = slab_stride(sizeof(Slab)) < 64 ? 64 : slab_stride(sizeof(Slab));
+
+static struct {
+    std::atomic<bool> lock{false};
+    uint8_t *region = NULL; // slabs are carved from here
+    size_t region_used = 0;
+    size_t nregions = 0;
+    std::vector<uint8_t *> huge; // regions still asking for huge pages
+    size_t nslabs = 0;
+    std::vector<Slab *> empty; // released, reusable by any class
+    SlabClass *classes = NULL;
+} g_slabs;
+
+static void spin_lock(std::atomic<bool> &lock) {
+    while(lock.exchange(true, std::memory_order_acquire)) {
+        while(lock.load(std::memory_order_relaxed)) {
+#if defined(__x86_64__)
+            __builtin_ia32_pause();
+#endif
+        }
+    }
+}
+
+static void spin_unlock(std::atomic<bool> &lock) {
+    lock.store(false, std::memory_order_release);
+}
+
+// Maps twice the size and trims it to an aligned region
+static uint8_t *region_new() {
+    size_t len = 2 * k_slab_region_size;
+    uint8_t *p = (uint8_t *)mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(p == MAP_FAILED) {
+        abort();
+    }
+
+    uint8_t *region = (uint8_t *)(((uintptr_t)p + k_slab_region_size - 1) & ~(uintptr_t)(k_slab_region_size - 1));
+    if(region > p) {
+        munmap(p, region - p);
+    }
+    munmap(region + k_slab_region_size, p + len - (region + k_slab_region_size));
+
+    if(g_slabs.nregions >= k_slab_huge_regions) {
+#if defined(MADV_HUGEPAGE)
+        if(0 == madvise(region, k_slab_region_size, MADV_HUGEPAGE)) {
+            g_slabs.huge.push_back(region);
+        }
+#endif
+    }
+    g_slabs.nregions++;
+    return region;
+}
+
+static Slab *slab_of(const void *obj) {
+    return (Slab *)((uintptr_t)obj & ~(uintptr_t)(k_slab_size - 1));
+}
+
+static Slab *slab_new(SlabClass *cls) {
+    spin_lock(g_slabs.lock);
+    if(!cls->listed) {
+        cls->next_class = g_slabs.classes;
+        g_slabs.classes = cls;
+        cls->listed = true;
+    }
+
+    uint8_t *mem = NULL;
+    if(!g_slabs.empty.empty()) {
+        mem = (uint8_t *)g_slabs.empty.back();
+        g_slabs.empty.pop_back();
+    } else {
+        if(!g_slabs.region || g_slabs.region_used == k_slab_region_size) {
+            g_slabs.region = region_new();
+            g_slabs.region_used = 0;
+        }
+        mem = g_slabs.region + g_slabs.region_used;
+        g_slabs.region_used += k_slab_size;
+    }
+    g_slabs.nslabs++;
+    spin_unlock(g_slabs.lock);
+
+    Slab *slab = (Slab *)mem;
+    slab->prev = slab->next = NULL;
+    slab->cls = cls;
+    slab->free = NULL;
+    slab->used = 0;
+    slab->fresh = 0;
+    slab->cap = (uint32_t)((k_slab_size - k_slab_header) / cls->size);
+    slab->partial = false;
+    cls->nslabs++;
+    return slab;
+}
+
+static void slab_release(SlabClass *cls, Slab *slab) {
+    cls->nslabs--;
+    madvise(slab, k_slab_size, MADV_DONTNEED);
+
+    spin_lock(g_slabs.lock);
+    // khugepaged would fill the hole back in to make a huge page again, so a region that has
+    // given a slab back stops asking for them
+    uint8_t *region = (uint8_t *)((uintptr_t)slab & ~(uintptr_t)(k_slab_region_size - 1));
+    auto it = std::find(g_slabs.huge.begin(), g_slabs.huge.end(), region);
+    if(it != g_slabs.huge.end()) {
+#if defined(MADV_NOHUGEPAGE)
+        madvise(region, k_slab_region_size, MADV_NOHUGEPAGE);
+#endif
+        g_slabs.huge.erase(it);
+    }
+    g_slabs.empty.push_back(slab);
+    g_slabs.nslabs--;
+    spin_unlock(g_slabs.lock);
+}
+
+static void partial_add(SlabClass *cls, Slab *slab) {
+    slab->prev = NULL;
+    slab->next = cls->partial;
+    if(cls->partial) {
+        cls->partial->prev = slab;
+    }
+    cls->partial = slab;
+    slab->partial = true;
+}
+
+static void partial_remove(SlabClass *cls, Slab *slab) {
+    if(slab->prev) {
+        slab->prev->next = slab->next;
+    } else {
+        cls->partial = slab->next;
+    }
+    if(slab->next) {
+        slab->next->prev = slab->prev;
+    }
+    slab->prev = slab->next = NULL;
+    slab->partial = false;
+    if(cls->dense == slab) {
+        cls->dense = NULL;
+    }
+}
+
+// Takes an object out of a slab on the partial list. Called with the class locked
+static void *slab_take(SlabClass *cls, Slab *slab) {
+    void *obj = slab->free;
+    if(obj) {
+        slab->free = *(void **)obj;
+    } else {
+        obj = (uint8_t *)slab + k_slab_header + (size_t)slab->fresh * cls->size;
+        slab->fresh++;
+    }
+
+    slab->used++;
+    cls->nobjs++;
+    if(slab->used == slab->cap) {
+        partial_remove(cls, slab);
+    }
+    return obj;
+}
+
+void *slab_alloc(SlabClass *cls) {
+    spin_lock(cls->lock);
+    Slab *slab = cls->partial;
+    if(!slab) {
+        slab = slab_new(cls);
+        partial_add(cls, slab);
+    }
+
+    void *obj = slab_take(cls, slab);
+    spin_unlock(cls->lock);
+    return obj;
+}
+
+bool slab_should_move(const void *obj) {
+    Slab *slab = slab_of(obj);
+    SlabClass *cls = slab->cls;
+    spin_lock(cls->lock);
+    bool sparse = (double)slab->used < k_slab_defrag_util * (double)slab->cap;
+    spin_unlock(cls->lock);
+    return sparse;
+}
+
+// A block for a copy of obj on a slab fuller than obj's own, NULL if none is found. Sticking
+// to the last slab used fills it up: the partial list starts with the slabs being emptied
+void *slab_alloc_dense(const void *obj) {
+    Slab *src = slab_of(obj);
+    SlabClass *cls = src->cls;
+    spin_lock(cls->lock);
+    Slab *best = NULL;
+    if(cls->dense && cls->dense != src && cls->dense->used > src->used) {
+        best = cls->dense;
+    }
+    size_t n = 0;
+    for(Slab *slab = best ? NULL : cls->partial; slab && n < k_slab_dense_scan; slab = slab->next, ++n) {
+        if(slab != src && slab->used > src->used && (!best || slab->used > best->used)) {
+            best = slab;
+        }
+    }
+    cls->dense = best;
+
+    void *dst = best ? slab_take(cls, best) : NULL;
+    spin_unlock(cls->lock);
+    return dst;
+}
+
+void slab_free(void *obj) {
+    if(!obj) {
+        return;
+    }
+
+    Slab *slab = slab_of(obj);
+    SlabClass *cls = slab->cls;
+    spin_lock(cls->lock);
+    assert(slab->used > 0);
+    *(void **)obj = slab->free;
+    slab->free = obj;
+    slab->used--;
+    cls->nobjs--;
+
+    if(!slab->partial) {
+        partial_add(cls, slab);
+    }
+    bool others = cls->partial != slab || slab->next;
+    if(slab->used == 0 && others) {
+        partial_remove(cls, slab);
+        slab_release(cls, slab);
+    }
+    spin_unlock(cls->lock);
+}
+
+void slab_stats(SlabStats *out) {
+    spin_lock(g_slabs.lock);
+    out->regions = g_slabs.nregions;
+    out->slabs = g_slabs.nslabs;
+    out->empty_slabs = g_slabs.empty.size();
+    out->huge_regions = g_slabs.huge.size();
+    SlabClass *classes = g_slabs.classes;
+    spin_unlock(g_slabs.lock);
+
+    // Classes are only ever added at the front, so the list can be walked unlocked
+    out->used_bytes = 0;
+    for(SlabClass *cls = classes; cls; cls = cls->next_class) {
+        spin_lock(cls->lock);
+        out->used_bytes += cls->nobjs * cls->size;
+        spin_unlock(cls->lock);
+    }
+}
@@ -0,0 +1,85 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <atomic>
+
+/*
+
+Slab allocator:
+    Fixed size objects (entries, hash fields, set members) come from 64KB slabs instead of
+    malloc: no per object header, and objects of one kind sit together. A slab starts with its
+    header and is aligned to its size, so a freed object finds its slab by masking the pointer.
+    Free objects are linked through their first word.
+
+    Slabs with free objects are on their class's partial list, most recently freed into first.
+    A slab that becomes empty has its pages handed back to the OS (MADV_DONTNEED) and is kept
+    for any class to reuse, except when it is the class's only partial slab: a key being added
+    and removed over and over shouldn't map and release a slab every time.
+
+    Slabs are carved from 2MB regions that are never unmapped. Regions after the first
+    k_slab_huge_regions ask for transparent huge pages, so a big keyspace takes fewer TLB
+    misses while a small one doesn't pay for 2MB pages. A region stops asking once one of its
+    slabs is released, or khugepaged would map the released pages again.
+
+    Each class has a spinlock and the regions have one. Only the snapshot loader threads and
+    the reclaim thread allocate or free concurrently, so they are almost never contended.
+
+    Defragmentation: deletes leave slabs partly used, and a slab's pages only go back once it is
+    empty. slab_should_move() tells whether an object sits on a slab used below
+    k_slab_defrag_util, and slab_alloc_dense() gives it a new block on a strictly fuller slab of
+    its class: the one it filled last, or the fullest of the first k_slab_dense_scan partial
+    slabs. The caller copies the object and frees the old block, so every move packs the
+    class tighter and a slab emptied that way is released.
+
+*/
+
+const size_t k_slab_size = 64 << 10;
+const size_t k_slab_region_size = 2 << 20;
+const size_t k_slab_huge_regions = 4;
+const double k_slab_defrag_util = 0.75; // slabs used less than this are emptied by defrag
+const size_t k_slab_dense_scan = 32;    // partial slabs looked at for a fuller one
+
+// Objects are 16 byte aligned, like malloc's
+constexpr size_t slab_stride(size_t size) {
+    return (size + 15) & ~(size_t)15;
+}
+
+struct SlabClass;
+
+struct Slab {
+    Slab *prev;
+    Slab *next;
+    SlabClass *cls;
+    void *free;     // freed objects
+    uint32_t used;  // objects handed out
+    uint32_t fresh; // objects from here on were never handed out
+    uint32_t cap;
+    bool partial;   // on the class's partial list
+};
+
+struct SlabClass {
+    const char *name;
+    size_t size; // slab_stride() of the object
+    Slab *partial = NULL;
+    Slab *dense = NULL; // where slab_alloc_dense() last put an object, while it is partial
+    SlabClass *next_class = NULL; // every class that has had a slab, for the stats
+    bool listed = false;
+    size_t nslabs = 0;
+    size_t nobjs = 0;
+    std::atomic<bool> lock{false};
+};
+
+struct SlabStats {
+    size_t regions = 0;
+    size_t slabs = 0;       // held by a class
+    size_t empty_slabs = 0; // released to the OS, waiting for reuse
+    size_t huge_regions = 0;
+    size_t used_bytes = 0; // objects handed out, times their size
+};
+
+void *slab_alloc(SlabClass *cls);
+void slab_free(void *obj);
+void slab_stats(SlabStats *out);
+bool slab_should_move(const void *obj);
+void *slab_alloc_dense(const void *obj);
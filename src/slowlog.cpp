@@ -0,0 +1,68 @@
+#include "slowlog.h"
+#include <stdio.h>
+#include <time.h>
+
+void slowlog_init(SlowLog *log, int64_t threshold_us, size_t max_len) {
+    log->threshold_us = threshold_us;
+    log->max_len = max_len;
+    log->ring.assign(max_len, SlowEntry());
+    log->head = 0;
+    log->len = 0;
+}
+
+bool slowlog_wants(const SlowLog *log, uint64_t duration_ns) {
+    return log->threshold_us >= 0 && log->max_len > 0 && duration_ns >= (uint64_t)log->threshold_us * 1000;
+}
+
+// Overwrites the oldest entry once the ring is full
+void slowlog_push(SlowLog *log, const std::vector<std::string> &args, uint64_t duration_ns, int fd) {
+    if(log->max_len == 0) {
+        return;
+    }
+
+    SlowEntry &e = log->ring[log->head];
+    e.id = log->next_id++;
+    e.time = (uint64_t)time(NULL);
+    e.duration_us = duration_ns / 1000;
+    e.fd = fd;
+    e.args.clear();
+
+    char note[64];
+    for(size_t i = 0; i < args.size(); ++i) {
+        if(i + 1 == k_slowlog_max_args && args.size() > k_slowlog_max_args) {
+            snprintf(note, sizeof(note), "... (%zu more arguments)", args.size() - i);
+            e.args.push_back(note);
+            break;
+        }
+
+        const std::string &arg = args[i];
+        if(arg.size() <= k_slowlog_max_arg_len) {
+            e.args.push_back(arg);
+        } else {
+            snprintf(note, sizeof(note), "... (%zu more bytes)", arg.size() - k_slowlog_max_arg_len);
+            e.args.push_back(arg.substr(0, k_slowlog_max_arg_len) + note);
+        }
+    }
+
+    log->head = (log->head + 1) % log->max_len;
+    if(log->len < log->max_len) {
+        log->len++;
+    }
+}
+
+// The i-th newest entry, NULL past the end
+const SlowEntry *slowlog_get(const SlowLog *log, size_t i) {
+    if(i >= log->len) {
+        return NULL;
+    }
+    return &log->ring[(log->head + log->max_len - 1 - i) % log->max_len];
+}
+
+// Ids keep counting up, so a reader can tell entries apart across resets
+void slowlog_reset(SlowLog *log) {
+    for(SlowEntry &e : log->ring) {
+        std::vector<std::string>().swap(e.args);
+    }
+    log->head = 0;
+    log->len = 0;
+}
@@ -0,0 +1,43 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string>
+#include <vector>
+
+/*
+
+Slow log:
+    A ring of the last max_len commands that ran longer than the threshold, newest first when
+    read. The ring is allocated once. Faster commands only cost the threshold comparison: the
+    arguments are copied (and truncated) only for commands that get logged.
+
+*/
+
+const int64_t k_slowlog_default_us = 10000;
+const size_t k_slowlog_default_len = 128;
+const size_t k_slowlog_max_args = 32;      // the last kept argument says how many more there were
+const size_t k_slowlog_max_arg_len = 128;  // longer arguments say how many more bytes there were
+
+struct SlowEntry {
+    uint64_t id = 0;
+    uint64_t time = 0; // unix seconds
+    uint64_t duration_us = 0;
+    int fd = -1;
+    std::vector<std::string> args;
+};
+
+struct SlowLog {
+    int64_t threshold_us = k_slowlog_default_us; // negative turns it off
+    size_t max_len = k_slowlog_default_len;
+    std::vector<SlowEntry> ring;
+    size_t head = 0; // where the next entry goes
+    size_t len = 0;
+    uint64_t next_id = 0;
+};
+
+void slowlog_init(SlowLog *log, int64_t threshold_us, size_t max_len);
+bool slowlog_wants(const SlowLog *log, uint64_t duration_ns);
+void slowlog_push(SlowLog *log, const std::vector<std::string> &args, uint64_t duration_ns, int fd);
+const SlowEntry *slowlog_get(const SlowLog *log, size_t i);
+void slowlog_reset(SlowLog *log);
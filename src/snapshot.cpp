@@ -0,0 +1,272 @@
+#include "snapshot.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <assert.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <atomic>
+#include <thread>
+
+static const char k_snap_magic[8] = {'R', 'S', 'N', 'A', 'P', '0', '0', '1'};
+static const char k_snap_end[8] = {'R', 'S', 'N', 'A', 'P', 'E', 'N', 'D'};
+const size_t k_snap_segment = 1 << 20; // cut a new segment every 1MB
+const size_t k_snap_trailer = 8 + 8 + 8;
+
+static int32_t write_all(int fd, const char *buf, size_t n)
+{
+    while (n > 0)
+    {
+        ssize_t rv = write(fd, buf, n);
+        if (rv < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (rv <= 0)
+        {
+            return -1; // error
+        }
+
+        assert((size_t)rv <= n);
+        n -= (size_t)rv;
+        buf += rv;
+    }
+    return 0;
+}
+
+static void snap_put(SnapWriter &w, const char *data, size_t len) {
+    if(!w.failed && write_all(w.fd, data, len) != 0) {
+        w.failed = true;
+    }
+    w.offset += len;
+}
+
+static void snap_cut_segment(SnapWriter &w) {
+    if(w.nrecords == 0) {
+        return;
+    }
+
+    SnapSegment seg;
+    seg.offset = w.offset;
+    seg.len = w.buf.size();
+    seg.nrecords = w.nrecords;
+    w.segments.push_back(seg);
+
+    snap_put(w, w.buf.data(), w.buf.size());
+    w.buf.clear();
+    w.nrecords = 0;
+}
+
+// Writes go to a temp file that replaces path once it is complete
+int32_t snap_write_begin(SnapWriter &w, const char *path, uint64_t nkeys) {
+    w.path = path;
+    std::string tmp = w.path + ".tmp";
+    w.fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if(w.fd < 0) {
+        return -1;
+    }
+
+    snap_put(w, k_snap_magic, 8);
+    snap_put(w, (char *)&nkeys, 8);
+    return 0;
+}
+
+void snap_write_record(SnapWriter &w, uint8_t type, const std::string &key, const std::string &val) {
+    uint32_t klen = (uint32_t)key.size();
+    uint32_t vlen = (uint32_t)val.size();
+
+    w.buf.push_back((char)type);
+    w.buf.append((char *)&klen, 4);
+    w.buf.append(key);
+    w.buf.append((char *)&vlen, 4);
+    w.buf.append(val);
+    w.nrecords++;
+
+    if(w.buf.size() >= k_snap_segment) {
+        snap_cut_segment(w);
+    }
+}
+
+int32_t snap_write_end(SnapWriter &w) {
+    snap_cut_segment(w);
+
+    uint64_t footer_offset = w.offset;
+    for(const SnapSegment &seg : w.segments) {
+        snap_put(w, (char *)&seg.offset, 8);
+        snap_put(w, (char *)&seg.len, 8);
+        snap_put(w, (char *)&seg.nrecords, 8);
+    }
+
+    uint64_t nsegs = w.segments.size();
+    snap_put(w, (char *)&nsegs, 8);
+    snap_put(w, (char *)&footer_offset, 8);
+    snap_put(w, k_snap_end, 8);
+
+    std::string tmp = w.path + ".tmp";
+    bool ok = !w.failed && fsync(w.fd) == 0;
+    close(w.fd);
+    w.fd = -1;
+
+    if(!ok || rename(tmp.c_str(), w.path.c_str()) != 0) {
+        unlink(tmp.c_str());
+        return -1;
+    }
+    return 0;
+}
+
+// Decodes one segment into the worker's batch. Returns false on a malformed record
+static bool snap_decode_segment(const uint8_t *data, const SnapSegment &seg,
+                                HNode *(*decode)(const SnapRecord &rec), std::vector<HNode *> &batch) {
+    const uint8_t *p = data + seg.offset;
+    const uint8_t *end = p + seg.len;
+
+    for(uint64_t i = 0; i < seg.nrecords; ++i) {
+        SnapRecord rec;
+        if(end - p < 1 + 4) {
+            return false;
+        }
+        rec.type = p[0];
+        memcpy(&rec.klen, &p[1], 4);
+        p += 1 + 4;
+
+        if((size_t)(end - p) < (size_t)rec.klen + 4) {
+            return false;
+        }
+        rec.key = p;
+        p += rec.klen;
+        memcpy(&rec.vlen, p, 4);
+        p += 4;
+
+        if((size_t)(end - p) < rec.vlen) {
+            return false;
+        }
+        rec.val = p;
+        p += rec.vlen;
+
+        HNode *node = decode(rec);
+        if(!node) {
+            return false;
+        }
+        batch.push_back(node);
+    }
+
+    return p == end;
+}
+
+/*
+
+Loads a snapshot into an empty hashmap:
+    1. mmap the file and read the footer
+    2. size the hashmap for the key count in one step
+    3. worker threads claim segments and decode them into per-thread batches (decode() runs on
+       the workers, so it must only allocate)
+    4. link every batch into the hashmap on the calling thread
+
+Returns the number of keys loaded, 0 if there's no snapshot, -1 on error.
+
+*/
+int64_t snap_load(const char *path, HMap *db, size_t nthreads,
+                  HNode *(*decode)(const SnapRecord &rec), void (*destroy)(HNode *node)) {
+    int fd = open(path, O_RDONLY);
+    if(fd < 0) {
+        return errno == ENOENT ? 0 : -1;
+    }
+
+    struct stat st = {};
+    if(fstat(fd, &st) != 0 || (size_t)st.st_size < 8 + 8 + k_snap_trailer) {
+        close(fd);
+        return -1;
+    }
+
+    size_t size = (size_t)st.st_size;
+    const uint8_t *data = (const uint8_t *)mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if(data == MAP_FAILED) {
+        return -1;
+    }
+    (void)madvise((void *)data, size, MADV_SEQUENTIAL | MADV_WILLNEED);
+
+    // Header and footer
+    uint64_t nkeys = 0, nsegs = 0, footer_offset = 0;
+    memcpy(&nkeys, &data[8], 8);
+    memcpy(&nsegs, &data[size - k_snap_trailer], 8);
+    memcpy(&footer_offset, &data[size - k_snap_trailer + 8], 8);
+
+    bool ok = 0 == memcmp(data, k_snap_magic, 8)
+        && 0 == memcmp(&data[size - 8], k_snap_end, 8)
+        && footer_offset <= size - k_snap_trailer
+        && nsegs == (size - k_snap_trailer - footer_offset) / 24
+        && footer_offset + nsegs * 24 + k_snap_trailer == size;
+
+    std::vector<SnapSegment> segments(ok ? nsegs : 0);
+    for(uint64_t i = 0; ok && i < nsegs; ++i) {
+        const uint8_t *p = &data[footer_offset + i * 24];
+        memcpy(&segments[i].offset, &p[0], 8);
+        memcpy(&segments[i].len, &p[8], 8);
+        memcpy(&segments[i].nrecords, &p[16], 8);
+        ok = segments[i].offset <= footer_offset && segments[i].len <= footer_offset - segments[i].offset;
+    }
+
+    if(!ok) {
+        munmap((void *)data, size);
+        return -1;
+    }
+
+    // Decode in parallel
+    if(nthreads == 0) {
+        nthreads = 1;
+    }
+    if(nthreads > segments.size()) {
+        nthreads = segments.size() ? segments.size() : 1;
+    }
+
+    std::vector<std::vector<HNode *>> batches(nthreads);
+    std::atomic<size_t> next_seg{0};
+    std::atomic<bool> failed{false};
+
+    auto worker = [&](size_t id) {
+        size_t i;
+        while(!failed.load(std::memory_order_relaxed) && (i = next_seg.fetch_add(1)) < segments.size()) {
+            if(!snap_decode_segment(data, segments[i], decode, batches[id])) {
+                failed = true;
+            }
+        }
+    };
+
+    std::vector<std::thread> threads;
+    for(size_t t = 1; t < nthreads; ++t) {
+        threads.emplace_back(worker, t);
+    }
+    worker(0);
+    for(std::thread &t : threads) {
+        t.join();
+    }
+    munmap((void *)data, size);
+
+    size_t total = 0;
+    for(std::vector<HNode *> &batch : batches) {
+        total += batch.size();
+    }
+
+    if(failed || total != nkeys) {
+        for(std::vector<HNode *> &batch : batches) {
+            for(HNode *node : batch) {
+                destroy(node);
+            }
+        }
+        return -1;
+    }
+
+    // Link. The map is already big enough, so no insert here moves keys around
+    hm_reserve(db, nkeys);
+    for(std::vector<HNode *> &batch : batches) {
+        for(HNode *node : batch) {
+            hm_insert(db, node);
+        }
+    }
+
+    return (int64_t)nkeys;
+}
@@ -0,0 +1,50 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string>
+#include <vector>
+#include "hashtable.h"
+
+/*
+
+Snapshot file format:
+    header   "RSNAP001" - key count u64
+    segments records, each: type u8 - key len u32 - key - val len u32 - val
+    footer   (offset u64 - len u64 - nrecords u64) per segment - nsegments u64 - footer offset u64 - "RSNAPEND"
+
+    Every segment starts on a record boundary, so segments decode independently. The key count
+    lets the loader size the hashmap once instead of doubling it over and over.
+
+*/
+
+struct SnapRecord {
+    uint8_t type = 0;
+    const uint8_t *key = NULL;
+    uint32_t klen = 0;
+    const uint8_t *val = NULL;
+    uint32_t vlen = 0;
+};
+
+struct SnapSegment {
+    uint64_t offset = 0;
+    uint64_t len = 0;
+    uint64_t nrecords = 0;
+};
+
+struct SnapWriter {
+    int fd = -1;
+    std::string path;
+    std::string buf;    // current segment
+    uint64_t offset = 0;
+    uint64_t nrecords = 0;
+    std::vector<SnapSegment> segments;
+    bool failed = false;
+};
+
+int32_t snap_write_begin(SnapWriter &w, const char *path, uint64_t nkeys);
+void snap_write_record(SnapWriter &w, uint8_t type, const std::string &key, const std::string &val);
+int32_t snap_write_end(SnapWriter &w);
+
+int64_t snap_load(const char *path, HMap *db, size_t nthreads,
+                  HNode *(*decode)(const SnapRecord &rec), void (*destroy)(HNode *node));
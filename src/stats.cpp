@@ -0,0 +1,83 @@
+#include "stats.h"
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+#if defined(__x86_64__)
+#include <x86intrin.h>
+#include <cpuid.h>
+#endif
+#if defined(__GLIBC__)
+#include <malloc.h>
+#endif
+
+static bool g_use_tsc = false;
+static double g_ns_per_tick = 1.0;
+
+static uint64_t monotonic_ns() {
+    struct timespec ts = {};
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+// Takes 10ms
+void stats_clock_init() {
+#if defined(__x86_64__)
+    unsigned int eax = 0, ebx = 0, ecx = 0, edx = 0;
+    if(!__get_cpuid(0x80000007, &eax, &ebx, &ecx, &edx) || !(edx & (1u << 8))) {
+        return; // the TSC rate follows the core clock
+    }
+
+    uint64_t ns0 = monotonic_ns(), t0 = __rdtsc();
+    struct timespec nap = {0, 10000000};
+    nanosleep(&nap, NULL);
+    uint64_t ns1 = monotonic_ns(), t1 = __rdtsc();
+    if(t1 > t0 && ns1 > ns0) {
+        g_ns_per_tick = (double)(ns1 - ns0) / (double)(t1 - t0);
+        g_use_tsc = true;
+    }
+#endif
+}
+
+uint64_t stats_ticks() {
+#if defined(__x86_64__)
+    if(g_use_tsc) {
+        return __rdtsc();
+    }
+#endif
+    return monotonic_ns();
+}
+
+uint64_t stats_ticks_to_ns(uint64_t ticks) {
+    return g_use_tsc ? (uint64_t)((double)ticks * g_ns_per_tick) : ticks;
+}
+
+uint64_t stats_now_ms() {
+    return monotonic_ns() / 1000000;
+}
+
+// Resident set size in bytes, 0 if unknown
+size_t stats_rss() {
+    FILE *f = fopen("/proc/self/statm", "r");
+    if(!f) {
+        return 0;
+    }
+
+    unsigned long size = 0, resident = 0;
+    int n = fscanf(f, "%lu %lu", &size, &resident);
+    fclose(f);
+    return n == 2 ? (size_t)resident * (size_t)sysconf(_SC_PAGESIZE) : 0;
+}
+
+// Walks the malloc arenas, so it isn't free. false if the allocator can't tell
+bool stats_alloc(AllocStats *out) {
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || __GLIBC_MINOR__ >= 33)
+    struct mallinfo2 mi = mallinfo2();
+    out->allocated = mi.uordblks + mi.hblkhd;
+    out->free = mi.fordblks;
+    out->mapped = mi.arena + mi.hblkhd;
+    return true;
+#else
+    (void)out;
+    return false;
+#endif
+}
@@ -0,0 +1,26 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+
+Cheap timing and process figures for introspection:
+    stats_ticks() reads the TSC where it is invariant, and CLOCK_MONOTONIC otherwise.
+    stats_clock_init() measures the TSC against CLOCK_MONOTONIC once at startup, so ticks
+    convert to nanoseconds with a multiplication.
+
+*/
+
+struct AllocStats {
+    size_t allocated = 0; // bytes handed out by malloc
+    size_t free = 0;      // bytes malloc holds but hasn't handed out
+    size_t mapped = 0;    // bytes malloc got from the system, heap and mmap'd chunks
+};
+
+void stats_clock_init();
+uint64_t stats_ticks();
+uint64_t stats_ticks_to_ns(uint64_t ticks);
+uint64_t stats_now_ms();
+size_t stats_rss();
+bool stats_alloc(AllocStats *out);
@@ -1,16 +1,77 @@
 #include <string>
 #include <stdlib.h>
+#include <errno.h>
+#include <math.h>
+#include <string.h>
+#include <stdio.h>
+#include "utils.h"
 
 bool str2dbl(const std::string &s, double &out) {
     char *endp = NULL;
     out = strtod(s.c_str(), &endp);
-    return endp == s.c_str() + s.size() && !isnan(out);
+    return !s.empty() && endp == s.c_str() + s.size() && !isnan(out);
 }
 
 bool str2int(const std::string &s, int64_t &out) {
     char *endp = NULL;
+    errno = 0;
     out = strtoll(s.c_str(), &endp, 10);
-    return endp == s.c_str() + s.size();
+    return !s.empty() && errno != ERANGE && endp == s.c_str() + s.size();
+}
+
+// Formats v in decimal into buf, which holds at least k_int_digits bytes. Returns the length
+uint32_t int_format(int64_t v, char *buf) {
+    char tmp[k_int_digits];
+    uint64_t u = v < 0 ? 0 - (uint64_t)v : (uint64_t)v;
+    uint32_t n = 0;
+    do {
+        tmp[n++] = (char)('0' + u % 10);
+        u /= 10;
+    } while(u);
+
+    uint32_t len = 0;
+    if(v < 0) {
+        buf[len++] = '-';
+    }
+    while(n) {
+        buf[len++] = tmp[--n];
+    }
+    return len;
+}
+
+// Formats v into buf, which holds at least k_dbl_digits bytes, with the fewest significant
+// digits that parse back to v. Whole numbers in int64 range are plain digits, so INCR takes
+// them. Returns the length
+uint32_t dbl_format(double v, char *buf) {
+    if(v >= -9223372036854775808.0 && v < 9223372036854775808.0 && v == trunc(v)) {
+        return int_format((int64_t)v, buf);
+    }
+
+    int n = 0;
+    for(int prec = 15; prec <= 17; ++prec) {
+        n = snprintf(buf, k_dbl_digits, "%.*g", prec, v);
+        if(strtod(buf, NULL) == v) {
+            break;
+        }
+    }
+    return (uint32_t)n;
+}
+
+// Like str2int, but only accepts the exact form int_format() produces, so the int can stand in
+// for the string
+bool str2int_canonical(const std::string &s, int64_t &out) {
+    char buf[k_int_digits];
+    return s.size() < k_int_digits && str2int(s, out)
+        && int_format(out, buf) == s.size() && 0 == memcmp(buf, s.data(), s.size());
+}
+
+bool cpu_has_avx2() {
+#if defined(__x86_64__)
+    static const bool avx2 = __builtin_cpu_supports("avx2");
+    return avx2;
+#else
+    return false;
+#endif
 }
 
 uint64_t str_hash(const uint8_t *data, size_t len) {
@@ -22,6 +83,41 @@ uint64_t str_hash(const uint8_t *data, size_t len) {
     return h;
 }
 
+// MurmurHash64A. For when 32 bits of state are not enough, e.g. HyperLogLog
+uint64_t hash64(const uint8_t *data, size_t len, uint64_t seed) {
+    const uint64_t m = 0xc6a4a7935bd1e995ull;
+    const int r = 47;
+    uint64_t h = seed ^ (len * m);
+
+    size_t i = 0;
+    for(; i + 8 <= len; i += 8) {
+        uint64_t k;
+        memcpy(&k, &data[i], 8);
+        k *= m;
+        k ^= k >> r;
+        k *= m;
+        h ^= k;
+        h *= m;
+    }
+
+    switch(len & 7) {
+        case 7: h ^= (uint64_t)data[i + 6] << 48; /* fallthrough */
+        case 6: h ^= (uint64_t)data[i + 5] << 40; /* fallthrough */
+        case 5: h ^= (uint64_t)data[i + 4] << 32; /* fallthrough */
+        case 4: h ^= (uint64_t)data[i + 3] << 24; /* fallthrough */
+        case 3: h ^= (uint64_t)data[i + 2] << 16; /* fallthrough */
+        case 2: h ^= (uint64_t)data[i + 1] << 8; /* fallthrough */
+        case 1:
+            h ^= (uint64_t)data[i];
+            h *= m;
+    }
+
+    h ^= h >> r;
+    h *= m;
+    h ^= h >> r;
+    return h;
+}
+
 uint32_t min(size_t lhs, size_t rhs) {
     return lhs < rhs ? lhs : rhs;
 }
\ No newline at end of file
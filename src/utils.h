@@ -16,7 +16,15 @@ enum {
     const typeof( ((type *)0)->member ) *__mptr = (ptr);    \
     (type *)( (char *)__mptr - offsetof(type, member) );})
 
+const size_t k_int_digits = 21; // "-9223372036854775808"
+const size_t k_dbl_digits = 32; // "-2.2250738585072014e-308"
+
 uint64_t str_hash(const uint8_t *data, size_t len);
+uint64_t hash64(const uint8_t *data, size_t len, uint64_t seed);
 bool str2dbl(const std::string &s, double &out);
 bool str2int(const std::string &s, int64_t &out);
+uint32_t int_format(int64_t v, char *buf);
+uint32_t dbl_format(double v, char *buf);
+bool str2int_canonical(const std::string &s, int64_t &out);
+bool cpu_has_avx2();
 uint32_t min(size_t lhs, size_t rhs);
\ No newline at end of file
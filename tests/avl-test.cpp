@@ -3,13 +3,12 @@
 #include "../src/hashtable.h"
 #include "../src/utils.h"
 #include <assert.h>
+#include <string.h>
 #include <algorithm>
 #include <set>
-
-#define container_of(ptr, type, member) ({ \
-    const typeof(((type *)0)->member) *__mptr = ptr; \
-    (type *)((char *) __mptr - __offsetof(type, member)); \
-})
+#include <string>
+#include <utility>
+#include <vector>
 
 struct Entry {
     struct HNode node;
@@ -93,20 +92,6 @@ static void add(ZSet *zset, ZNode *znode_to_add, std::string key_to_add) {
     zset->tree_root = insert(&(zset->tree_root), &(znode_to_add->tree_node), znode_compare);
 }
 
-//TODO: Implement remove function for zset
-//static bool remove(ZSet *zset, std::string key_to_delete) {
-    //find node
-//    Entry key;
-//    key.key.swap(key_to_delete);
-//    key.node.hcode = str_hash((uint8_t *)key.key.data(), key.key.size());
-//
-//    HNode *node = hm_lookup(&(zset->hashmap), &key.node, &entry_eq);
-//
-//    ZNode *znode = container_of(node, ZNode, hashmap_node);
-//    
-//    return del(&(zset->tree_root), &(znode->tree_node), znode_compare);
-//}
-
 static void node_verify(AVLNode *node) {
     if(node == NULL) {
         return;
@@ -195,10 +180,99 @@ static int search(AVLNode *node, uint32_t key) {
     }
 }
 
+static ZNode *make_znode(uint32_t score, const std::string &key) {
+    ZNode *znode = new ZNode();
+    znode->tree_node.height = 1;
+    znode->score = score;
+    znode->key = (char *)malloc(key.size() + 1);
+    memcpy(znode->key, key.data(), key.size() + 1);
+    znode->len = key.size();
+    return znode;
+}
+
+static void free_znode(ZNode *znode) {
+    free(znode->key);
+    delete znode;
+}
+
+typedef std::pair<uint32_t, std::string> RefItem;
+typedef std::set<RefItem> RefSet;
+
+static void extract_pairs(AVLNode *node, std::vector<RefItem> &out) {
+    if(!node) {
+        return;
+    }
+
+    extract_pairs(node->left, out);
+    ZNode *znode = container_of(node, ZNode, tree_node);
+    out.push_back(std::make_pair(znode->score, std::string(znode->key, znode->len)));
+    extract_pairs(node->right, out);
+}
+
+//Inorder sequence must match the reference exactly, and every height and balance factor must hold
+static void random_verify(AVLNode *root, const RefSet &ref) {
+    std::vector<RefItem> extracted;
+    extract_pairs(root, extracted);
+    assert(extracted == std::vector<RefItem>(ref.begin(), ref.end()));
+    node_verify(root);
+}
+
+//Random inserts and deletes against a std::set ordered by (score, key) like the tree.
+//Small score and key ranges so deletes hit often and nodes with two children get deleted
+static void test_random(uint32_t rounds) {
+    AVLNode *root = NULL;
+    RefSet ref;
+
+    for(uint32_t i = 0; i < rounds; i++) {
+        uint32_t score = (uint32_t)rand() % 512;
+        std::string key(1 + rand() % 2, 'a');
+        for(char &c : key) {
+            c = 'a' + rand() % 26;
+        }
+        ZNode *znode = make_znode(score, key);
+
+        if(rand() % 2) {
+            if(ref.insert(std::make_pair(score, key)).second) {
+                root = insert(&root, &znode->tree_node, znode_compare);
+            } else {
+                free_znode(znode);
+            }
+        } else {
+            //del() unlinks the node holding the key, which need not be the one inserted with it
+            AVLNode *removed = del(&root, &znode->tree_node, znode_compare);
+            bool found = ref.erase(std::make_pair(score, key)) == 1;
+            assert((removed != NULL) == found);
+            if(removed) {
+                ZNode *removed_container = container_of(removed, ZNode, tree_node);
+                assert(removed_container->score == score);
+                assert(std::string(removed_container->key, removed_container->len) == key);
+                free_znode(removed_container);
+            }
+            free_znode(znode);
+        }
+
+        if(i % 1000 == 0) {
+            random_verify(root, ref);
+        }
+    }
+    random_verify(root, ref);
+
+    //Drain the tree through del() too
+    while(!ref.empty()) {
+        ZNode *probe = make_znode(ref.begin()->first, ref.begin()->second);
+        AVLNode *removed = del(&root, &probe->tree_node, znode_compare);
+        assert(removed != NULL);
+        free_znode(container_of(removed, ZNode, tree_node));
+        free_znode(probe);
+        ref.erase(ref.begin());
+    }
+    assert(root == NULL);
+}
+
 int main() {
   //Create zset obj and reference multiset for testing
   //create basic hashtable
-  ZSet *zset = (struct ZSet *)malloc(sizeof(struct ZSet));
+  ZSet *zset = new ZSet();
 
   std::multiset<uint32_t> ref;
   char **keys = (char **)malloc(sizeof(char *) * 100);
@@ -218,11 +292,11 @@ int main() {
         //Create node
         ZNode *znode = new ZNode();
         znode->hashmap_node.next = NULL;
-        znode->hashmap_node.hcode = str_hash((uint8_t *)key, sizeof(key));
+        znode->hashmap_node.hcode = str_hash((uint8_t *)key, strlen(key));
 
         znode->tree_node.height = 1;
         znode->score = val;        
-        znode->key = (char *)malloc(sizeof(key) + 1);
+        znode->key = (char *)malloc(strlen(key) + 1);
         strcpy(znode->key, key);
         znode->len = strlen(key);
 
@@ -236,4 +310,6 @@ int main() {
     //Traverse tree in order and print results as (key, score)
     traversal(zset->tree_root);
 
+    test_random(200000);
+    printf("avl random test passed\n");
 }
@@ -0,0 +1,121 @@
+// The bitops module is compiled in whole so its static kernels can be called directly
+#include "../src/bitops.cpp"
+#include <assert.h>
+#include <stdio.h>
+#include <random>
+#include <vector>
+
+// Checks the popcount and AND/OR/XOR/NOT kernels against byte-at-a-time versions, at every
+// start alignment and at lengths around the 32-byte vector and 128-byte loop boundaries
+
+static std::mt19937_64 g_rng(12345);
+
+static uint64_t count_ref(const uint8_t *data, size_t len) {
+    uint64_t n = 0;
+    for(size_t i = 0; i < len; ++i) {
+        for(uint8_t b = data[i]; b; b &= (uint8_t)(b - 1)) {
+            n++;
+        }
+    }
+    return n;
+}
+
+static uint8_t op_ref(uint32_t op, uint8_t d, uint8_t s) {
+    switch(op) {
+    case BITOP_AND:
+        return d & s;
+    case BITOP_OR:
+        return d | s;
+    case BITOP_XOR:
+        return d ^ s;
+    default:
+        return (uint8_t)~s;
+    }
+}
+
+static std::vector<uint8_t> random_bytes(size_t n) {
+    std::vector<uint8_t> v(n);
+    for(uint8_t &b : v) {
+        b = (uint8_t)g_rng();
+    }
+    return v;
+}
+
+// Lengths 0 to 300 and a few past 1000, each at every start offset within a vector
+static std::vector<size_t> test_lengths() {
+    std::vector<size_t> lens;
+    for(size_t len = 0; len <= 300; ++len) {
+        lens.push_back(len);
+    }
+    for(size_t len : {1000, 1023, 1024, 1025, 1151, 1279, 4093}) {
+        lens.push_back(len);
+    }
+    return lens;
+}
+
+static void test_count() {
+    std::vector<uint8_t> data = random_bytes(4096 + 64);
+    // Runs of all-ones bytes, where a per-byte sum of 8 meets the nibble lookup's widest case
+    memset(&data[512], 0xFF, 300);
+    for(size_t len : test_lengths()) {
+        for(size_t off = 0; off < 33 && off + len <= data.size(); ++off) {
+            const uint8_t *p = &data[off];
+            uint64_t want = count_ref(p, len);
+            assert(count_tail(p, len) == want);
+            assert(bit_count(p, len) == want);
+#if defined(__x86_64__)
+            if(__builtin_cpu_supports("popcnt")) {
+                assert(count_popcnt(p, len) == want);
+            }
+            if(cpu_has_avx2()) {
+                assert(count_avx2(p, len) == want);
+            }
+#endif
+        }
+    }
+}
+
+typedef void (*OpKernel)(uint32_t op, uint8_t *dst, const uint8_t *src, size_t len);
+
+// Runs f at the given offsets, and checks the len bytes it should write and the guard bytes
+// around them it shouldn't
+static void check_op(OpKernel f, uint32_t op, const std::vector<uint8_t> &dst0,
+                     const std::vector<uint8_t> &src, size_t doff, size_t soff, size_t len) {
+    std::vector<uint8_t> dst = dst0;
+    f(op, &dst[doff], &src[soff], len);
+    for(size_t i = 0; i < dst.size(); ++i) {
+        bool inside = i >= doff && i < doff + len;
+        uint8_t want = inside ? op_ref(op, dst0[i], src[soff + i - doff]) : dst0[i];
+        if(dst[i] != want) {
+            fprintf(stderr, "op %u, len %zu, offsets %zu %zu: byte %zu is %u, want %u\n",
+                    op, len, doff, soff, i, dst[i], want);
+            assert(false);
+        }
+    }
+}
+
+static void test_op() {
+    for(uint32_t op : {BITOP_AND, BITOP_OR, BITOP_XOR, BITOP_NOT}) {
+        for(size_t len : test_lengths()) {
+            std::vector<uint8_t> dst = random_bytes(len + 80), src = random_bytes(len + 80);
+            for(size_t k = 0; k < 4; ++k) {
+                // The two sides at unrelated alignments
+                size_t doff = 8 + g_rng() % 33, soff = g_rng() % 33;
+                check_op(&op_tail, op, dst, src, doff, soff, len);
+                check_op(&bit_op, op, dst, src, doff, soff, len);
+#if defined(__x86_64__)
+                if(cpu_has_avx2()) {
+                    check_op(&op_avx2, op, dst, src, doff, soff, len);
+                }
+#endif
+            }
+        }
+    }
+}
+
+int main() {
+    test_count();
+    test_op();
+    printf("bitops tests passed\n");
+    return 0;
+}
@@ -0,0 +1,138 @@
+// The HLL module is compiled in whole so its static encodings and kernels can be reached
+#include "../src/hll.cpp"
+#include <stdio.h>
+#include <random>
+#include <vector>
+
+// Checks that the sparse and dense encodings hold the same registers, that the AVX2 register
+// kernels match the scalar ones, and that estimates stay within the expected error
+
+static std::mt19937_64 g_rng(12345);
+
+static std::string element(uint64_t i) {
+    return "element:" + std::to_string(i);
+}
+
+static void add(std::string &hll, const std::string &e) {
+    hll_add(hll, (const uint8_t *)e.data(), e.size());
+}
+
+static std::vector<uint8_t> registers(const std::string &hll) {
+    std::vector<uint8_t> regs(k_hll_registers, 0);
+    hll_merge(regs.data(), hll);
+    return regs;
+}
+
+// The same elements added to a sparse and to a dense HLL, compared as they grow and when the
+// sparse one switches to dense
+static void test_encodings() {
+    std::string sparse, dense;
+    hll_init(sparse);
+    std::vector<uint8_t> want(k_hll_registers, 0);
+    hll_from_regs(dense, want.data());
+    assert(hll_valid(sparse) && hll_valid(dense));
+    assert((uint8_t)sparse[4] == HLL_SPARSE && (uint8_t)dense[4] == HLL_DENSE);
+    assert(registers(sparse) == want && registers(dense) == want);
+    assert(hll_count(sparse) == 0 && hll_count(dense) == 0);
+
+    bool went_dense = false;
+    for(uint64_t i = 0; i < 20000; ++i) {
+        std::string e = element(i);
+        uint32_t idx = 0;
+        uint8_t count = 0;
+        hll_hash((const uint8_t *)e.data(), e.size(), idx, count);
+        want[idx] = std::max(want[idx], count);
+
+        bool was_sparse = (uint8_t)sparse[4] == HLL_SPARSE;
+        add(sparse, e);
+        add(dense, e);
+        went_dense = went_dense || (was_sparse && (uint8_t)sparse[4] == HLL_DENSE);
+
+        if(i < 200 || i % 97 == 0 || was_sparse != ((uint8_t)sparse[4] == HLL_SPARSE)) {
+            assert(hll_valid(sparse) && hll_valid(dense));
+            assert(registers(sparse) == want);
+            assert(registers(dense) == want);
+            assert(hll_count(sparse) == hll_count(dense));
+            assert(hll_count(sparse) == hll_count_regs(want.data()));
+        }
+    }
+    assert(went_dense);
+    assert(registers(sparse) == want && registers(dense) == want);
+
+    // Adding an element again changes nothing
+    std::string before = dense;
+    for(uint64_t i = 0; i < 1000; ++i) {
+        std::string e = element(i);
+        assert(!hll_add(dense, (const uint8_t *)e.data(), e.size()));
+    }
+    assert(dense == before);
+
+    // A packed and unpacked copy holds the same registers, with its estimate cached
+    std::string copy;
+    hll_from_regs(copy, want.data());
+    assert(registers(copy) == want);
+    assert(!((uint8_t)copy[15] & 0x80));
+    assert(hll_count(copy) == hll_count_regs(want.data()));
+}
+
+// Register arrays from all zero to all 63, with mostly low values in between like a real HLL
+static std::vector<uint8_t> random_regs(int kind) {
+    std::vector<uint8_t> regs(k_hll_registers, 0);
+    for(uint8_t &r : regs) {
+        if(kind == 1) {
+            r = 63;
+        } else if(kind == 2) {
+            r = (uint8_t)(g_rng() % 64);
+        } else if(kind >= 3 && g_rng() % (uint64_t)kind != 0) {
+            // Geometric, as the position of the first 1 bit of a hash is
+            r = (uint8_t)(__builtin_ctzll(g_rng() | (1ull << 50)) + 1);
+        }
+    }
+    return regs;
+}
+
+static void test_kernels() {
+#if defined(__x86_64__)
+    if(!cpu_has_avx2()) {
+        printf("no AVX2, register kernels not compared\n");
+        return;
+    }
+    for(int kind = 0; kind < 40; ++kind) {
+        std::vector<uint8_t> a = random_regs(kind), b = random_regs(kind == 0 ? 2 : kind);
+        std::vector<uint8_t> scalar = a, vec = a;
+        regs_max_scalar(scalar.data(), b.data());
+        regs_max_avx2(vec.data(), b.data());
+        assert(scalar == vec);
+
+        size_t zeros = 0, vec_zeros = 0;
+        double sum = regs_sum_scalar(a.data(), zeros);
+        double vec_sum = regs_sum_avx2(a.data(), vec_zeros);
+        assert(zeros == vec_zeros);
+        assert(fabs(sum - vec_sum) <= sum * 1e-12);
+    }
+#endif
+}
+
+// The standard error with 16384 registers is 1.04 / sqrt(16384), about 0.81%. Allow 4 times that
+static void test_error() {
+    for(uint64_t n : {1000, 100000, 1000000}) {
+        std::string hll;
+        hll_init(hll);
+        uint64_t base = g_rng();
+        for(uint64_t i = 0; i < n; ++i) {
+            add(hll, element(base + i));
+        }
+        double est = (double)hll_count(hll);
+        double err = fabs(est - (double)n) / (double)n;
+        printf("%lu elements: estimate %.0f, error %.3f%%\n", (unsigned long)n, est, err * 100);
+        assert(err < 0.0325);
+    }
+}
+
+int main() {
+    test_encodings();
+    test_kernels();
+    test_error();
+    printf("hll tests passed\n");
+    return 0;
+}
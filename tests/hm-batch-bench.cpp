@@ -0,0 +1,137 @@
+#include "../src/hashtable.h"
+#include "../src/utils.h"
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <string>
+#include <vector>
+#include <algorithm>
+
+// Compares hm_lookup_batch against one hm_lookup per key on random keys from a table much
+// bigger than the cache, then DEL's batched lookup and hm_unlink against one hm_pop per key.
+// Usage: hm-batch-bench [nkeys] [batch]
+
+struct Entry {
+    struct HNode node;
+    std::string key;
+};
+
+static bool entry_eq(HNode *lhs, HNode *rhs) {
+    struct Entry *le = container_of(lhs, struct Entry, node);
+    struct Entry *re = container_of(rhs, struct Entry, node);
+    return le->key == re->key;
+}
+
+static double now_sec() {
+    struct timespec ts = {};
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+static uint64_t xorshift(uint64_t &state) {
+    state ^= state << 13;
+    state ^= state >> 7;
+    state ^= state << 17;
+    return state;
+}
+
+int main(int argc, char **argv) {
+    size_t nkeys = argc > 1 ? (size_t)atol(argv[1]) : 4000000;
+    size_t batch = argc > 2 ? (size_t)atol(argv[2]) : 100;
+    const size_t nlookups = 4000000;
+
+    HMap db;
+    for(size_t i = 0; i < nkeys; ++i) {
+        Entry *entry = new Entry();
+        entry->key = "key:" + std::to_string(i);
+        entry->node.hcode = str_hash((uint8_t *)entry->key.data(), entry->key.size());
+        hm_insert(&db, &entry->node);
+    }
+
+    // Finish any resize so both runs see the same table
+    Entry warm;
+    while(db.h2.tab) {
+        hm_lookup(&db, &warm.node, &entry_eq);
+    }
+
+    std::vector<Entry> probes(batch);
+    std::vector<HNode *> keys(batch), found(batch);
+    for(size_t i = 0; i < batch; ++i) {
+        keys[i] = &probes[i].node;
+    }
+
+    uint64_t seed = 88172645463325252ull;
+    auto fill = [&]() {
+        for(Entry &probe : probes) {
+            probe.key = "key:" + std::to_string(xorshift(seed) % nkeys);
+            probe.node.hcode = str_hash((uint8_t *)probe.key.data(), probe.key.size());
+        }
+    };
+
+    size_t hits = 0;
+    double single = 0, batched = 0;
+    for(size_t done = 0; done < nlookups; done += batch) {
+        fill();
+
+        double start = now_sec();
+        for(size_t i = 0; i < batch; ++i) {
+            hits += hm_lookup(&db, keys[i], &entry_eq) != NULL;
+        }
+        single += now_sec() - start;
+
+        fill();
+
+        start = now_sec();
+        hm_lookup_batch(&db, keys.data(), batch, &entry_eq, found.data());
+        for(size_t i = 0; i < batch; ++i) {
+            hits += found[i] != NULL;
+        }
+        batched += now_sec() - start;
+    }
+
+    // Deletes the way DEL does: one hm_pop per key, or the batch's nodes unlinked. The keys go
+    // back in untimed
+    double single_del = 0, batched_del = 0;
+    std::vector<HNode *> popped;
+    for(size_t done = 0; done < nlookups; done += batch) {
+        fill();
+
+        popped.clear();
+        double start = now_sec();
+        for(size_t i = 0; i < batch; ++i) {
+            if(HNode *node = hm_pop(&db, keys[i], &entry_eq)) {
+                popped.push_back(node);
+            }
+        }
+        single_del += now_sec() - start;
+        for(HNode *node : popped) {
+            hm_insert(&db, node);
+        }
+
+        fill();
+
+        popped.clear();
+        start = now_sec();
+        hm_lookup_batch(&db, keys.data(), batch, &entry_eq, found.data());
+        std::sort(found.begin(), found.end());
+        found.erase(std::unique(found.begin(), found.end()), found.end());
+        for(HNode *node : found) {
+            if(node) {
+                hm_unlink(&db, node);
+                popped.push_back(node);
+            }
+        }
+        batched_del += now_sec() - start;
+        for(HNode *node : popped) {
+            hm_insert(&db, node);
+        }
+        found.resize(batch);
+    }
+
+    printf("keys=%zu batch=%zu hits=%zu\n", nkeys, batch, hits);
+    printf("single:  %.1f ns/lookup\n", single * 1e9 / (double)nlookups);
+    printf("batched: %.1f ns/lookup\n", batched * 1e9 / (double)nlookups);
+    printf("single del:  %.1f ns/key\n", single_del * 1e9 / (double)nlookups);
+    printf("batched del: %.1f ns/key\n", batched_del * 1e9 / (double)nlookups);
+    return 0;
+}
@@ -0,0 +1,467 @@
+#include "../src/hashtable.h"
+#include "../src/avl.h"
+#include "../src/zset.h"
+#include "../src/utils.h"
+#include "../src/protocol.h"
+#include "../src/slab.h"
+#include "../src/stats.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <string>
+#include <vector>
+#include <algorithm>
+#if defined(__x86_64__)
+#include <x86intrin.h>
+#endif
+
+// Times the hot paths and prints the results as JSON on stdout. Usage: microbench [name filter]
+// Every case runs k_reps times and reports its fastest run
+
+const int k_reps = 3;
+
+struct Entry {
+    struct HNode node;
+    std::string key;
+};
+
+struct Result {
+    std::string name;
+    uint64_t size;
+    uint64_t ops;
+    double ns_per_op;
+    double bytes_per_cycle; // str_hash only, 0 if there's no cycle counter
+    int64_t rss_bytes;      // alloc_* only: resident memory left after the frees
+};
+
+static std::vector<Result> g_results;
+static const char *g_filter = NULL;
+
+static bool entry_eq(HNode *lhs, HNode *rhs) {
+    struct Entry *le = container_of(lhs, struct Entry, node);
+    struct Entry *re = container_of(rhs, struct Entry, node);
+    return le->key == re->key;
+}
+
+static uint64_t now_ns() {
+    struct timespec ts = {};
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+static uint64_t cycles() {
+#if defined(__x86_64__)
+    return __rdtsc();
+#else
+    return 0;
+#endif
+}
+
+static uint64_t xorshift(uint64_t &state) {
+    state ^= state << 13;
+    state ^= state >> 7;
+    state ^= state << 17;
+    return state;
+}
+
+static bool wanted(const char *name) {
+    return !g_filter || strstr(name, g_filter);
+}
+
+static void report(const char *name, uint64_t size, uint64_t ops, uint64_t ns, double bytes_per_cycle = 0) {
+    g_results.push_back(Result{name, size, ops, (double)ns / (double)ops, bytes_per_cycle, 0});
+    fprintf(stderr, "%-22s %9lu %8.1f ns/op\n", name, (unsigned long)size, (double)ns / (double)ops);
+}
+
+// Keeps the compiler from dropping a result
+static void sink(uint64_t v) {
+    static volatile uint64_t s;
+    s += v;
+}
+
+static std::vector<Entry> make_entries(size_t n) {
+    std::vector<Entry> entries(n);
+    for(size_t i = 0; i < n; ++i) {
+        entries[i].key = "key:" + std::to_string(i);
+        entries[i].node.hcode = str_hash((uint8_t *)entries[i].key.data(), entries[i].key.size());
+    }
+    return entries;
+}
+
+static void shuffle(std::vector<size_t> &order, uint64_t seed) {
+    for(size_t i = order.size(); i > 1; --i) {
+        std::swap(order[i - 1], order[xorshift(seed) % i]);
+    }
+}
+
+static void bench_hmap(size_t n) {
+    std::vector<Entry> entries = make_entries(n);
+    std::vector<size_t> order(n);
+    for(size_t i = 0; i < n; ++i) {
+        order[i] = i;
+    }
+    shuffle(order, 88172645463325252ull + n);
+
+    uint64_t best_insert = UINT64_MAX, best_lookup = UINT64_MAX, best_pop = UINT64_MAX;
+    for(int rep = 0; rep < k_reps; ++rep) {
+        HMap db;
+        uint64_t start = now_ns();
+        for(size_t i = 0; i < n; ++i) {
+            entries[i].node.next = NULL;
+            hm_insert(&db, &entries[i].node);
+        }
+        best_insert = std::min(best_insert, now_ns() - start);
+
+        start = now_ns();
+        uint64_t hits = 0;
+        for(size_t i : order) {
+            hits += hm_lookup(&db, &entries[i].node, &entry_eq) != NULL;
+        }
+        best_lookup = std::min(best_lookup, now_ns() - start);
+        sink(hits);
+
+        start = now_ns();
+        for(size_t i : order) {
+            hits += hm_pop(&db, &entries[i].node, &entry_eq) != NULL;
+        }
+        best_pop = std::min(best_pop, now_ns() - start);
+        sink(hits);
+        hm_destroy(&db);
+    }
+
+    if(wanted("hm_insert")) {
+        report("hm_insert", n, n, best_insert);
+    }
+    if(wanted("hm_lookup")) {
+        report("hm_lookup", n, n, best_lookup);
+    }
+    if(wanted("hm_pop")) {
+        report("hm_pop", n, n, best_pop);
+    }
+}
+
+// Lookups while the table is being moved into a bigger one: each also moves a few buckets
+static void bench_hmap_resizing(size_t n) {
+    if(!wanted("hm_lookup_resizing")) {
+        return;
+    }
+
+    std::vector<Entry> entries = make_entries(n);
+    uint64_t best = UINT64_MAX, ops = 0;
+    for(int rep = 0; rep < k_reps; ++rep) {
+        HMap db;
+        size_t inserted = 0;
+        // Fill until a resize starts past the middle of the keys
+        for(bool started = false; inserted < n && !(started && inserted > n / 2); ++inserted) {
+            entries[inserted].node.next = NULL;
+            bool was = db.h2.tab != NULL;
+            hm_insert(&db, &entries[inserted].node);
+            started = !was && db.h2.tab != NULL;
+        }
+
+        uint64_t seed = 2463534242ull, count = 0;
+        uint64_t start = now_ns();
+        while(db.h2.tab) {
+            sink(hm_lookup(&db, &entries[xorshift(seed) % inserted].node, &entry_eq) != NULL);
+            count++;
+        }
+        uint64_t ns = now_ns() - start;
+        if(count && ns < best) {
+            best = ns;
+            ops = count;
+        }
+        hm_destroy(&db);
+    }
+
+    if(ops) {
+        report("hm_lookup_resizing", n, ops, best);
+    }
+}
+
+static int score_compare(AVLNode *lhs, AVLNode *rhs) {
+    uint32_t l = container_of(lhs, ZNode, tree_node)->score;
+    uint32_t r = container_of(rhs, ZNode, tree_node)->score;
+    return l < r ? -1 : (l > r ? 1 : 0);
+}
+
+// del() only unlinks, so the nodes are freed here once the tree is empty. They have no keys
+static void bench_avl(size_t n) {
+    std::vector<uint32_t> scores(n);
+    for(size_t i = 0; i < n; ++i) {
+        scores[i] = (uint32_t)i;
+    }
+    std::vector<size_t> order(n);
+    for(size_t i = 0; i < n; ++i) {
+        order[i] = i;
+    }
+    shuffle(order, 0x2545F4914F6CDD1Dull + n);
+
+    uint64_t best_insert = UINT64_MAX, best_del = UINT64_MAX;
+    for(int rep = 0; rep < k_reps; ++rep) {
+        std::vector<ZNode *> nodes(n);
+        for(size_t i = 0; i < n; ++i) {
+            nodes[i] = (ZNode *)calloc(1, sizeof(ZNode));
+            nodes[i]->score = scores[order[i]];
+            nodes[i]->tree_node.height = 1;
+        }
+
+        AVLNode *root = NULL;
+        uint64_t start = now_ns();
+        for(size_t i = 0; i < n; ++i) {
+            root = insert(&root, &nodes[i]->tree_node, score_compare);
+        }
+        best_insert = std::min(best_insert, now_ns() - start);
+
+        // Deleted by value in a different order: del() may move a value between nodes
+        ZNode probe = {};
+        shuffle(order, 0x9E3779B97F4A7C15ull + rep);
+        start = now_ns();
+        for(size_t i : order) {
+            probe.score = scores[i];
+            sink(del(&root, &probe.tree_node, score_compare) != NULL);
+        }
+        best_del = std::min(best_del, now_ns() - start);
+
+        for(ZNode *node : nodes) {
+            free(node);
+        }
+    }
+
+    if(wanted("avl_insert")) {
+        report("avl_insert", n, n, best_insert);
+    }
+    if(wanted("avl_del")) {
+        report("avl_del", n, n, best_del);
+    }
+}
+
+static void bench_str_hash(size_t len) {
+    if(!wanted("str_hash")) {
+        return;
+    }
+
+    std::vector<uint8_t> data(len);
+    uint64_t seed = 1;
+    for(uint8_t &b : data) {
+        b = (uint8_t)xorshift(seed);
+    }
+
+    size_t ops = std::max<size_t>(1000, (64 << 20) / std::max<size_t>(len, 1));
+    uint64_t best_ns = UINT64_MAX, best_cycles = UINT64_MAX;
+    for(int rep = 0; rep < k_reps; ++rep) {
+        uint64_t start = now_ns(), c0 = cycles();
+        uint64_t h = 0;
+        for(size_t i = 0; i < ops; ++i) {
+            data[0] = (uint8_t)h;
+            h = str_hash(data.data(), len);
+        }
+        uint64_t c = cycles() - c0;
+        best_ns = std::min(best_ns, now_ns() - start);
+        best_cycles = std::min(best_cycles, c);
+        sink(h);
+    }
+
+    double bpc = best_cycles ? (double)len * (double)ops / (double)best_cycles : 0;
+    report("str_hash", len, ops, best_ns, bpc);
+}
+
+static void *slab_alloc_obj(size_t size) {
+    static SlabClass cls = {"bench", slab_stride(128)};
+    (void)size;
+    return slab_alloc(&cls);
+}
+
+static void *malloc_obj(size_t size) {
+    return malloc(size);
+}
+
+// Allocates n objects, frees 90% of them and allocates n/2 again: the churn of a keyspace under
+// SET/DEL. Frees go in random order, or in allocation order like a deleted range of keys. Runs
+// once, the RSS figure doesn't survive repeats in one process
+static void bench_alloc(const char *name, size_t n, bool random, void *(*alloc)(size_t), void (*release)(void *)) {
+    if(!wanted(name)) {
+        return;
+    }
+
+    const size_t size = 128; // an Entry
+    std::vector<size_t> order(n);
+    for(size_t i = 0; i < n; ++i) {
+        order[i] = i;
+    }
+    if(random) {
+        shuffle(order, 0xD1B54A32D192ED03ull + n);
+    }
+
+    std::vector<void *> objs(n);
+    int64_t rss0 = (int64_t)stats_rss();
+    uint64_t start = now_ns();
+    for(size_t i = 0; i < n; ++i) {
+        objs[i] = alloc(size);
+        memset(objs[i], (int)i, size);
+    }
+    for(size_t i = 0; i < n - n / 10; ++i) {
+        release(objs[order[i]]);
+        objs[order[i]] = NULL;
+    }
+    uint64_t ns = now_ns() - start;
+    int64_t rss = (int64_t)stats_rss() - rss0;
+
+    start = now_ns();
+    for(size_t i = 0; i < n / 2; ++i) {
+        objs[order[i]] = alloc(size);
+        memset(objs[order[i]], (int)i, size);
+    }
+    ns += now_ns() - start;
+
+    for(void *obj : objs) {
+        release(obj);
+    }
+
+    report(name, n, n + (n - n / 10) + n / 2, ns);
+    g_results.back().rss_bytes = rss;
+}
+
+static std::vector<uint8_t> tlv_request(const std::vector<std::string> &cmd) {
+    std::vector<uint8_t> buf(8);
+    uint32_t n = (uint32_t)cmd.size();
+    memcpy(&buf[4], &n, 4);
+    for(const std::string &s : cmd) {
+        n = (uint32_t)s.size();
+        buf.insert(buf.end(), (uint8_t *)&n, (uint8_t *)&n + 4);
+        buf.insert(buf.end(), s.begin(), s.end());
+    }
+    n = (uint32_t)(buf.size() - 4);
+    memcpy(&buf[0], &n, 4);
+    return buf;
+}
+
+static void bench_parser() {
+    const size_t ops = 1000000;
+    std::vector<std::string> cmd = {"set", "key:123456", std::string(64, 'v')};
+    std::vector<std::string> out;
+
+    if(wanted("parse_req")) {
+        std::vector<uint8_t> req = tlv_request(cmd);
+        uint64_t best = UINT64_MAX;
+        for(int rep = 0; rep < k_reps; ++rep) {
+            uint64_t start = now_ns();
+            for(size_t i = 0; i < ops; ++i) {
+                out.clear();
+                sink((uint64_t)parse_req(&req[4], req.size() - 4, out));
+            }
+            best = std::min(best, now_ns() - start);
+        }
+        report("parse_req", req.size(), ops, best);
+    }
+
+    if(wanted("resp_parse")) {
+        std::string req = "*3\r\n$3\r\nset\r\n$10\r\nkey:123456\r\n$64\r\n" + cmd[2] + "\r\n";
+        uint64_t best = UINT64_MAX;
+        for(int rep = 0; rep < k_reps; ++rep) {
+            uint64_t start = now_ns();
+            for(size_t i = 0; i < ops; ++i) {
+                size_t used = 0;
+                out.clear();
+                sink((uint64_t)resp_parse((const uint8_t *)req.data(), req.size(), out, &used));
+            }
+            best = std::min(best, now_ns() - start);
+        }
+        report("resp_parse", req.size(), ops, best);
+    }
+}
+
+// One reply per op, from out_begin() to out_end()
+static void bench_writer(const char *name, uint32_t proto, void (*write)(Writer &w)) {
+    if(!wanted(name)) {
+        return;
+    }
+
+    const size_t ops = 1000000;
+    static uint8_t buf[4 + k_max_msg];
+    uint64_t best = UINT64_MAX, len = 0;
+    for(int rep = 0; rep < k_reps; ++rep) {
+        uint64_t start = now_ns();
+        for(size_t i = 0; i < ops; ++i) {
+            Writer w;
+            out_begin(w, proto, buf, sizeof(buf));
+            write(w);
+            out_end(w);
+            len = w.len;
+        }
+        best = std::min(best, now_ns() - start);
+        sink(buf[len / 2]);
+    }
+    report(name, len, ops, best);
+}
+
+static const std::string g_val(64, 'v');
+
+static void write_str(Writer &w) {
+    out_str(w, g_val);
+}
+
+static void write_int(Writer &w) {
+    out_int(w, 1234567890123);
+}
+
+static void write_arr(Writer &w) {
+    out_arr(w, 10);
+    for(int i = 0; i < 10; ++i) {
+        out_str(w, g_val);
+    }
+}
+
+static void write_dbl(Writer &w) {
+    out_dbl(w, 3.14159);
+}
+
+static void print_json() {
+    printf("{\n  \"benchmarks\": [\n");
+    for(size_t i = 0; i < g_results.size(); ++i) {
+        const Result &r = g_results[i];
+        printf("    {\"name\": \"%s\", \"size\": %lu, \"ops\": %lu, \"ns_per_op\": %.2f", r.name.c_str(),
+               (unsigned long)r.size, (unsigned long)r.ops, r.ns_per_op);
+        if(r.bytes_per_cycle > 0) {
+            printf(", \"bytes_per_cycle\": %.3f", r.bytes_per_cycle);
+        }
+        if(r.rss_bytes) {
+            printf(", \"rss_bytes\": %ld", (long)r.rss_bytes);
+        }
+        printf("}%s\n", i + 1 < g_results.size() ? "," : "");
+    }
+    printf("  ]\n}\n");
+}
+
+int main(int argc, char **argv) {
+    g_filter = argc > 1 ? argv[1] : NULL;
+
+    // Before the other cases leave freed memory in the malloc heap, which would hide how much
+    // alloc_malloc keeps resident
+    bench_alloc("alloc_slab", 1000000, true, slab_alloc_obj, slab_free);
+    bench_alloc("alloc_malloc", 1000000, true, malloc_obj, free);
+    bench_alloc("alloc_slab_range", 1000000, false, slab_alloc_obj, slab_free);
+    bench_alloc("alloc_malloc_range", 1000000, false, malloc_obj, free);
+
+    for(size_t n : {1000, 100000, 1000000}) {
+        bench_hmap(n);
+        bench_hmap_resizing(n);
+    }
+    for(size_t n : {1000, 100000, 1000000}) {
+        bench_avl(n);
+    }
+    for(size_t len : {8, 16, 64, 256, 4096, 65536}) {
+        bench_str_hash(len);
+    }
+    bench_parser();
+    bench_writer("out_str_tlv", PROTO_TLV, write_str);
+    bench_writer("out_str_resp", PROTO_RESP2, write_str);
+    bench_writer("out_int_tlv", PROTO_TLV, write_int);
+    bench_writer("out_int_resp", PROTO_RESP2, write_int);
+    bench_writer("out_dbl_resp", PROTO_RESP3, write_dbl);
+    bench_writer("out_arr_tlv", PROTO_TLV, write_arr);
+    bench_writer("out_arr_resp", PROTO_RESP2, write_arr);
+
+    print_json();
+    return 0;
+}
@@ -0,0 +1,325 @@
+// The protocol module is compiled in whole so its static parsers can be called directly
+#include "../src/protocol.cpp"
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <random>
+
+// Table driven checks of the RESP parsers and of the reply writer in RESP2 and RESP3
+
+static std::mt19937_64 g_rng(12345);
+
+struct LenCase {
+    const char *in;
+    bool ok;
+    int64_t want;
+};
+
+static void test_parse_len() {
+    const LenCase cases[] = {
+        {"0", true, 0},
+        {"7", true, 7},
+        {"10", true, 10},
+        {"4096", true, 4096},
+        {"00000012", true, 12},
+        {"12345678", true, 12345678},
+        {"99999999", true, 99999999},
+        {"", false, 0},
+        {"123456789", false, 0}, // more than 8 digits
+        {"-1", false, 0},
+        {"+1", false, 0},
+        {" 1", false, 0},
+        {"1a", false, 0},
+        {"1:", false, 0},        // 0x3A, one past '9'
+        {"1/", false, 0},        // 0x2F, one before '0'
+        {"1?", false, 0},        // 0x3F, passes the high nibble check alone
+        {"\xb1", false, 0},
+    };
+    for(const LenCase &c : cases) {
+        int64_t got = -1;
+        bool ok = parse_len((const uint8_t *)c.in, strlen(c.in), got);
+        if(ok != c.ok || (ok && got != c.want)) {
+            fprintf(stderr, "parse_len(\"%s\"): want %d %lld, got %d %lld\n",
+                    c.in, c.ok, (long long)c.want, ok, (long long)got);
+            assert(false);
+        }
+    }
+
+    // Against strtoll for random numbers, and a digit check for random bytes
+    for(int i = 0; i < 200000; ++i) {
+        char buf[16];
+        size_t n = 1 + g_rng() % 8;
+        bool digits = true;
+        for(size_t k = 0; k < n; ++k) {
+            buf[k] = i % 2 ? (char)('0' + g_rng() % 10) : (char)("0123456789/:?a-"[g_rng() % 15]);
+            digits = digits && buf[k] >= '0' && buf[k] <= '9';
+        }
+        buf[n] = '\0';
+
+        int64_t got = -1;
+        bool ok = parse_len((const uint8_t *)buf, n, got);
+        assert(ok == digits);
+        assert(!ok || got == strtoll(buf, NULL, 10));
+    }
+}
+
+struct ParseCase {
+    std::string in;
+    int32_t rv;
+    std::vector<std::string> want; // when rv is 1
+    size_t used;                   // when rv is 1, 0 for all of in
+};
+
+static const std::vector<ParseCase> &parse_cases() {
+    static const std::vector<ParseCase> cases = {
+        // Multibulk
+        {"*1\r\n$4\r\nPING\r\n", 1, {"PING"}, 0},
+        {"*2\r\n$3\r\nGET\r\n$1\r\nk\r\n", 1, {"GET", "k"}, 0},
+        {"*2\r\n$3\r\nGET\r\n$1\r\nk\r\n*1\r\n$4\r\nPING\r\n", 1, {"GET", "k"}, 20},
+        {"*0\r\n", 1, {}, 0},
+        {"*1\r\n$0\r\n\r\n", 1, {""}, 0},
+        {"*1\r\n$6\r\n" + std::string("a\r\nb\0c", 6) + "\r\n", 1, {std::string("a\r\nb\0c", 6)}, 0},
+        {"*01\r\n$00000003\r\nabc\r\n", 1, {"abc"}, 0},
+        {"*1\r\n$4096\r\n" + std::string(4096, 'x') + "\r\n", 1, {std::string(4096, 'x')}, 0},
+        // Incomplete
+        {"*", 0, {}, 0},
+        {"*2\r\n$1\r\na\r\n", 0, {}, 0},
+        {"*1\r\n$5\r\nab\r\n", 0, {}, 0},
+        // Bad lengths, nil and negative bulk strings
+        {"*\r\n", -1, {}, 0},
+        {"*1\n$1\r\na\r\n", -1, {}, 0},
+        {"*-1\r\n", -1, {}, 0},
+        {"*1\r\n$-1\r\n", -1, {}, 0},
+        {"*1\r\n$-5\r\nhello\r\n", -1, {}, 0},
+        {"*1\r\n$\r\n\r\n", -1, {}, 0},
+        {"*1\r\n$1x\r\na\r\n", -1, {}, 0},
+        {"*1\r\n$ 1\r\na\r\n", -1, {}, 0},
+        {"*123456789\r\n", -1, {}, 0},
+        {"*1\r\n$123456789\r\n", -1, {}, 0},
+        {"*1\r\n$000000001\r\na\r\n", -1, {}, 0},
+        {"*4097\r\n", -1, {}, 0},
+        {"*1\r\n$4097\r\n", -1, {}, 0},
+        {"*1\r\n$2\r\nabc\r\n", -1, {}, 0},
+        {"*1\r\n$2\r\nab\n\r", -1, {}, 0},
+        {"*1\r\n:1\r\n", -1, {}, 0},
+        {"*2\r\n$1\r\na\r\n+b\r\n", -1, {}, 0},
+        // Inline
+        {"PING\r\n", 1, {"PING"}, 0},
+        {"set k  v\r\n", 1, {"set", "k", "v"}, 0},
+        {"\tget\tk \r\n", 1, {"get", "k"}, 0},
+        {"get k\n", 1, {"get", "k"}, 0},
+        {"get k\r\nping\r\n", 1, {"get", "k"}, 7},
+        {"\r\n", 1, {}, 0},
+        {"   \r\n", 1, {}, 0},
+        {"get k", 0, {}, 0},
+        {"get k\r", 0, {}, 0},
+    };
+    return cases;
+}
+
+static std::string show(const std::string &s) {
+    std::string out;
+    for(char c : s.substr(0, 40)) {
+        out += c == '\r' ? "\\r" : c == '\n' ? "\\n" : std::string(1, c);
+    }
+    return out;
+}
+
+static int32_t parse(const std::string &in, size_t len, std::vector<std::string> &out, size_t &used) {
+    used = 0;
+    return resp_parse((const uint8_t *)in.data(), len, out, &used);
+}
+
+static void test_resp_parse() {
+    for(const ParseCase &c : parse_cases()) {
+        std::vector<std::string> out;
+        size_t used = 0;
+        int32_t rv = parse(c.in, c.in.size(), out, used);
+        size_t want_used = c.used ? c.used : c.in.size();
+        if(rv != c.rv || (rv == 1 && (out != c.want || used != want_used))) {
+            fprintf(stderr, "resp_parse(\"%s\"): want %d, got %d with %zu args, used %zu\n",
+                    show(c.in).c_str(), c.rv, rv, out.size(), used);
+            assert(false);
+        }
+
+        // Split at every byte: a complete command is never found early, and good input never
+        // looks bad before it is complete
+        for(size_t len = 0; len < (rv == 1 ? used : c.in.size()); ++len) {
+            int32_t part = parse(c.in, len, out, used);
+            if(part != 0 && !(c.rv == -1 && part == -1)) {
+                fprintf(stderr, "resp_parse(\"%s\") cut at %zu: got %d\n", show(c.in).c_str(), len, part);
+                assert(false);
+            }
+        }
+    }
+}
+
+// A stream of commands arriving in random pieces, parsed the way a connection does it
+static void test_stream() {
+    std::vector<std::vector<std::string>> sent;
+    std::string stream;
+    for(const ParseCase &c : parse_cases()) {
+        if(c.rv == 1 && c.used == 0) {
+            sent.push_back(c.want);
+            stream += c.in;
+        }
+    }
+
+    for(int round = 0; round < 200; ++round) {
+        std::vector<std::vector<std::string>> got;
+        std::string buf;
+        size_t pos = 0;
+        while(pos < stream.size() || !buf.empty()) {
+            size_t piece = std::min<size_t>(1 + g_rng() % (round < 100 ? 3 : 200), stream.size() - pos);
+            buf.append(stream, pos, piece);
+            pos += piece;
+
+            std::vector<std::string> cmd;
+            size_t used = 0;
+            int32_t rv = 0;
+            while(!buf.empty() && (rv = parse(buf, buf.size(), cmd, used)) == 1) {
+                got.push_back(cmd);
+                buf.erase(0, used);
+            }
+            assert(rv != -1);
+            if(pos == stream.size() && !buf.empty()) {
+                assert(rv == 0);
+                break;
+            }
+        }
+        assert(got == sent);
+    }
+}
+
+static std::string write_reply(uint32_t proto, void (*f)(Writer &)) {
+    std::vector<uint8_t> buf(k_max_msg);
+    Writer w;
+    out_begin(w, proto, buf.data(), buf.size());
+    f(w);
+    assert(out_end(w));
+    out_materialize(w);
+    return std::string((const char *)buf.data(), w.len);
+}
+
+struct WriteCase {
+    const char *name;
+    void (*f)(Writer &);
+    const char *resp2;
+    const char *resp3;
+};
+
+static const std::string g_long(300, 'L');
+
+static void test_writer() {
+    const WriteCase cases[] = {
+        {"nil", [](Writer &w) { out_nil(w); }, "$-1\r\n", "_\r\n"},
+        {"str", [](Writer &w) { out_str(w, std::string("abc")); }, "$3\r\nabc\r\n", "$3\r\nabc\r\n"},
+        {"empty str", [](Writer &w) { out_str(w, std::string()); }, "$0\r\n\r\n", "$0\r\n\r\n"},
+        {"int", [](Writer &w) { out_int(w, -42); }, ":-42\r\n", ":-42\r\n"},
+        {"int min", [](Writer &w) { out_int(w, INT64_MIN); },
+         ":-9223372036854775808\r\n", ":-9223372036854775808\r\n"},
+        {"dbl", [](Writer &w) { out_dbl(w, 0.1); }, "$3\r\n0.1\r\n", ",0.1\r\n"},
+        {"integral dbl", [](Writer &w) { out_dbl(w, 3); }, "$1\r\n3\r\n", ",3\r\n"},
+        {"big dbl", [](Writer &w) { out_dbl(w, 1e300); }, "$6\r\n1e+300\r\n", ",1e+300\r\n"},
+        {"negative dbl", [](Writer &w) { out_dbl(w, -2.5); }, "$4\r\n-2.5\r\n", ",-2.5\r\n"},
+        {"type err", [](Writer &w) { out_err(w, ERR_TYPE, "bad type"); },
+         "-WRONGTYPE bad type\r\n", "-WRONGTYPE bad type\r\n"},
+        {"arg err", [](Writer &w) { out_err(w, ERR_ARG, "bad arg"); }, "-ERR bad arg\r\n", "-ERR bad arg\r\n"},
+        {"arr", [](Writer &w) { out_arr(w, 2); out_int(w, 1); out_nil(w); },
+         "*2\r\n:1\r\n$-1\r\n", "*2\r\n:1\r\n_\r\n"},
+        {"push", [](Writer &w) { out_push(w, 1); out_str(w, std::string("m")); },
+         "*1\r\n$1\r\nm\r\n", ">1\r\n$1\r\nm\r\n"},
+        {"split", [](Writer &w) { out_split(w, 2); out_int(w, 1); out_int(w, 2); }, ":1\r\n:2\r\n", ":1\r\n:2\r\n"},
+        {"space", [](Writer &w) { memcpy(out_str_space(w, 2), "hi", 2); }, "$2\r\nhi\r\n", "$2\r\nhi\r\n"},
+    };
+    for(const WriteCase &c : cases) {
+        for(uint32_t proto : {PROTO_RESP2, PROTO_RESP3}) {
+            std::string got = write_reply(proto, c.f);
+            const char *want = proto == PROTO_RESP2 ? c.resp2 : c.resp3;
+            if(got != want) {
+                fprintf(stderr, "%s in RESP%u: want \"%s\", got \"%s\"\n",
+                        c.name, proto, show(want).c_str(), show(got).c_str());
+                assert(false);
+            }
+        }
+    }
+
+    // A referenced value goes out the same as a copied one, through writev or materialized
+    for(uint32_t proto : {PROTO_TLV, PROTO_RESP2, PROTO_RESP3}) {
+        std::vector<uint8_t> buf(k_max_msg);
+        Writer w;
+        out_begin(w, proto, buf.data(), buf.size());
+        out_arr(w, 3);
+        out_str_ref(w, (const uint8_t *)g_long.data(), (uint32_t)g_long.size());
+        out_int(w, 7);
+        out_str_ref(w, (const uint8_t *)g_long.data(), (uint32_t)g_long.size());
+        assert(out_end(w) && w.nrefs == 2);
+
+        struct iovec iov[8];
+        size_t n = out_iov(w, 0, iov, 8);
+        std::string sent;
+        for(size_t i = 0; i < n; ++i) {
+            sent.append((const char *)iov[i].iov_base, iov[i].iov_len);
+        }
+        out_materialize(w);
+
+        std::string want = write_reply(proto, [](Writer &w) {
+            out_arr(w, 3);
+            out_str(w, g_long);
+            out_int(w, 7);
+            out_str(w, g_long);
+        });
+        assert(sent == want);
+        assert(std::string((const char *)buf.data(), w.len) == want);
+    }
+
+    // A reply past the buffer fails as a whole
+    std::vector<uint8_t> small(16);
+    Writer w;
+    out_begin(w, PROTO_RESP2, small.data(), small.size());
+    out_str(w, g_long);
+    assert(!out_end(w));
+}
+
+// Commands written as RESP arrays of bulk strings parse back to the same arguments
+static void test_round_trip() {
+    for(int round = 0; round < 2000; ++round) {
+        std::vector<std::string> cmd(g_rng() % 6);
+        for(std::string &arg : cmd) {
+            arg.resize(g_rng() % (round % 10 == 0 ? 600 : 12));
+            for(char &c : arg) {
+                c = "ab\r\n\0$*:-9"[g_rng() % 10];
+            }
+        }
+
+        for(uint32_t proto : {PROTO_RESP2, PROTO_RESP3}) {
+            std::vector<uint8_t> buf(k_max_msg);
+            Writer w;
+            out_begin(w, proto, buf.data(), buf.size());
+            out_arr(w, (uint32_t)cmd.size());
+            for(const std::string &arg : cmd) {
+                out_str(w, arg);
+            }
+            assert(out_end(w));
+            std::string wire((const char *)buf.data(), w.len);
+
+            std::vector<std::string> out;
+            size_t used = 0;
+            assert(parse(wire, wire.size(), out, used) == 1);
+            assert(used == wire.size() && out == cmd);
+            for(size_t len = 0; len < wire.size(); len += 1 + len / 8) {
+                assert(parse(wire, len, out, used) == 0);
+            }
+        }
+    }
+}
+
+int main() {
+    test_parse_len();
+    test_resp_parse();
+    test_stream();
+    test_writer();
+    test_round_trip();
+    printf("protocol tests passed\n");
+    return 0;
+}
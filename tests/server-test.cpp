@@ -0,0 +1,445 @@
+#include "../src/async_client.h"
+#include "../src/utils.h"
+#include <assert.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/prctl.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <algorithm>
+#include <string>
+#include <vector>
+
+// Usage: server-test [server binary]
+// Starts servers on spare ports with their files in a scratch directory, and checks their
+// replies over TLV. The binary defaults to bin/server
+
+struct TestServer {
+    pid_t pid = -1;
+    uint16_t port = 0;
+    AsyncClient *c = NULL;
+};
+
+static const char *g_server_bin = "bin/server";
+static std::string g_dir;
+static uint16_t g_next_port = 0;
+
+static TestServer start_server(const std::vector<std::string> &args) {
+    TestServer srv;
+    srv.port = g_next_port++;
+    std::string port = std::to_string(srv.port);
+    std::string snap = g_dir + "/dump-" + port + ".snap";
+
+    srv.pid = fork();
+    assert(srv.pid >= 0);
+    if(srv.pid == 0) {
+        // Goes away with the test, even when an assert fails
+        prctl(PR_SET_PDEATHSIG, SIGKILL);
+        std::vector<const char *> argv = {g_server_bin, "--port", port.c_str(), "--dbfilename", snap.c_str()};
+        for(const std::string &arg : args) {
+            argv.push_back(arg.c_str());
+        }
+        argv.push_back(NULL);
+        int null = open("/dev/null", O_WRONLY);
+        dup2(null, 2);
+        execv(g_server_bin, (char **)argv.data());
+        _exit(127);
+    }
+
+    for(int i = 0; i < 100 && !srv.c; ++i) {
+        srv.c = ac_connect("127.0.0.1", srv.port, 1000);
+        if(!srv.c) {
+            usleep(50 * 1000);
+        }
+    }
+    assert(srv.c);
+    return srv;
+}
+
+static void stop_server(TestServer &srv) {
+    ac_close(srv.c);
+    kill(srv.pid, SIGKILL);
+    waitpid(srv.pid, NULL, 0);
+}
+
+static Reply run(TestServer &srv, const std::vector<std::string> &cmd) {
+    std::future<Reply> f = ac_command(srv.c, cmd);
+    int32_t err = ac_wait(srv.c, 5000);
+    assert(err == 0);
+    return f.get();
+}
+
+static void check_str(const Reply &r, const char *want) {
+    if(r.type != SER_STR || r.str != want) {
+        fprintf(stderr, "want \"%s\", got type %u \"%s\"\n", want, r.type, r.str.c_str());
+        assert(false);
+    }
+}
+
+// Sends raw RESP and checks that exactly want comes back
+static void check_resp(TestServer &srv, const std::string &req, const std::string &want) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(srv.port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    int rv = connect(fd, (struct sockaddr *)&addr, sizeof(addr));
+    assert(rv == 0);
+    struct timeval tv = {5, 0};
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+    ssize_t sent = write(fd, req.data(), req.size());
+    assert(sent == (ssize_t)req.size());
+    std::string got;
+    char buf[4096];
+    while(got.size() < want.size()) {
+        ssize_t n = read(fd, buf, sizeof(buf));
+        if(n <= 0) {
+            break;
+        }
+        got.append(buf, (size_t)n);
+    }
+    close(fd);
+    if(got != want) {
+        fprintf(stderr, "sent %s, want %s, got %s\n", req.c_str(), want.c_str(), got.c_str());
+        assert(false);
+    }
+}
+
+// INFO and INFO all stay answerable after many different commands have run
+static void test_info(TestServer &srv) {
+    std::vector<std::vector<std::string>> cmds = {
+        {"set", "k", "v"}, {"get", "k"}, {"mset", "a", "1", "b", "2"}, {"mget", "a", "b"},
+        {"incr", "n"}, {"decr", "n"}, {"incrby", "n", "5"}, {"decrby", "n", "2"},
+        {"incrbyfloat", "f", "1.5"}, {"lpush", "l", "x"}, {"rpush", "l", "y"}, {"lindex", "l", "0"},
+        {"lrange", "l", "0", "-1"}, {"lpop", "l"}, {"rpop", "l"}, {"hset", "h", "f", "v"},
+        {"hget", "h", "f"}, {"hgetall", "h"}, {"hincrby", "h", "c", "1"}, {"hdel", "h", "f"},
+        {"sadd", "s", "1", "2"}, {"sismember", "s", "1"}, {"scard", "s"}, {"smembers", "s"},
+        {"sinter", "s"}, {"sunion", "s"}, {"srem", "s", "1"}, {"setbit", "bits", "7", "1"},
+        {"getbit", "bits", "7"}, {"bitcount", "bits"}, {"bitop", "and", "dst", "bits"},
+        {"pfadd", "hll", "a"}, {"pfcount", "hll"}, {"pfmerge", "hll2", "hll"}, {"ping"},
+        {"publish", "ch", "msg"}, {"keys"}, {"del", "k"}, {"unlink", "a"}, {"slowlog", "len"},
+        {"latency", "latest"}, {"memory", "stats"},
+    };
+    for(const std::vector<std::string> &cmd : cmds) {
+        run(srv, cmd);
+    }
+
+    Reply r = run(srv, {"info"});
+    assert(r.type == SER_STR);
+    assert(r.str.find("# Server") != std::string::npos);
+    assert(r.str.find("# Keyspace") != std::string::npos);
+
+    r = run(srv, {"info", "all"});
+    assert(r.type == SER_STR);
+    assert(r.str.find("cmdstat_get:") != std::string::npos);
+    size_t cut = r.str.find("# Truncated");
+    assert(cut == std::string::npos || cut + strlen("# Truncated\r\n") == r.str.size());
+
+    r = run(srv, {"info", "latencyhistogram"});
+    assert(r.type == SER_STR);
+    assert(r.str.find("latency_histogram_usec_get:") != std::string::npos);
+}
+
+// Results are stored and sent with the fewest digits that parse back to the same double
+static void test_incrbyfloat(TestServer &srv) {
+    Reply r = run(srv, {"incrbyfloat", "f1", "0.1"});
+    assert(r.type == SER_DBL && r.dval == 0.1);
+    check_str(run(srv, {"get", "f1"}), "0.1");
+
+    run(srv, {"set", "f2", "10.5"});
+    run(srv, {"incrbyfloat", "f2", "0.1"});
+    check_str(run(srv, {"get", "f2"}), "10.6");
+
+    run(srv, {"incrbyfloat", "f3", "1e17"});
+    check_str(run(srv, {"get", "f3"}), "100000000000000000");
+    r = run(srv, {"incr", "f3"});
+    assert(r.type == SER_INT && r.ival == 100000000000000001ll);
+
+    run(srv, {"incrbyfloat", "f4", "0.5"});
+    run(srv, {"incrbyfloat", "f4", "0.5"});
+    check_str(run(srv, {"get", "f4"}), "1");
+
+    run(srv, {"incrbyfloat", "f5", "1e300"});
+    check_str(run(srv, {"get", "f5"}), "1e+300");
+
+    run(srv, {"incrbyfloat", "f6", "0.3"});
+    run(srv, {"incrbyfloat", "f6", "-0.1"});
+    check_str(run(srv, {"get", "f6"}), "0.19999999999999998");
+
+    check_resp(srv, "incrbyfloat r1 0.1\r\n", "$3\r\n0.1\r\n");
+    std::string hello3 = "*6\r\n$6\r\nserver\r\n$7\r\nredis-c\r\n$5\r\nproto\r\n:3\r\n"
+                         "$4\r\nmode\r\n$10\r\nstandalone\r\n";
+    check_resp(srv, "hello 3\r\nincrbyfloat r1 0.1\r\n", hello3 + ",0.2\r\n");
+    check_resp(srv, "hello 3\r\nincrbyfloat r2 2.5\r\nincrbyfloat r2 0.5\r\n", hello3 + ",2.5\r\n,3\r\n");
+}
+
+static size_t nkeys(TestServer &srv) {
+    Reply r = run(srv, {"keys"});
+    assert(r.type == SER_ARR);
+    return r.arr.size();
+}
+
+// MSET and DEL with keys repeated within the command
+static void test_mset_del(TestServer &srv) {
+    size_t before = nkeys(srv);
+    run(srv, {"set", "old", "0"});
+    run(srv, {"mset", "new1", "1", "old", "2", "new1", "3", "new2", "4", "new1", "5", "old", "6"});
+    assert(nkeys(srv) == before + 3);
+    check_str(run(srv, {"get", "new1"}), "5");
+    check_str(run(srv, {"get", "new2"}), "4");
+    check_str(run(srv, {"get", "old"}), "6");
+
+    std::vector<std::string> mset = {"mset"};
+    for(int i = 0; i < 100; ++i) {
+        mset.push_back("many" + std::to_string(i % 37));
+        mset.push_back(std::to_string(i));
+    }
+    run(srv, mset);
+    assert(nkeys(srv) == before + 3 + 37);
+    check_str(run(srv, {"get", "many0"}), "74");
+    check_str(run(srv, {"get", "many36"}), "73");
+
+    Reply r = run(srv, {"del", "new1", "missing", "new1", "old", "new2", "old"});
+    assert(r.type == SER_INT && r.ival == 3);
+    assert(nkeys(srv) == before + 37);
+    assert(run(srv, {"get", "new1"}).type == SER_NIL);
+
+    std::vector<std::string> del = {"unlink"};
+    for(int i = 0; i < 100; ++i) {
+        del.push_back("many" + std::to_string(i % 40));
+    }
+    r = run(srv, del);
+    assert(r.type == SER_INT && r.ival == 37);
+    assert(nkeys(srv) == before);
+}
+
+static uint64_t info_get(const std::string &info, const char *name) {
+    size_t at = info.find(std::string("\n") + name + ":");
+    assert(at != std::string::npos);
+    return strtoull(info.c_str() + at + strlen(name) + 2, NULL, 10);
+}
+
+static uint64_t info_field(TestServer &srv, const char *name) {
+    Reply r = run(srv, {"info", "memory"});
+    assert(r.type == SER_STR);
+    return info_get(r.str, name);
+}
+
+static void check_int(const Reply &r, int64_t want) {
+    if(r.type != SER_INT || r.ival != want) {
+        fprintf(stderr, "want %lld, got type %u %lld\n", (long long)want, r.type, (long long)r.ival);
+        assert(false);
+    }
+}
+
+static std::string random_bytes(size_t n) {
+    std::string s(n, '\0');
+    for(char &c : s) {
+        c = (char)(rand() & 0xFF);
+    }
+    return s;
+}
+
+static int64_t popcount(const std::string &s, size_t start, size_t end) {
+    int64_t n = 0;
+    for(size_t i = start; i <= end && i < s.size(); ++i) {
+        n += __builtin_popcount((uint8_t)s[i]);
+    }
+    return n;
+}
+
+// BITCOUNT ranges, negative and out of bounds, and BITOP over inputs of unequal length,
+// checked against byte-at-a-time results
+static void test_bitops(TestServer &srv) {
+    std::string val = random_bytes(1000);
+    val[0] = 'x'; // never an int
+    run(srv, {"set", "bits1", val});
+    int64_t len = (int64_t)val.size();
+
+    check_int(run(srv, {"bitcount", "bits1"}), popcount(val, 0, val.size() - 1));
+    check_int(run(srv, {"bitcount", "bits1", "5", "4"}), 0);
+    check_int(run(srv, {"bitcount", "bits1", "-5000", "5000"}), popcount(val, 0, val.size() - 1));
+    check_int(run(srv, {"bitcount", "bits1", "1000", "2000"}), 0);
+    check_int(run(srv, {"bitcount", "bits1", "-1", "-1"}), popcount(val, 999, 999));
+    check_int(run(srv, {"bitcount", "missing", "0", "-1"}), 0);
+    for(int i = 0; i < 300; ++i) {
+        int64_t start = rand() % (2 * len + 10) - len - 5, end = rand() % (2 * len + 10) - len - 5;
+        int64_t s = start < 0 ? std::max<int64_t>(start + len, 0) : start;
+        int64_t e = end < 0 ? end + len : std::min(end, len - 1);
+        int64_t want = s <= e ? popcount(val, (size_t)s, (size_t)e) : 0;
+        check_int(run(srv, {"bitcount", "bits1", std::to_string(start), std::to_string(end)}), want);
+    }
+
+    // Lengths around the 128-byte vector loop, plus a missing key, in every order
+    std::vector<std::string> vals = {random_bytes(5), random_bytes(129), random_bytes(300), ""};
+    std::vector<std::string> keys = {"bits5", "bits129", "bits300", "bitsnone"};
+    for(size_t i = 0; i < 3; ++i) {
+        vals[i][0] = 'x';
+        run(srv, {"set", keys[i], vals[i]});
+    }
+    std::vector<size_t> order = {0, 1, 2, 3};
+    do {
+        for(const char *op : {"and", "or", "xor"}) {
+            std::vector<std::string> cmd = {"bitop", op, "bitsdst"};
+            std::string want(300, '\0');
+            for(size_t k = 0; k < order.size(); ++k) {
+                const std::string &v = vals[order[k]];
+                cmd.push_back(keys[order[k]]);
+                for(size_t i = 0; i < want.size(); ++i) {
+                    uint8_t b = i < v.size() ? (uint8_t)v[i] : 0, d = (uint8_t)want[i];
+                    want[i] = (char)(k == 0 ? b : op[0] == 'a' ? d & b : op[0] == 'o' ? d | b : d ^ b);
+                }
+            }
+            check_int(run(srv, cmd), 300);
+            Reply r = run(srv, {"get", "bitsdst"});
+            assert(r.type == SER_STR && r.str == want);
+        }
+    } while(std::next_permutation(order.begin(), order.end()));
+
+    for(size_t i = 0; i < 3; ++i) {
+        check_int(run(srv, {"bitop", "not", "bitsdst", keys[i]}), (int64_t)vals[i].size());
+        std::string want = vals[i];
+        for(char &c : want) {
+            c = (char)~c;
+        }
+        assert(run(srv, {"get", "bitsdst"}).str == want);
+    }
+    run(srv, {"del", "bits1", "bits5", "bits129", "bits300", "bitsdst"});
+}
+
+// used_memory counts the slabs keys live in besides what malloc reports
+static void test_info_memory(TestServer &srv) {
+    for(int i = 0; i < 500; ++i) {
+        run(srv, {"set", "memkey" + std::to_string(i), "v"});
+    }
+    Reply r = run(srv, {"info", "memory"});
+    assert(r.type == SER_STR);
+    uint64_t slab = info_get(r.str, "used_memory_slab");
+    assert(slab > 0);
+    if(r.str.find("\nused_memory:") != std::string::npos) {
+        assert(info_get(r.str, "used_memory") == info_get(r.str, "allocator_allocated") + slab);
+    }
+    std::vector<std::string> del = {"del"};
+    for(int i = 0; i < 500; ++i) {
+        del.push_back("memkey" + std::to_string(i));
+    }
+    run(srv, del);
+}
+
+// PF* commands read shared and compressed values without decoding them for good, and only
+// replace them when they write
+static void test_pf_encodings(TestServer &srv) {
+    uint64_t compressed = info_field(srv, "compressed_keys");
+    std::string big(2000, 'x');
+    run(srv, {"set", "pfbig", big});
+    assert(info_field(srv, "compressed_keys") == compressed + 1);
+    assert(run(srv, {"pfcount", "pfbig"}).type == SER_ERR);
+    assert(run(srv, {"pfadd", "pfbig", "a"}).type == SER_ERR);
+    assert(run(srv, {"pfmerge", "pfdst", "pfbig"}).type == SER_ERR);
+    assert(info_field(srv, "compressed_keys") == compressed + 1);
+    check_str(run(srv, {"get", "pfbig"}), big.c_str());
+
+    // A stale estimate isn't written back by PFCOUNT
+    check_int(run(srv, {"pfadd", "pfsrc", "a", "b", "c"}), 1);
+    Reply r = run(srv, {"get", "pfsrc"});
+    assert(r.type == SER_STR);
+    std::string sparse = r.str;
+    check_int(run(srv, {"pfcount", "pfsrc"}), 3);
+    assert(run(srv, {"get", "pfsrc"}).str == sparse);
+
+    uint64_t refs = info_field(srv, "interned_refs");
+    run(srv, {"set", "pfc1", sparse});
+    run(srv, {"set", "pfc2", sparse});
+    assert(info_field(srv, "interned_refs") == refs + 2);
+    check_int(run(srv, {"pfcount", "pfc1"}), 3);
+    check_int(run(srv, {"pfcount", "pfc1", "pfc2"}), 3);
+    check_int(run(srv, {"pfadd", "pfc1", "a", "b"}), 0);
+    assert(info_field(srv, "interned_refs") == refs + 2);
+
+    check_int(run(srv, {"pfadd", "pfc1", "d"}), 1);
+    assert(info_field(srv, "interned_refs") == refs + 1);
+    check_int(run(srv, {"pfcount", "pfc1"}), 4);
+    assert(run(srv, {"get", "pfc2"}).str == sparse);
+
+    run(srv, {"pfmerge", "pfc2", "pfc1"});
+    assert(info_field(srv, "interned_refs") == refs);
+    check_int(run(srv, {"pfcount", "pfc2"}), 4);
+    run(srv, {"del", "pfbig", "pfsrc", "pfc1", "pfc2"});
+}
+
+// SLOWLOG GET and LATENCY SPIKES send as many entries as fit, newest first
+static void test_slowlog(TestServer &srv) {
+    std::string val(40, 'v');
+    for(int i = 0; i < 200; ++i) {
+        run(srv, {"set", "slow" + std::to_string(i), val});
+    }
+
+    for(const char *count : {"10", "64", "128"}) {
+        Reply r = run(srv, {"slowlog", "get", count});
+        assert(r.type == SER_ARR);
+        assert(r.arr.size() > 10 || (r.arr.size() == 10 && 0 == strcmp(count, "10")));
+        for(size_t i = 1; i < r.arr.size(); ++i) {
+            assert(r.arr[i].arr[0].ival < r.arr[i - 1].arr[0].ival);
+        }
+    }
+    Reply r = run(srv, {"slowlog", "len"});
+    assert(r.type == SER_INT && r.ival == 128);
+
+    // Every SUNION of a big set is a spike over 1 msec. The reply is too big, but the union
+    // is built anyway. The pause makes each one a separate event loop iteration
+    for(int i = 0; i < 160; ++i) {
+        std::vector<std::string> cmd = {"sadd", "bigset"};
+        for(int k = 0; k < 250; ++k) {
+            cmd.push_back("m" + std::to_string(i * 250 + k));
+        }
+        run(srv, cmd);
+    }
+    for(int i = 0; i < 70; ++i) {
+        run(srv, {"sunion", "bigset"});
+        usleep(2000);
+    }
+    r = run(srv, {"latency", "spikes", "64"});
+    assert(r.type == SER_ARR);
+    assert(r.arr.size() > 10);
+}
+
+int main(int argc, char **argv) {
+    if(argc > 1) {
+        g_server_bin = argv[1];
+    }
+    char dir[] = "/tmp/server-test-XXXXXX";
+    if(!mkdtemp(dir)) {
+        perror("mkdtemp");
+        return 1;
+    }
+    g_dir = dir;
+    g_next_port = (uint16_t)(20000 + getpid() % 20000);
+
+    TestServer srv = start_server({});
+    test_info(srv);
+    test_incrbyfloat(srv);
+    test_mset_del(srv);
+    test_bitops(srv);
+    test_pf_encodings(srv);
+    test_info_memory(srv);
+    stop_server(srv);
+
+    srv = start_server({"--slowlog-log-slower-than", "0", "--latency-monitor-threshold", "1"});
+    test_slowlog(srv);
+    stop_server(srv);
+
+    std::string rm = "rm -rf " + g_dir;
+    if(0 != system(rm.c_str())) {
+        fprintf(stderr, "can't remove %s\n", g_dir.c_str());
+    }
+    printf("server tests passed\n");
+    return 0;
+}
@@ -0,0 +1,128 @@
+// The set module is compiled in whole so its static intersection kernels can be called directly
+#include "../src/set.cpp"
+#include <stdio.h>
+#include <iterator>
+#include <random>
+
+// Checks every intersection kernel against the scalar merge, and the merge against
+// std::set_intersection, on random sorted arrays of distinct ints
+
+static std::mt19937_64 g_rng(12345);
+
+typedef size_t (*Kernel)(const int64_t *a, size_t na, const int64_t *b, size_t nb, int64_t *out);
+
+// n distinct sorted ints from base upwards. Small gaps make the two sides overlap a lot
+static std::vector<int64_t> random_ints(size_t n, int64_t base, uint64_t max_gap) {
+    std::vector<int64_t> v;
+    int64_t x = base;
+    for(size_t i = 0; i < n; ++i) {
+        x += 1 + (int64_t)(g_rng() % max_gap);
+        v.push_back(x);
+    }
+    return v;
+}
+
+// a with the element at every block edge (index 0 and 3 of each 4) also in b, merged into b
+static std::vector<int64_t> with_edges_of(const std::vector<int64_t> &a, std::vector<int64_t> b) {
+    for(size_t i = 0; i < a.size(); ++i) {
+        if(i % 4 == 0 || i % 4 == 3) {
+            b.push_back(a[i]);
+        }
+    }
+    std::sort(b.begin(), b.end());
+    b.erase(std::unique(b.begin(), b.end()), b.end());
+    return b;
+}
+
+static void check_kernel(const char *name, Kernel f, const std::vector<int64_t> &a,
+                         const std::vector<int64_t> &b, const std::vector<int64_t> &want) {
+    std::vector<int64_t> out(std::min(a.size(), b.size()) + 1, 0);
+    size_t n = f(a.data(), a.size(), b.data(), b.size(), out.data());
+    out.resize(n);
+    if(out != want) {
+        fprintf(stderr, "%s: sizes %zu and %zu, want %zu elements, got %zu\n",
+                name, a.size(), b.size(), want.size(), n);
+        assert(false);
+    }
+}
+
+static void check_pair(const std::vector<int64_t> &a, const std::vector<int64_t> &b) {
+    std::vector<int64_t> want;
+    std::set_intersection(a.begin(), a.end(), b.begin(), b.end(), std::back_inserter(want));
+
+    for(int swap = 0; swap < 2; ++swap) {
+        const std::vector<int64_t> &x = swap ? b : a;
+        const std::vector<int64_t> &y = swap ? a : b;
+        check_kernel("merge", &intersect_merge, x, y, want);
+        check_kernel("gallop", &intersect_gallop, x, y, want);
+        check_kernel("intersect_ints", &intersect_ints, x, y, want);
+#if defined(__x86_64__)
+        if(cpu_has_avx2()) {
+            check_kernel("avx2", &intersect_avx2, x, y, want);
+        }
+#endif
+    }
+}
+
+static void test_random(uint32_t rounds) {
+    for(uint32_t r = 0; r < rounds; ++r) {
+        // Every length up to 40 covers the tails of 0 to 3 left after the blocks of 4
+        size_t na = g_rng() % 41, nb = g_rng() % 41;
+        if(r % 4 == 1) {
+            nb = g_rng() % 600; // similar to very different sizes, around the gallop ratio
+        } else if(r % 4 == 2) {
+            na = g_rng() % 4;
+            nb = 100 + g_rng() % 2000;
+        }
+        uint64_t gap = 1 + g_rng() % 8;
+        int64_t base = (int64_t)(g_rng() % 64) - 32;
+
+        std::vector<int64_t> a = random_ints(na, base, gap);
+        std::vector<int64_t> b = random_ints(nb, base, gap);
+        if(r % 3 == 0) {
+            b = with_edges_of(a, b);
+        }
+        check_pair(a, b);
+    }
+}
+
+static void test_edges() {
+    std::vector<int64_t> empty, some = random_ints(37, 0, 3);
+    check_pair(empty, empty);
+    check_pair(empty, some);
+
+    // Identical, disjoint, and interleaved sides
+    check_pair(some, some);
+    std::vector<int64_t> low = random_ints(33, -1000, 5), high = random_ints(33, 1000, 5);
+    check_pair(low, high);
+    std::vector<int64_t> even, odd;
+    for(int64_t i = 0; i < 103; ++i) {
+        even.push_back(2 * i);
+        odd.push_back(2 * i + 1);
+    }
+    check_pair(even, odd);
+
+    // Blocks whose maxes are equal, so both sides move on together
+    std::vector<int64_t> a = {1, 2, 3, 10, 11, 12, 13, 20, 21};
+    std::vector<int64_t> b = {4, 5, 6, 10, 14, 15, 16, 20, 22};
+    check_pair(a, b);
+
+    // The ends of the int64 range
+    std::vector<int64_t> ends = {INT64_MIN, INT64_MIN + 1, -1, 0, 1, INT64_MAX - 1, INT64_MAX};
+    std::vector<int64_t> some_ends = {INT64_MIN, 0, INT64_MAX};
+    check_pair(ends, some_ends);
+    check_pair(ends, ends);
+
+    // One element against a long array, at its start, middle, end and past either end
+    std::vector<int64_t> big = random_ints(5000, 0, 4);
+    for(int64_t x : {big.front(), big[2500], big.back(), big.front() - 1, big.back() + 1}) {
+        check_pair({x}, big);
+    }
+}
+
+int main() {
+    test_edges();
+    test_random(20000);
+    printf("set intersection tests passed\n");
+    return 0;
+}